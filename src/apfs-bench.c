@@ -0,0 +1,747 @@
+#include <stdio.h>
+#include <sys/errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "apfs/io.h"
+#include "apfs/io/scan.h"
+#include "apfs/io/cache.h"
+#include "apfs/options.h"
+#include "apfs/func/cksum.h"
+#include "apfs/func/btree.h"
+#include "apfs/func/generate.h"
+#include "apfs/string/record.h"
+
+#include "apfs/struct/object.h"
+#include "apfs/struct/nx.h"
+#include "apfs/struct/omap.h"
+#include "apfs/struct/fs.h"
+#include "apfs/struct/j.h"
+#include "apfs/struct/dstream.h"
+
+/** Configuration **/
+
+uint32_t    bench_min_ms = 200;     // Minimum duration of each timed run
+uint32_t    bench_runs = 3;         // Timed runs per benchmark; the fastest counts
+bool        bench_quick = false;    // Smaller containers, for a quick check
+char*       bench_filter = NULL;    // Only run benchmarks whose names contain this
+char*       bench_baseline_path = NULL;
+char*       bench_scratch_dir = NULL;
+
+// Number of precomputed random keys that lookup benchmarks cycle through.
+#define BENCH_NUM_KEYS  1024
+
+/** Baseline results **/
+
+typedef struct {
+    char        name[64];
+    double      ns_per_op;
+} bench_result_t;
+
+bench_result_t* baseline_results = NULL;
+size_t          baseline_count = 0;
+
+/** A mounted generated container **/
+
+typedef struct {
+    FILE*               file;
+    nx_superblock_t*    nxsb;
+    btree_node_phys_t*  nx_omap_btree;
+    apfs_superblock_t*  apsb;
+    btree_node_phys_t*  fs_omap_btree;
+    btree_node_phys_t*  fs_root_btree;
+} bench_container_t;
+
+/** Benchmark contexts **/
+
+typedef struct {
+    uint32_t*   buffer;
+    size_t      size;
+} bench_cksum_ctx_t;
+
+typedef struct {
+    btree_node_phys_t*  omap_btree;
+    xid_t               max_xid;
+    oid_t               keys[BENCH_NUM_KEYS];
+} bench_omap_ctx_t;
+
+typedef struct {
+    bench_container_t*  container;
+    oid_t               oid;
+} bench_records_ctx_t;
+
+typedef struct {
+    bench_container_t*  container;
+    char*               path;
+} bench_path_ctx_t;
+
+typedef struct {
+    paddr_t     start_block;
+    paddr_t     end_block;
+    int         null_fd;    // Copied data is written here
+} bench_range_ctx_t;
+
+/**
+ * Print usage info for this program.
+ */
+void print_usage(char* program_name) {
+    printf("Usage:   %s [options] [--quick] [--filter=NAME] [--min-time=MS] [--runs=N] [--baseline=FILE] [--scratch-dir=DIR]\nExample: %s --format=jsonl > baseline.jsonl\n\n", program_name, program_name);
+    printf("Benchmark options:\n");
+    printf("  --quick             Use smaller containers and shorter runs.\n");
+    printf("  --filter=NAME       Only run the benchmarks whose names contain NAME.\n");
+    printf("  --min-time=MS       Make each timed run last at least MS milliseconds (default: %u).\n", bench_min_ms);
+    printf("  --runs=N            Time each benchmark N times, and report the fastest (default: %u).\n", bench_runs);
+    printf("  --baseline=FILE     Compare the results with those saved in FILE by `--format=jsonl`.\n");
+    printf("  --scratch-dir=DIR   Generate the test containers in DIR (default: $TMPDIR, or /tmp).\n");
+    printf("\n");
+    print_common_options_usage(stdout);
+}
+
+/**
+ * Parse and remove the options specific to this program from the argument
+ * list; see `parse_common_options()`.
+ */
+bool parse_bench_options(int* argc, char** argv) {
+    int num_kept = 1;
+    for (int i = 1; i < *argc; i++) {
+        char* arg = argv[i];
+        if (strcmp(arg, "--") == 0) {
+            // Leave the rest for `parse_common_options()`
+            while (i < *argc) {
+                argv[num_kept++] = argv[i++];
+            }
+            break;
+        }
+
+        if (strcmp(arg, "--quick") == 0) {
+            bench_quick = true;
+        } else if (strncmp(arg, "--filter=", 9) == 0) {
+            bench_filter = arg + 9;
+        } else if (strncmp(arg, "--min-time=", 11) == 0) {
+            if (!parse_option_uint32(arg + 11, &bench_min_ms)) {
+                fprintf(stderr, "Option `--min-time` requires a positive integer value.\n");
+                return false;
+            }
+        } else if (strncmp(arg, "--runs=", 7) == 0) {
+            if (!parse_option_uint32(arg + 7, &bench_runs)) {
+                fprintf(stderr, "Option `--runs` requires a positive integer value.\n");
+                return false;
+            }
+        } else if (strncmp(arg, "--baseline=", 11) == 0) {
+            bench_baseline_path = arg + 11;
+        } else if (strncmp(arg, "--scratch-dir=", 14) == 0) {
+            bench_scratch_dir = arg + 14;
+        } else {
+            argv[num_kept++] = arg;
+        }
+    }
+
+    argv[num_kept] = NULL;
+    *argc = num_kept;
+    return true;
+}
+
+/**
+ * Load the results of an earlier run, as written with `--format=jsonl`.
+ */
+void load_baseline(char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "\nABORT: Could not open the baseline `%s` (%s).\n", path, strerror(errno));
+        exit(-1);
+    }
+
+    char line[1024];
+    size_t capacity = 0;
+    while (fgets(line, sizeof(line), file)) {
+        char* name = strstr(line, "\"name\":\"");
+        char* ns = strstr(line, "\"ns_per_op\":");
+        if (!strstr(line, "\"type\":\"benchmark\"") || !name || !ns) {
+            continue;
+        }
+        if (baseline_count == capacity) {
+            capacity = capacity ? 2 * capacity : 32;
+            baseline_results = realloc(baseline_results, capacity * sizeof(bench_result_t));
+            if (!baseline_results) {
+                fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `baseline_results`.\n");
+                exit(-1);
+            }
+        }
+
+        bench_result_t* result = baseline_results + baseline_count++;
+        name += 8;
+        size_t name_len = strcspn(name, "\"");
+        if (name_len >= sizeof(result->name)) {
+            name_len = sizeof(result->name) - 1;
+        }
+        memcpy(result->name, name, name_len);
+        result->name[name_len] = '\0';
+        result->ns_per_op = strtod(ns + 12, NULL);
+    }
+    fclose(file);
+
+    if (baseline_count == 0) {
+        fprintf(stderr, "\nABORT: `%s` doesn't contain any benchmark results; save them with `--format=jsonl`.\n", path);
+        exit(-1);
+    }
+}
+
+bench_result_t* find_baseline(const char* name) {
+    for (size_t i = 0; i < baseline_count; i++) {
+        if (strcmp(baseline_results[i].name, name) == 0) {
+            return baseline_results + i;
+        }
+    }
+    return NULL;
+}
+
+bool is_benchmark_selected(const char* name) {
+    return !bench_filter || strstr(name, bench_filter);
+}
+
+/**
+ * Time a benchmark. The number of iterations is doubled until a run takes at
+ * least `bench_min_ms`, and the fastest of `bench_runs` runs of that many
+ * iterations is reported, along with the change from the baseline, if any.
+ *
+ * bytes_per_op:    The amount of data that each iteration processes, for
+ *                  reporting throughput, or 0 if that isn't meaningful.
+ */
+void run_benchmark(const char* name, void (*fn)(void*, uint64_t), void* ctx, uint64_t bytes_per_op) {
+    if (!is_benchmark_selected(name)) {
+        return;
+    }
+
+    uint64_t min_ns = (uint64_t)bench_min_ms * 1000000;
+    uint64_t iterations = 1;
+    uint64_t ns;
+    while (true) {
+        uint64_t start_ns = stats_now_ns();
+        fn(ctx, iterations);
+        ns = stats_now_ns() - start_ns;
+        if (ns >= min_ns || iterations >= (1ULL << 40)) {
+            break;
+        }
+        // Aim a little past the target, so that one more run usually suffices.
+        uint64_t estimate = ns ? iterations * min_ns / ns * 5 / 4 : iterations * 16;
+        iterations = estimate > 2 * iterations ? estimate : 2 * iterations;
+    }
+
+    for (uint32_t i = 1; i < bench_runs; i++) {
+        uint64_t start_ns = stats_now_ns();
+        fn(ctx, iterations);
+        uint64_t run_ns = stats_now_ns() - start_ns;
+        if (run_ns < ns) {
+            ns = run_ns;
+        }
+    }
+
+    double ns_per_op = (double)ns / iterations;
+    double mb_per_sec = bytes_per_op ? bytes_per_op / ns_per_op * 1e9 / (1024 * 1024) : 0;
+    bench_result_t* baseline = find_baseline(name);
+
+    if (is_structured_output()) {
+        record_begin("benchmark");
+        record_string("name", name);
+        record_uint("iterations", iterations);
+        record_double("ns_per_op", ns_per_op);
+        record_double("ops_per_sec", 1e9 / ns_per_op);
+        if (bytes_per_op) {
+            record_uint("bytes_per_op", bytes_per_op);
+            record_double("mb_per_sec", mb_per_sec);
+        }
+        if (baseline) {
+            record_double("baseline_ns_per_op", baseline->ns_per_op);
+            record_double("change", ns_per_op / baseline->ns_per_op - 1);
+        }
+        record_end();
+        return;
+    }
+
+    printf("%-32s %12llu %14.1f", name, iterations, ns_per_op);
+    if (bytes_per_op) {
+        printf(" %10.1f", mb_per_sec);
+    } else {
+        printf(" %10s", "-");
+    }
+    if (baseline) {
+        printf(" %14.1f %+8.1f%%", baseline->ns_per_op, (ns_per_op / baseline->ns_per_op - 1) * 100);
+    }
+    printf("\n");
+}
+
+/** Test containers **/
+
+/**
+ * Generate a container with the current `gen_params` in the scratch
+ * directory, and make it the container that is read from. The image file is
+ * unlinked at once, so that it is deleted when it is closed or the benchmark
+ * exits.
+ */
+void bench_generate(bench_container_t* container, const char* label) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/apfs-bench-%d-%s.img", bench_scratch_dir, (int)getpid(), label);
+
+    fprintf(stderr, "Generating the `%s` container ... ", label);
+    uint64_t block_count = generate_container(path);
+    container->file = fopen(path, "rb");
+    if (!container->file) {
+        fprintf(stderr, "\nABORT: ");
+        report_fopen_error();
+        exit(-1);
+    }
+    unlink(path);
+    fprintf(stderr, "OK (%llu blocks).\n", block_count);
+}
+
+/**
+ * Read a block of the current container into a newly allocated buffer.
+ */
+void* bench_read_block(paddr_t addr) {
+    void* block = malloc(nx_block_size);
+    if (!block) {
+        fprintf(stderr, "\nABORT: bench_read_block: Could not allocate sufficient memory for a block.\n");
+        exit(-1);
+    }
+    if (read_blocks(block, addr, 1) != 1 || !is_cksum_valid(block)) {
+        fprintf(stderr, "\nABORT: bench_read_block: Failed to read a valid object from block %#llx.\n", addr);
+        exit(-1);
+    }
+    return block;
+}
+
+/**
+ * Make a generated container the one that is read from, and find the object
+ * maps and file-system tree of its first volume. Generated containers have
+ * their latest superblock at block 0, and no encrypted volumes, so this is
+ * much simpler than a full mount.
+ */
+void bench_use(bench_container_t* container) {
+    nx = container->file;
+    cache_clear();
+    if (container->nxsb) {
+        return;
+    }
+
+    container->nxsb = bench_read_block(0);
+    omap_phys_t* nx_omap = bench_read_block(container->nxsb->nx_omap_oid);
+    container->nx_omap_btree = bench_read_block(nx_omap->om_tree_oid);
+    free(nx_omap);
+
+    omap_val_t* fs_val = get_btree_phys_omap_val(container->nx_omap_btree, container->nxsb->nx_fs_oid[0], container->nxsb->nx_o.o_xid);
+    if (!fs_val) {
+        fprintf(stderr, "\nABORT: bench_use: The first volume superblock isn't in the container object map.\n");
+        exit(-1);
+    }
+    container->apsb = bench_read_block(fs_val->ov_paddr);
+    free(fs_val);
+
+    omap_phys_t* fs_omap = bench_read_block(container->apsb->apfs_omap_oid);
+    container->fs_omap_btree = bench_read_block(fs_omap->om_tree_oid);
+    free(fs_omap);
+
+    omap_val_t* fs_root_val = get_btree_phys_omap_val(container->fs_omap_btree, container->apsb->apfs_root_tree_oid, container->apsb->apfs_o.o_xid);
+    if (!fs_root_val) {
+        fprintf(stderr, "\nABORT: bench_use: The file-system tree isn't in the volume object map.\n");
+        exit(-1);
+    }
+    container->fs_root_btree = bench_read_block(fs_root_val->ov_paddr);
+    free(fs_root_val);
+}
+
+void bench_close(bench_container_t* container) {
+    if (container->file) {
+        fclose(container->file);
+    }
+    free(container->nxsb);
+    free(container->nx_omap_btree);
+    free(container->apsb);
+    free(container->fs_omap_btree);
+    free(container->fs_root_btree);
+    memset(container, 0, sizeof(bench_container_t));
+    nx = NULL;
+}
+
+/**
+ * Set `gen_params` for a container whose root directory has a given number of
+ * empty files and nothing else.
+ */
+void bench_params_flat_dir(uint32_t num_files) {
+    gen_params_t params = {
+        .num_volumes = 1, .depth = 0, .files_per_dir = num_files,
+        .file_blocks = 0, .extents_per_file = 1, .num_checkpoints = 1,
+    };
+    gen_params = params;
+}
+
+/**
+ * Fill an array with random keys between `first` and `last` inclusive.
+ */
+void bench_random_keys(oid_t* keys, oid_t first, oid_t last) {
+    uint64_t state = 0x5eed;
+    for (uint32_t i = 0; i < BENCH_NUM_KEYS; i++) {
+        keys[i] = first + gen_splitmix64(&state) % (last - first + 1);
+    }
+}
+
+/** Benchmarks **/
+
+void bench_cksum(void* ctx_, uint64_t iterations) {
+    bench_cksum_ctx_t* ctx = ctx_;
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        ctx->buffer[2] = i;     // Keep the compiler from hoisting the call
+        sum += fletcher_cksum_sized(ctx->buffer, ctx->size, true);
+    }
+    __asm__ volatile("" : : "r"(sum));
+}
+
+void bench_omap_lookup(void* ctx_, uint64_t iterations) {
+    bench_omap_ctx_t* ctx = ctx_;
+    for (uint64_t i = 0; i < iterations; i++) {
+        omap_val_t* val = get_btree_phys_omap_val(ctx->omap_btree, ctx->keys[i % BENCH_NUM_KEYS], ctx->max_xid);
+        if (!val) {
+            fprintf(stderr, "\nABORT: bench_omap_lookup: OID %#llx is missing from the object map.\n", ctx->keys[i % BENCH_NUM_KEYS]);
+            exit(-1);
+        }
+        free(val);
+    }
+}
+
+void bench_fs_records(void* ctx_, uint64_t iterations) {
+    bench_records_ctx_t* ctx = ctx_;
+    for (uint64_t i = 0; i < iterations; i++) {
+        j_rec_t** records = get_fs_records(ctx->container->fs_omap_btree, ctx->container->fs_root_btree, ctx->oid, ~0ULL);
+        if (!records) {
+            fprintf(stderr, "\nABORT: bench_fs_records: No records found with OID %#llx.\n", ctx->oid);
+            exit(-1);
+        }
+        free_j_rec_array(records);
+    }
+}
+
+/**
+ * Resolve a path in the first volume of a container, in the same way as
+ * `apfs-list` and `apfs-recover`.
+ *
+ * RETURN VALUE:    The OID of the file-system object, or 0 if there is none.
+ */
+oid_t bench_resolve_path(bench_container_t* container, char* path) {
+    oid_t fs_oid = ROOT_DIR_INO_NUM;
+    j_rec_t** fs_records = get_fs_records(container->fs_omap_btree, container->fs_root_btree, fs_oid, ~0ULL);
+
+    char* element = path;
+    while (fs_records && *element) {
+        if (*element == '/') {
+            element++;
+            continue;
+        }
+        size_t element_len = strcspn(element, "/");
+
+        oid_t next_oid = 0;
+        for (j_rec_t** cursor = fs_records; *cursor; cursor++) {
+            j_key_t* hdr = (*cursor)->data;
+            if (((hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT) != APFS_TYPE_DIR_REC) {
+                continue;
+            }
+            j_drec_hashed_key_t* key = (*cursor)->data;
+            if (strncmp((char*)key->name, element, element_len) == 0 && key->name[element_len] == '\0') {
+                next_oid = ((j_drec_val_t*)((*cursor)->data + (*cursor)->key_len))->file_id;
+                break;
+            }
+        }
+        free_j_rec_array(fs_records);
+        if (!next_oid) {
+            return 0;
+        }
+
+        fs_oid = next_oid;
+        fs_records = get_fs_records(container->fs_omap_btree, container->fs_root_btree, fs_oid, ~0ULL);
+        element += element_len;
+    }
+
+    if (!fs_records) {
+        return 0;
+    }
+    free_j_rec_array(fs_records);
+    return fs_oid;
+}
+
+void bench_path_lookup(void* ctx_, uint64_t iterations) {
+    bench_path_ctx_t* ctx = ctx_;
+    for (uint64_t i = 0; i < iterations; i++) {
+        if (!bench_resolve_path(ctx->container, ctx->path)) {
+            fprintf(stderr, "\nABORT: bench_path_lookup: Could not resolve `%s`.\n", ctx->path);
+            exit(-1);
+        }
+    }
+}
+
+void bench_scan(void* ctx_, uint64_t iterations) {
+    bench_range_ctx_t* ctx = ctx_;
+    for (uint64_t i = 0; i < iterations; i++) {
+        scan_t scan;
+        scan_init(&scan, ctx->start_block, ctx->end_block);
+        paddr_t addr;
+        obj_phys_t* block;
+        uint64_t num_objects = 0;
+        while ( (block = scan_next(&scan, &addr)) ) {
+            num_objects += block->o_type != 0;
+        }
+        scan_end(&scan);
+        __asm__ volatile("" : : "r"(num_objects));
+    }
+}
+
+void bench_extent_copy(void* ctx_, uint64_t iterations) {
+    bench_range_ctx_t* ctx = ctx_;
+    for (uint64_t i = 0; i < iterations; i++) {
+        scan_t scan;
+        scan_init(&scan, ctx->start_block, ctx->end_block);
+        scan.skip_errors = false;
+        paddr_t chunk_addr;
+        char* chunk;
+        size_t chunk_len;
+        while ( (chunk_len = scan_next_chunk(&scan, &chunk_addr, &chunk)) ) {
+            if (write(ctx->null_fd, chunk, chunk_len * nx_block_size) < 0) {
+                fprintf(stderr, "\nABORT: bench_extent_copy: Could not write to /dev/null (%s).\n", strerror(errno));
+                exit(-1);
+            }
+        }
+        scan_end(&scan);
+    }
+}
+
+/** Benchmark groups **/
+
+void run_cksum_benchmarks() {
+    uint32_t sizes[] = { 4096, 16384, 65536 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench_cksum_ctx_t ctx = { malloc(sizes[i]), sizes[i] };
+        if (!ctx.buffer) {
+            fprintf(stderr, "\nABORT: Could not allocate sufficient memory for the checksum buffer.\n");
+            exit(-1);
+        }
+        uint64_t state = 1;
+        for (size_t j = 0; j < sizes[i] / sizeof(uint32_t); j++) {
+            ctx.buffer[j] = gen_splitmix64(&state);
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "cksum/%u", sizes[i]);
+        run_benchmark(name, bench_cksum, &ctx, sizes[i]);
+        free(ctx.buffer);
+    }
+}
+
+/**
+ * In-node key search: lookups in an object map whose only node is a leaf
+ * that is nearly full, namely the container object map of a container with
+ * the maximum number of volumes.
+ */
+void run_node_search_benchmarks() {
+    if (!is_benchmark_selected("node_search/omap_leaf")) {
+        return;
+    }
+
+    gen_params_t params = {
+        .num_volumes = NX_MAX_FILE_SYSTEMS, .depth = 0, .files_per_dir = 0,
+        .extents_per_file = 1, .num_checkpoints = 1,
+    };
+    gen_params = params;
+    bench_container_t container = { 0 };
+    bench_generate(&container, "volumes");
+    bench_use(&container);
+
+    bench_omap_ctx_t ctx = { .omap_btree = container.nx_omap_btree, .max_xid = container.nxsb->nx_o.o_xid };
+    bench_random_keys(ctx.keys, 0, NX_MAX_FILE_SYSTEMS - 1);
+    for (uint32_t i = 0; i < BENCH_NUM_KEYS; i++) {
+        ctx.keys[i] = container.nxsb->nx_fs_oid[ctx.keys[i]];
+    }
+    run_benchmark("node_search/omap_leaf", bench_omap_lookup, &ctx, 0);
+    bench_close(&container);
+}
+
+/**
+ * Object map point lookups and directory listings. The lookups are of the
+ * Virtual OIDs of file-system tree nodes in the volume object map of the
+ * largest directory, with the nodes' blocks warm in the block cache.
+ */
+void run_directory_benchmarks() {
+    uint32_t sizes[] = { 10, 10000, 1000000 };
+    size_t num_sizes = bench_quick ? 2 : 3;
+    for (size_t i = 0; i < num_sizes; i++) {
+        char dir_name[64], omap_name[64];
+        snprintf(dir_name, sizeof(dir_name), "fs_records/dir_%u", sizes[i]);
+        snprintf(omap_name, sizeof(omap_name), "omap_lookup/dir_%u", sizes[i]);
+        bool is_largest = i == num_sizes - 1;
+        if (!is_benchmark_selected(dir_name) && !(is_largest && is_benchmark_selected(omap_name))) {
+            continue;
+        }
+
+        char label[32];
+        snprintf(label, sizeof(label), "dir%u", sizes[i]);
+        bench_params_flat_dir(sizes[i]);
+        bench_container_t container = { 0 };
+        bench_generate(&container, label);
+        bench_use(&container);
+
+        if (is_largest) {
+            // File-system tree nodes have the Virtual OIDs that precede the
+            // volume superblock's.
+            bench_omap_ctx_t ctx = { .omap_btree = container.fs_omap_btree, .max_xid = container.apsb->apfs_o.o_xid };
+            bench_random_keys(ctx.keys, GEN_FIRST_VIRTUAL_OID, container.nxsb->nx_fs_oid[0] - 1);
+            run_benchmark(omap_name, bench_omap_lookup, &ctx, 0);
+        }
+
+        bench_records_ctx_t ctx = { &container, ROOT_DIR_INO_NUM };
+        run_benchmark(dir_name, bench_fs_records, &ctx, 0);
+        bench_close(&container);
+    }
+}
+
+void run_path_benchmarks() {
+    uint32_t depths[] = { 1, 2, 5, 10, 20 };
+    size_t num_depths = sizeof(depths) / sizeof(depths[0]);
+    char names[sizeof(depths) / sizeof(depths[0])][64];
+    bool any_selected = false;
+    for (size_t i = 0; i < num_depths; i++) {
+        snprintf(names[i], sizeof(names[i]), "path_lookup/depth_%u", depths[i]);
+        any_selected |= is_benchmark_selected(names[i]);
+    }
+    if (!any_selected) {
+        return;
+    }
+
+    gen_params_t params = {
+        .num_volumes = 1, .depth = 20, .subdirs_per_dir = 1, .files_per_dir = 8,
+        .file_blocks = 0, .extents_per_file = 1, .num_checkpoints = 1,
+    };
+    gen_params = params;
+    bench_container_t container = { 0 };
+    bench_generate(&container, "deep");
+    bench_use(&container);
+
+    char path[256];
+    for (size_t i = 0; i < num_depths; i++) {
+        // Each level is `/dir0`, and the last is the file.
+        path[0] = '\0';
+        for (uint32_t j = 1; j < depths[i]; j++) {
+            strcat(path, "/dir0");
+        }
+        strcat(path, "/file0");
+
+        bench_path_ctx_t ctx = { &container, path };
+        run_benchmark(names[i], bench_path_lookup, &ctx, 0);
+    }
+    bench_close(&container);
+}
+
+/**
+ * Sequential throughput: a scan of the whole container, and a copy of one
+ * large file's extents. Both read from the page cache after the first run,
+ * so they measure the cost of the I/O engine and of the per-block work.
+ */
+void run_throughput_benchmarks() {
+    if (!is_benchmark_selected("scan/container") && !is_benchmark_selected("extent_copy/file")) {
+        return;
+    }
+
+    uint32_t file_blocks = (bench_quick ? 16 : 64) * 1024 * 1024 / nx_block_size;
+    gen_params_t params = {
+        .num_volumes = 1, .depth = 0, .files_per_dir = 1,
+        .file_blocks = file_blocks, .extents_per_file = 16, .num_checkpoints = 1,
+        .fill_data = true,
+    };
+    gen_params = params;
+    bench_container_t container = { 0 };
+    bench_generate(&container, "data");
+    bench_use(&container);
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd == -1) {
+        fprintf(stderr, "\nABORT: Could not open /dev/null (%s).\n", strerror(errno));
+        exit(-1);
+    }
+
+    bench_range_ctx_t scan_ctx = { 0, container.nxsb->nx_block_count, null_fd };
+    run_benchmark("scan/container", bench_scan, &scan_ctx, scan_ctx.end_block * nx_block_size);
+
+    // The file's extents are separated by single-block holes; copy the whole
+    // range that they span.
+    bench_range_ctx_t copy_ctx = { INT64_MAX, 0, null_fd };
+    j_rec_t** records = get_fs_records(container.fs_omap_btree, container.fs_root_btree, MIN_USER_INO_NUM, ~0ULL);
+    for (j_rec_t** cursor = records; cursor && *cursor; cursor++) {
+        j_key_t* hdr = (*cursor)->data;
+        if (((hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT) != APFS_TYPE_FILE_EXTENT) {
+            continue;
+        }
+        j_file_extent_val_t* val = (*cursor)->data + (*cursor)->key_len;
+        paddr_t end_block = val->phys_block_num + (val->len_and_flags & J_FILE_EXTENT_LEN_MASK) / nx_block_size;
+        if ((paddr_t)val->phys_block_num < copy_ctx.start_block) {
+            copy_ctx.start_block = val->phys_block_num;
+        }
+        if (end_block > copy_ctx.end_block) {
+            copy_ctx.end_block = end_block;
+        }
+    }
+    if (records) {
+        free_j_rec_array(records);
+    }
+    if (copy_ctx.end_block <= copy_ctx.start_block) {
+        fprintf(stderr, "\nABORT: The file in the `data` container has no extents.\n");
+        exit(-1);
+    }
+    run_benchmark("extent_copy/file", bench_extent_copy, &copy_ctx, (uint64_t)file_blocks * nx_block_size);
+
+    close(null_fd);
+    bench_close(&container);
+}
+
+int main(int argc, char** argv) {
+    setbuf(stdout, NULL);
+    output_format_supported = true;
+
+    // Extrapolate CLI arguments, exit if invalid
+    if (!parse_bench_options(&argc, argv) || !parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (argc != 1) {
+        printf("Incorrect number of arguments.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (!bench_scratch_dir) {
+        bench_scratch_dir = getenv("TMPDIR");
+        if (!bench_scratch_dir || !*bench_scratch_dir) {
+            bench_scratch_dir = "/tmp";
+        }
+    }
+    if (bench_quick) {
+        bench_min_ms = bench_min_ms < 50 ? bench_min_ms : 50;
+    }
+    if (bench_baseline_path) {
+        load_baseline(bench_baseline_path);
+    }
+
+    start_structured_output();
+    nx_path = "(generated container)";
+
+    if (!is_structured_output()) {
+        printf("%-32s %12s %14s %10s", "Benchmark", "Iterations", "ns/op", "MB/s");
+        if (bench_baseline_path) {
+            printf(" %14s %9s", "Baseline ns/op", "Change");
+        }
+        printf("\n");
+    }
+
+    run_cksum_benchmarks();
+    run_node_search_benchmarks();
+    run_directory_benchmarks();
+    run_path_benchmarks();
+    run_throughput_benchmarks();
+    return 0;
+}
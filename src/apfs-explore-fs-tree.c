@@ -5,6 +5,9 @@
 #include <string.h>
 
 #include "apfs/io.h"
+#include "apfs/io/async.h"
+#include "apfs/options.h"
+#include "apfs/explore.h"
 #include "apfs/struct/general.h"
 #include "apfs/struct/j.h"
 #include "apfs/struct/const.h"
@@ -27,13 +30,275 @@
  * Print usage info for this program.
  */
 void print_usage(char* program_name) {
-    printf("Usage:   %s <container> <fs tree root node address> <omap tree root node address>\nExample: %s /dev/disk0s2 0xd02a4 0x3af2\n\n", program_name, program_name);
+    printf("Usage:   %s [options] [--path=STEP,...|--dump-level=N] <container> <fs tree root node address> <omap tree root node address>\nExample: %s /dev/disk0s2 0xd02a4 0x3af2\n\n", program_name, program_name);
+    print_explore_options_usage(stdout, "TYPE");
+    print_common_options_usage(stdout);
+}
+
+// The root node of the object map that maps the tree's Virtual OIDs
+btree_node_phys_t* omap_root_node = NULL;
+
+/**
+ * Get the end of the value area of a node, which precedes the B-tree info in
+ * a root node.
+ */
+char* get_val_end(btree_node_phys_t* node) {
+    char* val_end = (char*)node + nx_block_size;
+    if (node->btn_flags & BTNODE_ROOT) {
+        val_end -= sizeof(btree_info_t);
+    }
+    return val_end;
+}
+
+explore_key_t get_fs_key(btree_node_phys_t* node, uint32_t entry_index) {
+    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+    char* key_start = toc_start + node->btn_table_space.len;
+    kvloc_t* toc_entry = (kvloc_t*)toc_start + entry_index;
+    j_key_t* hdr = key_start + toc_entry->k.off;
+    explore_key_t key = {
+        hdr->obj_id_and_type & OBJ_ID_MASK,
+        (hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT,
+    };
+    return key;
+}
+
+/**
+ * Resolve the Virtual OID of the child node that an entry of a non-leaf node
+ * points to.
+ */
+paddr_t get_fs_child_addr(btree_node_phys_t* node, uint32_t entry_index) {
+    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+    kvloc_t* toc_entry = (kvloc_t*)toc_start + entry_index;
+    oid_t* child_node_virt_oid = get_val_end(node) - toc_entry->v.off;
+    omap_val_t* child_node_omap_val = get_btree_phys_omap_val( omap_root_node, *child_node_virt_oid, (xid_t)(~0) );
+    if (!child_node_omap_val) {
+        return 0;
+    }
+    paddr_t addr = child_node_omap_val->ov_paddr;
+    free(child_node_omap_val);
+    return addr;
+}
+
+/**
+ * Print a list of the entries of a node. For each entry of a non-leaf node,
+ * the child node it points to is also resolved and, if `read_children` is set,
+ * read and checked for being zeroed out.
+ */
+void print_fs_node_entries(btree_node_phys_t* node, bool read_children) {
+    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+    char* key_start = toc_start + node->btn_table_space.len;
+    char* val_end   = get_val_end(node);
+
+    printf("\nNode has %u entries, as follows:\n", node->btn_nkeys);
+    kvloc_t* toc_entry = toc_start;
+
+    // If this is a non-leaf node, read all of its child nodes at once, so
+    // that the reads can be serviced in parallel.
+    paddr_t*    child_addrs         = NULL;
+    aio_req_t*  child_reqs          = NULL;
+    aio_req_t** child_entry_reqs    = NULL;
+    char*       child_nodes         = NULL;
+    if (!(node->btn_flags & BTNODE_LEAF)) {
+        child_addrs         = calloc(node->btn_nkeys, sizeof(paddr_t));
+        child_reqs          = calloc(node->btn_nkeys, sizeof(aio_req_t));
+        child_entry_reqs    = calloc(node->btn_nkeys, sizeof(aio_req_t*));
+        child_nodes         = read_children ? malloc(node->btn_nkeys * nx_block_size) : NULL;
+        if (!child_addrs || !child_reqs || !child_entry_reqs || (read_children && !child_nodes)) {
+            fprintf(stderr, "\nABORT: Could not allocate sufficient memory for the child nodes.\n");
+            exit(-1);
+        }
+
+        size_t num_child_reqs = 0;
+        for (uint32_t i = 0;    i < node->btn_nkeys;    i++) {
+            child_addrs[i] = get_fs_child_addr(node, i);
+            if (child_addrs[i] && read_children) {
+                aio_req_t* req = child_reqs + num_child_reqs++;
+                req->buffer         = child_nodes + i * nx_block_size;
+                req->start_block    = child_addrs[i];
+                req->num_blocks     = 1;
+                child_entry_reqs[i] = req;
+            }
+        }
+        aio_read_batch(child_reqs, num_child_reqs);
+    }
+
+    for (uint32_t i = 0;    i < node->btn_nkeys;    i++, toc_entry++) {
+        j_key_t* hdr = key_start + toc_entry->k.off;
+        uint8_t type = (hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT;
+
+        printf(
+            "- %3u:  %#15llx = Virtual OID   ||   %2u = %#1x = Type",
+            i, hdr->obj_id_and_type & OBJ_ID_MASK, type, type
+        );
+
+        if (node->btn_flags & BTNODE_LEAF) {
+            if ( (hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT  ==  APFS_TYPE_DIR_REC ) {
+                j_drec_hashed_key_t* key = hdr;
+                j_drec_val_t* val = val_end - toc_entry->v.off;
+
+                printf(" = `dentry`   ||   Dentry Virtual OID = %#16llx   ||   Dentry name = %s", val->file_id, key->name);
+            }
+        } else {
+            oid_t* child_node_virt_oid = val_end - toc_entry->v.off;
+            printf("   ||   Target child node Virtual OID = %#16llx", *child_node_virt_oid);
+            aio_req_t* req = child_entry_reqs[i];
+            if (!child_addrs[i]) {
+                printf("  ||  UNRESOLVABLE");
+            } else if (!read_children) {
+                printf("  ||  Block %#llx", child_addrs[i]);
+            } else {
+                if (req->result != 1) {
+                    fprintf(stderr, "\nABORT: Failed to read block %#llx.\n", req->start_block);
+                    exit(-1);
+                }
+
+                if (*((uint64_t*)req->buffer) == 0) {
+                    printf("  ||  ZEROED OUT");
+                }
+            }
+        }
+
+        printf("\n");
+    }
+
+    free(child_nodes);
+    free(child_entry_reqs);
+    free(child_reqs);
+    free(child_addrs);
+}
+
+void print_fs_node_details(btree_node_phys_t* node) {
+    printf("\nNode details:\n");
+    printf("--------------------------------------------------------------------------------\n");
+    print_btree_node_phys(node);
+    printf("--------------------------------------------------------------------------------\n");
+    printf("\n");
+}
+
+/**
+ * Print a node for `--dump-level`. Its children aren't read here, since they
+ * are read when the next level is printed.
+ */
+void print_fs_node(btree_node_phys_t* node) {
+    print_fs_node_details(node);
+    print_fs_node_entries(node, false);
+}
+
+/**
+ * Print the file-system record of a given entry of a leaf node.
+ */
+void print_fs_node_record(btree_node_phys_t* node, uint32_t entry_index) {
+    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+    char* key_start = toc_start + node->btn_table_space.len;
+    char* val_end   = get_val_end(node);
+    kvloc_t* toc_entry = (kvloc_t*)toc_start + entry_index;
+
+    j_rec_t* fs_rec = malloc(sizeof(j_rec_t) + toc_entry->k.len + toc_entry->v.len);
+    if (!fs_rec) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `fs_rec`.\n");
+        exit(-1);
+    }
+
+    fs_rec->key_len = toc_entry->k.len;
+    fs_rec->val_len = toc_entry->v.len;
+    memcpy(
+        fs_rec->data,
+        key_start + toc_entry->k.off,
+        fs_rec->key_len
+    );
+    memcpy(
+        fs_rec->data + fs_rec->key_len,
+        val_end - toc_entry->v.off,
+        fs_rec->val_len
+    );
+
+    j_key_t* hdr = fs_rec->data;
+    printf("Key size:           %u bytes\n",    fs_rec->key_len);
+    printf("Value size:         %u bytes\n",    fs_rec->val_len);
+    printf("ID and type field:  0x%016llx\n",   hdr->obj_id_and_type);
+    printf("\n");
+
+    switch ( (hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT ) {
+        // NOTE: Need to enclose each case in a block `{}` since the
+        // names `key` and `val` are potentially declared multiple times
+        // in this switch-statement (though in practice it is not a
+        // concern since every `case` here ends in a `break`.)
+        case APFS_TYPE_SNAP_METADATA: {
+            j_snap_metadata_key_t* key = fs_rec->data;
+            j_snap_metadata_val_t* val = fs_rec->data + fs_rec->key_len;
+        } break;
+        case APFS_TYPE_EXTENT: {
+            j_phys_ext_key_t* key = fs_rec->data;
+            j_phys_ext_val_t* val = fs_rec->data + fs_rec->key_len;
+        } break;
+        case APFS_TYPE_INODE: {
+            j_inode_key_t* key = fs_rec->data;
+            j_inode_val_t* val = fs_rec->data + fs_rec->key_len;
+            print_j_inode_key(key);
+            print_j_inode_val(val, fs_rec->val_len == sizeof(j_inode_val_t));
+        } break;
+        case APFS_TYPE_XATTR: {
+            j_xattr_key_t* key = fs_rec->data;
+            j_xattr_val_t* val = fs_rec->data + fs_rec->key_len;
+        } break;
+        case APFS_TYPE_SIBLING_LINK: {
+            j_sibling_key_t* key = fs_rec->data;
+            j_sibling_val_t* val = fs_rec->data + fs_rec->key_len;
+        } break;
+        case APFS_TYPE_DSTREAM_ID: {
+            j_dstream_id_key_t* key = fs_rec->data;
+            j_dstream_id_val_t* val = fs_rec->data + fs_rec->key_len;
+        } break;
+        case APFS_TYPE_CRYPTO_STATE: {
+            j_crypto_key_t* key = fs_rec->data;
+            j_crypto_val_t* val = fs_rec->data + fs_rec->key_len;
+        } break;
+        case APFS_TYPE_FILE_EXTENT: {
+            j_file_extent_key_t* key = fs_rec->data;
+            j_file_extent_val_t* val = fs_rec->data + fs_rec->key_len;
+            print_j_file_extent_key(key);
+            print_j_file_extent_val(val);
+        } break;
+        case APFS_TYPE_DIR_REC: {
+            // Spec inorrectly says to use `j_drec_key_t`; see NOTE in `apfs/struct/j.h`
+            j_drec_hashed_key_t*    key = fs_rec->data;
+            j_drec_val_t*           val = fs_rec->data + fs_rec->key_len;
+            print_j_drec_hashed_key(key);
+            print_j_drec_val(val, fs_rec->val_len == sizeof(j_drec_val_t));
+        } break;
+        case APFS_TYPE_DIR_STATS: {
+            j_dir_stats_key_t* key = fs_rec->data;
+            // Spec incorrectly says to use `j_drec_val_t`; we use `j_dir_stats_val_t`
+            j_dir_stats_val_t* val = fs_rec->data + fs_rec->key_len;
+        } break;
+        case APFS_TYPE_SNAP_NAME: {
+            j_snap_name_key_t* key = fs_rec->data;
+            j_snap_name_val_t* val = fs_rec->data + fs_rec->key_len;
+        } break;
+        case APFS_TYPE_SIBLING_MAP: {
+            j_sibling_map_key_t* key = fs_rec->data;
+            j_sibling_map_val_t* val = fs_rec->data + fs_rec->key_len;
+        } break;
+        case APFS_TYPE_INVALID:
+            fprintf(stderr, "The record has an invalid type.\n");
+            break;
+        default:
+            fprintf(stderr, "The record has an unknown type.\n");
+            break;
+    }
+
+
+    free(fs_rec);
 }
 
 int main(int argc, char** argv) {
     printf("\n");
 
     // Extrapolate CLI arguments, exit if invalid
+    if (!parse_explore_options(&argc, argv) || !parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
     if (argc != 4) {
         printf("Incorrect number of arguments.\n");
         print_usage(argv[0]);
@@ -76,6 +341,7 @@ int main(int argc, char** argv) {
         return -errno;
     }
     printf("OK.\n\n");
+    detect_block_size();
 
     // Read the specified root nodes
     printf("Reading the file-system tree root node (block 0x%llx) ... ", fs_root_addr);
@@ -99,7 +365,7 @@ int main(int argc, char** argv) {
     printf("\n");
 
     printf("Reading the object map root node (block 0x%llx) ... ", omap_root_addr);
-    btree_node_phys_t* omap_root_node = malloc(nx_block_size);
+    omap_root_node = malloc(nx_block_size);
     if (!omap_root_node) {
         fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `omap_root_node`.\n");
         return -1;
@@ -118,6 +384,12 @@ int main(int argc, char** argv) {
     }
     printf("\n");
 
+    if (explore_dump_level >= 0) {
+        uint64_t num_printed = explore_dump_levels(fs_root_addr, get_fs_child_addr, print_fs_node);
+        printf("\nEND: Printed %llu nodes.\n", num_printed);
+        return 0;
+    }
+
     // Allocate space for the current working node in the file-system tree,
     // then copy the root node to this space.
     btree_node_phys_t* node = malloc(nx_block_size);
@@ -127,22 +399,6 @@ int main(int argc, char** argv) {
     }
     memcpy(node, fs_root_node, nx_block_size);
 
-    // Pointers to areas of the node
-    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
-    char* key_start = toc_start + node->btn_table_space.len;
-    char* val_end   = (char*)node + nx_block_size;
-    if (node->btn_flags & BTNODE_ROOT) {
-        val_end -= sizeof(btree_info_t);
-    }
-
-    // // Copy the B-tree info somewhere else for easy referencing
-    // btree_info_t* bt_info = malloc(sizeof(btree_info_t));
-    // if (!bt_info) {
-    //     fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `bt_info`.\n");
-    //     return -1;
-    // }
-    // memcpy(bt_info, val_end, sizeof(btree_info_t));
-
     // Descend the tree
     while (true) {
         if (node->btn_flags & BTNODE_FIXED_KV_SIZE) {
@@ -150,176 +406,29 @@ int main(int argc, char** argv) {
             return 0;
         }
 
-        printf("\nNode details:\n");
-        printf("--------------------------------------------------------------------------------\n");
-        print_btree_node_phys(node);
-        printf("--------------------------------------------------------------------------------\n");
-        printf("\n");
-
-        printf("\nNode has %u entries, as follows:\n", node->btn_nkeys);
+        print_fs_node_details(node);
         assert(node->btn_nkeys > 0);
+        print_fs_node_entries(node, true);
 
-        kvloc_t* toc_entry = toc_start;
-        for (uint32_t i = 0;    i < node->btn_nkeys;    i++, toc_entry++) {
-            j_key_t* hdr = key_start + toc_entry->k.off;
-            uint8_t type = (hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT;
-
-            printf(
-                "- %3u:  %#15llx = Virtual OID   ||   %2u = %#1x = Type",
-                i, hdr->obj_id_and_type & OBJ_ID_MASK, type, type
-            );
-
-            if (node->btn_flags & BTNODE_LEAF) {
-                if ( (hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT  ==  APFS_TYPE_DIR_REC ) {
-                    j_drec_hashed_key_t* key = hdr;
-                    j_drec_val_t* val = val_end - toc_entry->v.off;
-
-                    printf(" = `dentry`   ||   Dentry Virtual OID = %#16llx   ||   Dentry name = %s", val->file_id, key->name);
-                }
-            } else {
-                oid_t* child_node_virt_oid = val_end - toc_entry->v.off;
-                printf("   ||   Target child node Virtual OID = %#16llx", *child_node_virt_oid);
-                omap_val_t* child_node_omap_val = get_btree_phys_omap_val( omap_root_node, *child_node_virt_oid, (xid_t)(~0) );
-                if (!child_node_omap_val) {
-                    printf("  ||  UNRESOLVABLE");
-                } else {
-                    btree_node_phys_t* child_node = malloc(nx_block_size);
-                    if (!child_node) {
-                        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `child_node`.\n");
-                        return -1;
-                    }
-                    if (read_blocks(child_node, child_node_omap_val->ov_paddr, 1) != 1) {
-                        fprintf(stderr, "\nABORT: Failed to read block %#llx.\n", child_node_omap_val->ov_paddr);
-                        return -1;
-                    }
-
-                    if (*((uint64_t*)child_node) == 0) {
-                        printf("  ||  ZEROED OUT");
-                    }
-
-                    free (child_node);
-                }
-            }
-
-            printf("\n");
-        }
-        
-        uint32_t entry_index;
-        printf("Choose an entry [0-%u]: ", node->btn_nkeys - 1);
-        scanf("%u", &entry_index);
-        while (entry_index >= node->btn_nkeys) {
-            printf("Invalid choice; choose an entry [0-%u]: ", node->btn_nkeys - 1);
-            scanf("%u", &entry_index);
+        uint32_t entry_index = explore_choose_entry(node, get_fs_key);
+        if (entry_index == EXPLORE_NO_ENTRY) {
+            return 0;
         }
 
-        toc_entry = (kvloc_t*)toc_start + entry_index;
-
         // If this is a leaf node, output the file-system record details
         if (node->btn_flags & BTNODE_LEAF) {
-            j_rec_t* fs_rec = malloc(sizeof(j_rec_t) + toc_entry->k.len + toc_entry->v.len);
-            if (!fs_rec) {
-                fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `fs_rec`.\n");
-                return -1;
-            }
-
-            fs_rec->key_len = toc_entry->k.len;
-            fs_rec->val_len = toc_entry->v.len;
-            memcpy(
-                fs_rec->data,
-                key_start + toc_entry->k.off,
-                fs_rec->key_len
-            );
-            memcpy(
-                fs_rec->data + fs_rec->key_len,
-                val_end - toc_entry->v.off,
-                fs_rec->val_len
-            );
-
-            j_key_t* hdr = fs_rec->data;
-            printf("Key size:           %u bytes\n",    fs_rec->key_len);
-            printf("Value size:         %u bytes\n",    fs_rec->val_len);
-            printf("ID and type field:  0x%016llx\n",   hdr->obj_id_and_type);
-            printf("\n");
-
-            switch ( (hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT ) {
-                // NOTE: Need to enclose each case in a block `{}` since the
-                // names `key` and `val` are potentially declared multiple times
-                // in this switch-statement (though in practice it is not a
-                // concern since every `case` here ends in a `break`.)
-                case APFS_TYPE_SNAP_METADATA: {
-                    j_snap_metadata_key_t* key = fs_rec->data;
-                    j_snap_metadata_val_t* val = fs_rec->data + fs_rec->key_len;
-                } break;
-                case APFS_TYPE_EXTENT: {
-                    j_phys_ext_key_t* key = fs_rec->data;
-                    j_phys_ext_val_t* val = fs_rec->data + fs_rec->key_len;
-                } break;
-                case APFS_TYPE_INODE: {
-                    j_inode_key_t* key = fs_rec->data;
-                    j_inode_val_t* val = fs_rec->data + fs_rec->key_len;
-                    print_j_inode_key(key);
-                    print_j_inode_val(val, fs_rec->val_len == sizeof(j_inode_val_t));
-                } break;
-                case APFS_TYPE_XATTR: {
-                    j_xattr_key_t* key = fs_rec->data;
-                    j_xattr_val_t* val = fs_rec->data + fs_rec->key_len;
-                } break;
-                case APFS_TYPE_SIBLING_LINK: {
-                    j_sibling_key_t* key = fs_rec->data;
-                    j_sibling_val_t* val = fs_rec->data + fs_rec->key_len;
-                } break;
-                case APFS_TYPE_DSTREAM_ID: {
-                    j_dstream_id_key_t* key = fs_rec->data;
-                    j_dstream_id_val_t* val = fs_rec->data + fs_rec->key_len;
-                } break;
-                case APFS_TYPE_CRYPTO_STATE: {
-                    j_crypto_key_t* key = fs_rec->data;
-                    j_crypto_val_t* val = fs_rec->data + fs_rec->key_len;
-                } break;
-                case APFS_TYPE_FILE_EXTENT: {
-                    j_file_extent_key_t* key = fs_rec->data;
-                    j_file_extent_val_t* val = fs_rec->data + fs_rec->key_len;
-                    print_j_file_extent_key(key);
-                    print_j_file_extent_val(val);
-                } break;
-                case APFS_TYPE_DIR_REC: {
-                    // Spec inorrectly says to use `j_drec_key_t`; see NOTE in `apfs/struct/j.h`
-                    j_drec_hashed_key_t*    key = fs_rec->data;
-                    j_drec_val_t*           val = fs_rec->data + fs_rec->key_len;
-                    print_j_drec_hashed_key(key);
-                    print_j_drec_val(val, fs_rec->val_len == sizeof(j_drec_val_t));
-                } break;
-                case APFS_TYPE_DIR_STATS: {
-                    j_dir_stats_key_t* key = fs_rec->data;
-                    // Spec incorrectly says to use `j_drec_val_t`; we use `j_dir_stats_val_t`
-                    j_dir_stats_val_t* val = fs_rec->data + fs_rec->key_len;
-                } break;
-                case APFS_TYPE_SNAP_NAME: {
-                    j_snap_name_key_t* key = fs_rec->data;
-                    j_snap_name_val_t* val = fs_rec->data + fs_rec->key_len;
-                } break;
-                case APFS_TYPE_SIBLING_MAP: {
-                    j_sibling_map_key_t* key = fs_rec->data;
-                    j_sibling_map_val_t* val = fs_rec->data + fs_rec->key_len;
-                } break;
-                case APFS_TYPE_INVALID:
-                    fprintf(stderr, "The record has an invalid type.\n");
-                    break;
-                default:
-                    fprintf(stderr, "The record has an unknown type.\n");
-                    break;
-            }
-
+            print_fs_node_record(node, entry_index);
             return 0;
         }
 
         // Else, read the corresponding child node into `node` and loop
-        oid_t* child_node_virt_oid = val_end - toc_entry->v.off;
-        printf("Child node has Virtual OID 0x%llx.\n", *child_node_virt_oid);
+        kvloc_t* toc_entry = (kvloc_t*)((char*)node->btn_data + node->btn_table_space.off) + entry_index;
+        oid_t child_node_virt_oid = *(oid_t*)(get_val_end(node) - toc_entry->v.off);
+        printf("Child node has Virtual OID 0x%llx.\n", child_node_virt_oid);
         
-        omap_val_t* child_node_omap_val = get_btree_phys_omap_val(omap_root_node, *child_node_virt_oid, (xid_t)(~0) /*fs_root_node->btn_o.o_xid*/);
+        omap_val_t* child_node_omap_val = get_btree_phys_omap_val(omap_root_node, child_node_virt_oid, (xid_t)(~0) /*fs_root_node->btn_o.o_xid*/);
         if (!child_node_omap_val) {
-            printf("Need to descend to node with Virtual OID 0x%llx, but the object map lists no objects with this Virtual OID.\n", *child_node_virt_oid);
+            printf("Need to descend to node with Virtual OID 0x%llx, but the object map lists no objects with this Virtual OID.\n", child_node_virt_oid);
             return 0;
         }
 
@@ -336,10 +445,6 @@ int main(int argc, char** argv) {
             printf("FAILED.\n");
         }
 
-        toc_start = (char*)(node->btn_data) + node->btn_table_space.off;
-        key_start = toc_start + node->btn_table_space.len;
-        val_end   = (char*)node + nx_block_size;    // Always dealing with non-root node here
-
         free(child_node_omap_val);
     }
     
@@ -5,6 +5,9 @@
 #include <string.h>
 
 #include "apfs/io.h"
+#include "apfs/io/async.h"
+#include "apfs/options.h"
+#include "apfs/explore.h"
 #include "apfs/struct/general.h"
 
 #include "apfs/func/boolean.h"
@@ -20,13 +23,137 @@
  * Print usage info for this program.
  */
 void print_usage(char* program_name) {
-    printf("Usage:   %s <container> <root node address>\nExample: %s /dev/disk0s2 0x3af2\n\n", program_name, program_name);
+    printf("Usage:   %s [options] [--path=STEP,...|--dump-level=N] <container> <root node address>\nExample: %s /dev/disk0s2 0x3af2\n\n", program_name, program_name);
+    print_explore_options_usage(stdout, "XID");
+    print_common_options_usage(stdout);
+}
+
+/**
+ * Get the end of the value area of a node, which precedes the B-tree info in
+ * a root node.
+ */
+char* get_val_end(btree_node_phys_t* node) {
+    char* val_end = (char*)node + nx_block_size;
+    if (node->btn_flags & BTNODE_ROOT) {
+        val_end -= sizeof(btree_info_t);
+    }
+    return val_end;
+}
+
+explore_key_t get_omap_key(btree_node_phys_t* node, uint32_t entry_index) {
+    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+    char* key_start = toc_start + node->btn_table_space.len;
+    kvoff_t* toc_entry = (kvoff_t*)toc_start + entry_index;
+    omap_key_t* omap_key = key_start + toc_entry->k;
+    explore_key_t key = { omap_key->ok_oid, omap_key->ok_xid };
+    return key;
+}
+
+paddr_t get_omap_child_addr(btree_node_phys_t* node, uint32_t entry_index) {
+    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+    kvoff_t* toc_entry = (kvoff_t*)toc_start + entry_index;
+    return *(paddr_t*)(get_val_end(node) - toc_entry->v);
+}
+
+/**
+ * Print a list of the entries of a node. For each entry of a leaf node, if
+ * `read_targets` is set, the block it maps to is also read and checked against
+ * the entry's key.
+ */
+void print_omap_node_entries(btree_node_phys_t* node, bool read_targets) {
+    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+    char* key_start = toc_start + node->btn_table_space.len;
+    char* val_end   = get_val_end(node);
+
+    printf("\nNode has %u entries, as follows:\n", node->btn_nkeys);
+    kvoff_t* toc_entry = toc_start;
+    // Print mapped block's details if explroing a leaf node
+    if ((node->btn_flags & BTNODE_LEAF) && read_targets) {
+        // Read all of the mapped blocks at once, so that the reads can be
+        // serviced in parallel.
+        aio_req_t* reqs = calloc(node->btn_nkeys, sizeof(aio_req_t));
+        char* blocks = malloc(node->btn_nkeys * nx_block_size);
+        if (!reqs || !blocks) {
+            fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `blocks`.\n");
+            exit(-1);
+        }
+        for (uint32_t i = 0;    i < node->btn_nkeys;    i++, toc_entry++) {
+            omap_val_t* val = val_end - toc_entry->v;
+            reqs[i].buffer      = blocks + i * nx_block_size;
+            reqs[i].start_block = val->ov_paddr;
+            reqs[i].num_blocks  = 1;
+        }
+        aio_read_batch(reqs, node->btn_nkeys);
+
+        toc_entry = toc_start;
+        for (uint32_t i = 0;    i < node->btn_nkeys;    i++, toc_entry++) {
+            omap_key_t* key = key_start + toc_entry->k;
+            omap_val_t* val = val_end   - toc_entry->v;
+            obj_phys_t* block = reqs[i].buffer;
+            if (reqs[i].result != 1) {
+                fprintf(stderr, "\nABORT: read_blocks: Error reading block %#llx.\n", val->ov_paddr);
+                exit(-1);
+            }
+
+            printf(
+                "- %3u:"
+                "  OID = %#9llx"
+                "  ||  XID = %#9llx"
+                "  ||  Target block = %#9llx"
+                "  ||  Target's actual OID = %#9llx (%s)"
+                "  ||  Target's actual XID = %#9llx (%s)\n", 
+                
+                i,
+                key->ok_oid,
+                key->ok_xid,
+                val->ov_paddr,
+                block->o_oid,   (block->o_oid == key->ok_oid ? "YES  " : "   NO"),
+                block->o_xid,   (block->o_xid == key->ok_xid ? "YES  " : "   NO")
+            );
+        }
+        free(blocks);
+        free(reqs);
+    } else {
+        for (uint32_t i = 0;    i < node->btn_nkeys;    i++, toc_entry++) {
+            omap_key_t* key = key_start + toc_entry->k;
+            paddr_t* target_addr = val_end - toc_entry->v;
+
+            printf(
+                "- %3u:"
+                "  OID = %#9llx"
+                "  ||  XID = %#9llx"
+                "  ||  %s = %#9llx\n",
+                
+                i,
+                key->ok_oid,
+                key->ok_xid,
+                (node->btn_flags & BTNODE_LEAF) ? "Target block" : "Child node block",
+                *target_addr
+            );
+        }
+    }
+}
+
+/**
+ * Print a node for `--dump-level`. The blocks that leaf entries map to aren't
+ * read, so that a whole level can be listed quickly.
+ */
+void print_omap_node(btree_node_phys_t* node) {
+    printf("\nNode details:\n");
+    printf("--------------------------------------------------------------------------------\n");
+    print_btree_node_phys(node);
+    printf("--------------------------------------------------------------------------------\n");
+    print_omap_node_entries(node, false);
 }
 
 int main(int argc, char** argv) {
     printf("\n");
 
     // Extrapolate CLI arguments, exit if invalid
+    if (!parse_explore_options(&argc, argv) || !parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
     if (argc != 3) {
         printf("Incorrect number of arguments.\n");
         print_usage(argv[0]);
@@ -56,6 +183,7 @@ int main(int argc, char** argv) {
         return -errno;
     }
     printf("OK.\n\n");
+    detect_block_size();
 
     // Read the specified root node
     printf("Reading block 0x%llx ... ", root_node_block_addr);
@@ -78,6 +206,12 @@ int main(int argc, char** argv) {
     }
     printf("\n");
 
+    if (explore_dump_level >= 0) {
+        uint64_t num_printed = explore_dump_levels(root_node_block_addr, get_omap_child_addr, print_omap_node);
+        printf("\nEND: Printed %llu nodes.\n", num_printed);
+        return 0;
+    }
+
     // Allocate space for the current working node,
     // then copy the root node to this space.
     btree_node_phys_t* node = malloc(nx_block_size);
@@ -87,22 +221,6 @@ int main(int argc, char** argv) {
     }
     memcpy(node, root_node, nx_block_size);
 
-    // Pointers to areas of the node
-    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
-    char* key_start = toc_start + node->btn_table_space.len;
-    char* val_end   = (char*)node + nx_block_size;
-    if (node->btn_flags & BTNODE_ROOT) {
-        val_end -= sizeof(btree_info_t);
-    }
-
-    // // Copy the B-tree info somewhere else for easy referencing
-    // btree_info_t* bt_info = malloc(sizeof(btree_info_t));
-    // if (!bt_info) {
-    //     fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `bt_info`.\n");
-    //     return -1;
-    // }
-    // memcpy(bt_info, val_end, sizeof(btree_info_t));
-
     // Descend the tree
     while (true) {
         if (!(node->btn_flags & BTNODE_FIXED_KV_SIZE)) {
@@ -110,65 +228,17 @@ int main(int argc, char** argv) {
             return 0;
         }
 
-        printf("\nNode has %u entries, as follows:\n", node->btn_nkeys);
-        kvoff_t* toc_entry = toc_start;
-        // Print mapped block's details if explroing a leaf node
-        if (node->btn_flags & BTNODE_LEAF) {
-            obj_phys_t* block = malloc(nx_block_size);
-            if (!block) {
-                fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `block`.\n");
-                return -1;
-            }
-            for (uint32_t i = 0;    i < node->btn_nkeys;    i++, toc_entry++) {
-                omap_key_t* key = key_start + toc_entry->k;
-                omap_val_t* val = val_end   - toc_entry->v;
-                if (read_blocks(block, val->ov_paddr, 1) != 1) {
-                    fprintf(stderr, "\nABORT: read_blocks: Error reading block %#llx.\n", val->ov_paddr);
-                    return -1;
-                }
-
-                printf(
-                    "- %3u:"
-                    "  OID = %#9llx"
-                    "  ||  XID = %#9llx"
-                    "  ||  Target block = %#9llx"
-                    "  ||  Target's actual OID = %#9llx (%s)"
-                    "  ||  Target's actual XID = %#9llx (%s)\n", 
-                    
-                    i,
-                    key->ok_oid,
-                    key->ok_xid,
-                    val->ov_paddr,
-                    block->o_oid,   (block->o_oid == key->ok_oid ? "YES  " : "   NO"),
-                    block->o_xid,   (block->o_xid == key->ok_xid ? "YES  " : "   NO")
-                );
-            }
-            free(block);
-        } else {
-            for (uint32_t i = 0;    i < node->btn_nkeys;    i++, toc_entry++) {
-                omap_key_t* key = key_start + toc_entry->k;
-
-                printf(
-                    "- %3u:"
-                    "  OID = %#9llx"
-                    "  ||  XID = %#9llx\n",
-                    
-                    i,
-                    key->ok_oid,
-                    key->ok_xid
-                );
-            }
-        } 
+        print_omap_node_entries(node, true);
         
-        uint32_t entry_index;
-        printf("Choose an entry [0-%u]: ", node->btn_nkeys - 1);
-        scanf("%u", &entry_index);
-        while (entry_index >= node->btn_nkeys) {
-            printf("Invalid choice; choose an entry [0-%u]: ", node->btn_nkeys - 1);
-            scanf("%u", &entry_index);
+        uint32_t entry_index = explore_choose_entry(node, get_omap_key);
+        if (entry_index == EXPLORE_NO_ENTRY) {
+            return 0;
         }
 
-        toc_entry = (kvoff_t*)toc_start + entry_index;
+        char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+        char* key_start = toc_start + node->btn_table_space.len;
+        char* val_end   = get_val_end(node);
+        kvoff_t* toc_entry = (kvoff_t*)toc_start + entry_index;
 
         // If this is a leaf node, output the object map value
         if (node->btn_flags & BTNODE_LEAF) {
@@ -183,11 +253,11 @@ int main(int argc, char** argv) {
         }
 
         // Else, read the corresponding child node into `node` and loop
-        paddr_t* child_node_addr = val_end - toc_entry->v;
+        paddr_t child_node_addr = *(paddr_t*)(val_end - toc_entry->v);
 
-        printf("Child node resides at adress 0x%llx. Reading ... ", *child_node_addr);
-        if (read_blocks(node, *child_node_addr, 1) != 1) {
-            fprintf(stderr, "\nABORT: Failed to read block 0x%llx.\n", *child_node_addr);
+        printf("Child node resides at adress 0x%llx. Reading ... ", child_node_addr);
+        if (read_blocks(node, child_node_addr, 1) != 1) {
+            fprintf(stderr, "\nABORT: Failed to read block 0x%llx.\n", child_node_addr);
             return -1;
         }
 
@@ -197,10 +267,6 @@ int main(int argc, char** argv) {
         } else {
             printf("FAILED.\n");
         }
-
-        toc_start = (char*)(node->btn_data) + node->btn_table_space.off;
-        key_start = toc_start + node->btn_table_space.len;
-        val_end   = (char*)node + nx_block_size;    // Always dealing with non-root node here
     }
     
     return 0;
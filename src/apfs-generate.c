@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <sys/errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apfs/io.h"
+#include "apfs/options.h"
+#include "apfs/func/generate.h"
+
+/**
+ * Print usage info for this program.
+ */
+void print_usage(char* program_name) {
+    printf("Usage:   %s [options] <output image>\nExample: %s --volumes=2 --depth=4 --files=100 synthetic.img\n\n", program_name, program_name);
+    printf("Generation options:\n");
+    printf("  --volumes=N         Create N volumes (default: %u).\n", gen_params.num_volumes);
+    printf("  --depth=N           Nest subdirectories N levels below each volume's root (default: %u).\n", gen_params.depth);
+    printf("  --subdirs=N         Create N subdirectories in each directory (default: %u).\n", gen_params.subdirs_per_dir);
+    printf("  --files=N           Create N files in each directory (default: %u).\n", gen_params.files_per_dir);
+    printf("  --clones=N          Create N clones of the first file in each directory (default: %u).\n", gen_params.clones_per_dir);
+    printf("  --file-blocks=N     Give each file N blocks of data (default: %u).\n", gen_params.file_blocks);
+    printf("  --extents=N         Split each file's data into N discontiguous extents (default: %u).\n", gen_params.extents_per_file);
+    printf("  --fanout=N          Put at most N entries in each B-tree node, rather than filling them.\n");
+    printf("  --checkpoints=N     Write N checkpoints (default: %u).\n", gen_params.num_checkpoints);
+    printf("  --snapshots=N       Take N snapshots of each volume (default: %u).\n", gen_params.num_snapshots);
+    printf("  --blocks=N          Make the container N blocks long, rather than as small as possible.\n");
+    printf("  --seed=N            Derive UUIDs and file data from N (default: %llu).\n", gen_params.seed);
+    printf("  --fill              Write file data; otherwise it is left as holes in a sparse image.\n");
+    printf("\n");
+    print_common_options_usage(stdout);
+}
+
+/**
+ * Parse and remove the options specific to this program from the argument
+ * list; see `parse_common_options()`.
+ */
+bool parse_generate_options(int* argc, char** argv) {
+    struct {
+        const char* name;
+        uint32_t*   value;
+        bool        zero_allowed;
+    } uint32_options[] = {
+        { "--volumes=",     &gen_params.num_volumes,        false },
+        { "--depth=",       &gen_params.depth,              true  },
+        { "--subdirs=",     &gen_params.subdirs_per_dir,    true  },
+        { "--files=",       &gen_params.files_per_dir,      true  },
+        { "--clones=",      &gen_params.clones_per_dir,     true  },
+        { "--file-blocks=", &gen_params.file_blocks,        true  },
+        { "--extents=",     &gen_params.extents_per_file,   false },
+        { "--fanout=",      &gen_params.fanout,             false },
+        { "--checkpoints=", &gen_params.num_checkpoints,    false },
+        { "--snapshots=",   &gen_params.num_snapshots,      true  },
+    };
+    size_t num_uint32_options = sizeof(uint32_options) / sizeof(uint32_options[0]);
+
+    int num_kept = 1;
+    for (int i = 1; i < *argc; i++) {
+        char* arg = argv[i];
+        if (strcmp(arg, "--") == 0) {
+            // Leave the rest for `parse_common_options()`
+            while (i < *argc) {
+                argv[num_kept++] = argv[i++];
+            }
+            break;
+        }
+
+        bool matched = false;
+        for (size_t j = 0; j < num_uint32_options; j++) {
+            size_t len = strlen(uint32_options[j].name);
+            if (strncmp(arg, uint32_options[j].name, len) != 0) {
+                continue;
+            }
+            bool valid = uint32_options[j].zero_allowed
+                ? parse_option_uint32_or_zero(arg + len, uint32_options[j].value)
+                : parse_option_uint32(arg + len, uint32_options[j].value);
+            if (!valid) {
+                fprintf(stderr, "Option `%.*s` requires a %s integer value.\n",
+                    (int)(len - 1), uint32_options[j].name,
+                    uint32_options[j].zero_allowed ? "non-negative" : "positive"
+                );
+                return false;
+            }
+            matched = true;
+            break;
+        }
+        if (matched) {
+            continue;
+        }
+
+        if (strncmp(arg, "--blocks=", 9) == 0) {
+            if (!parse_option_uint64(arg + 9, &gen_params.block_count) || gen_params.block_count == 0) {
+                fprintf(stderr, "Option `--blocks` requires a positive integer value.\n");
+                return false;
+            }
+        } else if (strncmp(arg, "--seed=", 7) == 0) {
+            if (!parse_option_uint64(arg + 7, &gen_params.seed)) {
+                fprintf(stderr, "Option `--seed` requires a non-negative integer value.\n");
+                return false;
+            }
+        } else if (strcmp(arg, "--fill") == 0) {
+            gen_params.fill_data = true;
+        } else {
+            argv[num_kept++] = arg;
+        }
+    }
+
+    argv[num_kept] = NULL;
+    *argc = num_kept;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    setbuf(stdout, NULL);
+    printf("\n");
+
+    // Extrapolate CLI arguments, exit if invalid
+    if (!parse_generate_options(&argc, argv) || !parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (argc != 2) {
+        printf("Incorrect number of arguments.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    char* image_path = argv[1];
+
+    printf("Generating a container with %zu-byte blocks at `%s` ... ", nx_block_size, image_path);
+    stats_phase("generate");
+    uint64_t block_count = generate_container(image_path);
+    stats_phase(NULL);
+    printf("OK.\n\n");
+
+    printf("- Volumes:                  %u\n", gen_params.num_volumes);
+    printf("- Inodes per volume:        %llu\n", gen_num_objects);
+    printf("- Records:                  %llu\n", gen_num_records);
+    printf("- B-tree nodes:             %llu\n", gen_num_nodes);
+    printf("- File data blocks:         %llu%s\n", gen_num_data_blocks, gen_params.fill_data ? "" : " (holes)");
+    printf("- Container size:           %llu blocks (%llu bytes)\n", block_count, block_count * nx_block_size);
+    printf("\n");
+    return 0;
+}
@@ -0,0 +1,753 @@
+#include <stdio.h>
+#include <sys/errno.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "apfs/io.h"
+#include "apfs/io/async.h"
+#include "apfs/io/direct.h"
+#include "apfs/options.h"
+#include "apfs/func/boolean.h"
+#include "apfs/func/cksum.h"
+#include "apfs/func/btree.h"
+
+#include "apfs/struct/object.h"
+#include "apfs/struct/nx.h"
+#include "apfs/struct/omap.h"
+#include "apfs/struct/fs.h"
+
+#include "apfs/struct/j.h"
+#include "apfs/struct/dstream.h"
+
+#include "apfs/string/progress.h"
+
+/**
+ * A range of blocks to be copied into the image.
+ */
+typedef struct {
+    paddr_t     start;
+    uint64_t    count;
+} block_range_t;
+
+block_range_t*  ranges = NULL;
+size_t          num_ranges = 0;
+size_t          ranges_capacity = 0;
+
+// Blocks on the second tier of a Fusion container can't be placed in the
+// image, which has the layout of the main device; they are only counted.
+uint64_t        num_tier2_blocks = 0;
+
+// Ranges separated by at most this many blocks are read as one, since reading
+// a few unwanted blocks costs less than issuing another request.
+uint64_t        merge_gap_blocks = 32;
+
+/**
+ * Print usage info for this program.
+ */
+void print_usage(char* program_name) {
+    printf("Usage:   %s [options] <container> <output image> [<volume ID>:<path in volume> ...]\nExample: %s /dev/disk0s2 disk0s2.img 0:/Users/john/Documents 0:/etc/hosts\n\n", program_name, program_name);
+    print_common_options_usage(stdout);
+}
+
+/**
+ * Add a range of blocks to the list of blocks to be copied.
+ */
+void add_range(paddr_t start, uint64_t count) {
+    if (count == 0) {
+        return;
+    }
+    if (is_tier2_addr(start)) {
+        num_tier2_blocks += count;
+        return;
+    }
+    if (num_ranges == ranges_capacity) {
+        ranges_capacity = ranges_capacity ? 2 * ranges_capacity : 1024;
+        ranges = realloc(ranges, ranges_capacity * sizeof(block_range_t));
+        if (!ranges) {
+            fprintf(stderr, "\nABORT: add_range: Could not allocate sufficient memory for `ranges`.\n");
+            exit(-1);
+        }
+    }
+    ranges[num_ranges].start = start;
+    ranges[num_ranges].count = count;
+    num_ranges++;
+}
+
+int compare_ranges(const void* a, const void* b) {
+    paddr_t start_a = ((block_range_t*)a)->start;
+    paddr_t start_b = ((block_range_t*)b)->start;
+    return start_a < start_b ? -1 : (start_a > start_b ? 1 : 0);
+}
+
+/**
+ * Add every node of a B-tree to the list of blocks to be copied. The tree is
+ * walked one level at a time, and the nodes of each level are read together,
+ * in address order.
+ *
+ * description:     A description of the tree, used in messages.
+ *
+ * root_addr:       The block address of the root node.
+ *
+ * omap_root_node:  If the tree refers to its child nodes by Virtual OID, the
+ *      root node of the object map used to resolve them; else NULL.
+ *
+ * max_xid:         The highest XID to consider when resolving Virtual OIDs.
+ *
+ * encrypted:       If true, the nodes are encrypted with the key of the
+ *      volume that is currently unlocked, and are decrypted before use. The
+ *      blocks are still copied to the image as they are on disk.
+ *
+ * RETURN VALUE:    The number of nodes found.
+ */
+uint64_t collect_btree(char* description, paddr_t root_addr, btree_node_phys_t* omap_root_node, xid_t max_xid, bool encrypted) {
+    size_t level_len = 1;
+    paddr_t* level = malloc(sizeof(paddr_t));
+    if (!level) {
+        fprintf(stderr, "\nABORT: collect_btree: Could not allocate sufficient memory for `level`.\n");
+        exit(-1);
+    }
+    level[0] = root_addr;
+    uint64_t num_nodes = 0;
+
+    while (level_len > 0) {
+        qsort(level, level_len, sizeof(paddr_t), compare_paddrs);
+
+        aio_req_t* reqs = calloc(level_len, sizeof(aio_req_t));
+        char* nodes = malloc(level_len * nx_block_size);
+        if (!reqs || !nodes) {
+            fprintf(stderr, "\nABORT: collect_btree: Could not allocate sufficient memory for %lu nodes.\n", level_len);
+            exit(-1);
+        }
+        for (size_t i = 0; i < level_len; i++) {
+            reqs[i].buffer      = nodes + i * nx_block_size;
+            reqs[i].start_block = level[i];
+            reqs[i].num_blocks  = 1;
+            add_range(level[i], 1);
+        }
+        aio_read_batch(reqs, level_len);
+        num_nodes += level_len;
+
+        size_t next_len = 0;
+        size_t next_capacity = 0;
+        paddr_t* next = NULL;
+
+        for (size_t i = 0; i < level_len; i++) {
+            btree_node_phys_t* node = reqs[i].buffer;
+            if (encrypted && reqs[i].result == 1) {
+                decrypt_metadata_blocks(node, level[i], 1);
+            }
+            if (reqs[i].result != 1 || !is_cksum_valid(node) || !is_btree_node_phys(node)) {
+                printf("- %s: Node at block %#llx is unreadable or invalid; not descending it.\n", description, level[i]);
+                continue;
+            }
+            if (node->btn_flags & BTNODE_LEAF) {
+                continue;
+            }
+
+            char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+            char* val_end   = (char*)node + nx_block_size;
+            if (node->btn_flags & BTNODE_ROOT) {
+                val_end -= sizeof(btree_info_t);
+            }
+
+            for (uint32_t j = 0; j < node->btn_nkeys; j++) {
+                oid_t child_oid = (node->btn_flags & BTNODE_FIXED_KV_SIZE)
+                    ? *(oid_t*)(val_end - ((kvoff_t*)toc_start)[j].v)
+                    : *(oid_t*)(val_end - ((kvloc_t*)toc_start)[j].v.off);
+
+                paddr_t child_addr = child_oid;
+                if (omap_root_node) {
+                    omap_val_t* child_omap_val = get_btree_phys_omap_val(omap_root_node, child_oid, max_xid);
+                    if (!child_omap_val) {
+                        printf("- %s: Child node with Virtual OID %#llx is not in the object map; not descending it.\n", description, child_oid);
+                        continue;
+                    }
+                    child_addr = child_omap_val->ov_paddr;
+                    free(child_omap_val);
+                }
+
+                if (next_len == next_capacity) {
+                    next_capacity = next_capacity ? 2 * next_capacity : 256;
+                    next = realloc(next, next_capacity * sizeof(paddr_t));
+                    if (!next) {
+                        fprintf(stderr, "\nABORT: collect_btree: Could not allocate sufficient memory for `next`.\n");
+                        exit(-1);
+                    }
+                }
+                next[next_len++] = child_addr;
+            }
+        }
+
+        free(nodes);
+        free(reqs);
+        free(level);
+        level = next;
+        level_len = next_len;
+    }
+
+    free(level);
+    printf("- %s: %llu nodes.\n", description, num_nodes);
+    return num_nodes;
+}
+
+/**
+ * Read a single object into a newly allocated buffer and check that it is
+ * valid.
+ *
+ * RETURN VALUE:    A pointer to the object, which must be freed when no longer
+ *      needed, or NULL if it could not be read or is invalid.
+ */
+void* read_object(char* description, paddr_t addr) {
+    obj_phys_t* obj = malloc(nx_block_size);
+    if (!obj) {
+        fprintf(stderr, "\nABORT: read_object: Could not allocate sufficient memory for `obj`.\n");
+        exit(-1);
+    }
+    if (read_blocks(obj, addr, 1) != 1 || !is_cksum_valid(obj)) {
+        printf("- %s at block %#llx is unreadable or invalid.\n", description, addr);
+        free(obj);
+        return NULL;
+    }
+    add_range(addr, 1);
+    return obj;
+}
+
+/**
+ * Look up the file-system object at a given path in a volume.
+ *
+ * RETURN VALUE:    The file-system object ID, or 0 if the path doesn't exist.
+ */
+oid_t resolve_path(btree_node_phys_t* fs_omap_btree, btree_node_phys_t* fs_root_btree, char* path_stack) {
+    oid_t fs_oid = 0x2;     // The root directory
+
+    char* path = malloc(strlen(path_stack) + 1);
+    if (!path) {
+        fprintf(stderr, "\nABORT: resolve_path: Could not allocate sufficient memory for `path`.\n");
+        exit(-1);
+    }
+    memcpy(path, path_stack, strlen(path_stack) + 1);
+    char* path_start = path;
+
+    char* path_element;
+    while ( (path_element = strsep(&path, "/")) != NULL ) {
+        // If path element is empty string, skip it
+        if (*path_element == '\0') {
+            continue;
+        }
+
+        j_rec_t** fs_records = get_fs_records(fs_omap_btree, fs_root_btree, fs_oid, (xid_t)(~0) );
+        if (!fs_records) {
+            free(path_start);
+            return 0;
+        }
+
+        oid_t next_oid = 0;
+        for (j_rec_t** fs_rec_cursor = fs_records; *fs_rec_cursor; fs_rec_cursor++) {
+            j_rec_t* fs_rec = *fs_rec_cursor;
+            j_key_t* hdr = fs_rec->data;
+            if ( ((hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT)  ==  APFS_TYPE_DIR_REC ) {
+                j_drec_hashed_key_t* key = fs_rec->data;
+                if (strcmp((char*)key->name, path_element) == 0) {
+                    next_oid = ((j_drec_val_t*)(fs_rec->data + fs_rec->key_len))->file_id;
+                    break;
+                }
+            }
+        }
+        free_j_rec_array(fs_records);
+
+        if (next_oid == 0) {
+            free(path_start);
+            return 0;
+        }
+        fs_oid = next_oid;
+    }
+
+    free(path_start);
+    return fs_oid;
+}
+
+/**
+ * Add the file extents of a file-system object to the list of blocks to be
+ * copied. If the object is a directory, do the same for everything beneath it.
+ *
+ * RETURN VALUE:    The number of blocks of file extents added.
+ */
+uint64_t collect_file_extents(btree_node_phys_t* fs_omap_btree, btree_node_phys_t* fs_root_btree, oid_t fs_oid) {
+    uint64_t num_blocks = 0;
+
+    size_t stack_len = 1;
+    size_t stack_capacity = 64;
+    oid_t* stack = malloc(stack_capacity * sizeof(oid_t));
+    if (!stack) {
+        fprintf(stderr, "\nABORT: collect_file_extents: Could not allocate sufficient memory for `stack`.\n");
+        exit(-1);
+    }
+    stack[0] = fs_oid;
+
+    while (stack_len > 0) {
+        oid_t oid = stack[--stack_len];
+        j_rec_t** fs_records = get_fs_records(fs_omap_btree, fs_root_btree, oid, (xid_t)(~0) );
+        if (!fs_records) {
+            continue;
+        }
+
+        for (j_rec_t** fs_rec_cursor = fs_records; *fs_rec_cursor; fs_rec_cursor++) {
+            j_rec_t* fs_rec = *fs_rec_cursor;
+            j_key_t* hdr = fs_rec->data;
+            uint8_t type = (hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT;
+
+            if (type == APFS_TYPE_FILE_EXTENT) {
+                j_file_extent_val_t* val = fs_rec->data + fs_rec->key_len;
+                uint64_t extent_len_blocks = ((val->len_and_flags & J_FILE_EXTENT_LEN_MASK) + nx_block_size - 1) / nx_block_size;
+                if (val->phys_block_num != 0) {     // Block 0 denotes a sparse extent
+                    add_range(val->phys_block_num, extent_len_blocks);
+                    num_blocks += extent_len_blocks;
+                }
+            } else if (type == APFS_TYPE_DIR_REC) {
+                if (stack_len == stack_capacity) {
+                    stack_capacity *= 2;
+                    stack = realloc(stack, stack_capacity * sizeof(oid_t));
+                    if (!stack) {
+                        fprintf(stderr, "\nABORT: collect_file_extents: Could not allocate sufficient memory for `stack`.\n");
+                        exit(-1);
+                    }
+                }
+                stack[stack_len++] = ((j_drec_val_t*)(fs_rec->data + fs_rec->key_len))->file_id;
+            }
+        }
+        free_j_rec_array(fs_records);
+    }
+
+    free(stack);
+    return num_blocks;
+}
+
+/**
+ * Sort the list of ranges and merge ranges that overlap or lie within
+ * `merge_gap_blocks` of each other.
+ */
+void coalesce_ranges() {
+    if (num_ranges == 0) {
+        return;
+    }
+    qsort(ranges, num_ranges, sizeof(block_range_t), compare_ranges);
+
+    size_t num_merged = 1;
+    for (size_t i = 1; i < num_ranges; i++) {
+        block_range_t* last = ranges + num_merged - 1;
+        uint64_t last_end = last->start + last->count;
+        if ((uint64_t)ranges[i].start <= last_end + merge_gap_blocks) {
+            uint64_t end = ranges[i].start + ranges[i].count;
+            if (end > last_end) {
+                last->count = end - last->start;
+            }
+        } else {
+            ranges[num_merged++] = ranges[i];
+        }
+    }
+    num_ranges = num_merged;
+}
+
+/**
+ * Write a completed read to the output image at the same offset.
+ */
+void write_to_image(int image_fd, aio_req_t* req) {
+    size_t num_bytes = req->result * nx_block_size;
+    off_t offset = (off_t)req->start_block * nx_block_size;
+    size_t num_written = 0;
+    while (num_written < num_bytes) {
+        ssize_t ret = pwrite(image_fd, (char*)req->buffer + num_written, num_bytes - num_written, offset + num_written);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            fprintf(stderr, "\nABORT: Failed to write blocks %#llx to %#llx to the image (%s).\n", req->start_block, req->start_block + req->result - 1, strerror(errno));
+            exit(-1);
+        }
+        num_written += ret;
+    }
+}
+
+int main(int argc, char** argv) {
+    setbuf(stdout, NULL);
+    printf("\n");
+
+    // Extrapolate CLI arguments, exit if invalid
+    if (!parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (argc < 3) {
+        printf("Incorrect number of arguments.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    nx_path = argv[1];
+    char* image_path = argv[2];
+
+    // Check the requested paths before doing anything
+    for (int i = 3; i < argc; i++) {
+        uint32_t volume_id;
+        int path_offset = 0;
+        if (sscanf(argv[i], "%u:%n", &volume_id, &path_offset) != 1 || path_offset == 0) {
+            printf("`%s` is not of the form `<volume ID>:<path in volume>`.\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Open (device special) file corresponding to an APFS container, read-only
+    printf("Opening file at `%s` in read-only mode ... ", nx_path);
+    nx = fopen(nx_path, "rb");
+    if (!nx) {
+        fprintf(stderr, "\nABORT: ");
+        report_fopen_error();
+        printf("\n");
+        return -errno;
+    }
+    printf("OK.\n");
+    detect_block_size();
+
+    nx_superblock_t* nxsb = malloc(nx_block_size);
+    if (!nxsb) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `nxsb`.\n");
+        return -1;
+    }
+    if (read_blocks(nxsb, 0x0, 1) != 1) {
+        fprintf(stderr, "\nABORT: Failed to read block 0x0.\n");
+        return -1;
+    }
+    if (!is_cksum_valid(nxsb) || !is_nx_superblock(nxsb) || nxsb->nx_magic != NX_MAGIC) {
+        printf("!! APFS ERROR !! Block 0x0 is not a valid container superblock. Proceeding as if it is.\n");
+    }
+    uint64_t nx_block_count = nxsb->nx_block_count;
+    add_range(0x0, 1);
+
+    /** Checkpoint areas **/
+
+    stats_phase("collect");
+    printf("\nCollecting the blocks to copy:\n");
+
+    uint32_t xp_desc_blocks = nxsb->nx_xp_desc_blocks & ~(1 << 31);
+    uint32_t xp_data_blocks = nxsb->nx_xp_data_blocks & ~(1 << 31);
+    if ((nxsb->nx_xp_desc_blocks >> 31) || (nxsb->nx_xp_data_blocks >> 31)) {
+        // TODO: Handle non-contiguous checkpoint areas
+        fprintf(stderr, "\nABORT: The checkpoint areas are not contiguous; the ability to handle this case has not yet been implemented.\n");
+        return -1;
+    }
+    add_range(nxsb->nx_xp_desc_base, xp_desc_blocks);
+    add_range(nxsb->nx_xp_data_base, xp_data_blocks);
+    printf("- Checkpoint descriptor area: %u blocks.\n", xp_desc_blocks);
+    printf("- Checkpoint data area: %u blocks.\n", xp_data_blocks);
+
+    // Find the latest container superblock in the checkpoint descriptor area
+    char (*xp_desc)[nx_block_size] = malloc(xp_desc_blocks * nx_block_size);
+    if (!xp_desc) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for %u blocks.\n", xp_desc_blocks);
+        return -1;
+    }
+    if (read_blocks(xp_desc, nxsb->nx_xp_desc_base, xp_desc_blocks) != xp_desc_blocks) {
+        fprintf(stderr, "\nABORT: Failed to read all blocks in the checkpoint descriptor area.\n");
+        return -1;
+    }
+
+    xid_t xid_latest_nx = 0;
+    for (uint32_t i = 0; i < xp_desc_blocks; i++) {
+        nx_superblock_t* candidate = xp_desc[i];
+        if (is_cksum_valid(candidate) && is_nx_superblock(candidate) && candidate->nx_magic == NX_MAGIC
+            && candidate->nx_o.o_xid > xid_latest_nx
+        ) {
+            xid_latest_nx = candidate->nx_o.o_xid;
+            memcpy(nxsb, candidate, sizeof(nx_superblock_t));
+        }
+    }
+    free(xp_desc);
+    if (xid_latest_nx == 0) {
+        fprintf(stderr, "\nABORT: There is no valid container superblock in the checkpoint descriptor area.\n");
+        return -1;
+    }
+
+    /** Container-wide structures **/
+
+    if (nxsb->nx_keylocker.pr_start_paddr != 0) {
+        add_range(nxsb->nx_keylocker.pr_start_paddr, nxsb->nx_keylocker.pr_block_count);
+        printf("- Container keybag: %llu blocks.\n", nxsb->nx_keylocker.pr_block_count);
+    }
+    if (nxsb->nx_fusion_mt_oid != 0) {
+        collect_btree("Fusion middle tree", nxsb->nx_fusion_mt_oid, NULL, 0, false);
+    }
+
+    omap_phys_t* nx_omap = read_object("Container object map", nxsb->nx_omap_oid);
+    if (!nx_omap) {
+        fprintf(stderr, "\nABORT: The container object map is needed in order to find the volumes.\n");
+        return -1;
+    }
+    collect_btree("Container object map B-tree", nx_omap->om_tree_oid, NULL, 0, false);
+    if (nx_omap->om_snapshot_tree_oid != 0) {
+        collect_btree("Container object map snapshot tree", nx_omap->om_snapshot_tree_oid, NULL, 0, false);
+    }
+
+    btree_node_phys_t* nx_omap_btree = malloc(nx_block_size);
+    if (!nx_omap_btree) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `nx_omap_btree`.\n");
+        return -1;
+    }
+    if (read_blocks_cached(nx_omap_btree, nx_omap->om_tree_oid, 1) != 1) {
+        fprintf(stderr, "\nABORT: Failed to read block %#llx.\n", nx_omap->om_tree_oid);
+        return -1;
+    }
+
+    /** Volumes **/
+
+    uint32_t num_file_systems = 0;
+    for (uint32_t i = 0; i < NX_MAX_FILE_SYSTEMS; i++) {
+        if (nxsb->nx_fs_oid[i] == 0) {
+            break;
+        }
+        num_file_systems++;
+    }
+
+    btree_node_phys_t** fs_omap_btrees = calloc(num_file_systems, sizeof(btree_node_phys_t*));
+    btree_node_phys_t** fs_root_btrees = calloc(num_file_systems, sizeof(btree_node_phys_t*));
+    aes_xts_key_t* volume_keys = calloc(num_file_systems, sizeof(aes_xts_key_t));
+    if (!fs_omap_btrees || !fs_root_btrees || !volume_keys) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for the volumes' B-trees.\n");
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < num_file_systems; i++) {
+        printf("Volume %u:\n", i);
+
+        omap_val_t* fs_val = get_btree_phys_omap_val(nx_omap_btree, nxsb->nx_fs_oid[i], nxsb->nx_o.o_xid);
+        if (!fs_val) {
+            printf("- Its superblock (Virtual OID %#llx) is not in the container object map; skipping it.\n", nxsb->nx_fs_oid[i]);
+            continue;
+        }
+        apfs_superblock_t* apsb = read_object("Volume superblock", fs_val->ov_paddr);
+        free(fs_val);
+        if (!apsb) {
+            continue;
+        }
+        printf("- Name: %s\n", apsb->apfs_volname);
+
+        prange_t keybag_location;
+        if (!(apsb->apfs_fs_flags & APFS_FS_UNENCRYPTED) && nxsb->nx_keylocker.pr_start_paddr != 0
+            && get_volume_keybag_location(nxsb, apsb->apfs_vol_uuid, &keybag_location)) {
+            add_range(keybag_location.pr_start_paddr, keybag_location.pr_block_count);
+            printf("- Volume keybag: %llu blocks.\n", keybag_location.pr_block_count);
+        }
+
+        omap_phys_t* fs_omap = read_object("Volume object map", apsb->apfs_omap_oid);
+        if (!fs_omap) {
+            free(apsb);
+            continue;
+        }
+        collect_btree("Volume object map B-tree", fs_omap->om_tree_oid, NULL, 0, false);
+        if (fs_omap->om_snapshot_tree_oid != 0) {
+            collect_btree("Volume object map snapshot tree", fs_omap->om_snapshot_tree_oid, NULL, 0, false);
+        }
+        if (apsb->apfs_extentref_tree_oid != 0) {
+            collect_btree("Extent-reference tree", apsb->apfs_extentref_tree_oid, NULL, 0, false);
+        }
+        if (apsb->apfs_snap_meta_tree_oid != 0) {
+            collect_btree("Snapshot metadata tree", apsb->apfs_snap_meta_tree_oid, NULL, 0, false);
+        }
+
+        fs_omap_btrees[i] = malloc(nx_block_size);
+        if (!fs_omap_btrees[i]) {
+            fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `fs_omap_btrees[%u]`.\n", i);
+            return -1;
+        }
+        if (read_blocks_cached(fs_omap_btrees[i], fs_omap->om_tree_oid, 1) != 1) {
+            free(fs_omap_btrees[i]);
+            fs_omap_btrees[i] = NULL;
+            free(fs_omap);
+            free(apsb);
+            continue;
+        }
+
+        omap_val_t* fs_root_val = get_btree_phys_omap_val(fs_omap_btrees[i], apsb->apfs_root_tree_oid, apsb->apfs_o.o_xid);
+        if (!fs_root_val) {
+            printf("- Its file-system root tree (Virtual OID %#llx) is not in the volume object map.\n", apsb->apfs_root_tree_oid);
+        } else if ((fs_root_val->ov_flags & OMAP_VAL_ENCRYPTED) && !unlock_volume(nxsb, apsb)) {
+            printf("- It is encrypted and could not be unlocked, so its file-system tree will not be copied.\n");
+            free(fs_root_val);
+        } else {
+            bool encrypted = fs_root_val->ov_flags & OMAP_VAL_ENCRYPTED;
+            if (encrypted) {
+                volume_keys[i] = crypto_vek;
+            }
+            collect_btree("File-system root tree", fs_root_val->ov_paddr, fs_omap_btrees[i], apsb->apfs_o.o_xid, encrypted);
+
+            fs_root_btrees[i] = malloc(nx_block_size);
+            if (!fs_root_btrees[i]) {
+                fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `fs_root_btrees[%u]`.\n", i);
+                return -1;
+            }
+            if (read_fs_node_cached(fs_root_btrees[i], fs_root_val) != 1 || !is_cksum_valid(fs_root_btrees[i])) {
+                free(fs_root_btrees[i]);
+                fs_root_btrees[i] = NULL;
+            }
+            free(fs_root_val);
+        }
+
+        free(fs_omap);
+        free(apsb);
+    }
+
+    /** Requested files **/
+
+    int num_failed_paths = 0;
+    for (int i = 3; i < argc; i++) {
+        uint32_t volume_id;
+        int path_offset = 0;
+        sscanf(argv[i], "%u:%n", &volume_id, &path_offset);
+        char* path = argv[i] + path_offset;
+
+        if (volume_id >= num_file_systems || !fs_root_btrees[volume_id]) {
+            printf("- `%s`: Volume %u does not exist or could not be read.\n", argv[i], volume_id);
+            num_failed_paths++;
+            continue;
+        }
+
+        // The volume's key, if it is encrypted; another volume may have been
+        // unlocked since.
+        crypto_vek = volume_keys[volume_id];
+        oid_t fs_oid = resolve_path(fs_omap_btrees[volume_id], fs_root_btrees[volume_id], path);
+        if (fs_oid == 0) {
+            printf("- `%s`: Could not find a dentry for that path.\n", argv[i]);
+            num_failed_paths++;
+            continue;
+        }
+
+        uint64_t num_blocks = collect_file_extents(fs_omap_btrees[volume_id], fs_root_btrees[volume_id], fs_oid);
+        printf("- `%s`: %llu blocks of file extents.\n", argv[i], num_blocks);
+    }
+
+    /** Copy the blocks **/
+
+    coalesce_ranges();
+    uint64_t total_blocks = 0;
+    for (size_t i = 0; i < num_ranges; i++) {
+        total_blocks += ranges[i].count;
+    }
+    if (num_tier2_blocks > 0) {
+        printf("\nNote: %llu blocks lie on the second tier of this Fusion container, and will not be copied.\n", num_tier2_blocks);
+    }
+    stats_phase("copy");
+    printf("\nCopying %llu blocks in %lu runs (out of %llu blocks in the container) to `%s`.\n", total_blocks, num_ranges, nx_block_count, image_path);
+
+    int image_fd = open(image_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (image_fd == -1) {
+        fprintf(stderr, "\nABORT: Could not open `%s` for writing (%s).\n", image_path, strerror(errno));
+        return -1;
+    }
+    // Give the image the same size as the container; blocks that we don't
+    // copy are left as holes, so the image is sparse.
+    if (ftruncate(image_fd, (off_t)nx_block_count * nx_block_size) != 0) {
+        fprintf(stderr, "\nABORT: Could not set the size of `%s` (%s).\n", image_path, strerror(errno));
+        return -1;
+    }
+
+    bool async = aio_init();
+    bool direct = direct_open();
+    uint32_t num_slots = async ? aio_queue_depth : 1;
+    size_t chunk_blocks = scan_chunk_blocks;
+
+    aio_req_t* slots = calloc(num_slots, sizeof(aio_req_t));
+    char* buffers = direct
+        ? direct_alloc((size_t)num_slots * chunk_blocks * nx_block_size)
+        : malloc((size_t)num_slots * chunk_blocks * nx_block_size);
+    aio_req_t** free_slots = malloc(num_slots * sizeof(aio_req_t*));
+    if (!slots || !buffers || !free_slots) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for the copy buffers.\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < num_slots; i++) {
+        slots[i].buffer = buffers + (size_t)i * chunk_blocks * nx_block_size;
+        slots[i].fixed_index = -1;
+        slots[i].direct = direct;
+        slots[i].unmasked = true;
+        free_slots[i] = slots + i;
+    }
+    uint32_t num_free_slots = num_slots;
+
+    size_t range_index = 0;
+    uint64_t range_offset = 0;
+    uint64_t num_copied = 0;
+    uint64_t num_failed = 0;
+
+    progress_t progress;
+    progress_init(&progress, total_blocks);
+    progress.show_matches = false;
+
+    while (range_index < num_ranges || num_free_slots < num_slots) {
+        aio_req_t* req = NULL;
+
+        // Issue reads for as many free slots as possible, in address order
+        while (num_free_slots > 0 && range_index < num_ranges) {
+            aio_req_t* next = free_slots[--num_free_slots];
+            next->start_block = ranges[range_index].start + range_offset;
+            next->num_blocks = ranges[range_index].count - range_offset;
+            if (next->num_blocks > chunk_blocks) {
+                next->num_blocks = chunk_blocks;
+            }
+
+            range_offset += next->num_blocks;
+            if (range_offset == ranges[range_index].count) {
+                range_index++;
+                range_offset = 0;
+            }
+
+            if (!async) {
+                aio_execute(next);
+                req = next;
+                break;
+            }
+            aio_submit(next);
+        }
+        if (!req) {
+            aio_flush();
+            req = aio_wait();
+        }
+        free_slots[num_free_slots++] = req;
+
+        if (req->result == -1) {
+            progress_clear(&progress);
+            fprintf(stderr, "- Failed to read blocks %#llx to %#llx (%s); they are missing from the image.\n",
+                req->start_block, req->start_block + req->num_blocks - 1, strerror(req->error)
+            );
+            num_failed += req->num_blocks;
+        } else {
+            write_to_image(image_fd, req);
+            num_copied += req->result;
+            num_failed += req->num_blocks - req->result;
+        }
+        progress_add_blocks(&progress, req->num_blocks);
+        progress_update(&progress);
+    }
+    progress_clear(&progress);
+
+    if (fsync(image_fd) != 0 || close(image_fd) != 0) {
+        fprintf(stderr, "\nABORT: Failed to finish writing `%s` (%s).\n", image_path, strerror(errno));
+        return -1;
+    }
+
+    printf("\nDone. Copied %llu blocks", num_copied);
+    if (num_failed > 0) {
+        printf("; %llu blocks could not be read", num_failed);
+    }
+    if (io_rescue && rescue_num_bad_blocks + rescue_num_skipped_blocks > 0) {
+        printf("; %llu bad blocks were replaced with zeroes", rescue_num_bad_blocks + rescue_num_skipped_blocks);
+    }
+    printf(".\n\n");
+
+    free(buffers);
+    free(free_slots);
+    free(slots);
+    fclose(nx);
+    return (num_failed > 0 || num_failed_paths > 0) ? 1 : 0;
+}
@@ -5,6 +5,7 @@
 #include <string.h>
 
 #include "apfs/io.h"
+#include "apfs/options.h"
 #include "apfs/func/boolean.h"
 #include "apfs/func/cksum.h"
 #include "apfs/func/btree.h"
@@ -25,19 +26,27 @@
 #include "apfs/string/btree.h"
 #include "apfs/string/fs.h"
 #include "apfs/string/j.h"
+#include "apfs/string/record.h"
 
 /**
  * Print usage info for this program.
  */
 void print_usage(char* program_name) {
-    printf("Usage:   %s <container>\nExample: %s /dev/disk0s2\n\n", program_name, program_name);
+    printf("Usage:   %s [options] <container>\nExample: %s /dev/disk0s2\n\n", program_name, program_name);
+    print_common_options_usage(stdout);
 }
 
 int main(int argc, char** argv) {
-    setbuf(stdout, NULL);
+    set_dump_stdout_buffering();
     printf("\n");
 
+    output_format_supported = true;
+
     // Extrapolate CLI arguments, exit if invalid
+    if (!parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
     if (argc != 2) {
         printf("Incorrect number of arguments.\n");
         print_usage(argv[0]);
@@ -55,6 +64,7 @@ int main(int argc, char** argv) {
         return -errno;
     }
     printf("OK.\nSimulating a mount of the APFS container.\n");
+    detect_block_size();
     
     // Using `nx_superblock_t*`, but allocating a whole block of memory.
     // This way, we can read the entire block and validate its checksum,
@@ -83,6 +93,9 @@ int main(int argc, char** argv) {
     print_nx_superblock(nxsb);
     printf("--------------------------------------------------------------------------------\n");
     printf("\n");
+    if (is_structured_output()) {
+        record_block("block_zero", 0x0, nxsb, is_cksum_valid(nxsb));
+    }
 
     if (!is_nx_superblock(nxsb)) {
         printf("!! APFS ERROR !! Block 0x0 should be a container superblock, but it isn't. Proceeding as if it is.\n\n");
@@ -167,6 +180,9 @@ int main(int argc, char** argv) {
     printf("--------------------------------------------------------------------------------\n");
     print_nx_superblock(nxsb);
     printf("--------------------------------------------------------------------------------\n");
+    if (is_structured_output()) {
+        record_block("container_superblock", nxsb->nx_xp_desc_base + i_latest_nx, nxsb, true);
+    }
     printf("- The corresponding checkpoint starts at index %u within the checkpoint descriptor area, and spans %u blocks.\n\n", nxsb->nx_xp_desc_index, nxsb->nx_xp_desc_len);
 
     // Copy the contents of the checkpoint we are currently considering to its
@@ -211,6 +227,10 @@ int main(int argc, char** argv) {
             print_checkpoint_map_phys(xp[i]);
         }
         printf("--------------------------------------------------------------------------------\n");
+        if (is_structured_output()) {
+            paddr_t addr = nxsb->nx_xp_desc_base + (nxsb->nx_xp_desc_index + i) % xp_desc_blocks;
+            record_block("checkpoint", addr, xp[i], is_cksum_valid(xp[i]));
+        }
     }
 
     uint32_t xp_obj_len = 0;    // This variable will equal the number of
@@ -240,6 +260,9 @@ int main(int argc, char** argv) {
                     fprintf(stderr, "\nABORT: Failed to read block 0x%llx.\n", xp_map->cpm_map[j].cpm_paddr);
                     return -1;
                 }
+                if (is_structured_output()) {
+                    record_block("ephemeral", xp_map->cpm_map[j].cpm_paddr, xp_obj[num_read], is_cksum_valid(xp_obj[num_read]));
+                }
                 num_read++;
             }
         }
@@ -297,6 +320,9 @@ int main(int argc, char** argv) {
     print_omap_phys(nx_omap);
     printf("--------------------------------------------------------------------------------\n");
     printf("\n");
+    if (is_structured_output()) {
+        record_block("container_omap", nxsb->nx_omap_oid, nx_omap, true);
+    }
 
     if ((nx_omap->om_tree_type & OBJ_STORAGETYPE_MASK) != OBJ_PHYSICAL) {
         printf("END: The container object map B-tree is not of the Physical storage type, and therefore it cannot be located.\n");
@@ -327,6 +353,9 @@ int main(int argc, char** argv) {
     print_btree_node_phys(nx_omap_btree);
     printf("--------------------------------------------------------------------------------\n");
     printf("\n");
+    if (is_structured_output()) {
+        record_block("container_omap_tree", nx_omap->om_tree_oid, nx_omap_btree, is_cksum_valid(nx_omap_btree));
+    }
 
     uint32_t num_file_systems = 0;
     for (uint32_t i = 0; i < NX_MAX_FILE_SYSTEMS; i++) {
@@ -357,6 +386,9 @@ int main(int argc, char** argv) {
             fprintf(stderr, "\nABORT: Failed to read block 0x%llx.\n", fs_val->ov_paddr);
             return -1;
         }
+        if (is_structured_output()) {
+            record_block("volume_superblock", fs_val->ov_paddr, apsbs + i, is_cksum_valid(apsbs + i));
+        }
     }
     printf("OK.\n");
 
@@ -426,6 +458,9 @@ int main(int argc, char** argv) {
         print_omap_phys(fs_omap);
         printf("--------------------------------------------------------------------------------\n");
         printf("\n");
+        if (is_structured_output()) {
+            record_block("volume_omap", apsb->apfs_omap_oid, fs_omap, true);
+        }
 
         if ((fs_omap->om_tree_type & OBJ_STORAGETYPE_MASK) != OBJ_PHYSICAL) {
             printf("END: The volume object map B-tree is not of the Physical storage type, and therefore it cannot be located.\n");
@@ -456,6 +491,9 @@ int main(int argc, char** argv) {
         print_btree_node_phys(fs_omap_btree);
         printf("--------------------------------------------------------------------------------\n");
         printf("\n");
+        if (is_structured_output()) {
+            record_block("volume_omap_tree", fs_omap->om_tree_oid, fs_omap_btree, is_cksum_valid(fs_omap_btree));
+        }
 
         printf("The file-system tree root for this volume has Virtual OID 0x%llx.\n", apsb->apfs_root_tree_oid);
         printf("Looking up this Virtual OID in the volume object map ... ");
@@ -476,6 +514,9 @@ int main(int argc, char** argv) {
             fprintf(stderr, "\nABORT: Failed to read block 0x%llx.\n", fs_root_val->ov_paddr);
             return -1;
         }
+        if (is_structured_output()) {
+            record_block("fs_tree", fs_root_val->ov_paddr, fs_root_btree, is_cksum_valid(fs_root_btree));
+        }
         free(fs_root_val);  // No longer need the block address of the file-system root.
         printf("validating ... ");
         if (!is_cksum_valid(fs_root_btree)) {
@@ -524,6 +565,9 @@ int main(int argc, char** argv) {
                 j_rec_t* fs_rec = *fs_rec_cursor;
 
                 j_key_t* hdr = fs_rec->data;
+                if (is_structured_output()) {
+                    record_fs_record(fs_rec->data, fs_rec->data + fs_rec->key_len, fs_rec->val_len);
+                }
                 // printf("Key size:           %u bytes\n",    fs_rec->key_len);
                 // printf("Value size:         %u bytes\n",    fs_rec->val_len);
                 // printf("ID and type field:  0x%016llx\n",   hdr->obj_id_and_type);
@@ -5,6 +5,7 @@
 #include <string.h>
 
 #include "apfs/io.h"
+#include "apfs/options.h"
 #include "apfs/func/boolean.h"
 #include "apfs/func/cksum.h"
 #include "apfs/func/btree.h"
@@ -25,12 +26,14 @@
 #include "apfs/string/btree.h"
 #include "apfs/string/fs.h"
 #include "apfs/string/j.h"
+#include "apfs/string/record.h"
 
 /**
  * Print usage info for this program.
  */
 void print_usage(char* program_name) {
-    fprintf(stderr, "Usage:   %s <container> <volume ID> <file-system object ID in volume>\nExample: %s /dev/disk0s2  0  0xd4a7f\n\n", program_name, program_name);
+    fprintf(stderr, "Usage:   %s [options] <container> <volume ID> <file-system object ID in volume>\nExample: %s /dev/disk0s2  0  0xd4a7f\n\n", program_name, program_name);
+    print_common_options_usage(stderr);
 }
 
 void print_fs_records(j_rec_t** fs_records) {
@@ -40,6 +43,11 @@ void print_fs_records(j_rec_t** fs_records) {
         num_records++;
         j_rec_t* fs_rec = *fs_rec_cursor;
 
+        if (is_structured_output()) {
+            record_fs_record(fs_rec->data, fs_rec->data + fs_rec->key_len, fs_rec->val_len);
+            continue;
+        }
+
         j_key_t* hdr = fs_rec->data;
         fprintf(stderr, "- ");
 
@@ -151,9 +159,15 @@ void print_fs_records(j_rec_t** fs_records) {
 }
 
 int main(int argc, char** argv) {
-    setbuf(stdout, NULL);
+    set_dump_stdout_buffering();
+
+    output_format_supported = true;
 
     // Extrapolate CLI arguments, exit if invalid
+    if (!parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
     if (argc != 4) {
         fprintf(stderr, "Incorrect number of arguments.\n");
         print_usage(argv[0]);
@@ -190,6 +204,7 @@ int main(int argc, char** argv) {
         return -errno;
     }
     fprintf(stderr, "OK.\nSimulating a mount of the APFS container.\n");
+    detect_block_size();
     
     // Using `nx_superblock_t*`, but allocating a whole block of memory.
     // This way, we can read the entire block and validate its checksum,
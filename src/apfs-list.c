@@ -5,6 +5,7 @@
 #include <string.h>
 
 #include "apfs/io.h"
+#include "apfs/options.h"
 #include "apfs/func/boolean.h"
 #include "apfs/func/cksum.h"
 #include "apfs/func/btree.h"
@@ -25,12 +26,14 @@
 #include "apfs/string/btree.h"
 #include "apfs/string/fs.h"
 #include "apfs/string/j.h"
+#include "apfs/string/record.h"
 
 /**
  * Print usage info for this program.
  */
 void print_usage(char* program_name) {
-    fprintf(stderr, "Usage:   %s <container> <volume ID> <path in volume>\nExample: %s /dev/disk0s2  0  /Users/john/Documents\n\n", program_name, program_name);
+    fprintf(stderr, "Usage:   %s [options] <container> <volume ID> <path in volume>\nExample: %s /dev/disk0s2  0  /Users/john/Documents\n\n", program_name, program_name);
+    print_common_options_usage(stderr);
 }
 
 void print_fs_records(j_rec_t** fs_records) {
@@ -40,6 +43,11 @@ void print_fs_records(j_rec_t** fs_records) {
         num_records++;
         j_rec_t* fs_rec = *fs_rec_cursor;
 
+        if (is_structured_output()) {
+            record_fs_record(fs_rec->data, fs_rec->data + fs_rec->key_len, fs_rec->val_len);
+            continue;
+        }
+
         j_key_t* hdr = fs_rec->data;
         fprintf(stderr, "- ");
 
@@ -154,9 +162,15 @@ void print_fs_records(j_rec_t** fs_records) {
 }
 
 int main(int argc, char** argv) {
-    setbuf(stdout, NULL);
+    set_dump_stdout_buffering();
+
+    output_format_supported = true;
 
     // Extrapolate CLI arguments, exit if invalid
+    if (!parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
     if (argc != 4) {
         fprintf(stderr, "Incorrect number of arguments.\n");
         print_usage(argv[0]);
@@ -184,6 +198,8 @@ int main(int argc, char** argv) {
         return -errno;
     }
     fprintf(stderr, "OK.\nSimulating a mount of the APFS container.\n");
+    stats_phase("mount");
+    detect_block_size();
     
     // Using `nx_superblock_t*`, but allocating a whole block of memory.
     // This way, we can read the entire block and validate its checksum,
@@ -523,13 +539,19 @@ int main(int argc, char** argv) {
     }
     fprintf(stderr, "corresponding block address is 0x%llx.\n", fs_root_val->ov_paddr);
 
+    // The file-system tree of an encrypted volume is encrypted.
+    if ((fs_root_val->ov_flags & OMAP_VAL_ENCRYPTED) && !unlock_volume(nxsb, apsb)) {
+        fprintf(stderr, "\nABORT: Could not unlock the volume.\n");
+        return -1;
+    }
+
     fprintf(stderr, "Reading ... ");
     btree_node_phys_t* fs_root_btree = malloc(nx_block_size);
     if (!fs_root_btree) {
         fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `fs_root_btree`.\n");
         return -1;
     }
-    if (read_blocks(fs_root_btree, fs_root_val->ov_paddr, 1) != 1) {
+    if (read_fs_node_cached(fs_root_btree, fs_root_val) != 1) {
         fprintf(stderr, "\nABORT: Failed to read block 0x%llx.\n", fs_root_val->ov_paddr);
         return -1;
     }
@@ -542,6 +564,7 @@ int main(int argc, char** argv) {
     }
     fprintf(stderr, "OK.\n");
 
+    stats_phase("path lookup");
     oid_t fs_oid = 0x2;
 
     j_rec_t** fs_records = get_fs_records(fs_omap_btree, fs_root_btree, fs_oid, (xid_t)(~0) );
@@ -595,6 +618,7 @@ int main(int argc, char** argv) {
 
     fprintf(stderr, "\nRecords for file-system object %#llx -- `%s` --\n", fs_oid, path_stack);
     // `fs_records` now contains the records for the item at the specified path
+    stats_phase("output");
     print_fs_records(fs_records);
 
     free_j_rec_array(fs_records);
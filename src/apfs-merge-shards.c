@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apfs/options.h"
+#include "apfs/func/sink.h"
+#include "apfs/func/shard.h"
+
+#include "apfs/string/record.h"
+
+/**
+ * Print usage info for this program.
+ */
+void print_usage(char* program_name) {
+    printf("Usage:   %s [--top-k=N] [--format=FORMAT] <shard file>...\nExample: %s --top-k=1 shard-0.bin shard-1.bin shard-2.bin\n\n", program_name, program_name);
+    printf(
+        "Combine the partial results that the shards of a partitioned search wrote with\n"
+        "`--shard-output`, and report them as one search of all of the shards' ranges would.\n"
+        "\n"
+        "  --top-k=N           List only the N newest versions of each object, rather than every\n"
+        "                      version.\n"
+        "  --format=FORMAT     Write one record per criterion and version to stdout, as JSON Lines\n"
+        "                      (`jsonl`) or a CBOR sequence (`cbor`), and all other output to stderr;\n"
+        "                      or write the usual text (`text`, the default).\n"
+        "\n"
+    );
+}
+
+/**
+ * Determine whether a shard file belongs to the same search as another.
+ *
+ * RETURN VALUE:    `true` if so; otherwise, the difference is printed.
+ */
+bool is_same_search(shard_file_t* shard, shard_file_t* first) {
+    shard_header_t* a = &shard->header;
+    shard_header_t* b = &first->header;
+
+    char* difference = NULL;
+    if (strcmp(a->tool, b->tool) != 0) {
+        difference = "was written by a different tool";
+    } else if (memcmp(a->nx_uuid, b->nx_uuid, sizeof(uuid_t)) != 0
+        || a->block_size != b->block_size
+        || a->nx_block_count != b->nx_block_count
+    ) {
+        difference = "is of a different container";
+    } else if (a->num_shards != b->num_shards) {
+        difference = "is of a search with a different number of shards";
+    } else if (a->num_search_ranges != b->num_search_ranges
+        || memcmp(shard->search_ranges, first->search_ranges, a->num_search_ranges * sizeof(scan_range_t)) != 0
+    ) {
+        difference = "is of a search of different ranges";
+    } else if (memcmp(a->config_digest, b->config_digest, sizeof(a->config_digest)) != 0) {
+        difference = "is of a search with a different configuration";
+    } else if (a->num_criteria != b->num_criteria) {
+        difference = "is of a search with different criteria";
+    } else {
+        for (uint32_t i = 0; i < a->num_criteria; i++) {
+            if (strcmp(shard->criteria[i].name, first->criteria[i].name) != 0) {
+                difference = "is of a search with different criteria";
+            }
+        }
+    }
+
+    if (difference) {
+        printf("FAILED: `%s` %s than `%s`.\n", shard->path, difference, first->path);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    set_dump_stdout_buffering();
+    printf("\n");
+
+    output_format_supported = true;
+
+    // Extrapolate CLI arguments, exit if invalid
+    if (!parse_sink_options(&argc, argv) || !parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (argc < 2) {
+        printf("Incorrect number of arguments.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    size_t num_shards = argc - 1;
+    shard_file_t* shards = malloc(num_shards * sizeof(shard_file_t));
+    if (!shards) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `shards`.\n");
+        return -1;
+    }
+
+    uint64_t total_versions = 0;
+    for (size_t i = 0; i < num_shards; i++) {
+        shard_file_t* shard = shards + i;
+        printf("Reading shard file `%s` ... ", argv[i + 1]);
+        if (!shard_read(argv[i + 1], shard) || !is_same_search(shard, shards)) {
+            return -1;
+        }
+        for (size_t j = 0; j < i; j++) {
+            if (shards[j].header.shard_index == shard->header.shard_index) {
+                printf("FAILED: `%s` and `%s` are both of shard %u.\n", shards[j].path, shard->path, shard->header.shard_index);
+                return -1;
+            }
+        }
+        printf("OK; shard %u of %u, ranges ", shard->header.shard_index, shard->header.num_shards);
+        print_scan_ranges(shard->ranges, shard->header.num_ranges);
+        printf(", %llu versions.\n", shard->header.num_versions);
+        total_versions += shard->header.num_versions;
+    }
+
+    shard_header_t* header = &shards[0].header;
+    printf("\nShards are of a search by `%s` of a container with %llu = %#llx blocks.\n", header->tool, header->nx_block_count, header->nx_block_count);
+    if (num_shards < header->num_shards) {
+        printf("!! Only %zu of %u shards were given, so these results are incomplete. Missing shards:", num_shards, header->num_shards);
+        for (uint32_t index = 0; index < header->num_shards; index++) {
+            bool found = false;
+            for (size_t i = 0; i < num_shards && !found; i++) {
+                found = shards[i].header.shard_index == index;
+            }
+            if (!found) {
+                printf(" %u", index);
+            }
+        }
+        printf(".\n");
+    }
+
+    // Each shard's versions are sorted already, but the same version may have
+    // been found by several shards; inserting every shard's versions into one
+    // sink merges the copies, and the sink sorts the result.
+    sink_max_versions = total_versions == 0 ? 1 : total_versions < UINT32_MAX ? total_versions : UINT32_MAX;
+    const char** names = malloc(header->num_criteria * sizeof(char*) + 1);
+    if (!names) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `names`.\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < header->num_criteria; i++) {
+        names[i] = shards[0].criteria[i].name;
+    }
+    result_sink_t sink;
+    sink_init(&sink, header->num_criteria, names);
+
+    for (size_t i = 0; i < num_shards; i++) {
+        shard_file_t* shard = shards + i;
+        for (uint32_t j = 0; j < shard->header.num_criteria; j++) {
+            shard_criterion_t* from = shard->criteria + j;
+            sink_criterion_t* to = sink.criteria + j;
+            if (from->num_matches > 0) {
+                to->num_matches += from->num_matches;
+                to->first_addr = from->first_addr < to->first_addr ? from->first_addr : to->first_addr;
+                to->last_addr = from->last_addr > to->last_addr ? from->last_addr : to->last_addr;
+            }
+        }
+        for (uint64_t j = 0; j < shard->header.num_versions; j++) {
+            shard_version_t* version = shard->versions + j;
+            sink_insert(&sink, version->criterion, version->oid, version->xid, version->addr, version->num_copies);
+        }
+        sink.num_dropped += shard->header.num_dropped;
+    }
+
+    sink_report_criteria(&sink);
+    sink_report_versions(&sink, sink_top_k);
+
+    sink_free(&sink);
+    free(names);
+    for (size_t i = 0; i < num_shards; i++) {
+        shard_free(shards + i);
+    }
+    free(shards);
+    printf("\nFinished merging %zu shards.\n\n", num_shards);
+
+    return 0;
+}
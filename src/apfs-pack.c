@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <sys/errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "apfs/io.h"
+#include "apfs/io/scan.h"
+#include "apfs/options.h"
+#include "apfs/func/boolean.h"
+#include "apfs/func/cksum.h"
+#include "apfs/func/sha256.h"
+
+#include "apfs/struct/object.h"
+#include "apfs/struct/nx.h"
+
+#include "apfs/string/progress.h"
+
+/** Configuration **/
+
+#if defined(APFS_ZSTD)
+uint16_t    pack_codec = PACKED_CODEC_ZSTD;
+#elif defined(APFS_LZ4)
+uint16_t    pack_codec = PACKED_CODEC_LZ4;
+#else
+uint16_t    pack_codec = PACKED_CODEC_NONE;
+#endif
+
+int         pack_level = 0;             // 0 means the codec's default
+uint32_t    pack_chunk_blocks = 64;     // 256 KiB chunks with 4 KiB blocks
+
+/**
+ * Deduplication table, mapping the SHA-256 digest of a block's contents to the
+ * index of the unique block with those contents. It uses open addressing with
+ * linear probing, and is kept at most half full.
+ *
+ * Blocks are taken to be identical if their digests are; the unique blocks
+ * have been compressed and written out by the time a duplicate turns up, so
+ * they can't be compared byte for byte. A collision-resistant hash is used,
+ * since a disk under examination may hold content that was chosen to collide
+ * under a weaker one, which would replace one block's data with another's.
+ */
+typedef struct {
+    uint8_t     digest[SHA256_DIGEST_SIZE];
+    uint64_t    unique_plus_one;        // 0 if the slot is empty
+} dedup_entry_t;
+
+dedup_entry_t*  dedup_table = NULL;
+uint64_t        dedup_capacity = 0;
+uint64_t        dedup_count = 0;
+
+/** Packing state **/
+
+int             pack_fd = -1;
+uint64_t        pack_offset = PACKED_HEADER_SIZE;   // The header is written last
+
+char*           chunk_data = NULL;                  // Unique blocks of the current chunk
+uint32_t        chunk_fill = 0;
+char*           compressed = NULL;
+
+packed_chunk_t* chunks = NULL;
+uint64_t        num_chunks = 0;
+uint64_t        chunks_capacity = 0;
+
+/**
+ * Print usage info for this program.
+ */
+void print_usage(char* program_name) {
+    printf("Usage:   %s [options] [--codec=zstd|lz4|none] [--level=N] [--pack-chunk=N] <container> <packed image>\nExample: %s /dev/disk0s2 disk0s2.apfspack\n\n", program_name, program_name);
+    printf("Packing options:\n");
+    printf("  --codec=NAME        Compress chunks with NAME (default: %s).\n", packed_codec_to_string(pack_codec));
+    printf("  --level=N           Use compression level N (default: the codec's default).\n");
+    printf("  --pack-chunk=N      Put N distinct blocks in each compressed chunk (default: %u).\n", pack_chunk_blocks);
+    printf("\n");
+    print_common_options_usage(stdout);
+}
+
+/**
+ * Parse and remove the options specific to this program from the argument
+ * list; see `parse_common_options()`.
+ */
+bool parse_pack_options(int* argc, char** argv) {
+    int num_kept = 1;
+    for (int i = 1; i < *argc; i++) {
+        char* arg = argv[i];
+        if (strcmp(arg, "--") == 0) {
+            // Leave the rest for `parse_common_options()`
+            while (i < *argc) {
+                argv[num_kept++] = argv[i++];
+            }
+            break;
+        }
+
+        if (strncmp(arg, "--codec=", 8) == 0) {
+            char* name = arg + 8;
+            if (strcmp(name, "none") == 0) {
+                pack_codec = PACKED_CODEC_NONE;
+            } else if (strcmp(name, "zstd") == 0) {
+                pack_codec = PACKED_CODEC_ZSTD;
+            } else if (strcmp(name, "lz4") == 0) {
+                pack_codec = PACKED_CODEC_LZ4;
+            } else {
+                fprintf(stderr, "Unknown codec `%s`.\n", name);
+                return false;
+            }
+            if (!packed_codec_supported(pack_codec)) {
+                fprintf(stderr, "Support for %s compression was not compiled in; rebuild with `make %s=1`.\n",
+                    name, pack_codec == PACKED_CODEC_ZSTD ? "ZSTD" : "LZ4"
+                );
+                return false;
+            }
+        } else if (strncmp(arg, "--level=", 8) == 0) {
+            uint32_t level;
+            if (!parse_option_uint32(arg + 8, &level) || level > 22) {
+                fprintf(stderr, "Option `--level` requires an integer value from 1 to 22.\n");
+                return false;
+            }
+            pack_level = level;
+        } else if (strncmp(arg, "--pack-chunk=", 13) == 0) {
+            if (!parse_option_uint32(arg + 13, &pack_chunk_blocks) || pack_chunk_blocks > UINT16_MAX) {
+                fprintf(stderr, "Option `--pack-chunk` requires an integer value from 1 to %u.\n", UINT16_MAX);
+                return false;
+            }
+        } else {
+            argv[num_kept++] = arg;
+        }
+    }
+
+    argv[num_kept] = NULL;
+    *argc = num_kept;
+    return true;
+}
+
+/**
+ * Get the index of the slot in the deduplication table at which to start
+ * looking for a given digest.
+ */
+uint64_t dedup_slot(uint8_t* digest) {
+    uint64_t index;
+    memcpy(&index, digest, sizeof(index));
+    return index & (dedup_capacity - 1);
+}
+
+/**
+ * Look up a digest in the deduplication table, inserting it if it isn't there.
+ *
+ * unique:          If the digest isn't in the table, the index to associate it
+ *      with.
+ *
+ * RETURN VALUE:    The index of the unique block with the given digest, which
+ *      is `unique` if the digest was inserted.
+ */
+uint64_t dedup_lookup_or_insert(uint8_t* digest, uint64_t unique) {
+    if (2 * (dedup_count + 1) > dedup_capacity) {
+        uint64_t old_capacity = dedup_capacity;
+        dedup_entry_t* old_table = dedup_table;
+
+        dedup_capacity = old_capacity ? 2 * old_capacity : 1 << 16;
+        dedup_table = calloc(dedup_capacity, sizeof(dedup_entry_t));
+        if (!dedup_table) {
+            fprintf(stderr, "\nABORT: dedup_lookup_or_insert: Could not allocate sufficient memory for %llu table entries.\n", dedup_capacity);
+            exit(-1);
+        }
+        for (uint64_t i = 0; i < old_capacity; i++) {
+            if (old_table[i].unique_plus_one) {
+                uint64_t j = dedup_slot(old_table[i].digest);
+                while (dedup_table[j].unique_plus_one) {
+                    j = (j + 1) & (dedup_capacity - 1);
+                }
+                dedup_table[j] = old_table[i];
+            }
+        }
+        free(old_table);
+    }
+
+    uint64_t j = dedup_slot(digest);
+    while (dedup_table[j].unique_plus_one) {
+        if (memcmp(dedup_table[j].digest, digest, SHA256_DIGEST_SIZE) == 0) {
+            return dedup_table[j].unique_plus_one - 1;
+        }
+        j = (j + 1) & (dedup_capacity - 1);
+    }
+
+    memcpy(dedup_table[j].digest, digest, SHA256_DIGEST_SIZE);
+    dedup_table[j].unique_plus_one = unique + 1;
+    dedup_count++;
+    return unique;
+}
+
+/**
+ * Determine whether a block consists entirely of zeroes.
+ */
+bool is_block_zeroed(char* block) {
+    uint64_t* words = (uint64_t*)block;
+    for (size_t i = 0; i < nx_block_size / sizeof(uint64_t); i++) {
+        if (words[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Write given data to the packed image at a given offset, aborting on failure.
+ */
+void write_or_abort(int fd, void* buffer, size_t num_bytes, uint64_t offset) {
+    size_t num_written = 0;
+    while (num_written < num_bytes) {
+        ssize_t ret = pwrite(fd, (char*)buffer + num_written, num_bytes - num_written, offset + num_written);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            fprintf(stderr, "\nABORT: Failed to write to the packed image (%s).\n", strerror(errno));
+            exit(-1);
+        }
+        num_written += ret;
+    }
+}
+
+/**
+ * Compress the current chunk, append it to the packed image, and add it to
+ * the chunk index. Chunks that don't compress are stored as-is.
+ */
+void flush_chunk() {
+    if (chunk_fill == 0) {
+        return;
+    }
+    if (num_chunks == chunks_capacity) {
+        chunks_capacity = chunks_capacity ? 2 * chunks_capacity : 1024;
+        chunks = realloc(chunks, chunks_capacity * sizeof(packed_chunk_t));
+        if (!chunks) {
+            fprintf(stderr, "\nABORT: flush_chunk: Could not allocate sufficient memory for %llu chunks.\n", chunks_capacity);
+            exit(-1);
+        }
+    }
+
+    size_t data_size = (size_t)chunk_fill * nx_block_size;
+    size_t stored_size = packed_compress(pack_codec, pack_level, compressed, data_size, chunk_data, data_size);
+
+    packed_chunk_t* chunk = chunks + num_chunks++;
+    chunk->offset = pack_offset;
+    chunk->num_blocks = chunk_fill;
+    if (stored_size > 0 && stored_size < data_size) {
+        chunk->codec = pack_codec;
+        chunk->size = stored_size;
+        write_or_abort(pack_fd, compressed, stored_size, pack_offset);
+    } else {
+        chunk->codec = PACKED_CODEC_NONE;
+        chunk->size = data_size;
+        write_or_abort(pack_fd, chunk_data, data_size, pack_offset);
+    }
+    pack_offset += chunk->size;
+    chunk_fill = 0;
+}
+
+int main(int argc, char** argv) {
+    setbuf(stdout, NULL);
+    printf("\n");
+
+    // Extrapolate CLI arguments, exit if invalid
+    if (!parse_pack_options(&argc, argv) || !parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (argc != 3) {
+        printf("Incorrect number of arguments.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    nx_path = argv[1];
+    char* pack_path = argv[2];
+
+    // Open (device special) file corresponding to an APFS container, read-only
+    printf("Opening file at `%s` in read-only mode ... ", nx_path);
+    nx = fopen(nx_path, "rb");
+    if (!nx) {
+        fprintf(stderr, "\nABORT: ");
+        report_fopen_error();
+        printf("\n");
+        return -errno;
+    }
+    printf("OK.\n");
+    detect_block_size();
+
+    if (nx_is_packed()) {
+        printf("`%s` is already a packed image; it will be repacked.\n", nx_path);
+    }
+
+    // Determine the size of the container, preferring what its superblock
+    // says, since the size of a device special file may not be available.
+    uint64_t block_count = 0;
+    nx_superblock_t* nxsb = malloc(nx_block_size);
+    if (!nxsb) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `nxsb`.\n");
+        return -1;
+    }
+    if (read_blocks(nxsb, 0x0, 1) == 1 && is_cksum_valid(nxsb) && is_nx_superblock(nxsb) && nxsb->nx_magic == NX_MAGIC) {
+        block_count = nxsb->nx_block_count;
+    } else {
+        printf("Block 0x0 is not a valid container superblock; using the size of the file instead.\n");
+        off_t size = lseek(fileno(nx), 0, SEEK_END);
+        if (size <= 0) {
+            fprintf(stderr, "\nABORT: Could not determine the size of `%s`.\n", nx_path);
+            return -1;
+        }
+        block_count = size / nx_block_size;
+    }
+    free(nxsb);
+
+    pack_fd = open(pack_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (pack_fd == -1) {
+        fprintf(stderr, "\nABORT: Could not open `%s` for writing (%s).\n", pack_path, strerror(errno));
+        return -1;
+    }
+
+    // Compressed chunks that would be larger than the original are not kept,
+    // so the compression buffer needn't be any larger than a chunk.
+    chunk_data = malloc((size_t)pack_chunk_blocks * nx_block_size);
+    compressed = malloc((size_t)pack_chunk_blocks * nx_block_size);
+
+    uint64_t runs_capacity = 1024;
+    uint64_t num_runs = 0;
+    packed_run_t* runs = malloc(runs_capacity * sizeof(packed_run_t));
+
+    if (!chunk_data || !compressed || !runs) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for the packing buffers.\n");
+        return -1;
+    }
+
+    uint64_t num_unique = 0;
+    uint64_t num_zeroed = 0;
+    uint64_t num_duplicate = 0;
+
+    printf("Packing %llu blocks into `%s` with %s compression.\n", block_count, pack_path, packed_codec_to_string(pack_codec));
+
+    scan_t scan;
+    scan_init(&scan, 0, block_count);
+    scan.skip_errors = false;
+    scan.unmasked = true;
+
+    paddr_t chunk_start;
+    char* data;
+    size_t num_blocks;
+    progress_t progress;
+    progress_init(&progress, block_count);
+    progress.show_matches = false;
+    while ( (num_blocks = scan_next_chunk(&scan, &chunk_start, &data)) ) {
+        for (size_t i = 0; i < num_blocks; i++) {
+            char* block = data + i * nx_block_size;
+            paddr_t addr = chunk_start + i;
+
+            if (is_block_zeroed(block)) {
+                num_zeroed++;
+                continue;
+            }
+
+            uint8_t digest[SHA256_DIGEST_SIZE];
+            sha256(block, nx_block_size, digest);
+            uint64_t unique = dedup_lookup_or_insert(digest, num_unique);
+
+            if (unique != num_unique) {
+                num_duplicate++;
+            } else {
+                // A block we haven't seen before; add it to the current chunk.
+                memcpy(chunk_data + (size_t)chunk_fill * nx_block_size, block, nx_block_size);
+                chunk_fill++;
+                num_unique++;
+            }
+
+            // Extend the last run if this block continues it; else start a new one.
+            packed_run_t* last = num_runs ? runs + num_runs - 1 : NULL;
+            if (last && last->start_block + last->count == (uint64_t)addr && last->unique_start + last->count == unique) {
+                last->count++;
+            } else {
+                if (num_runs == runs_capacity) {
+                    runs_capacity *= 2;
+                    runs = realloc(runs, runs_capacity * sizeof(packed_run_t));
+                    if (!runs) {
+                        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for %llu runs.\n", runs_capacity);
+                        return -1;
+                    }
+                }
+                runs[num_runs].start_block  = addr;
+                runs[num_runs].unique_start = unique;
+                runs[num_runs].count        = 1;
+                num_runs++;
+            }
+
+            if (chunk_fill == pack_chunk_blocks) {
+                flush_chunk();
+            }
+        }
+
+        progress_add_blocks(&progress, num_blocks);
+        progress_update(&progress);
+    }
+    progress_clear(&progress);
+    if (scan.error) {
+        fprintf(stderr, "\nABORT: A read error occurred (%s); try again with `--rescue`.\n", strerror(scan.error));
+        return -1;
+    }
+    scan_end(&scan);
+
+    flush_chunk();
+
+    // Chunk index and run map
+    packed_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACKED_MAGIC, sizeof(header.magic));
+    header.version              = PACKED_VERSION;
+    header.block_size           = nx_block_size;
+    header.block_count          = block_count;
+    header.chunk_blocks         = pack_chunk_blocks;
+    header.num_unique_blocks    = num_unique;
+    header.num_chunks           = num_chunks;
+    header.index_offset         = pack_offset;
+    write_or_abort(pack_fd, chunks, num_chunks * sizeof(packed_chunk_t), pack_offset);
+    pack_offset += num_chunks * sizeof(packed_chunk_t);
+    header.num_runs             = num_runs;
+    header.map_offset           = pack_offset;
+    write_or_abort(pack_fd, runs, num_runs * sizeof(packed_run_t), pack_offset);
+    pack_offset += num_runs * sizeof(packed_run_t);
+
+    char header_block[PACKED_HEADER_SIZE];
+    memset(header_block, 0, PACKED_HEADER_SIZE);
+    memcpy(header_block, &header, sizeof(header));
+    write_or_abort(pack_fd, header_block, PACKED_HEADER_SIZE, 0);
+
+    if (fsync(pack_fd) != 0 || close(pack_fd) != 0) {
+        fprintf(stderr, "\nABORT: Failed to finish writing `%s` (%s).\n", pack_path, strerror(errno));
+        return -1;
+    }
+
+    uint64_t raw_size = block_count * nx_block_size;
+    printf("\nDone.\n");
+    printf("- Zeroed blocks:      %llu\n", num_zeroed);
+    printf("- Duplicate blocks:   %llu\n", num_duplicate);
+    printf("- Distinct blocks:    %llu, in %llu chunks\n", num_unique, num_chunks);
+    printf("- Runs:               %llu\n", num_runs);
+    printf("- Packed image size:  %llu bytes (%.2fx smaller than the container)\n", pack_offset, pack_offset ? (double)raw_size / pack_offset : 0.0);
+    printf("\n");
+
+    free(runs);
+    free(chunks);
+    free(compressed);
+    free(chunk_data);
+    free(dedup_table);
+    fclose(nx);
+    return 0;
+}
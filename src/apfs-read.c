@@ -5,6 +5,7 @@
 #include <string.h>
 
 #include "apfs/io.h"
+#include "apfs/options.h"
 #include "apfs/struct/general.h"
 
 #include "apfs/func/boolean.h"
@@ -15,18 +16,26 @@
 #include "apfs/string/btree.h"
 #include "apfs/string/omap.h"
 #include "apfs/string/fs.h"
+#include "apfs/string/record.h"
 
 /**
  * Print usage info for this program.
  */
 void print_usage(char* program_name) {
-    printf("Usage:   %s <container> <address>\nExample: %s /dev/disk0s2 0x3af2\n\n", program_name, program_name);
+    printf("Usage:   %s [options] <container> <address>\nExample: %s /dev/disk0s2 0x3af2\n\n", program_name, program_name);
+    print_common_options_usage(stdout);
 }
 
 int main(int argc, char** argv) {
     printf("\n");
 
+    output_format_supported = true;
+
     // Extrapolate CLI arguments, exit if invalid
+    if (!parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
     if (argc != 3) {
         printf("Incorrect number of arguments.\n");
         print_usage(argv[0]);
@@ -54,6 +63,7 @@ int main(int argc, char** argv) {
         return -errno;
     }
     printf("OK.\n\n");
+    detect_block_size();
 
     printf("Reading block 0x%llx ... ", nx_block_addr);
     obj_phys_t* block = malloc(nx_block_size);
@@ -68,6 +78,11 @@ int main(int argc, char** argv) {
         printf("FAILED.\nThe specified block may contain file-system data or be free space.\n");
     }
     printf("\n");
+
+    if (is_structured_output()) {
+        record_block(NULL, nx_block_addr, block, is_cksum_valid(block));
+        goto cleanup;
+    }
     
     printf("Details of block 0x%llx:\n", nx_block_addr);
     printf("--------------------------------------------------------------------------------\n");
@@ -0,0 +1,1251 @@
+#include <stdio.h>
+#include <sys/errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "apfs/io.h"
+#include "apfs/io/async.h"
+#include "apfs/io/scan.h"
+#include "apfs/io/batch.h"
+#include "apfs/options.h"
+#include "apfs/func/boolean.h"
+#include "apfs/func/cksum.h"
+#include "apfs/func/btree.h"
+#include "apfs/func/build.h"
+#include "apfs/func/prefilter.h"
+
+#include "apfs/struct/object.h"
+#include "apfs/struct/nx.h"
+#include "apfs/struct/omap.h"
+#include "apfs/struct/btree.h"
+#include "apfs/struct/fs.h"
+#include "apfs/struct/spaceman.h"
+
+#include "apfs/string/record.h"
+#include "apfs/string/progress.h"
+
+// The number of objects read at once when classifying leaves and verifying
+// mappings; each batch is serviced in parallel by the I/O engine.
+#define REBUILD_BATCH_SIZE          1024
+
+// The number of mappings of each leaf whose targets are read to tell which
+// object map the leaf belongs to: its first, middle, and last.
+#define REBUILD_SAMPLES_PER_LEAF    3
+
+// The minimum number of mappings read at once from each sorted run when the
+// runs are merged.
+#define REBUILD_MIN_RUN_READ        64
+
+/** Configuration **/
+
+// Set by `--xid`; the XID at which to rebuild the object map, or 0 for the
+// XID of the latest checkpoint.
+xid_t       rebuild_xid = 0;
+
+// Set by `--oids`; only mappings for OIDs in this range are kept.
+oid_t       rebuild_oid_min = 0;
+oid_t       rebuild_oid_max = ~0ULL;
+
+// Set by `--blocks`; the range of blocks to scan, or the whole container if
+// `rebuild_end` is 0.
+paddr_t     rebuild_start = 0;
+paddr_t     rebuild_end = 0;
+
+// Set by `--sort-memory`; the memory used to sort mappings, in MiB. Mappings
+// that don't fit are sorted in runs that are spilled to a temporary file.
+uint32_t    rebuild_sort_memory = 256;
+
+// Set by `--list` and `--verify`.
+bool        rebuild_list = false;
+bool        rebuild_verify = false;
+
+// Set by `--write`; the range of unused, but allocated, blocks to write the
+// new tree to, or nothing if `rebuild_write_end` is 0.
+paddr_t     rebuild_write_start = 0;
+paddr_t     rebuild_write_end = 0;
+
+// Set by `--omap`; the object map whose tree is replaced, or 0 to find it.
+paddr_t     rebuild_omap_addr = 0;
+
+// Set by `--force`.
+bool        rebuild_force = false;
+
+// Set by `--undo-log` and `--no-undo-log`.
+char*       undo_path = "apfs-rebuild-omap.undo";
+
+/** State **/
+
+enum {
+    LEAF_UNKNOWN,
+    LEAF_CONTAINER,     // Maps volume superblocks
+    LEAF_VOLUME,        // Maps file-system tree nodes
+};
+
+/**
+ * An object map leaf node found by the scan. The targets of a few of its
+ * mappings are read later, to tell which object map it belongs to.
+ */
+typedef struct {
+    paddr_t     addr;
+    xid_t       xid;
+    uint32_t    num_samples;
+    uint8_t     kind;
+    oid_t       sample_oids[REBUILD_SAMPLES_PER_LEAF];
+    paddr_t     sample_paddrs[REBUILD_SAMPLES_PER_LEAF];
+} carved_leaf_t;
+
+carved_leaf_t*  leaves = NULL;
+uint32_t        num_leaves = 0;
+uint32_t        leaves_capacity = 0;
+
+/**
+ * A mapping found in a carved leaf, along with the XID of that leaf, so that
+ * of identical mappings found in several copies of a leaf, the newest copy's
+ * can be preferred.
+ */
+typedef struct {
+    oid_t       oid;
+    xid_t       xid;
+    xid_t       node_xid;
+    paddr_t     paddr;
+    uint32_t    flags;
+    uint32_t    size;
+    uint32_t    leaf;       // Index in `leaves`
+} carved_mapping_t;
+
+/**
+ * A sorted run of mappings, either the in-memory sort buffer or a part of
+ * the spill file, with a buffer of mappings that have been read from it.
+ */
+typedef struct {
+    off_t               offset;     // Of the next mapping to read from the spill file
+    size_t              remaining;  // Mappings not yet read from the spill file
+    carved_mapping_t*   buffer;
+    size_t              capacity;
+    size_t              count;
+    size_t              next;
+} sort_run_t;
+
+carved_mapping_t*   sort_buffer = NULL;
+size_t              sort_buffer_len = 0;
+size_t              sort_buffer_capacity = 0;
+FILE*               spill = NULL;
+sort_run_t*         runs = NULL;
+uint32_t            num_runs = 0;
+
+// The rebuilt object map, in (OID, XID) order; one mapping per OID.
+omap_mapping_t*     rebuilt = NULL;
+size_t              num_rebuilt = 0;
+size_t              rebuilt_capacity = 0;
+
+/** Statistics **/
+
+uint64_t    num_carved_mappings = 0;
+uint64_t    num_foreign_mappings = 0;   // In leaves of other object maps
+uint64_t    num_superseded_mappings = 0;
+uint64_t    num_deleted_oids = 0;
+
+/**
+ * Print usage info for this program.
+ */
+void print_usage(char* program_name) {
+    printf("Usage:   %s [options] [--xid=N] [--oids=LO:HI] [--blocks=START:END] [--list] [--verify]\n", program_name);
+    printf("         [--write=START:END [--omap=ADDR] [--force] [--undo-log=FILE|--no-undo-log]] <container> [<volume ID>]\n");
+    printf("Example: %s --verify /dev/disk0s2 0\n\n", program_name);
+    printf("Rebuilds the container object map, or the object map of the given volume, from the object map\n");
+    printf("leaf nodes found anywhere in the container.\n\n");
+    printf("Rebuild options:\n");
+    printf("  --xid=N             Rebuild the object map as of transaction N (default: the latest checkpoint).\n");
+    printf("  --oids=LO:HI        Only keep mappings for OIDs from LO to HI; use this to tell apart the\n");
+    printf("                      object maps of volumes whose OIDs are in known ranges.\n");
+    printf("  --blocks=START:END  Only scan blocks from START up to, but not including, END.\n");
+    printf("  --sort-memory=N     Sort mappings in N MiB of memory, spilling the rest to a temporary file\n");
+    printf("                      (default: %u).\n", rebuild_sort_memory);
+    printf("  --list              List the mappings of the rebuilt object map.\n");
+    printf("  --verify            Read every mapped object, and check that it is valid.\n");
+    printf("  --write=START:END   Write the rebuilt tree to the unused blocks from START up to, but not\n");
+    printf("                      including, END, and make the object map use it. The blocks that are\n");
+    printf("                      written to must already be allocated in the space manager.\n");
+    printf("  --omap=ADDR         With `--write`, the object map to update, if it can't be found.\n");
+    printf("  --force             With `--write`, write to blocks that hold valid objects or that aren't\n");
+    printf("                      known to be allocated.\n");
+    printf("  --undo-log=FILE     Save the original contents of the written blocks to FILE, which must not\n");
+    printf("                      exist (default: `%s`).\n", undo_path);
+    printf("  --no-undo-log       Don't save the original contents of the written blocks.\n");
+    printf("\n");
+    print_common_options_usage(stdout);
+}
+
+/**
+ * Parse a range of block addresses or OIDs, as in `0x1000:0x2000`.
+ */
+bool parse_range(char* string, uint64_t* start, uint64_t* end) {
+    char* colon = strchr(string, ':');
+    if (!colon) {
+        return false;
+    }
+    *colon = '\0';
+    bool ok = parse_option_uint64(string, start) && parse_option_uint64(colon + 1, end);
+    *colon = ':';
+    return ok;
+}
+
+/**
+ * Parse and remove the options specific to this program from the argument
+ * list; see `parse_common_options()`.
+ */
+bool parse_rebuild_options(int* argc, char** argv) {
+    int num_kept = 1;
+    for (int i = 1; i < *argc; i++) {
+        char* arg = argv[i];
+        if (strcmp(arg, "--") == 0) {
+            // Leave the rest for `parse_common_options()`
+            while (i < *argc) {
+                argv[num_kept++] = argv[i++];
+            }
+            break;
+        }
+
+        uint64_t start, end;
+        if (strncmp(arg, "--xid=", 6) == 0) {
+            if (!parse_option_uint64(arg + 6, &rebuild_xid) || rebuild_xid == 0) {
+                fprintf(stderr, "Option `--xid` requires a positive integer value.\n");
+                return false;
+            }
+        } else if (strncmp(arg, "--oids=", 7) == 0) {
+            if (!parse_range(arg + 7, &start, &end) || start > end) {
+                fprintf(stderr, "Option `--oids` requires a range of OIDs, as in `--oids=0x400:0x2000`.\n");
+                return false;
+            }
+            rebuild_oid_min = start;
+            rebuild_oid_max = end;
+        } else if (strncmp(arg, "--blocks=", 9) == 0) {
+            if (!parse_range(arg + 9, &start, &end) || start >= end || end > INT64_MAX) {
+                fprintf(stderr, "Option `--blocks` requires a range of block addresses, as in `--blocks=0x1000:0x2000`.\n");
+                return false;
+            }
+            rebuild_start = start;
+            rebuild_end = end;
+        } else if (strncmp(arg, "--sort-memory=", 14) == 0) {
+            if (!parse_option_uint32(arg + 14, &rebuild_sort_memory)) {
+                fprintf(stderr, "Option `--sort-memory` requires a positive integer value.\n");
+                return false;
+            }
+        } else if (strcmp(arg, "--list") == 0) {
+            rebuild_list = true;
+        } else if (strcmp(arg, "--verify") == 0) {
+            rebuild_verify = true;
+        } else if (strncmp(arg, "--write=", 8) == 0) {
+            if (!parse_range(arg + 8, &start, &end) || start >= end || end > INT64_MAX) {
+                fprintf(stderr, "Option `--write` requires a range of block addresses, as in `--write=0x1000:0x2000`.\n");
+                return false;
+            }
+            rebuild_write_start = start;
+            rebuild_write_end = end;
+        } else if (strncmp(arg, "--omap=", 7) == 0) {
+            if (!parse_option_uint64(arg + 7, &start) || start == 0 || start > INT64_MAX) {
+                fprintf(stderr, "Option `--omap` requires a block address.\n");
+                return false;
+            }
+            rebuild_omap_addr = start;
+        } else if (strcmp(arg, "--force") == 0) {
+            rebuild_force = true;
+        } else if (strncmp(arg, "--undo-log=", 11) == 0) {
+            undo_path = arg + 11;
+        } else if (strcmp(arg, "--no-undo-log") == 0) {
+            undo_path = NULL;
+        } else {
+            argv[num_kept++] = arg;
+        }
+    }
+
+    argv[num_kept] = NULL;
+    *argc = num_kept;
+    return true;
+}
+
+/**
+ * Read and validate an object.
+ *
+ * RETURN VALUE:    A pointer to the object, which the caller must free, or
+ *      NULL if it couldn't be read or is invalid.
+ */
+void* read_object(char* description, paddr_t addr) {
+    obj_phys_t* obj = malloc(nx_block_size);
+    if (!obj) {
+        fprintf(stderr, "\nABORT: read_object: Could not allocate sufficient memory for `obj`.\n");
+        exit(-1);
+    }
+    if (read_blocks(obj, addr, 1) != 1 || !is_cksum_valid(obj)) {
+        printf("%s at block %#llx is unreadable or invalid.\n", description, addr);
+        free(obj);
+        return NULL;
+    }
+    return obj;
+}
+
+/** External sort **/
+
+/**
+ * Order mappings by (OID, XID), and mappings with the same key by
+ * descending XID of the leaf they were found in.
+ */
+int compare_carved_mappings(const void* a, const void* b) {
+    const carved_mapping_t* x = a;
+    const carved_mapping_t* y = b;
+    if (x->oid != y->oid) {
+        return x->oid < y->oid ? -1 : 1;
+    }
+    if (x->xid != y->xid) {
+        return x->xid < y->xid ? -1 : 1;
+    }
+    return x->node_xid > y->node_xid ? -1 : x->node_xid < y->node_xid;
+}
+
+/**
+ * Sort the mappings in the sort buffer, and write them to the spill file as
+ * a new run.
+ */
+void spill_sort_buffer() {
+    if (!spill) {
+        spill = tmpfile();
+        if (!spill) {
+            fprintf(stderr, "\nABORT: spill_sort_buffer: Could not create a temporary file (%s).\n", strerror(errno));
+            exit(-1);
+        }
+    }
+
+    qsort(sort_buffer, sort_buffer_len, sizeof(carved_mapping_t), compare_carved_mappings);
+    off_t offset = num_runs ? runs[num_runs - 1].offset + runs[num_runs - 1].remaining * sizeof(carved_mapping_t) : 0;
+    if (!write_all(fileno(spill), sort_buffer, sort_buffer_len * sizeof(carved_mapping_t))) {
+        fprintf(stderr, "\nABORT: spill_sort_buffer: Could not write to the temporary file (%s).\n", strerror(errno));
+        exit(-1);
+    }
+
+    runs = realloc(runs, (num_runs + 1) * sizeof(sort_run_t));
+    if (!runs) {
+        fprintf(stderr, "\nABORT: spill_sort_buffer: Could not allocate sufficient memory for `runs`.\n");
+        exit(-1);
+    }
+    memset(runs + num_runs, 0, sizeof(sort_run_t));
+    runs[num_runs].offset = offset;
+    runs[num_runs].remaining = sort_buffer_len;
+    num_runs++;
+    sort_buffer_len = 0;
+}
+
+void add_carved_mapping(carved_mapping_t* mapping) {
+    if (!sort_buffer) {
+        sort_buffer_capacity = ((size_t)rebuild_sort_memory << 20) / sizeof(carved_mapping_t);
+        sort_buffer = malloc(sort_buffer_capacity * sizeof(carved_mapping_t));
+        if (!sort_buffer) {
+            fprintf(stderr, "\nABORT: add_carved_mapping: Could not allocate %u MiB to sort mappings in.\n", rebuild_sort_memory);
+            exit(-1);
+        }
+    }
+    if (sort_buffer_len == sort_buffer_capacity) {
+        spill_sort_buffer();
+    }
+    sort_buffer[sort_buffer_len++] = *mapping;
+    num_carved_mappings++;
+}
+
+/**
+ * Prepare the sorted runs to be merged. If nothing was spilled, the sort
+ * buffer is the only run; otherwise, it is spilled as the last run, and the
+ * sort memory is shared among the runs' read buffers.
+ */
+void finish_sort() {
+    if (!spill) {
+        qsort(sort_buffer, sort_buffer_len, sizeof(carved_mapping_t), compare_carved_mappings);
+        runs = calloc(1, sizeof(sort_run_t));
+        if (!runs) {
+            fprintf(stderr, "\nABORT: finish_sort: Could not allocate sufficient memory for `runs`.\n");
+            exit(-1);
+        }
+        runs[0].buffer = sort_buffer;
+        runs[0].count = sort_buffer_len;
+        num_runs = 1;
+        sort_buffer = NULL;
+        return;
+    }
+
+    if (sort_buffer_len > 0) {
+        spill_sort_buffer();
+    }
+    free(sort_buffer);
+    sort_buffer = NULL;
+
+    size_t run_capacity = sort_buffer_capacity / num_runs;
+    if (run_capacity < REBUILD_MIN_RUN_READ) {
+        run_capacity = REBUILD_MIN_RUN_READ;
+    }
+    for (uint32_t i = 0; i < num_runs; i++) {
+        runs[i].capacity = run_capacity;
+        runs[i].buffer = malloc(run_capacity * sizeof(carved_mapping_t));
+        if (!runs[i].buffer) {
+            fprintf(stderr, "\nABORT: finish_sort: Could not allocate sufficient memory for the buffers of %u runs.\n", num_runs);
+            exit(-1);
+        }
+    }
+}
+
+/**
+ * Get the next mapping of a run, without consuming it.
+ *
+ * RETURN VALUE:    A pointer to the mapping, or NULL if the run is exhausted.
+ */
+carved_mapping_t* run_peek(sort_run_t* run) {
+    if (run->next < run->count) {
+        return run->buffer + run->next;
+    }
+    if (run->remaining == 0) {
+        return NULL;
+    }
+
+    size_t count = run->remaining < run->capacity ? run->remaining : run->capacity;
+    size_t num_bytes = count * sizeof(carved_mapping_t);
+    if (pread(fileno(spill), run->buffer, num_bytes, run->offset) != (ssize_t)num_bytes) {
+        fprintf(stderr, "\nABORT: run_peek: Could not read from the temporary file (%s).\n", strerror(errno));
+        exit(-1);
+    }
+    run->offset += num_bytes;
+    run->remaining -= count;
+    run->count = count;
+    run->next = 0;
+    return run->buffer;
+}
+
+bool run_less(uint32_t a, uint32_t b) {
+    return compare_carved_mappings(run_peek(runs + a), run_peek(runs + b)) < 0;
+}
+
+void heap_sift_down(uint32_t* heap, uint32_t heap_len, uint32_t i) {
+    while (true) {
+        uint32_t smallest = i;
+        uint32_t left = 2 * i + 1;
+        uint32_t right = left + 1;
+        if (left < heap_len && run_less(heap[left], heap[smallest])) {
+            smallest = left;
+        }
+        if (right < heap_len && run_less(heap[right], heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        uint32_t tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+void add_rebuilt_mapping(carved_mapping_t* mapping) {
+    if (mapping->flags & OMAP_VAL_DELETED) {
+        num_deleted_oids++;
+        return;
+    }
+    if (num_rebuilt == rebuilt_capacity) {
+        rebuilt_capacity = rebuilt_capacity ? 2 * rebuilt_capacity : 4096;
+        rebuilt = realloc(rebuilt, rebuilt_capacity * sizeof(omap_mapping_t));
+        if (!rebuilt) {
+            fprintf(stderr, "\nABORT: add_rebuilt_mapping: Could not allocate sufficient memory for `rebuilt`.\n");
+            exit(-1);
+        }
+    }
+    omap_mapping_t* out = rebuilt + num_rebuilt++;
+    out->key.ok_oid     = mapping->oid;
+    out->key.ok_xid     = mapping->xid;
+    out->val.ov_flags   = mapping->flags;
+    out->val.ov_size    = mapping->size;
+    out->val.ov_paddr   = mapping->paddr;
+}
+
+/**
+ * Merge the sorted runs, keeping, for each OID, the newest mapping at or
+ * below the target XID that was found in an accepted leaf.
+ */
+void merge_runs(bool* leaf_accepted, xid_t target_xid) {
+    uint32_t* heap = malloc(num_runs * sizeof(uint32_t) + 1);
+    if (!heap) {
+        fprintf(stderr, "\nABORT: merge_runs: Could not allocate sufficient memory for `heap`.\n");
+        exit(-1);
+    }
+    uint32_t heap_len = 0;
+    for (uint32_t i = 0; i < num_runs; i++) {
+        if (run_peek(runs + i)) {
+            heap[heap_len++] = i;
+        }
+    }
+    for (uint32_t i = heap_len / 2; i-- > 0; ) {
+        heap_sift_down(heap, heap_len, i);
+    }
+
+    carved_mapping_t best;
+    bool have_best = false;
+    while (heap_len > 0) {
+        sort_run_t* run = runs + heap[0];
+        carved_mapping_t mapping = *run_peek(run);
+        run->next++;
+        if (!run_peek(run)) {
+            heap[0] = heap[--heap_len];
+        }
+        heap_sift_down(heap, heap_len, 0);
+
+        if (!leaf_accepted[mapping.leaf]) {
+            num_foreign_mappings++;
+            continue;
+        }
+        if (have_best && mapping.oid != best.oid) {
+            add_rebuilt_mapping(&best);
+            have_best = false;
+        }
+        // Mappings of each OID arrive in ascending XID order, and of those
+        // with the same XID, the one from the newest leaf arrives first.
+        if (mapping.xid <= target_xid && (!have_best || mapping.xid > best.xid)) {
+            if (have_best) {
+                num_superseded_mappings++;
+            }
+            best = mapping;
+            have_best = true;
+        } else {
+            num_superseded_mappings++;
+        }
+    }
+    if (have_best) {
+        add_rebuilt_mapping(&best);
+    }
+
+    free(heap);
+    for (uint32_t i = 0; i < num_runs; i++) {
+        free(runs[i].buffer);
+    }
+    free(runs);
+    runs = NULL;
+    num_runs = 0;
+    if (spill) {
+        fclose(spill);
+        spill = NULL;
+    }
+}
+
+/** Carving **/
+
+/**
+ * Add the mappings of a block to the sort, if it is a valid object map leaf
+ * node that is no newer than the target XID.
+ *
+ * RETURN VALUE:    Whether the block is such a leaf node with mappings in
+ *      the range given by `--oids`.
+ */
+bool carve_leaf(btree_node_phys_t* node, paddr_t addr, xid_t target_xid) {
+    if (   !is_btree_node_phys(node)
+        || !is_omap_tree(node)
+        || !(node->btn_flags & BTNODE_LEAF)
+        || !(node->btn_flags & BTNODE_FIXED_KV_SIZE)
+        || (target_xid && node->btn_o.o_xid > target_xid)
+        || !is_cksum_valid(node)
+    ) {
+        return false;
+    }
+
+    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+    char* key_start = toc_start + node->btn_table_space.len;
+    char* val_end   = (char*)node + nx_block_size - (is_btree_node_phys_root(node) ? sizeof(btree_info_t) : 0);
+    if (   node->btn_nkeys * sizeof(kvoff_t) > node->btn_table_space.len
+        || key_start > val_end
+    ) {
+        return false;
+    }
+
+    if (num_leaves == leaves_capacity) {
+        leaves_capacity = leaves_capacity ? 2 * leaves_capacity : 1024;
+        leaves = realloc(leaves, leaves_capacity * sizeof(carved_leaf_t));
+        if (!leaves) {
+            fprintf(stderr, "\nABORT: carve_leaf: Could not allocate sufficient memory for `leaves`.\n");
+            exit(-1);
+        }
+    }
+    carved_leaf_t* leaf = leaves + num_leaves;
+    memset(leaf, 0, sizeof(carved_leaf_t));
+    leaf->addr = addr;
+    leaf->xid = node->btn_o.o_xid;
+
+    uint32_t num_in_range = 0;
+    uint32_t sample_indices[REBUILD_SAMPLES_PER_LEAF] = { 0, node->btn_nkeys / 2, node->btn_nkeys - 1 };
+    kvoff_t* toc_entry = toc_start;
+    for (uint32_t i = 0; i < node->btn_nkeys; i++, toc_entry++) {
+        omap_key_t* key = key_start + toc_entry->k;
+        omap_val_t* val = val_end - toc_entry->v;
+        if ((char*)(key + 1) > val_end || (char*)val < key_start) {
+            continue;
+        }
+        if (key->ok_oid < rebuild_oid_min || key->ok_oid > rebuild_oid_max) {
+            continue;
+        }
+        if (target_xid && key->ok_xid > target_xid) {
+            continue;
+        }
+
+        carved_mapping_t mapping = {
+            .oid        = key->ok_oid,
+            .xid        = key->ok_xid,
+            .node_xid   = node->btn_o.o_xid,
+            .paddr      = val->ov_paddr,
+            .flags      = val->ov_flags,
+            .size       = val->ov_size,
+            .leaf       = num_leaves,
+        };
+        add_carved_mapping(&mapping);
+        num_in_range++;
+
+        // Only volume object maps map encrypted objects; the targets of
+        // other samples are read later.
+        if (val->ov_flags & OMAP_VAL_ENCRYPTED) {
+            leaf->kind = LEAF_VOLUME;
+        }
+        for (uint32_t j = 0; j < REBUILD_SAMPLES_PER_LEAF; j++) {
+            if (sample_indices[j] == i && leaf->num_samples < REBUILD_SAMPLES_PER_LEAF && !(val->ov_flags & OMAP_VAL_DELETED)) {
+                leaf->sample_oids[leaf->num_samples] = key->ok_oid;
+                leaf->sample_paddrs[leaf->num_samples] = val->ov_paddr;
+                leaf->num_samples++;
+                break;
+            }
+        }
+    }
+
+    if (num_in_range == 0) {
+        return false;
+    }
+    num_leaves++;
+    return true;
+}
+
+/**
+ * Tell which object map each leaf belongs to, by reading the targets of its
+ * sampled mappings: those of the container object map are volume
+ * superblocks. Leaves none of whose sampled targets are intact remain
+ * unknown.
+ */
+void classify_leaves() {
+    aio_req_t* reqs = calloc(REBUILD_BATCH_SIZE, sizeof(aio_req_t));
+    uint32_t (*req_samples)[2] = malloc(REBUILD_BATCH_SIZE * sizeof(*req_samples));
+    char* targets = malloc(REBUILD_BATCH_SIZE * nx_block_size);
+    if (!reqs || !req_samples || !targets) {
+        fprintf(stderr, "\nABORT: classify_leaves: Could not allocate sufficient memory for a batch of reads.\n");
+        exit(-1);
+    }
+
+    uint32_t leaf_index = 0;
+    uint32_t sample_index = 0;
+    while (leaf_index < num_leaves) {
+        uint32_t batch_len = 0;
+        while (batch_len < REBUILD_BATCH_SIZE && leaf_index < num_leaves) {
+            carved_leaf_t* leaf = leaves + leaf_index;
+            if (leaf->kind != LEAF_UNKNOWN || sample_index >= leaf->num_samples) {
+                leaf_index++;
+                sample_index = 0;
+                continue;
+            }
+            reqs[batch_len].buffer      = targets + batch_len * nx_block_size;
+            reqs[batch_len].start_block = leaf->sample_paddrs[sample_index];
+            reqs[batch_len].num_blocks  = 1;
+            req_samples[batch_len][0]   = leaf_index;
+            req_samples[batch_len][1]   = sample_index;
+            batch_len++;
+            sample_index++;
+        }
+        aio_read_batch(reqs, batch_len);
+
+        for (uint32_t i = 0; i < batch_len; i++) {
+            carved_leaf_t* leaf = leaves + req_samples[i][0];
+            obj_phys_t* target = reqs[i].buffer;
+            if (   leaf->kind != LEAF_UNKNOWN
+                || reqs[i].result != 1
+                || target->o_oid != leaf->sample_oids[req_samples[i][1]]
+                || !is_cksum_valid(target)
+            ) {
+                continue;
+            }
+            leaf->kind = (target->o_type & OBJECT_TYPE_MASK) == OBJECT_TYPE_FS ? LEAF_CONTAINER : LEAF_VOLUME;
+        }
+    }
+
+    free(reqs);
+    free(req_samples);
+    free(targets);
+}
+
+/**
+ * Read the object that each rebuilt mapping points to, and count those that
+ * are intact: they have the mapping's OID and XID, and a valid checksum.
+ * Encrypted objects can't be checked, and are counted separately.
+ */
+void verify_rebuilt(uint64_t* num_valid, uint64_t* num_encrypted) {
+    aio_req_t* reqs = calloc(REBUILD_BATCH_SIZE, sizeof(aio_req_t));
+    size_t* req_mappings = malloc(REBUILD_BATCH_SIZE * sizeof(size_t));
+    char* targets = malloc(REBUILD_BATCH_SIZE * nx_block_size);
+    if (!reqs || !req_mappings || !targets) {
+        fprintf(stderr, "\nABORT: verify_rebuilt: Could not allocate sufficient memory for a batch of reads.\n");
+        exit(-1);
+    }
+
+    *num_valid = 0;
+    *num_encrypted = 0;
+    size_t next = 0;
+    while (next < num_rebuilt) {
+        uint32_t batch_len = 0;
+        for (; next < num_rebuilt && batch_len < REBUILD_BATCH_SIZE; next++) {
+            if (rebuilt[next].val.ov_flags & OMAP_VAL_ENCRYPTED) {
+                (*num_encrypted)++;
+                continue;
+            }
+            reqs[batch_len].buffer      = targets + batch_len * nx_block_size;
+            reqs[batch_len].start_block = rebuilt[next].val.ov_paddr;
+            reqs[batch_len].num_blocks  = 1;
+            req_mappings[batch_len]     = next;
+            batch_len++;
+        }
+        aio_read_batch(reqs, batch_len);
+
+        for (uint32_t i = 0; i < batch_len; i++) {
+            omap_mapping_t* mapping = rebuilt + req_mappings[i];
+            obj_phys_t* target = reqs[i].buffer;
+            if (   reqs[i].result == 1
+                && target->o_oid == mapping->key.ok_oid
+                && target->o_xid == mapping->key.ok_xid
+                && is_cksum_valid(target)
+            ) {
+                (*num_valid)++;
+            }
+        }
+    }
+
+    free(reqs);
+    free(req_mappings);
+    free(targets);
+}
+
+/** Writing **/
+
+paddr_t write_next_addr = 0;
+
+// The space manager of the latest checkpoint, which says which blocks are
+// allocated; NULL if it couldn't be read.
+spaceman_phys_t* spaceman = NULL;
+
+/**
+ * Read the space manager of the checkpoint that a given container superblock
+ * belongs to, by way of that checkpoint's mapping blocks.
+ *
+ * RETURN VALUE:    A pointer to the space manager, which the caller must free,
+ *      or NULL if it couldn't be found or is invalid.
+ */
+spaceman_phys_t* read_spaceman(nx_superblock_t* nxsb) {
+    checkpoint_map_phys_t* cpm = malloc(nx_block_size);
+    if (!cpm) {
+        fprintf(stderr, "\nABORT: read_spaceman: Could not allocate sufficient memory for `cpm`.\n");
+        exit(-1);
+    }
+
+    paddr_t sm_addr = 0;
+    uint32_t sm_size = 0;
+    uint32_t max_mappings = (nx_block_size - sizeof(checkpoint_map_phys_t)) / sizeof(checkpoint_mapping_t);
+    for (uint32_t i = 0; i < nxsb->nx_xp_desc_len && !sm_addr; i++) {
+        paddr_t addr = nxsb->nx_xp_desc_base + (nxsb->nx_xp_desc_index + i) % nxsb->nx_xp_desc_blocks;
+        if (read_blocks(cpm, addr, 1) != 1 || !is_cksum_valid(cpm) || !is_checkpoint_map_phys(cpm)
+            || cpm->cpm_o.o_xid != nxsb->nx_o.o_xid
+        ) {
+            continue;
+        }
+        for (uint32_t j = 0; j < cpm->cpm_count && j < max_mappings; j++) {
+            if (cpm->cpm_map[j].cpm_oid == nxsb->nx_spaceman_oid) {
+                sm_addr = cpm->cpm_map[j].cpm_paddr;
+                sm_size = cpm->cpm_map[j].cpm_size;
+                break;
+            }
+        }
+    }
+    free(cpm);
+    if (!sm_addr || sm_size < sizeof(spaceman_phys_t) || sm_size % nx_block_size != 0 || sm_size > 64 * nx_block_size) {
+        return NULL;
+    }
+
+    spaceman_phys_t* sm = malloc(sm_size);
+    if (!sm) {
+        fprintf(stderr, "\nABORT: read_spaceman: Could not allocate sufficient memory for `sm`.\n");
+        exit(-1);
+    }
+    if (read_blocks(sm, sm_addr, sm_size / nx_block_size) != sm_size / nx_block_size
+        || fletcher_cksum_sized((uint32_t*)sm, sm_size, true) != *(uint64_t*)sm
+        || (sm->sm_o.o_type & OBJECT_TYPE_MASK) != OBJECT_TYPE_SPACEMAN
+        || sm->sm_blocks_per_chunk == 0 || sm->sm_chunks_per_cib == 0
+        || sm->sm_dev[SD_MAIN].sm_addr_offset >= sm_size
+        || (sm_size - sm->sm_dev[SD_MAIN].sm_addr_offset) / sizeof(paddr_t) < sm->sm_dev[SD_MAIN].sm_cib_count
+    ) {
+        free(sm);
+        return NULL;
+    }
+    return sm;
+}
+
+/**
+ * Determine whether the space manager says that a given block, on the main
+ * device, is allocated.
+ *
+ * RETURN VALUE:    1 if the block is allocated, 0 if it is free, or -1 if the
+ *      space manager's records of it couldn't be read.
+ */
+int is_block_allocated(spaceman_phys_t* sm, paddr_t addr) {
+    if (addr < 0 || (uint64_t)addr >= sm->sm_dev[SD_MAIN].sm_block_count) {
+        return -1;
+    }
+    uint64_t chunk_index = addr / sm->sm_blocks_per_chunk;
+    uint64_t cib_index = chunk_index / sm->sm_chunks_per_cib;
+    paddr_t* addrs = (paddr_t*)((char*)sm + sm->sm_dev[SD_MAIN].sm_addr_offset);
+
+    // The space manager lists the chunk-info blocks themselves, or, on large
+    // devices, chunk-info address blocks that list them.
+    paddr_t cib_addr = 0;
+    if (sm->sm_dev[SD_MAIN].sm_cab_count == 0) {
+        if (cib_index < sm->sm_dev[SD_MAIN].sm_cib_count) {
+            cib_addr = addrs[cib_index];
+        }
+    } else if (sm->sm_cibs_per_cab > 0 && cib_index / sm->sm_cibs_per_cab < sm->sm_dev[SD_MAIN].sm_cab_count) {
+        cib_addr_block_t* cab = read_object("A chunk-info address block", addrs[cib_index / sm->sm_cibs_per_cab]);
+        if (cab) {
+            uint32_t index = cib_index % sm->sm_cibs_per_cab;
+            if (index < cab->cab_cib_count) {
+                cib_addr = cab->cab_cib_addr[index];
+            }
+            free(cab);
+        }
+    }
+    if (!cib_addr) {
+        return -1;
+    }
+
+    chunk_info_block_t* cib = read_object("A chunk-info block", cib_addr);
+    if (!cib) {
+        return -1;
+    }
+    uint32_t index = chunk_index % sm->sm_chunks_per_cib;
+    if (index >= cib->cib_chunk_info_count) {
+        free(cib);
+        return -1;
+    }
+    chunk_info_t info = cib->cib_chunk_info[index];
+    free(cib);
+
+    if ((uint64_t)addr < info.ci_addr || (uint64_t)addr - info.ci_addr >= info.ci_block_count) {
+        return -1;
+    }
+    if (info.ci_free_count == 0) {
+        return 1;
+    }
+    if (info.ci_free_count == info.ci_block_count || info.ci_bitmap_addr == 0) {
+        return 0;
+    }
+
+    uint8_t* bitmap = malloc(nx_block_size);
+    if (!bitmap) {
+        fprintf(stderr, "\nABORT: is_block_allocated: Could not allocate sufficient memory for `bitmap`.\n");
+        exit(-1);
+    }
+    uint64_t bit = addr - info.ci_addr;
+    int allocated = read_blocks(bitmap, info.ci_bitmap_addr, 1) == 1
+        ? (bitmap[bit / 8] >> (bit % 8)) & 1
+        : -1;
+    free(bitmap);
+    return allocated;
+}
+
+/**
+ * Store a node of the rebuilt tree in the next block of the range given by
+ * `--write`; see `tree_builder_store_t`.
+ */
+oid_t store_rebuilt_node(tree_builder_t* tree, btree_node_phys_t* node) {
+    if (write_next_addr >= rebuild_write_end) {
+        fprintf(stderr, "\nABORT: The range of blocks given by `--write` is too small for the rebuilt tree.\n");
+        exit(-1);
+    }
+    paddr_t addr = write_next_addr++;
+
+    // The tree isn't added to the space manager, so it must be written to
+    // blocks that are already allocated, such as those of the tree it
+    // replaces; otherwise, they could be allocated again and overwritten.
+    if (!rebuild_force) {
+        int allocated = spaceman ? is_block_allocated(spaceman, addr) : -1;
+        if (allocated != 1) {
+            fprintf(stderr, "\nABORT: Block %#llx, in the range given by `--write`, %s; use `--force` to write to it anyway.\n",
+                addr, allocated == 0 ? "is not allocated in the space manager" : "can't be confirmed to be allocated in the space manager"
+            );
+            exit(-1);
+        }
+    }
+
+    if (!rebuild_force) {
+        obj_phys_t* existing = tree->context;
+        if (read_blocks(existing, addr, 1) == 1 && is_cksum_valid(existing)) {
+            fprintf(stderr, "\nABORT: Block %#llx, in the range given by `--write`, holds a valid object; use `--force` to overwrite it.\n", addr);
+            exit(-1);
+        }
+    }
+
+    finish_object(node, addr, node->btn_o.o_xid, node->btn_o.o_type, node->btn_o.o_subtype);
+    batch_put_block(node, addr, true);
+    return addr;
+}
+
+/**
+ * Look up an object in a container's object map.
+ *
+ * RETURN VALUE:    The address of the object, or 0 if it can't be found.
+ */
+paddr_t resolve_nx_object(nx_superblock_t* nxsb, oid_t oid) {
+    omap_phys_t* nx_omap = read_object("The container object map", nxsb->nx_omap_oid);
+    if (!nx_omap) {
+        return 0;
+    }
+    btree_node_phys_t* nx_omap_btree = read_object("The container object map B-tree", nx_omap->om_tree_oid);
+    free(nx_omap);
+    if (!nx_omap_btree) {
+        return 0;
+    }
+    omap_val_t* val = get_btree_phys_omap_val(nx_omap_btree, oid, nxsb->nx_o.o_xid);
+    free(nx_omap_btree);
+    if (!val) {
+        return 0;
+    }
+    paddr_t addr = val->ov_paddr;
+    free(val);
+    return addr;
+}
+
+int main(int argc, char** argv) {
+    setbuf(stdout, NULL);
+    printf("\n");
+
+    output_format_supported = true;
+
+    // Extrapolate CLI arguments, exit if invalid
+    if (!parse_rebuild_options(&argc, argv) || !parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (argc != 2 && argc != 3) {
+        printf("Incorrect number of arguments.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    nx_path = argv[1];
+
+    uint32_t volume_id = 0;
+    bool volume_given = argc == 3;
+    if (volume_given && sscanf(argv[2], "%u", &volume_id) != 1) {
+        printf("%s is not a valid volume ID.\n", argv[2]);
+        print_usage(argv[0]);
+        return 1;
+    }
+    bool writing = rebuild_write_end != 0;
+
+    // Open (device special) file corresponding to an APFS container; for
+    // reading and writing only if the rebuilt tree is to be written, with mode
+    // "r+b" rather than "w+b", which would truncate an image file.
+    printf("Opening file at `%s` in %s mode ... ", nx_path, writing ? "read-and-write" : "read-only");
+    nx = fopen(nx_path, writing ? "r+b" : "rb");
+    if (!nx) {
+        fprintf(stderr, "\nABORT: ");
+        report_fopen_error();
+        printf("\n");
+        return -errno;
+    }
+    printf("OK.\n");
+    detect_block_size();
+
+    stats_phase("mount");
+    nx_superblock_t* nxsb = malloc(nx_block_size);
+    if (!nxsb) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `nxsb`.\n");
+        return -1;
+    }
+    if (read_blocks(nxsb, 0x0, 1) != 1) {
+        fprintf(stderr, "\nABORT: Failed to read block 0x0.\n");
+        return -1;
+    }
+
+    // Find the latest container superblock in the checkpoint descriptor area,
+    // if block 0 is intact enough to say where that is.
+    xid_t xid_latest_nx = 0;
+    if (is_cksum_valid(nxsb) && is_nx_superblock(nxsb) && nxsb->nx_magic == NX_MAGIC && !(nxsb->nx_xp_desc_blocks >> 31)) {
+        uint32_t xp_desc_blocks = nxsb->nx_xp_desc_blocks;
+        char (*xp_desc)[nx_block_size] = malloc(xp_desc_blocks * nx_block_size);
+        if (!xp_desc) {
+            fprintf(stderr, "\nABORT: Could not allocate sufficient memory for %u blocks.\n", xp_desc_blocks);
+            return -1;
+        }
+        if (read_blocks(xp_desc, nxsb->nx_xp_desc_base, xp_desc_blocks) == xp_desc_blocks) {
+            for (uint32_t i = 0; i < xp_desc_blocks; i++) {
+                nx_superblock_t* candidate = xp_desc[i];
+                if (is_cksum_valid(candidate) && is_nx_superblock(candidate) && candidate->nx_magic == NX_MAGIC
+                    && candidate->nx_o.o_xid > xid_latest_nx
+                ) {
+                    xid_latest_nx = candidate->nx_o.o_xid;
+                    memcpy(nxsb, candidate, sizeof(nx_superblock_t));
+                }
+            }
+        }
+        free(xp_desc);
+    }
+    if (xid_latest_nx == 0) {
+        printf("!! APFS ERROR !! There is no valid container superblock; scanning up to the end of the device.\n");
+    } else {
+        printf("The latest checkpoint has XID %#llx.\n", xid_latest_nx);
+    }
+    if (volume_given && (volume_id >= NX_MAX_FILE_SYSTEMS || (xid_latest_nx && nxsb->nx_fs_oid[volume_id] == 0))) {
+        printf("The container has no volume with ID %u.\n", volume_id);
+        return 1;
+    }
+
+    xid_t target_xid = rebuild_xid ? rebuild_xid : xid_latest_nx;
+    paddr_t scan_start = rebuild_start;
+    paddr_t end_addr = rebuild_end ? rebuild_end : (xid_latest_nx ? (paddr_t)nxsb->nx_block_count : INT64_MAX);
+
+    /** Carve object map leaf nodes **/
+
+    stats_phase("scan");
+    printf("Scanning blocks %#llx to %#llx for object map leaf nodes ...\n", scan_start, end_addr - 1);
+    progress_t progress;
+    progress_init(&progress, xid_latest_nx || rebuild_end ? (uint64_t)(end_addr - scan_start) : 0);
+
+    scan_t scan;
+    scan_init(&scan, scan_start, end_addr);
+    uint32_t* survivors = malloc(scan.chunk_blocks * sizeof(uint32_t));
+    if (!survivors) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `survivors`.\n");
+        return -1;
+    }
+    paddr_t chunk_addr;
+    char* chunk;
+    size_t chunk_len;
+    while ( (chunk_len = scan_next_chunk(&scan, &chunk_addr, &chunk)) ) {
+        progress_add_blocks(&progress, chunk_len);
+        // Only blocks that pass the header prefilter can be leaves.
+        size_t num_survivors = prefilter_objects(chunk, chunk_len, survivors);
+        for (size_t i = 0; i < num_survivors; i++) {
+            btree_node_phys_t* node = (btree_node_phys_t*)(chunk + survivors[i] * nx_block_size);
+            if (carve_leaf(node, chunk_addr + survivors[i], target_xid)) {
+                progress_add_matches(&progress, 1);
+            }
+        }
+        progress_update(&progress);
+    }
+    scan_end(&scan);
+    free(survivors);
+    progress_clear(&progress);
+    printf("Found %u leaf nodes with %llu mappings.\n", num_leaves, num_carved_mappings);
+
+    if (target_xid == 0) {
+        for (uint32_t i = 0; i < num_leaves; i++) {
+            if (leaves[i].xid > target_xid) {
+                target_xid = leaves[i].xid;
+            }
+        }
+    }
+    printf("Rebuilding the %s object map as of XID %#llx.\n", volume_given ? "volume" : "container", target_xid);
+
+    /** Tell apart the leaves of the container and volume object maps **/
+
+    stats_phase("classify");
+    classify_leaves();
+    bool* leaf_accepted = malloc(num_leaves * sizeof(bool) + 1);
+    if (!leaf_accepted) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `leaf_accepted`.\n");
+        return -1;
+    }
+    uint32_t num_per_kind[3] = { 0 };
+    uint32_t num_accepted = 0;
+    for (uint32_t i = 0; i < num_leaves; i++) {
+        uint8_t kind = leaves[i].kind;
+        num_per_kind[kind]++;
+        // Leaves whose targets have all been overwritten since may still
+        // hold the newest mappings of other objects, so volume object maps
+        // take them too; volume superblocks are rarely overwritten.
+        leaf_accepted[i] = volume_given ? kind != LEAF_CONTAINER : kind == LEAF_CONTAINER;
+        num_accepted += leaf_accepted[i];
+    }
+    printf("Leaves of the container object map: %u; of volume object maps: %u; unknown: %u. Using %u.\n",
+        num_per_kind[LEAF_CONTAINER], num_per_kind[LEAF_VOLUME], num_per_kind[LEAF_UNKNOWN], num_accepted);
+
+    /** Merge the mappings **/
+
+    stats_phase("merge");
+    if (spill) {
+        printf("Merging %u sorted runs ...\n", num_runs + (sort_buffer_len > 0));
+    }
+    finish_sort();
+    merge_runs(leaf_accepted, target_xid);
+    printf("Rebuilt %zu mappings; %llu older or duplicate mappings were superseded, %llu OIDs were deleted,\n", num_rebuilt, num_superseded_mappings, num_deleted_oids);
+    printf("and %llu mappings were in leaves of other object maps.\n", num_foreign_mappings);
+    free(leaf_accepted);
+
+    if (rebuild_list) {
+        for (size_t i = 0; i < num_rebuilt; i++) {
+            omap_mapping_t* mapping = rebuilt + i;
+            if (is_structured_output()) {
+                record_begin("mapping");
+                record_uint("oid",      mapping->key.ok_oid);
+                record_uint("xid",      mapping->key.ok_xid);
+                record_uint("flags",    mapping->val.ov_flags);
+                record_uint("size",     mapping->val.ov_size);
+                record_uint("paddr",    mapping->val.ov_paddr);
+                record_end();
+            } else {
+                printf("- OID %#9llx, XID %#9llx => block %#9llx%s\n",
+                    mapping->key.ok_oid,
+                    mapping->key.ok_xid,
+                    mapping->val.ov_paddr,
+                    (mapping->val.ov_flags & OMAP_VAL_ENCRYPTED) ? " (encrypted)" : ""
+                );
+            }
+        }
+    }
+
+    if (rebuild_verify) {
+        stats_phase("verify");
+        uint64_t num_valid, num_encrypted;
+        verify_rebuilt(&num_valid, &num_encrypted);
+        printf("Verified the mapped objects: %llu are intact, %llu are not, and %llu are encrypted and weren't checked.\n",
+            num_valid, num_rebuilt - num_valid - num_encrypted, num_encrypted);
+    }
+
+    // With a volume, check that the file-system tree can now be found.
+    apfs_superblock_t* apsb = NULL;
+    if (volume_given && xid_latest_nx) {
+        paddr_t apsb_addr = resolve_nx_object(nxsb, nxsb->nx_fs_oid[volume_id]);
+        if (apsb_addr) {
+            apsb = read_object("The volume superblock", apsb_addr);
+        }
+    }
+    if (apsb) {
+        // The rebuilt object map has one mapping per OID, in OID order.
+        oid_t root_oid = apsb->apfs_root_tree_oid;
+        omap_mapping_t* found = NULL;
+        size_t lo = 0, hi = num_rebuilt;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (rebuilt[mid].key.ok_oid < root_oid) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < num_rebuilt && rebuilt[lo].key.ok_oid == root_oid) {
+            found = rebuilt + lo;
+        }
+        if (found) {
+            printf("The file-system root tree of volume %u (%s) is mapped to block %#llx.\n", volume_id, apsb->apfs_volname, found->val.ov_paddr);
+        } else {
+            printf("!! The file-system root tree of volume %u (%s), Virtual OID %#llx, is not in the rebuilt object map.\n",
+                volume_id, apsb->apfs_volname, apsb->apfs_root_tree_oid);
+        }
+    }
+
+    stats_phase(NULL);
+    if (!writing) {
+        printf("\n");
+        return 0;
+    }
+
+    /** Write the rebuilt tree and make the object map use it **/
+
+    if (num_rebuilt == 0) {
+        fprintf(stderr, "\nABORT: The rebuilt object map is empty; not writing it.\n");
+        return -1;
+    }
+
+    paddr_t omap_addr = rebuild_omap_addr;
+    if (!omap_addr && !volume_given && xid_latest_nx) {
+        omap_addr = nxsb->nx_omap_oid;
+    }
+    if (!omap_addr && apsb) {
+        omap_addr = apsb->apfs_omap_oid;
+    }
+    if (!omap_addr) {
+        fprintf(stderr, "\nABORT: The object map to update couldn't be found; give its address with `--omap`.\n");
+        return -1;
+    }
+
+    omap_phys_t* omap = batch_get_block(omap_addr, true);
+    if (!omap) {
+        fprintf(stderr, "\nABORT: Failed to read the object map at block %#llx.\n", omap_addr);
+        return -1;
+    }
+    if (!is_cksum_valid(omap) || (omap->om_o.o_type & OBJECT_TYPE_MASK) != OBJECT_TYPE_OMAP) {
+        if (!rebuild_force) {
+            fprintf(stderr, "\nABORT: Block %#llx is not a valid object map; use `--force` to update it anyway.\n", omap_addr);
+            return -1;
+        }
+        printf("Block %#llx is not a valid object map; updating it anyway.\n", omap_addr);
+    }
+    if (omap->om_snap_count > 0) {
+        printf("The object map has %u snapshots; the rebuilt tree only maps the newest version of each object.\n", omap->om_snap_count);
+    }
+
+    if (xid_latest_nx) {
+        spaceman = read_spaceman(nxsb);
+    }
+    if (!spaceman) {
+        if (!rebuild_force) {
+            fprintf(stderr, "\nABORT: The space manager couldn't be read, so the blocks given by `--write` can't be confirmed to be allocated; use `--force` to write to them anyway.\n");
+            return -1;
+        }
+        printf("The space manager couldn't be read; writing to the blocks given by `--write` without checking that they are allocated.\n");
+    }
+
+    printf("Building the new tree in blocks %#llx to %#llx ... ", rebuild_write_start, rebuild_write_end - 1);
+    write_next_addr = rebuild_write_start;
+    obj_phys_t* existing = malloc(nx_block_size);
+    if (!existing) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `existing`.\n");
+        return -1;
+    }
+    oid_t tree_oid = build_omap_tree(rebuilt, num_rebuilt, target_xid, store_rebuilt_node, existing);
+    free(existing);
+    printf("OK; %llu nodes, with the root at block %#llx.\n", write_next_addr - rebuild_write_start, tree_oid);
+
+    // The object map is staged, and is modified in place.
+    omap->om_tree_type  = OBJ_PHYSICAL | OBJECT_TYPE_BTREE;
+    omap->om_tree_oid   = tree_oid;
+
+    size_t num_staged = batch_num_blocks;
+    if (undo_path) {
+        printf("Writing %zu blocks, saving their original contents to `%s` ... ", num_staged, undo_path);
+    } else {
+        printf("Writing %zu blocks, without saving their original contents ... ", num_staged);
+    }
+    size_t num_written = batch_commit(undo_path);
+    if (num_written != num_staged) {
+        fprintf(stderr, "\nABORT: Only %zu of %zu blocks were written.", num_written, num_staged);
+        if (undo_path && num_written > 0) {
+            fprintf(stderr, " Use `apfs-modify --rollback=%s` to restore the blocks that were.", undo_path);
+        }
+        fprintf(stderr, "\n");
+        return -1;
+    }
+    printf("OK.\n");
+    if (undo_path) {
+        printf("To undo these changes, run `apfs-modify --rollback=%s %s`.\n", undo_path, nx_path);
+    }
+
+    free(spaceman);
+    free(apsb);
+    free(rebuilt);
+    free(leaves);
+    free(nxsb);
+    fclose(nx);
+    printf("\n");
+    return 0;
+}
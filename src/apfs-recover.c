@@ -5,6 +5,8 @@
 #include <string.h>
 
 #include "apfs/io.h"
+#include "apfs/io/scan.h"
+#include "apfs/options.h"
 #include "apfs/func/boolean.h"
 #include "apfs/func/cksum.h"
 #include "apfs/func/btree.h"
@@ -30,7 +32,8 @@
  * Print usage info for this program.
  */
 void print_usage(char* program_name) {
-    fprintf(stderr, "Usage:   %s <container> <volume ID> <path in volume>\nExample: %s /dev/disk0s2  0  /Users/john/Documents\n\n", program_name, program_name);
+    fprintf(stderr, "Usage:   %s [options] <container> <volume ID> <path in volume>\nExample: %s /dev/disk0s2  0  /Users/john/Documents\n\n", program_name, program_name);
+    print_common_options_usage(stderr);
 }
 
 void print_fs_records(j_rec_t** fs_records) {
@@ -154,6 +157,10 @@ int main(int argc, char** argv) {
     setbuf(stdout, NULL);
 
     // Extrapolate CLI arguments, exit if invalid
+    if (!parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
     if (argc != 4) {
         fprintf(stderr, "Incorrect number of arguments.\n");
         print_usage(argv[0]);
@@ -181,6 +188,8 @@ int main(int argc, char** argv) {
         return -errno;
     }
     fprintf(stderr, "OK.\nSimulating a mount of the APFS container.\n");
+    stats_phase("mount");
+    detect_block_size();
     
     // Using `nx_superblock_t*`, but allocating a whole block of memory.
     // This way, we can read the entire block and validate its checksum,
@@ -520,13 +529,19 @@ int main(int argc, char** argv) {
     }
     fprintf(stderr, "corresponding block address is 0x%llx.\n", fs_root_val->ov_paddr);
 
+    // The file-system tree of an encrypted volume is encrypted.
+    if ((fs_root_val->ov_flags & OMAP_VAL_ENCRYPTED) && !unlock_volume(nxsb, apsb)) {
+        fprintf(stderr, "\nABORT: Could not unlock the volume.\n");
+        return -1;
+    }
+
     fprintf(stderr, "Reading ... ");
     btree_node_phys_t* fs_root_btree = malloc(nx_block_size);
     if (!fs_root_btree) {
         fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `fs_root_btree`.\n");
         return -1;
     }
-    if (read_blocks(fs_root_btree, fs_root_val->ov_paddr, 1) != 1) {
+    if (read_fs_node_cached(fs_root_btree, fs_root_val) != 1) {
         fprintf(stderr, "\nABORT: Failed to read block 0x%llx.\n", fs_root_val->ov_paddr);
         return -1;
     }
@@ -539,6 +554,7 @@ int main(int argc, char** argv) {
     }
     fprintf(stderr, "OK.\n");
 
+    stats_phase("path lookup");
     oid_t fs_oid = 0x2;
 
     j_rec_t** fs_records = get_fs_records(fs_omap_btree, fs_root_btree, fs_oid, (xid_t)(~0) );
@@ -595,12 +611,7 @@ int main(int argc, char** argv) {
     print_fs_records(fs_records);
 
     // Output content from all matching file extents
-    char* buffer = malloc(nx_block_size);
-    if (!buffer) {
-        fprintf(stderr, "Could not allocate sufficient memory for `buffer`.\n");
-        return -1;
-    }
-
+    stats_phase("data copy");
     bool found_file_extent = false;
     for (j_rec_t** fs_rec_cursor = fs_records; *fs_rec_cursor; fs_rec_cursor++) {
         j_rec_t* fs_rec = *fs_rec_cursor;
@@ -610,19 +621,40 @@ int main(int argc, char** argv) {
             j_file_extent_val_t* val = fs_rec->data + fs_rec->key_len;
 
             // Output the content from this particular file extent
-            uint64_t block_addr = val->phys_block_num;
-
             uint64_t extent_len_blocks = (val->len_and_flags & J_FILE_EXTENT_LEN_MASK) / nx_block_size;
-            for (uint64_t i = 0;   i < extent_len_blocks;   i++, block_addr++) {
-                if (read_blocks(buffer, block_addr, 1) != 1) {
-                    fprintf(stderr, "\n\nEncountered an error reading block %#llx (block %llu of %llu). Exiting.\n\n", block_addr, i+1, extent_len_blocks);
-                    return -1;
+            uint64_t num_written = 0;
+
+            scan_t scan;
+            scan_init(&scan, val->phys_block_num, val->phys_block_num + extent_len_blocks);
+            scan.skip_errors = false;
+
+            paddr_t chunk_addr;
+            char* chunk;
+            size_t chunk_len;
+            while ( (chunk_len = scan_next_chunk(&scan, &chunk_addr, &chunk)) ) {
+                if (crypto_unlocked) {
+                    decrypt_file_data(chunk, chunk_len * nx_block_size,
+                        val->crypto_id + (chunk_addr - val->phys_block_num) * (nx_block_size / AES_XTS_UNIT_SIZE)
+                    );
                 }
-                
-                if (fwrite(buffer, nx_block_size, 1, stdout) != 1) {
-                    fprintf(stderr, "\n\nEncountered an error writing block %llu of %llu to `stdout`. Exiting.\n\n", i+1, extent_len_blocks);
+                if (fwrite(chunk, nx_block_size, chunk_len, stdout) != chunk_len) {
+                    fprintf(stderr, "\n\nEncountered an error writing blocks %llu to %llu of %llu to `stdout`. Exiting.\n\n", num_written+1, num_written+chunk_len, extent_len_blocks);
                     return -1;
                 }
+                num_written += chunk_len;
+            }
+            scan_end(&scan);
+
+            if (io_rescue) {
+                uint64_t num_bad_blocks = rescue_count_bad(val->phys_block_num, extent_len_blocks);
+                if (num_bad_blocks > 0) {
+                    fprintf(stderr, "Warning: %llu of the %llu blocks of the extent at %#llx could not be read, and were replaced with zeroes.\n", num_bad_blocks, extent_len_blocks, val->phys_block_num);
+                }
+            }
+
+            if (num_written != extent_len_blocks) {
+                fprintf(stderr, "\n\nEncountered an error reading block %#llx (block %llu of %llu). Exiting.\n\n", val->phys_block_num + num_written, num_written+1, extent_len_blocks);
+                return -1;
             }
         }
     }
@@ -5,6 +5,7 @@
 #include <string.h>
 
 #include "apfs/io.h"
+#include "apfs/options.h"
 #include "apfs/func/boolean.h"
 #include "apfs/func/cksum.h"
 #include "apfs/func/btree.h"
@@ -30,14 +31,19 @@
  * Print usage info for this program.
  */
 void print_usage(char* program_name) {
-    printf("Usage:   %s <container>\nExample: %s /dev/disk0s2\n\n", program_name, program_name);
+    printf("Usage:   %s [options] <container>\nExample: %s /dev/disk0s2\n\n", program_name, program_name);
+    print_common_options_usage(stdout);
 }
 
 int main(int argc, char** argv) {
-    setbuf(stdout, NULL);
+    set_dump_stdout_buffering();
     printf("\n");
 
     // Extrapolate CLI arguments, exit if invalid
+    if (!parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
     if (argc != 2) {
         printf("Incorrect number of arguments.\n");
         print_usage(argv[0]);
@@ -55,6 +61,7 @@ int main(int argc, char** argv) {
         return -errno;
     }
     printf("OK.\nSimulating a mount of the APFS container.\n");
+    detect_block_size();
     
     // Using `nx_superblock_t*`, but allocating a whole block of memory.
     // This way, we can read the entire block and validate its checksum,
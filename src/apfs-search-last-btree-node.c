@@ -5,8 +5,13 @@
 #include <string.h>
 
 #include "apfs/io.h"
+#include "apfs/io/scan.h"
+#include "apfs/options.h"
 #include "apfs/func/boolean.h"
 #include "apfs/func/cksum.h"
+#include "apfs/func/prefilter.h"
+#include "apfs/func/sink.h"
+#include "apfs/func/shard.h"
 #include "apfs/func/btree.h"
 
 #include "apfs/struct/object.h"
@@ -25,19 +30,30 @@
 #include "apfs/string/btree.h"
 #include "apfs/string/fs.h"
 #include "apfs/string/j.h"
+#include "apfs/string/record.h"
+#include "apfs/string/progress.h"
 
 /**
  * Print usage info for this program.
  */
 void print_usage(char* program_name) {
-    printf("Usage:   %s <container>\nExample: %s /dev/disk0s2\n\n", program_name, program_name);
+    printf("Usage:   %s [options] [--dedupe] [--top-k=N] [--shard=I/N] <container>\nExample: %s --top-k=1 /dev/disk0s2\n\n", program_name, program_name);
+    print_sink_options_usage(stdout);
+    print_shard_options_usage(stdout);
+    print_common_options_usage(stdout);
 }
 
 int main(int argc, char** argv) {
-    setbuf(stdout, NULL);
+    set_dump_stdout_buffering();
     printf("\n");
 
+    output_format_supported = true;
+
     // Extrapolate CLI arguments, exit if invalid
+    if (!parse_sink_options(&argc, argv) || !parse_shard_options(&argc, argv) || !parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
     if (argc != 2) {
         printf("Incorrect number of arguments.\n");
         print_usage(argv[0]);
@@ -55,6 +71,7 @@ int main(int argc, char** argv) {
         return -errno;
     }
     printf("OK.\n");
+    detect_block_size();
 
     obj_phys_t* block = malloc(nx_block_size);
     if (!block) {
@@ -73,52 +90,90 @@ int main(int argc, char** argv) {
     printf("The specified device has %llu = %#llx blocks. Commencing search:\n\n", num_blocks, num_blocks);
 
     uint64_t num_matches = 0;
-    uint64_t first_match_addr = 0;
-    uint64_t last_match_addr = 0;
-
-    printf("First match: %#llx\n", first_match_addr);
-    printf("Last match:  %#llx\n", last_match_addr);
-
-    for (uint64_t addr = 0xa5e3b; addr < 0x13adf2; addr++) {
-        printf("\rReading %#llx ...", addr);
-
-        if (read_blocks(block, addr, 1) != 1) {
-            if (feof(nx)) {
-                printf("Reached end of file; ending search.\n");
-                break;
-            }
-
-            assert(ferror(nx));
-            printf("- An error occurred whilst reading block %#llx.\n", addr);
-            continue;
-        }
+    const char* criterion_names[] = { "btree_leaf" };
+    result_sink_t sink;
+    sink_init(&sink, 1, criterion_names);
+
+    // Keep the superblock to identify the container in any shard file; the
+    // scan provides its own buffers from here on.
+    nx_superblock_t nxsb = *(nx_superblock_t*)block;
+    free(block);
+
+    uint64_t start_addr = 0xa5e3b;
+    uint64_t end_addr   = 0x13adf2;
+
+    // The part of the range that this shard scans, if the scan is partitioned;
+    // see `func/shard.h`.
+    scan_range_t* ranges;
+    size_t num_ranges = shard_ranges(start_addr, end_addr, num_blocks, &ranges);
+    print_shard_ranges(ranges, num_ranges);
+    shard_add_config(prefilter_params, sizeof(prefilter_params));
+
+    progress_t progress;
+    progress_init(&progress, count_range_blocks(ranges, num_ranges));
+
+    scan_t scan;
+    scan_init_ranges(&scan, ranges, num_ranges);
+
+    // Indices of the blocks of each chunk that pass the header prefilter;
+    // only these are checksummed.
+    uint32_t* survivors = malloc(scan.chunk_blocks * sizeof(uint32_t));
+    if (!survivors) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `survivors`.\n");
+        return -1;
+    }
 
-        /** Search criteria for dentries of items with certain names **/
-        if (   is_cksum_valid(block)
-            && is_btree_node_phys(block)
-        ) {
-            btree_node_phys_t* node = block;
-            
-            if (node->btn_flags & BTNODE_LEAF) {
-                num_matches++;
-                last_match_addr = addr;
-                if (first_match_addr == 0) {
-                    first_match_addr = addr;
+    paddr_t chunk_addr;
+    char* chunk;
+    size_t chunk_len;
+    while ( (chunk_len = scan_next_chunk(&scan, &chunk_addr, &chunk)) ) {
+        progress_add_blocks(&progress, chunk_len);
+        size_t num_survivors = prefilter_objects(chunk, chunk_len, survivors);
+
+        for (size_t i = 0; i < num_survivors; i++) {
+            paddr_t addr = chunk_addr + survivors[i];
+            block = (obj_phys_t*)(chunk + survivors[i] * nx_block_size);
+
+            /** Search criteria for dentries of items with certain names **/
+            if (   is_cksum_valid(block)
+                && is_btree_node_phys(block)
+            ) {
+                btree_node_phys_t* node = block;
+                
+                if (node->btn_flags & BTNODE_LEAF) {
+                    num_matches++;
+                    progress_add_matches(&progress, 1);
+                    if (sink_add(&sink, 0, node->btn_o.o_oid, node->btn_o.o_xid, addr) && is_structured_output()) {
+                        record_begin("match");
+                        record_string("query",  "btree_leaf");
+                        record_uint("addr",     addr);
+                        record_uint("oid",      node->btn_o.o_oid);
+                        record_uint("xid",      node->btn_o.o_xid);
+                        record_end();
+                    }
                 }
-                // Move to start of line,
-                // clear whole line (which reads "Reading 0x..."),
-                // move up one line,
-                // clear whole line (which reads "Last match: 0x..."),
-                // move up one line,
-                // clear whole line (which reads "First match: 0x...")
-                printf("\r\033[2K\033[A\033[2K\033[A\033[2K");
-                printf("First match: %#llx\n", first_match_addr);
-                printf("Last match:  %#llx\n", last_match_addr);
             }
         }
+        progress_update(&progress);
+    }
+    scan_end(&scan);
+    free(survivors);
+    progress_clear(&progress);
+
+    if (shard_output_path) {
+        printf("Writing the results of shard %u of %u to `%s` ... ", shard_index, shard_count, shard_output_path);
+        if (!shard_write(shard_output_path, "apfs-search-last-btree-node", &nxsb, &sink, ranges, num_ranges)) {
+            return -1;
+        }
+        printf("OK.\n");
     }
+    free(ranges);
 
-    printf("\n\nFinished search; found %llu results.\n\n", num_matches);
+    printf("First match: %#llx\n", num_matches ? sink.criteria[0].first_addr : 0);
+    printf("Last match:  %#llx\n", num_matches ? sink.criteria[0].last_addr : 0);
+    sink_report(&sink);
+    sink_free(&sink);
+    printf("\nFinished search; found %llu results.\n\n", num_matches);
     
     return 0;
 }
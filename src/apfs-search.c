@@ -5,8 +5,13 @@
 #include <string.h>
 
 #include "apfs/io.h"
+#include "apfs/io/scan.h"
+#include "apfs/options.h"
 #include "apfs/func/boolean.h"
 #include "apfs/func/cksum.h"
+#include "apfs/func/prefilter.h"
+#include "apfs/func/sink.h"
+#include "apfs/func/shard.h"
 #include "apfs/func/btree.h"
 
 #include "apfs/struct/object.h"
@@ -25,19 +30,49 @@
 #include "apfs/string/btree.h"
 #include "apfs/string/fs.h"
 #include "apfs/string/j.h"
+#include "apfs/string/record.h"
+#include "apfs/string/progress.h"
+
+// The search criteria, whose matches are aggregated in a result sink; see
+// `func/sink.h`.
+enum {
+    SEARCH_OMAP_LEAF,
+    SEARCH_VIRTUAL_OID,
+    SEARCH_FS_OID,
+    SEARCH_DENTRY_NAME,
+    SEARCH_DENTRY_TARGET,
+    SEARCH_NUM_CRITERIA
+};
+
+const char* search_criterion_names[SEARCH_NUM_CRITERIA] = {
+    "omap_leaf",
+    "virtual_oid",
+    "fs_oid",
+    "dentry_name",
+    "dentry_target",
+};
 
 /**
  * Print usage info for this program.
  */
 void print_usage(char* program_name) {
-    printf("Usage:   %s <container>\nExample: %s /dev/disk0s2\n\n", program_name, program_name);
+    printf("Usage:   %s [options] [--dedupe] [--top-k=N] [--shard=I/N] <container>\nExample: %s --top-k=1 /dev/disk0s2\n\n", program_name, program_name);
+    print_sink_options_usage(stdout);
+    print_shard_options_usage(stdout);
+    print_common_options_usage(stdout);
 }
 
 int main(int argc, char** argv) {
-    setbuf(stdout, NULL);
+    set_dump_stdout_buffering();
     printf("\n");
 
+    output_format_supported = true;
+
     // Extrapolate CLI arguments, exit if invalid
+    if (!parse_sink_options(&argc, argv) || !parse_shard_options(&argc, argv) || !parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
     if (argc != 2) {
         printf("Incorrect number of arguments.\n");
         print_usage(argv[0]);
@@ -55,6 +90,7 @@ int main(int argc, char** argv) {
         return -errno;
     }
     printf("OK.\n");
+    detect_block_size();
 
     obj_phys_t* block = malloc(nx_block_size);
     if (!block) {
@@ -72,8 +108,6 @@ int main(int argc, char** argv) {
     uint64_t num_blocks = ((nx_superblock_t*)block)->nx_block_count;
     printf("The specified device has %llu = %#llx blocks. Commencing search:\n\n", num_blocks, num_blocks);
 
-    uint64_t num_matches = 0;
-
     /** Search for dentries for items with any of these names **/
     size_t NUM_DENTRY_NAMES = 10;
     char* dentry_names[] = {
@@ -144,319 +178,420 @@ int main(int argc, char** argv) {
         0xd3015, 0xd171c, 0xdb96a, 0xd5ff0, 0xd193f, 0xed80b, 0xd1588, 0xd85ff, 
     };
 
+    /** Search for omap leaves with keys in this range of OIDs **/
+    uint64_t omap_oid_range[2] = {0x1b16dd, 0x1b3926};
+
+    /** Search for Virtual objects with this Virtual OID **/
+    uint64_t virtual_oid = 0x25e8fa;
+
+    /** Search for FS-Root B-tree leaf nodes with records for this FS OID **/
+    uint64_t fs_oid = 0xae9549;
+
     uint64_t start_addr = 0xa5e3b;
     uint64_t end_addr   = 0x13adf2;
-    uint64_t addr_range_size = end_addr - start_addr;
 
-    double addr_index_100 = 0;
+    // The part of the range that this shard scans, if the scan is partitioned;
+    // see `func/shard.h`.
+    scan_range_t* ranges;
+    size_t num_ranges = shard_ranges(start_addr, end_addr, num_blocks, &ranges);
+    uint64_t addr_range_size = count_range_blocks(ranges, num_ranges);
+    print_shard_ranges(ranges, num_ranges);
+
+    // Everything that decides what the criteria match, so that shards of
+    // different searches aren't merged.
+    shard_add_config(omap_oid_range,    sizeof(omap_oid_range));
+    shard_add_config(&virtual_oid,      sizeof(virtual_oid));
+    shard_add_config(&fs_oid,           sizeof(fs_oid));
+    for (size_t j = 0; j < NUM_DENTRY_NAMES; j++) {
+        shard_add_config(dentry_names[j], strlen(dentry_names[j]) + 1);
+    }
+    shard_add_config(fs_oid_ranges,     NUM_FS_OID_RANGES * sizeof(fs_oid_ranges[0]));
+    shard_add_config(prefilter_params,  sizeof(prefilter_params));
+
+    result_sink_t sink;
+    sink_init(&sink, SEARCH_NUM_CRITERIA, search_criterion_names);
 
     /** Search over all B-tree nodes **/
     if (true) {
-        for (uint64_t addr = start_addr;    addr < end_addr;    addr++, addr_index_100 += 100) {
-            printf("\rReading block %#9llx (%6.2f%%) ... ", addr, addr_index_100/addr_range_size);
-
-            if (read_blocks(block, addr, 1) != 1) {
-                if (feof(nx)) {
-                    printf("Reached end of file; ending search.\n");
-                    break;
-                }
-
-                assert(ferror(nx));
-                printf("- An error occurred whilst reading block %#llx.\n", addr);
-                continue;
-            }
-
-            /** Search criteria **/
+        stats_phase("scan");
+        progress_t progress;
+        progress_init(&progress, addr_range_size);
+
+        scan_t scan;
+        scan_init_ranges(&scan, ranges, num_ranges);
+
+        // Indices of the blocks of each chunk that pass the header prefilter;
+        // only these are checksummed and handed to the search criteria.
+        uint32_t* survivors = malloc(scan.chunk_blocks * sizeof(uint32_t));
+        if (!survivors) {
+            fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `survivors`.\n");
+            return -1;
+        }
 
-            /** Search for Omap leaf nodes that contain mappings for given Virtual OIDs **/
-            if (false) {
-                if (   is_cksum_valid(block)
-                    && is_btree_node_phys_non_root(block)
-                    && is_omap_tree(block)
-                ) {
-                    btree_node_phys_t* node = block;
+        paddr_t chunk_addr;
+        char* chunk;
+        size_t chunk_len;
+        while ( (chunk_len = scan_next_chunk(&scan, &chunk_addr, &chunk)) ) {
+            progress_add_blocks(&progress, chunk_len);
+            size_t num_survivors = prefilter_objects(chunk, chunk_len, survivors);
+
+            for (size_t survivor = 0; survivor < num_survivors; survivor++) {
+                paddr_t addr = chunk_addr + survivors[survivor];
+                obj_phys_t* block = (obj_phys_t*)(chunk + survivors[survivor] * nx_block_size);
+
+                /** Search criteria **/
+
+                /** Search for Omap leaf nodes that contain mappings for given Virtual OIDs **/
+                if (false) {
+                    if (   is_cksum_valid(block)
+                        && is_btree_node_phys_non_root(block)
+                        && is_omap_tree(block)
+                    ) {
+                        btree_node_phys_t* node = block;
                     
-                    if ( ! (node->btn_flags & BTNODE_FIXED_KV_SIZE) ) {
-                        printf("Omap tree node with non-fixed key and value sizes; skipping this block\n");
-                        continue;
-                    }
+                        if ( ! (node->btn_flags & BTNODE_FIXED_KV_SIZE) ) {
+                            printf("Omap tree node with non-fixed key and value sizes; skipping this block\n");
+                            continue;
+                        }
 
-                    if ( ! (node->btn_flags & BTNODE_LEAF) ) {
-                        continue;
-                    }
-                    
-                    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
-                    char* key_start = toc_start + node->btn_table_space.len;
-
-                    kvoff_t* toc_entry = toc_start;
-                    for (uint32_t i = 0;   i < node->btn_nkeys;   i++, toc_entry++) {
-                        omap_key_t* key = key_start + toc_entry->k;
-                        if ( key->ok_oid >= 0x1b16dd  &&  key->ok_oid <= 0x1b3926 ) {
-                            // Found a match; print details, then move on to the next block
-                            num_matches++;
-
-                            kvoff_t* first_toc_entry = toc_start;
-                            omap_key_t* first_key = key_start + first_toc_entry->k;
-
-                            kvoff_t* last_toc_entry = first_toc_entry + node->btn_nkeys - 1;
-                            omap_key_t* last_key = key_start + last_toc_entry->k;
-
-                            printf("\rMATCHED %#8llx || Node XID = %#9llx || from (OID, XID) = (%#9llx, %#9llx) => (%#9llx, %#9llx)\n",
-                                addr,
-                                node->btn_o.o_xid,
-                                first_key->ok_oid,
-                                first_key->ok_xid,
-                                last_key->ok_oid,
-                                last_key->ok_xid
-                            );
-
-                            break;
+                        if ( ! (node->btn_flags & BTNODE_LEAF) ) {
+                            continue;
                         }
-                    }
-                }
-            }
+                    
+                        char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+                        char* key_start = toc_start + node->btn_table_space.len;
+
+                        kvoff_t* toc_entry = toc_start;
+                        for (uint32_t i = 0;   i < node->btn_nkeys;   i++, toc_entry++) {
+                            omap_key_t* key = key_start + toc_entry->k;
+                            if ( key->ok_oid >= omap_oid_range[0]  &&  key->ok_oid <= omap_oid_range[1] ) {
+                                // Found a match; print details, then move on to the next block
+                                progress_add_matches(&progress, 1);
+                                if (!sink_add(&sink, SEARCH_OMAP_LEAF, node->btn_o.o_oid, node->btn_o.o_xid, addr)) {
+                                    break;
+                                }
 
-            /** Search for Virtual objects with a given Virtual OID **/
-            if (true) {
-                if (is_cksum_valid(block)) {
-                    if ( (block->o_type & OBJ_STORAGETYPE_MASK)  ==  OBJ_VIRTUAL ) {
-                        switch (block->o_oid) {
-                            case 0x25e8fa:
-                                num_matches++;
-                                printf("\rMATCHED %#8llx || OID = %#9llx || XID = %#9llx\n", addr, block->o_oid, block->o_xid);
-                                break;
+                                kvoff_t* first_toc_entry = toc_start;
+                                omap_key_t* first_key = key_start + first_toc_entry->k;
+
+                                kvoff_t* last_toc_entry = first_toc_entry + node->btn_nkeys - 1;
+                                omap_key_t* last_key = key_start + last_toc_entry->k;
+
+                                if (is_structured_output()) {
+                                    record_begin("match");
+                                    record_string("query",      "omap_leaf");
+                                    record_uint("addr",         addr);
+                                    record_uint("xid",          node->btn_o.o_xid);
+                                    record_uint("first_oid",    first_key->ok_oid);
+                                    record_uint("first_xid",    first_key->ok_xid);
+                                    record_uint("last_oid",     last_key->ok_oid);
+                                    record_uint("last_xid",     last_key->ok_xid);
+                                    record_end();
+                                } else {
+                                    progress_clear(&progress);
+                                    printf("MATCHED %#8llx || Node XID = %#9llx || from (OID, XID) = (%#9llx, %#9llx) => (%#9llx, %#9llx)\n",
+                                        addr,
+                                        node->btn_o.o_xid,
+                                        first_key->ok_oid,
+                                        first_key->ok_xid,
+                                        last_key->ok_oid,
+                                        last_key->ok_xid
+                                    );
+                                }
 
-                            default:
                                 break;
+                            }
                         }
                     }
                 }
-            }
 
-            /** Search for FS-Root B-tree leaf nodes containing records for certain FS OIDs **/
-            if (true) {
-                if (   is_cksum_valid(block)
-                    && is_btree_node_phys(block)
-                    && is_fs_tree(block)
-                ) {
-                    btree_node_phys_t* node = block;
-
-                    if (node->btn_flags & BTNODE_FIXED_KV_SIZE) {
-                        // File-system B-tree nodes don't have fixed-size keys and values ... do they? 
-                        printf("FIXED_KV_SIZE\n");
-                        continue;
-                    }
-
-                    if ( ! (node->btn_flags & BTNODE_LEAF) ) {
-                        // Not a leaf node; look at next block
-                        printf("NOT A LEAF\n");
-                        continue;
+                /** Search for Virtual objects with a given Virtual OID **/
+                if (true) {
+                    if (is_cksum_valid(block)) {
+                        if ( (block->o_type & OBJ_STORAGETYPE_MASK)  ==  OBJ_VIRTUAL ) {
+                            if (block->o_oid == virtual_oid) {
+                                progress_add_matches(&progress, 1);
+                                if (sink_add(&sink, SEARCH_VIRTUAL_OID, block->o_oid, block->o_xid, addr)) {
+                                    if (is_structured_output()) {
+                                        record_begin("match");
+                                        record_string("query",  "virtual_oid");
+                                        record_uint("addr",     addr);
+                                        record_uint("oid",      block->o_oid);
+                                        record_uint("xid",      block->o_xid);
+                                        record_end();
+                                    } else {
+                                        progress_clear(&progress);
+                                        printf("MATCHED %#8llx || OID = %#9llx || XID = %#9llx\n", addr, block->o_oid, block->o_xid);
+                                    }
+                                }
+                            }
+                        }
                     }
+                }
 
-                    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
-                    char* key_start = toc_start + node->btn_table_space.len;
-                    char* val_end   = (char*)node + nx_block_size;
-                    if (node->btn_flags & BTNODE_ROOT) {
-                        val_end -= sizeof(btree_info_t);
-                    }
+                /** Search for FS-Root B-tree leaf nodes containing records for certain FS OIDs **/
+                if (true) {
+                    if (   is_cksum_valid(block)
+                        && is_btree_node_phys(block)
+                        && is_fs_tree(block)
+                    ) {
+                        btree_node_phys_t* node = block;
 
-                    kvloc_t* toc_entry = toc_start;
-                    for (uint32_t i = 0;    i < node->btn_nkeys;    i++, toc_entry++) {
-                        j_key_t* hdr = key_start + toc_entry->k.off;
-                        uint64_t oid = hdr->obj_id_and_type & OBJ_ID_MASK;
+                        if (node->btn_flags & BTNODE_FIXED_KV_SIZE) {
+                            // File-system B-tree nodes don't have fixed-size keys and values ... do they? 
+                            continue;
+                        }
 
-                        if (   oid == 0xae9549
-                            // || (oid >= 0xda06a  &&  oid <= 0xda079)
-                            // || (oid >= 0x3a6386  &&  oid <= 0x3a6398)
-                        ) {
-                            num_matches++;
-                            
-                            kvloc_t* first_toc_entry = toc_start;
-                            j_key_t* first_hdr = key_start + first_toc_entry->k.off;
-                            uint64_t first_oid = first_hdr->obj_id_and_type & OBJ_ID_MASK;
+                        if ( ! (node->btn_flags & BTNODE_LEAF) ) {
+                            // Not a leaf node; look at next block
+                            continue;
+                        }
 
-                            kvloc_t* last_toc_entry = first_toc_entry + node->btn_nkeys - 1;
-                            j_key_t* last_hdr = key_start + last_toc_entry->k.off;
-                            uint64_t last_oid = last_hdr->obj_id_and_type & OBJ_ID_MASK;
+                        char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+                        char* key_start = toc_start + node->btn_table_space.len;
+                        char* val_end   = (char*)node + nx_block_size;
+                        if (node->btn_flags & BTNODE_ROOT) {
+                            val_end -= sizeof(btree_info_t);
+                        }
 
-                            printf("\rMATCHED %#8llx || First record OID: %#llx || Last record OID: %#llx || Node XID: %#llx\n", addr, first_oid, last_oid, node->btn_o.o_xid);
+                        kvloc_t* toc_entry = toc_start;
+                        for (uint32_t i = 0;    i < node->btn_nkeys;    i++, toc_entry++) {
+                            j_key_t* hdr = key_start + toc_entry->k.off;
+                            uint64_t oid = hdr->obj_id_and_type & OBJ_ID_MASK;
+
+                            if (   oid == fs_oid
+                                // || (oid >= 0xda06a  &&  oid <= 0xda079)
+                                // || (oid >= 0x3a6386  &&  oid <= 0x3a6398)
+                            ) {
+                                progress_add_matches(&progress, 1);
+                                if (!sink_add(&sink, SEARCH_FS_OID, node->btn_o.o_oid, node->btn_o.o_xid, addr)) {
+                                    break;
+                                }
+                            
+                                kvloc_t* first_toc_entry = toc_start;
+                                j_key_t* first_hdr = key_start + first_toc_entry->k.off;
+                                uint64_t first_oid = first_hdr->obj_id_and_type & OBJ_ID_MASK;
+
+                                kvloc_t* last_toc_entry = first_toc_entry + node->btn_nkeys - 1;
+                                j_key_t* last_hdr = key_start + last_toc_entry->k.off;
+                                uint64_t last_oid = last_hdr->obj_id_and_type & OBJ_ID_MASK;
+
+                                if (is_structured_output()) {
+                                    record_begin("match");
+                                    record_string("query",      "fs_oid");
+                                    record_uint("addr",         addr);
+                                    record_uint("xid",          node->btn_o.o_xid);
+                                    record_uint("first_oid",    first_oid);
+                                    record_uint("last_oid",     last_oid);
+                                    record_end();
+                                } else {
+                                    progress_clear(&progress);
+                                    printf("MATCHED %#8llx || First record OID: %#llx || Last record OID: %#llx || Node XID: %#llx\n", addr, first_oid, last_oid, node->btn_o.o_xid);
+                                }
                             
-                            // Found a match; don't need to check other entries in this node
-                            break;
+                                // Found a match; don't need to check other entries in this node
+                                break;
+                            }
                         }
                     }
                 }
-            }
-
-            /** Search for dentries of items with certain names/properties **/
-            if (true) {
-                if (   is_cksum_valid(block)
-                    && is_btree_node_phys(block)
-                    && is_fs_tree(block)
-                ) {
-                    btree_node_phys_t* node = block;
-
-                    if (node->btn_flags & BTNODE_FIXED_KV_SIZE) {
-                        printf("FIXED_KV_SIZE\n");
-                        continue;
-                    }
 
-                    if ( ! (node->btn_flags & BTNODE_LEAF) ) {
-                        // Not a leaf node; look at next block
-                        continue;
-                    }
-
-                    printf("LEAF NODE // OID = %#llx // XID = %#llx ... ", node->btn_o.o_oid, node->btn_o.o_xid);
-                    
-                    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
-                    char* key_start = toc_start + node->btn_table_space.len;
-                    char* val_end   = (char*)node + nx_block_size;
-                    if (node->btn_flags & BTNODE_ROOT) {
-                        printf("ALSO A ROOT NODE ...");
-                        val_end -= sizeof(btree_info_t);
-                    }
+                /** Search for dentries of items with certain names/properties **/
+                if (true) {
+                    if (   is_cksum_valid(block)
+                        && is_btree_node_phys(block)
+                        && is_fs_tree(block)
+                    ) {
+                        btree_node_phys_t* node = block;
 
-                    uint32_t num_matches_in_node = 0;
-
-                    printf("Inspecting entries contained in this node ...\n");
-                    kvloc_t* toc_entry = toc_start;
-                    for (uint32_t i = 0;    i < node->btn_nkeys;    i++, toc_entry++) {
-                        printf("\r- Entry %u ... ", i);
-
-                        j_key_t* hdr = key_start + toc_entry->k.off;
-                        uint8_t record_type = (hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT;
-                        switch (record_type) {
-                            case APFS_TYPE_DIR_REC: {
-                                printf("DENTRY ... ");
+                        if (node->btn_flags & BTNODE_FIXED_KV_SIZE) {
+                            continue;
+                        }
 
-                                j_drec_hashed_key_t* key = hdr;
-                                j_drec_val_t* val = val_end - toc_entry->v.off;
+                        if ( ! (node->btn_flags & BTNODE_LEAF) ) {
+                            // Not a leaf node; look at next block
+                            continue;
+                        }
 
-                                for (size_t j = 0; j < NUM_DENTRY_NAMES; j++) {
-                                    if (strcasecmp((char*)key->name, dentry_names[j]) == 0) {
-                                        num_matches_in_node++;
-                                        num_matches++;
+                        char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+                        char* key_start = toc_start + node->btn_table_space.len;
+                        char* val_end   = (char*)node + nx_block_size;
+                        if (node->btn_flags & BTNODE_ROOT) {
+                            val_end -= sizeof(btree_info_t);
+                        }
 
-                                        printf("MATCHED --- query = %s --- match = %s\n", dentry_names[j], key->name);
+                        // The sink records each copy of the node once, however
+                        // many of its dentries match, and all of them are
+                        // reported if the node is; 1 or 0 once it is known.
+                        int report_node = -1;
+
+                        kvloc_t* toc_entry = toc_start;
+                        for (uint32_t i = 0;    i < node->btn_nkeys;    i++, toc_entry++) {
+
+                            j_key_t* hdr = key_start + toc_entry->k.off;
+                            uint8_t record_type = (hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT;
+                            switch (record_type) {
+                                case APFS_TYPE_DIR_REC: {
+                                    j_drec_hashed_key_t* key = hdr;
+                                    j_drec_val_t* val = val_end - toc_entry->v.off;
+
+                                    for (size_t j = 0; j < NUM_DENTRY_NAMES; j++) {
+                                        if (strcasecmp((char*)key->name, dentry_names[j]) == 0) {
+                                            if (report_node == -1) {
+                                                progress_add_matches(&progress, 1);
+                                                report_node = sink_add(&sink, SEARCH_DENTRY_NAME, node->btn_o.o_oid, node->btn_o.o_xid, addr);
+                                            }
+                                            if (!report_node) {
+                                                break;
+                                            }
+
+                                            if (is_structured_output()) {
+                                                record_begin("match");
+                                                record_string("query",      "dentry_name");
+                                                record_uint("addr",         addr);
+                                                record_uint("xid",          node->btn_o.o_xid);
+                                                record_string("pattern",    dentry_names[j]);
+                                                record_drec_name("name",    key);
+                                                record_uint("target_id",    val->file_id);
+                                                record_end();
+                                            } else {
+                                                progress_clear(&progress);
+                                                printf("MATCHED --- query = %s --- match = %s\n", dentry_names[j], key->name);
+                                            }
                                         
-                                        // Found a match; don't need to compare against other strings
-                                        break;
+                                            // Found a match; don't need to compare against other strings
+                                            break;
+                                        }
                                     }
-                                }
-                            } break;
-                            // case APFS_TYPE_INODE: {
-                            //     printf("INDOE ... ");
+                                } break;
+                                // case APFS_TYPE_INODE: {
+                                //     printf("INDOE ... ");
 
-                            //     j_inode_key_t* key = hdr;
-                            //     j_inode_val_t* val = val_end - toc_entry->v.off;
+                                //     j_inode_key_t* key = hdr;
+                                //     j_inode_val_t* val = val_end - toc_entry->v.off;
 
-                            //     if (val->parent_id == 0x1) {
-                            //         num_matches_in_node++;
-                            //         num_matches++;
+                                //     if (val->parent_id == 0x1) {
+                                //         num_matches_in_node++;
+                                //         num_matches++;
 
-                            //         printf("MATCHED --- query = INODE 0x1 --- match = ")
-                            //     }
-                            // } break;
-                            default: break;
+                                //         printf("MATCHED --- query = INODE 0x1 --- match = ")
+                                //     }
+                                // } break;
+                                default: break;
+                            }
                         }
-                    }
 
-                    if (num_matches_in_node == 0) {
-                        // Move to start of line,
-                        // clear whole line (which reads "- Entry x"),
-                        // move up one line,
-                        // clear whole line (which reads "Reading block [...] Inspecting entries")
-                        printf("\r\033[2K\033[A\033[2K");
                     }
                 }
-            }
-
-            /** Search for dentries pointing to items with certain file-system object IDs **/
-            if (true) {
-                if (   is_cksum_valid(block)
-                    && is_btree_node_phys(block)
-                    && is_fs_tree(block)
-                ) {
-                    btree_node_phys_t* node = block;
-
-                    if (node->btn_flags & BTNODE_FIXED_KV_SIZE) {
-                        printf("FIXED_KV_SIZE\n");
-                        continue;
-                    }
 
-                    if ( ! (node->btn_flags & BTNODE_LEAF) ) {
-                        // Not a leaf node; look at next block
-                        continue;
-                    }
+                /** Search for dentries pointing to items with certain file-system object IDs **/
+                if (true) {
+                    if (   is_cksum_valid(block)
+                        && is_btree_node_phys(block)
+                        && is_fs_tree(block)
+                    ) {
+                        btree_node_phys_t* node = block;
 
-                    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
-                    char* key_start = toc_start + node->btn_table_space.len;
-                    char* val_end   = (char*)node + nx_block_size;
-                    if (node->btn_flags & BTNODE_ROOT) {
-                        val_end -= sizeof(btree_info_t);
-                    }
+                        if (node->btn_flags & BTNODE_FIXED_KV_SIZE) {
+                            continue;
+                        }
 
-                    uint32_t num_matches_in_node = 0;
+                        if ( ! (node->btn_flags & BTNODE_LEAF) ) {
+                            // Not a leaf node; look at next block
+                            continue;
+                        }
 
-                    printf("\n");
+                        char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+                        char* key_start = toc_start + node->btn_table_space.len;
+                        char* val_end   = (char*)node + nx_block_size;
+                        if (node->btn_flags & BTNODE_ROOT) {
+                            val_end -= sizeof(btree_info_t);
+                        }
 
-                    kvloc_t* toc_entry = toc_start;
-                    for (uint32_t i = 0;    i < node->btn_nkeys;    i++, toc_entry++) {
-                        printf("\r- Entry %u ... ", i);
+                        // As above; 1 or 0 once it is known.
+                        int report_node = -1;
 
-                        j_key_t* hdr = key_start + toc_entry->k.off;
-                        uint8_t record_type = (hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT;
-                        if (record_type != APFS_TYPE_DIR_REC) {
-                            // Not a dentry; look at next entry in this leaf node
-                            continue;
-                        }
+                        kvloc_t* toc_entry = toc_start;
+                        for (uint32_t i = 0;    i < node->btn_nkeys;    i++, toc_entry++) {
+                            j_key_t* hdr = key_start + toc_entry->k.off;
+                            uint8_t record_type = (hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT;
+                            if (record_type != APFS_TYPE_DIR_REC) {
+                                // Not a dentry; look at next entry in this leaf node
+                                continue;
+                            }
 
-                        j_drec_hashed_key_t* key = hdr;
-                        j_drec_val_t* val = val_end - toc_entry->v.off;
+                            j_drec_hashed_key_t* key = hdr;
+                            j_drec_val_t* val = val_end - toc_entry->v.off;
 
-                        /** Check whether FS OID matches one in `fs_oids[]` **/
-                        // for (size_t j = 0; j < NUM_FS_OIDS; j++) {
-                        //     if (val->file_id == fs_oids[j]) {
-                        //         num_matches_in_node++;
-                        //         num_matches++;
+                            /** Check whether FS OID matches one in `fs_oids[]` **/
+                            // for (size_t j = 0; j < NUM_FS_OIDS; j++) {
+                            //     if (val->file_id == fs_oids[j]) {
+                            //         num_matches_in_node++;
+                            //         num_matches++;
 
-                        //         printf("MATCHED --- query = %#llx --- match = %s\n", fs_oids[j], key->name);
+                            //         printf("MATCHED --- query = %#llx --- match = %s\n", fs_oids[j], key->name);
                                 
-                        //         // Found a match; don't need to compare against other FS OIDs
-                        //         break;
-                        //     }
-                        // }
-
-                        /** Check whether FS OID lies within a range in `fs_oid_ranges[]` **/
-                        for (size_t j = 0; j < NUM_FS_OID_RANGES; j++) {
-                            if ( (val->file_id >= fs_oid_ranges[j][0])  &&  (val->file_id <= fs_oid_ranges[j][1]) ) {
-                                num_matches_in_node++;
-                                num_matches++;
-
-                                printf( "MATCHED --- query = (%#llx, %#llx) --- match = %#llx --- name = %s\n",
-                                    fs_oid_ranges[j][0],
-                                    fs_oid_ranges[j][1],
-                                    val->file_id,
-                                    key->name
-                                );
+                            //         // Found a match; don't need to compare against other FS OIDs
+                            //         break;
+                            //     }
+                            // }
+
+                            /** Check whether FS OID lies within a range in `fs_oid_ranges[]` **/
+                            for (size_t j = 0; j < NUM_FS_OID_RANGES; j++) {
+                                if ( (val->file_id >= fs_oid_ranges[j][0])  &&  (val->file_id <= fs_oid_ranges[j][1]) ) {
+                                    if (report_node == -1) {
+                                        progress_add_matches(&progress, 1);
+                                        report_node = sink_add(&sink, SEARCH_DENTRY_TARGET, node->btn_o.o_oid, node->btn_o.o_xid, addr);
+                                    }
+                                    if (!report_node) {
+                                        break;
+                                    }
+
+                                    if (is_structured_output()) {
+                                        record_begin("match");
+                                        record_string("query",      "dentry_target");
+                                        record_uint("addr",         addr);
+                                        record_uint("xid",          node->btn_o.o_xid);
+                                        record_uint("range_start",  fs_oid_ranges[j][0]);
+                                        record_uint("range_end",    fs_oid_ranges[j][1]);
+                                        record_drec_name("name",    key);
+                                        record_uint("target_id",    val->file_id);
+                                        record_end();
+                                    } else {
+                                        progress_clear(&progress);
+                                        printf( "MATCHED --- query = (%#llx, %#llx) --- match = %#llx --- name = %s\n",
+                                            fs_oid_ranges[j][0],
+                                            fs_oid_ranges[j][1],
+                                            val->file_id,
+                                            key->name
+                                        );
+                                    }
                                 
-                                // Found a match; don't need to compare against other FS OIDs
-                                break;
+                                    // Found a match; don't need to compare against other FS OIDs
+                                    break;
+                                }
                             }
                         }
-                    }
 
-                    if (num_matches_in_node == 0) {
-                        // Move to start of line,
-                        // clear whole line (which reads "- Entry x"),
-                        // move up one line,
-                        // clear whole line (which reads "Reading block [...] Inspecting entries")
-                        printf("\r\033[2K\033[A\033[2K");
                     }
                 }
             }
+            progress_update(&progress);
+        }
+
+        scan_end(&scan);
+        free(survivors);
+        progress_clear(&progress);
+
+        if (shard_output_path) {
+            printf("Writing the results of shard %u of %u to `%s` ... ", shard_index, shard_count, shard_output_path);
+            if (!shard_write(shard_output_path, "apfs-search", (nx_superblock_t*)block, &sink, ranges, num_ranges)) {
+                return -1;
+            }
+            printf("OK.\n");
         }
     }
+    free(ranges);
 
     /** Get FS record types of first record in certain blocks on disk **/
     if (false) {
@@ -464,13 +599,12 @@ int main(int argc, char** argv) {
             uint64_t addr = blocks[block_index];
             printf("\rReading block %2lu: %#llx ... ", block_index, addr);
 
-            if (read_blocks(block, addr, 1) != 1) {
-                if (feof(nx)) {
-                    printf("Reached end of file; ending search.\n");
-                    break;
-                }
-
-                assert(ferror(nx));
+            size_t num_blocks_read = read_blocks(block, addr, 1);
+            if (num_blocks_read == 0) {
+                printf("Reached end of file; ending search.\n");
+                break;
+            }
+            if (num_blocks_read != 1) {
                 printf("- An error occurred whilst reading block %#llx.\n", addr);
                 continue;
             }
@@ -486,6 +620,9 @@ int main(int argc, char** argv) {
         }
     }
 
+    uint64_t num_matches = sink_num_matches(&sink);
+    sink_report(&sink);
+    sink_free(&sink);
     printf("\n\nFinished search; found %llu results.\n\n", num_matches);
     
     return 0;
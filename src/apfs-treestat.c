@@ -0,0 +1,730 @@
+#include <stdio.h>
+#include <sys/errno.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apfs/io.h"
+#include "apfs/io/async.h"
+#include "apfs/options.h"
+#include "apfs/func/boolean.h"
+#include "apfs/func/cksum.h"
+#include "apfs/func/btree.h"
+
+#include "apfs/struct/object.h"
+#include "apfs/struct/nx.h"
+#include "apfs/struct/omap.h"
+#include "apfs/struct/fs.h"
+
+#include "apfs/struct/j.h"
+#include "apfs/struct/dstream.h"
+
+#include "apfs/string/j.h"
+
+// The number of nodes read at once; each batch is serviced in parallel by the
+// I/O engine.
+#define TREESTAT_BATCH_SIZE     1024
+
+#define TREESTAT_MAX_LEVELS     16
+
+// Sizes and distances are counted in buckets whose bounds are powers of two:
+// 0, 1, 2--3, 4--7, and so on.
+#define TREESTAT_NUM_BUCKETS    48
+
+#define TREESTAT_NUM_TYPES      16
+
+/** Configuration **/
+
+// Set by `--sample`; the maximum number of nodes to read at each level of a
+// tree, or 0 to read every node.
+uint32_t treestat_sample = 0;
+
+// Set by `--top`; the number of directories and files to list.
+uint32_t treestat_top = 10;
+
+/**
+ * An entry of a list of the largest directories or most fragmented files.
+ */
+typedef struct {
+    oid_t       oid;
+    uint64_t    count;      // Directory entries, or fragments
+    uint64_t    extents;
+    uint64_t    blocks;
+} treestat_top_t;
+
+typedef struct {
+    uint64_t    num_nodes;
+    uint64_t    num_entries;
+    uint64_t    num_invalid;
+    uint64_t    num_unresolvable;
+    double      est_nodes;      // Accounting for sampling
+    double      fill_sum;
+} treestat_level_t;
+
+/**
+ * The statistics gathered while walking a tree.
+ */
+typedef struct {
+    treestat_level_t    levels[TREESTAT_MAX_LEVELS];
+    uint32_t            num_levels;
+    double              leaf_weight;
+
+    uint64_t    num_records;
+    uint64_t    key_size_sum;
+    uint64_t    key_size_min;
+    uint64_t    key_size_max;
+    uint64_t    key_size_hist[TREESTAT_NUM_BUCKETS];
+    uint64_t    val_size_sum;
+    uint64_t    val_size_min;
+    uint64_t    val_size_max;
+    uint64_t    val_size_hist[TREESTAT_NUM_BUCKETS];
+    uint64_t    records_per_type[TREESTAT_NUM_TYPES];
+
+    uint64_t    num_siblings;
+    uint64_t    num_adjacent_siblings;
+    uint64_t    sibling_dist_sum;
+    uint64_t    sibling_dist_hist[TREESTAT_NUM_BUCKETS];
+
+    // Records of a file-system tree are visited in key order, so the records
+    // of each object are seen consecutively.
+    treestat_top_t  cur_dir;
+    treestat_top_t  cur_file;
+    paddr_t         cur_file_next_block;
+    treestat_top_t* top_dirs;
+    uint32_t        num_top_dirs;
+    treestat_top_t* top_files;
+    uint32_t        num_top_files;
+} treestat_t;
+
+treestat_t ts;
+
+/**
+ * Print usage info for this program.
+ */
+void print_usage(char* program_name) {
+    printf("Usage:   %s [options] [--sample=N] [--top=N] <container> [<volume ID>]\nExample: %s --sample=4096 /dev/disk0s2 0\n\n", program_name, program_name);
+    printf("Tree statistics options:\n");
+    printf("  --sample=N          Read at most N nodes at each level of a tree, evenly spread across it, and\n");
+    printf("                      extrapolate the totals.\n");
+    printf("  --top=N             List the N largest directories and most fragmented files (default: %u).\n", treestat_top);
+    printf("\n");
+    print_common_options_usage(stdout);
+}
+
+/**
+ * Parse and remove the options specific to this program from the argument
+ * list; see `parse_common_options()`.
+ */
+bool parse_treestat_options(int* argc, char** argv) {
+    int num_kept = 1;
+    for (int i = 1; i < *argc; i++) {
+        char* arg = argv[i];
+        if (strcmp(arg, "--") == 0) {
+            // Leave the rest for `parse_common_options()`
+            while (i < *argc) {
+                argv[num_kept++] = argv[i++];
+            }
+            break;
+        }
+
+        if (strncmp(arg, "--sample=", 9) == 0) {
+            if (!parse_option_uint32(arg + 9, &treestat_sample)) {
+                fprintf(stderr, "Option `--sample` requires a positive integer value.\n");
+                return false;
+            }
+        } else if (strncmp(arg, "--top=", 6) == 0) {
+            if (!parse_option_uint32_or_zero(arg + 6, &treestat_top)) {
+                fprintf(stderr, "Option `--top` requires a non-negative integer value.\n");
+                return false;
+            }
+        } else {
+            argv[num_kept++] = arg;
+        }
+    }
+
+    argv[num_kept] = NULL;
+    *argc = num_kept;
+    return true;
+}
+
+uint32_t get_bucket(uint64_t n) {
+    uint32_t bucket = 0;
+    while (n && bucket < TREESTAT_NUM_BUCKETS - 1) {
+        n >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/**
+ * Add an entry to a list that is kept sorted by descending count, keeping at
+ * most `treestat_top` entries.
+ */
+void top_insert(treestat_top_t* top, uint32_t* num_top, treestat_top_t* entry) {
+    if (treestat_top == 0 || entry->count == 0) {
+        return;
+    }
+    uint32_t i = *num_top;
+    if (i == treestat_top) {
+        if (entry->count <= top[i - 1].count) {
+            return;
+        }
+        i--;
+    } else {
+        (*num_top)++;
+    }
+    while (i > 0 && top[i - 1].count < entry->count) {
+        top[i] = top[i - 1];
+        i--;
+    }
+    top[i] = *entry;
+}
+
+void flush_cur_dir() {
+    top_insert(ts.top_dirs, &ts.num_top_dirs, &ts.cur_dir);
+    memset(&ts.cur_dir, 0, sizeof(ts.cur_dir));
+}
+
+void flush_cur_file() {
+    top_insert(ts.top_files, &ts.num_top_files, &ts.cur_file);
+    memset(&ts.cur_file, 0, sizeof(ts.cur_file));
+    ts.cur_file_next_block = 0;
+}
+
+/**
+ * Account for a record of a file-system tree.
+ */
+void add_fs_record(j_key_t* hdr, void* val) {
+    oid_t oid = hdr->obj_id_and_type & OBJ_ID_MASK;
+    uint8_t type = (hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT;
+    ts.records_per_type[type]++;
+
+    if (type == APFS_TYPE_DIR_REC) {
+        if (oid != ts.cur_dir.oid) {
+            flush_cur_dir();
+            ts.cur_dir.oid = oid;
+        }
+        ts.cur_dir.count++;
+    } else if (type == APFS_TYPE_FILE_EXTENT) {
+        if (oid != ts.cur_file.oid) {
+            flush_cur_file();
+            ts.cur_file.oid = oid;
+        }
+        j_file_extent_val_t* extent = val;
+        uint64_t extent_len_blocks = ((extent->len_and_flags & J_FILE_EXTENT_LEN_MASK) + nx_block_size - 1) / nx_block_size;
+        ts.cur_file.extents++;
+        if (extent->phys_block_num == 0) {
+            // A sparse extent; it doesn't break the contiguity of the file
+            return;
+        }
+        if (ts.cur_file.blocks == 0 || (paddr_t)extent->phys_block_num != ts.cur_file_next_block) {
+            ts.cur_file.count++;
+        }
+        ts.cur_file.blocks += extent_len_blocks;
+        ts.cur_file_next_block = extent->phys_block_num + extent_len_blocks;
+    }
+}
+
+/**
+ * Account for a node of a tree, and append the Virtual or Physical OIDs of its
+ * child nodes to a list.
+ *
+ * fs_records:      Whether the node belongs to a file-system tree.
+ *
+ * fixed_kv:        The key and value sizes of the tree's leaf records, if
+ *      its keys and values have a fixed size.
+ *
+ * children, num_children, children_capacity:
+ *      The list of child nodes, and its length and capacity.
+ *
+ * follows_sibling: A list, of the same length as `children`, of whether each
+ *      child node is the next sibling of the one before it in the list.
+ */
+void add_node(btree_node_phys_t* node, bool fs_records, btree_info_fixed_t* fixed_kv, treestat_level_t* level,
+    oid_t** children, bool** follows_sibling, size_t* num_children, size_t* children_capacity
+) {
+    char* toc_start = (char*)node->btn_data + node->btn_table_space.off;
+    char* key_start = toc_start + node->btn_table_space.len;
+    char* val_end   = (char*)node + nx_block_size;
+    size_t space = nx_block_size - sizeof(btree_node_phys_t);
+    if (node->btn_flags & BTNODE_ROOT) {
+        val_end -= sizeof(btree_info_t);
+        space   -= sizeof(btree_info_t);
+    }
+    size_t free_space = node->btn_free_space.len + node->btn_key_free_list.len + node->btn_val_free_list.len;
+
+    level->num_nodes++;
+    level->num_entries += node->btn_nkeys;
+    level->fill_sum += free_space < space ? (double)(space - free_space) / space : 0;
+
+    bool fixed = node->btn_flags & BTNODE_FIXED_KV_SIZE;
+    for (uint32_t i = 0; i < node->btn_nkeys; i++) {
+        uint16_t key_off = fixed ? ((kvoff_t*)toc_start)[i].k : ((kvloc_t*)toc_start)[i].k.off;
+        uint16_t val_off = fixed ? ((kvoff_t*)toc_start)[i].v : ((kvloc_t*)toc_start)[i].v.off;
+
+        if (!(node->btn_flags & BTNODE_LEAF)) {
+            if (*num_children == *children_capacity) {
+                *children_capacity = *children_capacity ? 2 * *children_capacity : 256;
+                *children = realloc(*children, *children_capacity * sizeof(oid_t));
+                *follows_sibling = realloc(*follows_sibling, *children_capacity * sizeof(bool));
+                if (!*children || !*follows_sibling) {
+                    fprintf(stderr, "\nABORT: add_node: Could not allocate sufficient memory for the child nodes.\n");
+                    exit(-1);
+                }
+            }
+            (*children)[*num_children] = *(oid_t*)(val_end - val_off);
+            (*follows_sibling)[*num_children] = i > 0;
+            (*num_children)++;
+            continue;
+        }
+
+        uint64_t key_len = fixed ? fixed_kv->bt_key_size : ((kvloc_t*)toc_start)[i].k.len;
+        uint64_t val_len = fixed ? fixed_kv->bt_val_size : ((kvloc_t*)toc_start)[i].v.len;
+        if (ts.num_records == 0 || key_len < ts.key_size_min) {
+            ts.key_size_min = key_len;
+        }
+        if (ts.num_records == 0 || val_len < ts.val_size_min) {
+            ts.val_size_min = val_len;
+        }
+        if (key_len > ts.key_size_max) {
+            ts.key_size_max = key_len;
+        }
+        if (val_len > ts.val_size_max) {
+            ts.val_size_max = val_len;
+        }
+        ts.key_size_sum += key_len;
+        ts.val_size_sum += val_len;
+        ts.key_size_hist[get_bucket(key_len)]++;
+        ts.val_size_hist[get_bucket(val_len)]++;
+        ts.num_records++;
+
+        if (fs_records && val_off != 0xffff) {
+            add_fs_record(key_start + key_off, val_end - val_off);
+        }
+    }
+}
+
+/**
+ * Walk a B-tree one level at a time, and gather statistics about it in `ts`.
+ * The nodes of each level are visited in key order, and read in batches.
+ *
+ * root_addr:       The block address of the root node.
+ *
+ * omap_root_node:  If the tree refers to its child nodes by Virtual OID, the
+ *      root node of the object map used to resolve them; else NULL.
+ *
+ * max_xid:         The highest XID to consider when resolving Virtual OIDs.
+ *
+ * encrypted:       If true, the nodes are encrypted with the key of the
+ *      volume that is currently unlocked.
+ *
+ * fs_records:      Whether the tree is a file-system tree, whose records are to
+ *      be counted by type.
+ */
+void walk_btree(paddr_t root_addr, btree_node_phys_t* omap_root_node, xid_t max_xid, bool encrypted, bool fs_records) {
+    size_t level_len = 1;
+    paddr_t* level = malloc(sizeof(paddr_t));
+    bool* level_follows_sibling = calloc(1, sizeof(bool));
+    aio_req_t* reqs = calloc(TREESTAT_BATCH_SIZE, sizeof(aio_req_t));
+    char* nodes = malloc(TREESTAT_BATCH_SIZE * nx_block_size);
+    if (!level || !level_follows_sibling || !reqs || !nodes) {
+        fprintf(stderr, "\nABORT: walk_btree: Could not allocate sufficient memory.\n");
+        exit(-1);
+    }
+    level[0] = root_addr;
+
+    btree_info_fixed_t fixed_kv = { 0 };
+    double weight = 1;
+    uint64_t num_unresolvable = 0;
+
+    for (ts.num_levels = 0; level_len > 0 && ts.num_levels < TREESTAT_MAX_LEVELS; ts.num_levels++) {
+        treestat_level_t* cur_level = ts.levels + ts.num_levels;
+        cur_level->est_nodes = level_len * weight;
+        cur_level->num_unresolvable = num_unresolvable;
+        ts.leaf_weight = weight;
+
+        // Distances between consecutive children of the same parent
+        for (size_t i = 1; i < level_len; i++) {
+            if (!level_follows_sibling[i]) {
+                continue;
+            }
+            uint64_t dist = level[i] > level[i - 1] ? level[i] - level[i - 1] : level[i - 1] - level[i];
+            ts.num_siblings++;
+            ts.sibling_dist_sum += dist;
+            ts.sibling_dist_hist[get_bucket(dist)]++;
+            if (dist == 1) {
+                ts.num_adjacent_siblings++;
+            }
+        }
+
+        oid_t* children = NULL;
+        bool* follows_sibling = NULL;
+        size_t num_children = 0;
+        size_t children_capacity = 0;
+
+        for (size_t batch_start = 0; batch_start < level_len; batch_start += TREESTAT_BATCH_SIZE) {
+            size_t batch_len = level_len - batch_start;
+            if (batch_len > TREESTAT_BATCH_SIZE) {
+                batch_len = TREESTAT_BATCH_SIZE;
+            }
+            for (size_t i = 0; i < batch_len; i++) {
+                reqs[i].buffer      = nodes + i * nx_block_size;
+                reqs[i].start_block = level[batch_start + i];
+                reqs[i].num_blocks  = 1;
+            }
+            aio_read_batch(reqs, batch_len);
+
+            for (size_t i = 0; i < batch_len; i++) {
+                btree_node_phys_t* node = reqs[i].buffer;
+                if (encrypted && reqs[i].result == 1) {
+                    decrypt_metadata_blocks(node, reqs[i].start_block, 1);
+                }
+                if (reqs[i].result != 1 || !is_cksum_valid(node) || !is_btree_node_phys(node)) {
+                    cur_level->num_invalid++;
+                    continue;
+                }
+                if (ts.num_levels == 0 && (node->btn_flags & BTNODE_FIXED_KV_SIZE)) {
+                    btree_info_t* bt_info = (char*)node + nx_block_size - sizeof(btree_info_t);
+                    fixed_kv = bt_info->bt_fixed;
+                }
+                add_node(node, fs_records, &fixed_kv, cur_level, &children, &follows_sibling, &num_children, &children_capacity);
+            }
+        }
+
+        // Choose which of the child nodes to read, spreading the sample evenly
+        // across the level so that it is read in key order.
+        size_t next_len = num_children;
+        if (treestat_sample && num_children > treestat_sample) {
+            next_len = treestat_sample;
+            weight = num_children * weight / next_len;
+            size_t prev_chosen = 0;
+            for (size_t i = 0; i < next_len; i++) {
+                size_t chosen = (size_t)((i + 0.5) * num_children / next_len);
+                children[i] = children[chosen];
+                follows_sibling[i] = follows_sibling[chosen] && i > 0 && chosen == prev_chosen + 1;
+                prev_chosen = chosen;
+            }
+        }
+
+        // Resolve the chosen child nodes' addresses
+        num_unresolvable = 0;
+        size_t num_resolved = 0;
+        bool prev_resolved = false;
+        for (size_t i = 0; i < next_len; i++) {
+            paddr_t child_addr = children[i];
+            if (omap_root_node) {
+                omap_val_t* child_omap_val = get_btree_phys_omap_val(omap_root_node, children[i], max_xid);
+                if (!child_omap_val) {
+                    num_unresolvable++;
+                    prev_resolved = false;
+                    continue;
+                }
+                child_addr = child_omap_val->ov_paddr;
+                free(child_omap_val);
+            }
+            children[num_resolved] = child_addr;
+            follows_sibling[num_resolved] = follows_sibling[i] && prev_resolved;
+            num_resolved++;
+            prev_resolved = true;
+        }
+
+        free(level);
+        free(level_follows_sibling);
+        level = (paddr_t*)children;
+        level_follows_sibling = follows_sibling;
+        level_len = num_resolved;
+    }
+
+    if (fs_records) {
+        flush_cur_dir();
+        flush_cur_file();
+    }
+
+    free(nodes);
+    free(reqs);
+    free(level_follows_sibling);
+    free(level);
+}
+
+void print_hist(char* indent, uint64_t* hist, uint64_t total) {
+    for (uint32_t i = 0; i < TREESTAT_NUM_BUCKETS; i++) {
+        if (!hist[i]) {
+            continue;
+        }
+        char range[48];
+        if (i <= 1) {
+            snprintf(range, sizeof(range), "%u:", i);
+        } else if (i == TREESTAT_NUM_BUCKETS - 1) {
+            snprintf(range, sizeof(range), "%llu and over:", 1ULL << (i - 1));
+        } else {
+            snprintf(range, sizeof(range), "%llu--%llu:", 1ULL << (i - 1), (1ULL << i) - 1);
+        }
+        printf("%s- %-24s %5.1f%%\n", indent, range, 100.0 * hist[i] / total);
+    }
+}
+
+/**
+ * Walk a B-tree and print statistics about it.
+ */
+void report_btree(char* description, paddr_t root_addr, btree_node_phys_t* omap_root_node, xid_t max_xid, bool encrypted, bool fs_records) {
+    treestat_top_t* top_dirs = calloc(treestat_top + 1, sizeof(treestat_top_t));
+    treestat_top_t* top_files = calloc(treestat_top + 1, sizeof(treestat_top_t));
+    if (!top_dirs || !top_files) {
+        fprintf(stderr, "\nABORT: report_btree: Could not allocate sufficient memory for the top lists.\n");
+        exit(-1);
+    }
+    memset(&ts, 0, sizeof(ts));
+    ts.top_dirs = top_dirs;
+    ts.top_files = top_files;
+
+    printf("\n%s (root node at block %#llx):\n", description, root_addr);
+    walk_btree(root_addr, omap_root_node, max_xid, encrypted, fs_records);
+
+    bool sampled = false;
+    double est_total_nodes = 0;
+    for (uint32_t i = 0; i < ts.num_levels; i++) {
+        sampled |= ts.levels[i].est_nodes > ts.levels[i].num_nodes + ts.levels[i].num_invalid;
+        est_total_nodes += ts.levels[i].est_nodes;
+    }
+    char* estimated = sampled ? " (estimated)" : "";
+
+    printf("- Depth:                      %u levels\n", ts.num_levels);
+    printf("- Nodes:                      %.0f%s, %.1f MiB\n", est_total_nodes, estimated, est_total_nodes * nx_block_size / (1024 * 1024));
+    for (uint32_t i = 0; i < ts.num_levels; i++) {
+        treestat_level_t* level = ts.levels + i;
+        char name[32];
+        snprintf(name, sizeof(name), "Level %u%s:", i, i == 0 ? " (root)" : (i == ts.num_levels - 1 ? " (leaves)" : ""));
+        printf("  - %-26s %.0f nodes", name, level->est_nodes);
+        if (level->num_nodes) {
+            printf(", %.1f entries per node, %.1f%% full", (double)level->num_entries / level->num_nodes, 100 * level->fill_sum / level->num_nodes);
+        }
+        if (level->num_nodes != level->est_nodes) {
+            printf(" (%llu read)", level->num_nodes);
+        }
+        printf("\n");
+        if (level->num_invalid) {
+            printf("    !! %llu nodes are unreadable or invalid.\n", level->num_invalid);
+        }
+        if (level->num_unresolvable) {
+            printf("    !! %llu nodes are not in the object map.\n", level->num_unresolvable);
+        }
+    }
+
+    if (ts.num_records) {
+        printf("- Records:                    %.0f%s\n", ts.num_records * ts.leaf_weight, estimated);
+        printf("- Key sizes:                  %llu to %llu bytes, %.1f on average\n", ts.key_size_min, ts.key_size_max, (double)ts.key_size_sum / ts.num_records);
+        if (ts.key_size_min != ts.key_size_max) {
+            print_hist("  ", ts.key_size_hist, ts.num_records);
+        }
+        printf("- Value sizes:                %llu to %llu bytes, %.1f on average\n", ts.val_size_min, ts.val_size_max, (double)ts.val_size_sum / ts.num_records);
+        if (ts.val_size_min != ts.val_size_max) {
+            print_hist("  ", ts.val_size_hist, ts.num_records);
+        }
+    }
+
+    if (fs_records && ts.num_records) {
+        printf("- Records by type:\n");
+        for (uint32_t i = 0; i < TREESTAT_NUM_TYPES; i++) {
+            if (ts.records_per_type[i]) {
+                printf("  - %-44s %12.0f  %5.1f%%\n", j_key_type_to_string(i), ts.records_per_type[i] * ts.leaf_weight, 100.0 * ts.records_per_type[i] / ts.num_records);
+            }
+        }
+    }
+
+    if (ts.num_siblings) {
+        printf("- Distance between siblings:  %.1f blocks on average, %.1f%% adjacent\n",
+            (double)ts.sibling_dist_sum / ts.num_siblings, 100.0 * ts.num_adjacent_siblings / ts.num_siblings
+        );
+        print_hist("  ", ts.sibling_dist_hist, ts.num_siblings);
+    }
+
+    if (ts.num_top_dirs) {
+        printf("- Largest directories%s:\n", sampled ? " (among the nodes read)" : "");
+        for (uint32_t i = 0; i < ts.num_top_dirs; i++) {
+            printf("  - OID %#-16llx %llu entries\n", ts.top_dirs[i].oid, ts.top_dirs[i].count);
+        }
+    }
+    if (ts.num_top_files) {
+        printf("- Most fragmented files%s:\n", sampled ? " (among the nodes read)" : "");
+        for (uint32_t i = 0; i < ts.num_top_files; i++) {
+            printf("  - Data stream %#-16llx %llu fragments, %llu extents, %llu blocks\n",
+                ts.top_files[i].oid, ts.top_files[i].count, ts.top_files[i].extents, ts.top_files[i].blocks
+            );
+        }
+    }
+
+    free(top_files);
+    free(top_dirs);
+}
+
+/**
+ * Read a single object into a newly allocated buffer and check that it is
+ * valid.
+ *
+ * RETURN VALUE:    A pointer to the object, which must be freed when no longer
+ *      needed, or NULL if it could not be read or is invalid.
+ */
+void* read_object(char* description, paddr_t addr) {
+    obj_phys_t* obj = malloc(nx_block_size);
+    if (!obj) {
+        fprintf(stderr, "\nABORT: read_object: Could not allocate sufficient memory for `obj`.\n");
+        exit(-1);
+    }
+    if (read_blocks(obj, addr, 1) != 1 || !is_cksum_valid(obj)) {
+        printf("%s at block %#llx is unreadable or invalid.\n", description, addr);
+        free(obj);
+        return NULL;
+    }
+    return obj;
+}
+
+int main(int argc, char** argv) {
+    setbuf(stdout, NULL);
+    printf("\n");
+
+    // Extrapolate CLI arguments, exit if invalid
+    if (!parse_treestat_options(&argc, argv) || !parse_common_options(&argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (argc != 2 && argc != 3) {
+        printf("Incorrect number of arguments.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    nx_path = argv[1];
+
+    uint32_t volume_id = 0;
+    bool volume_given = argc == 3;
+    if (volume_given && sscanf(argv[2], "%u", &volume_id) != 1) {
+        printf("%s is not a valid volume ID.\n", argv[2]);
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // Open (device special) file corresponding to an APFS container, read-only
+    printf("Opening file at `%s` in read-only mode ... ", nx_path);
+    nx = fopen(nx_path, "rb");
+    if (!nx) {
+        fprintf(stderr, "\nABORT: ");
+        report_fopen_error();
+        printf("\n");
+        return -errno;
+    }
+    printf("OK.\n");
+    detect_block_size();
+
+    stats_phase("mount");
+    nx_superblock_t* nxsb = malloc(nx_block_size);
+    if (!nxsb) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for `nxsb`.\n");
+        return -1;
+    }
+    if (read_blocks(nxsb, 0x0, 1) != 1) {
+        fprintf(stderr, "\nABORT: Failed to read block 0x0.\n");
+        return -1;
+    }
+    if (!is_cksum_valid(nxsb) || !is_nx_superblock(nxsb) || nxsb->nx_magic != NX_MAGIC) {
+        printf("!! APFS ERROR !! Block 0x0 is not a valid container superblock. Proceeding as if it is.\n");
+    }
+
+    // Find the latest container superblock in the checkpoint descriptor area
+    uint32_t xp_desc_blocks = nxsb->nx_xp_desc_blocks & ~(1 << 31);
+    if (nxsb->nx_xp_desc_blocks >> 31) {
+        // TODO: Handle non-contiguous checkpoint areas
+        fprintf(stderr, "\nABORT: The checkpoint descriptor area is not contiguous; the ability to handle this case has not yet been implemented.\n");
+        return -1;
+    }
+    char (*xp_desc)[nx_block_size] = malloc(xp_desc_blocks * nx_block_size);
+    if (!xp_desc) {
+        fprintf(stderr, "\nABORT: Could not allocate sufficient memory for %u blocks.\n", xp_desc_blocks);
+        return -1;
+    }
+    if (read_blocks(xp_desc, nxsb->nx_xp_desc_base, xp_desc_blocks) != xp_desc_blocks) {
+        fprintf(stderr, "\nABORT: Failed to read all blocks in the checkpoint descriptor area.\n");
+        return -1;
+    }
+
+    xid_t xid_latest_nx = 0;
+    for (uint32_t i = 0; i < xp_desc_blocks; i++) {
+        nx_superblock_t* candidate = xp_desc[i];
+        if (is_cksum_valid(candidate) && is_nx_superblock(candidate) && candidate->nx_magic == NX_MAGIC
+            && candidate->nx_o.o_xid > xid_latest_nx
+        ) {
+            xid_latest_nx = candidate->nx_o.o_xid;
+            memcpy(nxsb, candidate, sizeof(nx_superblock_t));
+        }
+    }
+    free(xp_desc);
+    if (xid_latest_nx == 0) {
+        fprintf(stderr, "\nABORT: There is no valid container superblock in the checkpoint descriptor area.\n");
+        return -1;
+    }
+
+    omap_phys_t* nx_omap = read_object("The container object map", nxsb->nx_omap_oid);
+    if (!nx_omap) {
+        return -1;
+    }
+
+    if (!volume_given) {
+        stats_phase("walk");
+        report_btree("Container object map B-tree", nx_omap->om_tree_oid, NULL, 0, false, false);
+        stats_phase(NULL);
+        printf("\n");
+        return 0;
+    }
+
+    if (volume_id >= NX_MAX_FILE_SYSTEMS || nxsb->nx_fs_oid[volume_id] == 0) {
+        printf("The container has no volume with ID %u.\n", volume_id);
+        return 1;
+    }
+
+    btree_node_phys_t* nx_omap_btree = read_object("The container object map B-tree", nx_omap->om_tree_oid);
+    if (!nx_omap_btree) {
+        return -1;
+    }
+    omap_val_t* fs_val = get_btree_phys_omap_val(nx_omap_btree, nxsb->nx_fs_oid[volume_id], nxsb->nx_o.o_xid);
+    if (!fs_val) {
+        printf("The superblock of volume %u (Virtual OID %#llx) is not in the container object map.\n", volume_id, nxsb->nx_fs_oid[volume_id]);
+        return -1;
+    }
+    apfs_superblock_t* apsb = read_object("The volume superblock", fs_val->ov_paddr);
+    free(fs_val);
+    if (!apsb) {
+        return -1;
+    }
+    printf("Volume %u: %s\n", volume_id, apsb->apfs_volname);
+
+    omap_phys_t* fs_omap = read_object("The volume object map", apsb->apfs_omap_oid);
+    if (!fs_omap) {
+        return -1;
+    }
+    btree_node_phys_t* fs_omap_btree = read_object("The volume object map B-tree", fs_omap->om_tree_oid);
+    if (!fs_omap_btree) {
+        return -1;
+    }
+
+    stats_phase("walk");
+    report_btree("Volume object map B-tree", fs_omap->om_tree_oid, NULL, 0, false, false);
+
+    omap_val_t* fs_root_val = get_btree_phys_omap_val(fs_omap_btree, apsb->apfs_root_tree_oid, apsb->apfs_o.o_xid);
+    if (!fs_root_val) {
+        printf("\nThe file-system root tree (Virtual OID %#llx) is not in the volume object map.\n", apsb->apfs_root_tree_oid);
+    } else if ((fs_root_val->ov_flags & OMAP_VAL_ENCRYPTED) && !unlock_volume(nxsb, apsb)) {
+        printf("\nThe volume is encrypted and could not be unlocked, so its file-system tree can't be read.\n");
+    } else {
+        bool encrypted = fs_root_val->ov_flags & OMAP_VAL_ENCRYPTED;
+        report_btree("File-system root tree", fs_root_val->ov_paddr, fs_omap_btree, apsb->apfs_o.o_xid, encrypted, true);
+    }
+    stats_phase(NULL);
+    printf("\n");
+
+    free(fs_root_val);
+    free(fs_omap_btree);
+    free(fs_omap);
+    free(apsb);
+    free(nx_omap_btree);
+    free(nx_omap);
+    free(nxsb);
+    return 0;
+}
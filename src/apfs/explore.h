@@ -0,0 +1,405 @@
+/**
+ * Navigation of B-trees by the explorers (`apfs-explore-fs-tree` and
+ * `apfs-explore-omap-tree`), either interactively, by choosing an entry of
+ * each node in turn, or non-interactively:
+ *
+ * - `--path=STEP,STEP,...` chooses the entry of each node in turn, starting at
+ *      the root. A step is an entry index, `first`, `last`, or a key predicate
+ *      `oid=OID` or `oid=OID:N`, where N is the record type (file-system trees)
+ *      or XID (object maps). In a non-leaf node, a predicate chooses the entry
+ *      that a lookup of that key would descend into; in a leaf node, it
+ *      chooses the first entry with that OID (and type or XID, if given). If
+ *      the last step is a predicate, it is also used at every level below, so
+ *      `--path=oid=0x1d` descends straight to the first record of OID 0x1d.
+ *      When the path runs out, the explorer exits rather than prompting.
+ *
+ * - `--dump-level=N` prints every node in the top N+1 levels of the tree
+ *      (i.e. the root and N levels below it), level by level. The children of
+ *      a level are resolved and read in batches of `EXPLORE_BATCH_SIZE`
+ *      nodes, so that the reads can be serviced in parallel.
+ */
+
+#ifndef APFS_EXPLORE_H
+#define APFS_EXPLORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "io.h"
+#include "io/async.h"
+#include "options.h"
+#include "func/cksum.h"
+#include "struct/btree.h"
+
+/** Configuration **/
+
+typedef enum {
+    EXPLORE_STEP_INDEX,
+    EXPLORE_STEP_FIRST,
+    EXPLORE_STEP_LAST,
+    EXPLORE_STEP_KEY,
+} explore_step_kind_t;
+
+typedef struct {
+    explore_step_kind_t kind;
+    uint32_t    index;              // For `EXPLORE_STEP_INDEX`
+    uint64_t    oid;                // For `EXPLORE_STEP_KEY`
+    uint64_t    qualifier;          // Record type or XID, if `has_qualifier`
+    bool        has_qualifier;
+} explore_step_t;
+
+// Set by `--path`
+explore_step_t* explore_steps = NULL;
+size_t          explore_num_steps = 0;
+size_t          explore_next_step_index = 0;
+
+// Set by `--dump-level`; -1 if not dumping
+int64_t         explore_dump_level = -1;
+
+// Number of nodes whose children are resolved and read at once when dumping.
+#define EXPLORE_BATCH_SIZE  256
+
+// Value of `explore_choose_entry()` when no entry is chosen.
+#define EXPLORE_NO_ENTRY    UINT32_MAX
+
+/**
+ * The parts of a key that predicate steps compare: the OID, and the record
+ * type (file-system trees) or XID (object maps).
+ */
+typedef struct {
+    uint64_t    oid;
+    uint64_t    qualifier;
+} explore_key_t;
+
+/**
+ * A function that gets the key of a given entry of a node.
+ */
+typedef explore_key_t (*explore_get_key_t)(btree_node_phys_t* node, uint32_t entry_index);
+
+bool is_explore_batch() {
+    return explore_steps != NULL || explore_dump_level >= 0;
+}
+
+void print_explore_options_usage(FILE* stream, const char* qualifier_name) {
+    fprintf(stream,
+        "Navigation options:\n"
+        "  --path=STEP,...     Choose an entry of each node in turn, rather than prompting. Each STEP is an\n"
+        "                      entry index, `first`, `last`, or `oid=OID[:%s]` to follow the key with that\n"
+        "                      OID (and %s); a final `oid=` step is applied all the way down to a leaf.\n"
+        "  --dump-level=N      Print every node in the top N+1 levels of the tree, rather than prompting.\n"
+        "\n",
+        qualifier_name, qualifier_name
+    );
+}
+
+/**
+ * Parse a single step of a `--path` option.
+ */
+bool parse_explore_step(char* string, explore_step_t* step) {
+    memset(step, 0, sizeof(explore_step_t));
+    if (strcmp(string, "first") == 0) {
+        step->kind = EXPLORE_STEP_FIRST;
+        return true;
+    }
+    if (strcmp(string, "last") == 0) {
+        step->kind = EXPLORE_STEP_LAST;
+        return true;
+    }
+    if (strncmp(string, "oid=", 4) == 0) {
+        step->kind = EXPLORE_STEP_KEY;
+        char* qualifier = strchr(string + 4, ':');
+        if (qualifier) {
+            *qualifier++ = '\0';
+            if (!parse_option_uint64(qualifier, &step->qualifier)) {
+                return false;
+            }
+            step->has_qualifier = true;
+        }
+        return parse_option_uint64(string + 4, &step->oid);
+    }
+
+    uint32_t index;
+    if (!parse_option_uint32_or_zero(string, &index)) {
+        return false;
+    }
+    step->kind = EXPLORE_STEP_INDEX;
+    step->index = index;
+    return true;
+}
+
+/**
+ * Parse and remove the navigation options from the argument list; see
+ * `parse_common_options()`.
+ */
+bool parse_explore_options(int* argc, char** argv) {
+    int num_kept = 1;
+    for (int i = 1; i < *argc; i++) {
+        char* arg = argv[i];
+        if (strcmp(arg, "--") == 0) {
+            // Leave the rest for `parse_common_options()`
+            while (i < *argc) {
+                argv[num_kept++] = argv[i++];
+            }
+            break;
+        }
+
+        if (strncmp(arg, "--path=", 7) == 0) {
+            char* path = arg + 7;
+            size_t num_steps = 1;
+            for (char* c = path; *c; c++) {
+                num_steps += *c == ',';
+            }
+            free(explore_steps);
+            explore_steps = malloc(num_steps * sizeof(explore_step_t));
+            if (!explore_steps) {
+                fprintf(stderr, "\nABORT: parse_explore_options: Could not allocate sufficient memory for `explore_steps`.\n");
+                exit(-1);
+            }
+            explore_num_steps = 0;
+
+            char* step_string;
+            while ( (step_string = strsep(&path, ",")) != NULL ) {
+                if (!parse_explore_step(step_string, explore_steps + explore_num_steps)) {
+                    fprintf(stderr, "Option `--path` has an invalid step `%s`; steps are indices, `first`, `last`, or `oid=OID[:N]`.\n", step_string);
+                    return false;
+                }
+                explore_num_steps++;
+            }
+        } else if (strncmp(arg, "--dump-level=", 13) == 0) {
+            uint32_t level;
+            if (!parse_option_uint32_or_zero(arg + 13, &level)) {
+                fprintf(stderr, "Option `--dump-level` requires a non-negative integer value.\n");
+                return false;
+            }
+            explore_dump_level = level;
+        } else {
+            argv[num_kept++] = arg;
+        }
+    }
+
+    if (explore_steps && explore_dump_level >= 0) {
+        fprintf(stderr, "Options `--path` and `--dump-level` can't be used together.\n");
+        return false;
+    }
+
+    argv[num_kept] = NULL;
+    *argc = num_kept;
+    return true;
+}
+
+/**
+ * Prompt for an entry of a node with a given number of entries.
+ *
+ * RETURN VALUE:    The index of the chosen entry, or `EXPLORE_NO_ENTRY` if
+ *      standard input has ended.
+ */
+uint32_t explore_prompt_entry(uint32_t num_entries) {
+    uint32_t entry_index;
+    printf("Choose an entry [0-%u]: ", num_entries - 1);
+    while (true) {
+        int ret = scanf("%u", &entry_index);
+        if (ret == EOF) {
+            printf("\n");
+            return EXPLORE_NO_ENTRY;
+        }
+        if (ret == 1 && entry_index < num_entries) {
+            return entry_index;
+        }
+        if (ret != 1) {
+            // Discard the rest of the line
+            int c;
+            while ((c = getchar()) != '\n' && c != EOF);
+        }
+        printf("Invalid choice; choose an entry [0-%u]: ", num_entries - 1);
+    }
+}
+
+/**
+ * Choose the entry of a node to descend into or display, by the next step of
+ * `--path`, or else by prompting unless in batch mode.
+ *
+ * get_key:     Gets the key of an entry, for predicate steps.
+ *
+ * RETURN VALUE:    The index of the chosen entry, or `EXPLORE_NO_ENTRY` if
+ *      the path has been followed to its end, standard input has ended, or
+ *      the step chooses no entry, in which case that has been reported.
+ */
+uint32_t explore_choose_entry(btree_node_phys_t* node, explore_get_key_t get_key) {
+    uint32_t num_entries = node->btn_nkeys;
+    if (!explore_steps) {
+        if (is_explore_batch()) {
+            return EXPLORE_NO_ENTRY;
+        }
+        return explore_prompt_entry(num_entries);
+    }
+
+    explore_step_t* step;
+    if (explore_next_step_index < explore_num_steps) {
+        step = explore_steps + explore_next_step_index++;
+    } else if (explore_num_steps > 0 && explore_steps[explore_num_steps - 1].kind == EXPLORE_STEP_KEY) {
+        step = explore_steps + explore_num_steps - 1;
+    } else {
+        printf("End of `--path`.\n");
+        return EXPLORE_NO_ENTRY;
+    }
+
+    switch (step->kind) {
+        case EXPLORE_STEP_INDEX:
+            if (step->index >= num_entries) {
+                printf("Path step %u is out of range; this node has entries 0 to %u.\n", step->index, num_entries - 1);
+                return EXPLORE_NO_ENTRY;
+            }
+            printf("Path step: entry %u.\n", step->index);
+            return step->index;
+        case EXPLORE_STEP_FIRST:
+            printf("Path step: first entry (0).\n");
+            return 0;
+        case EXPLORE_STEP_LAST:
+            printf("Path step: last entry (%u).\n", num_entries - 1);
+            return num_entries - 1;
+        case EXPLORE_STEP_KEY:
+            break;
+    }
+
+    uint32_t chosen = EXPLORE_NO_ENTRY;
+    if (node->btn_flags & BTNODE_LEAF) {
+        // The first entry whose key matches
+        for (uint32_t i = 0; i < num_entries; i++) {
+            explore_key_t key = get_key(node, i);
+            if (key.oid == step->oid && (!step->has_qualifier || key.qualifier == step->qualifier)) {
+                chosen = i;
+                break;
+            }
+        }
+    } else {
+        // The last entry whose key doesn't exceed the one sought. Without a
+        // qualifier, the records with the OID begin in the child that the
+        // first entry with that OID points to, if there is one.
+        for (uint32_t i = 0; i < num_entries; i++) {
+            explore_key_t key = get_key(node, i);
+            if (key.oid > step->oid || (key.oid == step->oid && step->has_qualifier && key.qualifier > step->qualifier)) {
+                break;
+            }
+            chosen = i;
+            if (key.oid == step->oid && !step->has_qualifier) {
+                break;
+            }
+        }
+    }
+
+    if (chosen == EXPLORE_NO_ENTRY) {
+        printf("Path step: no entry of this node %s OID %#llx", (node->btn_flags & BTNODE_LEAF) ? "has" : "can lead to", step->oid);
+        if (step->has_qualifier) {
+            printf(" and qualifier %#llx", step->qualifier);
+        }
+        printf(".\n");
+        return EXPLORE_NO_ENTRY;
+    }
+    printf("Path step: entry %u, for OID %#llx.\n", chosen, step->oid);
+    return chosen;
+}
+
+/**
+ * A function that gets the physical address of the child node that a given
+ * entry of a non-leaf node points to, or 0 if it can't be resolved.
+ */
+typedef paddr_t (*explore_get_child_addr_t)(btree_node_phys_t* node, uint32_t entry_index);
+
+/**
+ * A function that prints a node and its entries, for `--dump-level`.
+ */
+typedef void (*explore_print_node_t)(btree_node_phys_t* node);
+
+/**
+ * Print the nodes of the top `explore_dump_level + 1` levels of a tree, level
+ * by level. Each level's nodes are read in batches of `EXPLORE_BATCH_SIZE`,
+ * and the addresses of their children are resolved as each batch is printed,
+ * so that nodes are only read once.
+ *
+ * RETURN VALUE:    The number of nodes printed.
+ */
+uint64_t explore_dump_levels(paddr_t root_addr, explore_get_child_addr_t get_child_addr, explore_print_node_t print_node) {
+    size_t level_len = 1;
+    paddr_t* level_addrs = malloc(sizeof(paddr_t));
+    aio_req_t* reqs = calloc(EXPLORE_BATCH_SIZE, sizeof(aio_req_t));
+    char* nodes = malloc(EXPLORE_BATCH_SIZE * nx_block_size);
+    if (!level_addrs || !reqs || !nodes) {
+        fprintf(stderr, "\nABORT: explore_dump_levels: Could not allocate sufficient memory.\n");
+        exit(-1);
+    }
+    level_addrs[0] = root_addr;
+    uint64_t num_printed = 0;
+
+    for (int64_t level = 0; level <= explore_dump_level && level_len > 0; level++) {
+        size_t next_len = 0;
+        size_t next_capacity = 0;
+        paddr_t* next_addrs = NULL;
+
+        printf("\n================================================================================\n");
+        printf("Depth %lld: %zu node%s\n", level, level_len, level_len == 1 ? "" : "s");
+        printf("================================================================================\n");
+
+        for (size_t batch_start = 0; batch_start < level_len; batch_start += EXPLORE_BATCH_SIZE) {
+            size_t batch_len = level_len - batch_start;
+            if (batch_len > EXPLORE_BATCH_SIZE) {
+                batch_len = EXPLORE_BATCH_SIZE;
+            }
+            for (size_t i = 0; i < batch_len; i++) {
+                memset(reqs + i, 0, sizeof(aio_req_t));
+                reqs[i].buffer      = nodes + i * nx_block_size;
+                reqs[i].start_block = level_addrs[batch_start + i];
+                reqs[i].num_blocks  = 1;
+            }
+            aio_read_batch(reqs, batch_len);
+
+            for (size_t i = 0; i < batch_len; i++) {
+                btree_node_phys_t* node = reqs[i].buffer;
+                printf("\nNode %zu of depth %lld, at block %#llx", batch_start + i, level, reqs[i].start_block);
+                if (reqs[i].result != 1) {
+                    printf(": UNREADABLE.\n");
+                    continue;
+                }
+                if (*(uint64_t*)node == 0) {
+                    printf(": ZEROED OUT.\n");
+                    continue;
+                }
+                printf("%s:\n", is_cksum_valid(node) ? "" : " (checksum FAILED)");
+                print_node(node);
+                num_printed++;
+
+                if (level == explore_dump_level || (node->btn_flags & BTNODE_LEAF)) {
+                    continue;
+                }
+                for (uint32_t j = 0; j < node->btn_nkeys; j++) {
+                    paddr_t child_addr = get_child_addr(node, j);
+                    if (!child_addr) {
+                        continue;
+                    }
+                    if (next_len == next_capacity) {
+                        next_capacity = next_capacity ? 2 * next_capacity : 256;
+                        next_addrs = realloc(next_addrs, next_capacity * sizeof(paddr_t));
+                        if (!next_addrs) {
+                            fprintf(stderr, "\nABORT: explore_dump_levels: Could not allocate sufficient memory for `next_addrs`.\n");
+                            exit(-1);
+                        }
+                    }
+                    next_addrs[next_len++] = child_addr;
+                }
+            }
+        }
+
+        free(level_addrs);
+        level_addrs = next_addrs;
+        level_len = next_len;
+    }
+
+    free(level_addrs);
+    free(nodes);
+    free(reqs);
+    return num_printed;
+}
+
+#endif // APFS_EXPLORE_H
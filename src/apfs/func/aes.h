@@ -0,0 +1,486 @@
+/**
+ * AES (FIPS 197), the XTS mode used to encrypt APFS blocks (IEEE 1619), and
+ * AES key unwrapping (RFC 3394), as needed to read encrypted volumes.
+ *
+ * On x86 processors with the AES-NI instructions, blocks are decrypted with
+ * those, processing eight cipher blocks at a time so that the pipelined
+ * `aesdec` units are kept busy; the XTS tweaks for a whole 512-byte data unit
+ * are independent of one another, so all 32 of its cipher blocks can be in
+ * flight together. Elsewhere, a table-driven software implementation is used.
+ * The choice is made at run time, so the same binary works on any processor.
+ */
+
+#ifndef APFS_FUNC_AES_H
+#define APFS_FUNC_AES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define APFS_AES_NI
+#include <wmmintrin.h>
+#include <smmintrin.h>
+#endif
+
+#define AES_BLOCK_SIZE      16
+#define AES_MAX_ROUNDS      14
+
+/** Size of an XTS data unit; each has its own tweak **/
+#define AES_XTS_UNIT_SIZE   512
+
+/**
+ * An expanded AES key. The round keys are stored as little-endian column
+ * words, i.e. in the byte order of the key schedule in FIPS 197, which is also
+ * the order that the AES-NI instructions expect. The decryption round keys are
+ * those of the equivalent inverse cipher, in the order they are used.
+ */
+typedef struct {
+    uint32_t    enc_keys[4 * (AES_MAX_ROUNDS + 1)];
+    uint32_t    dec_keys[4 * (AES_MAX_ROUNDS + 1)];
+    int         num_rounds;
+} aes_key_t;
+
+/**
+ * An AES-XTS key: the first half of the key material encrypts the data, the
+ * second half encrypts the tweaks.
+ */
+typedef struct {
+    aes_key_t   data_key;
+    aes_key_t   tweak_key;
+} aes_xts_key_t;
+
+/** Tables **/
+
+uint8_t     aes_sbox[256];
+uint8_t     aes_inv_sbox[256];
+uint32_t    aes_enc_table[4][256];
+uint32_t    aes_dec_table[4][256];
+bool        aes_use_aes_ni = false;
+
+pthread_once_t  aes_init_once = PTHREAD_ONCE_INIT;
+
+static inline uint8_t aes_xtime(uint8_t x) {
+    return (x << 1) ^ ((x & 0x80) ? 0x1b : 0);
+}
+
+static inline uint8_t aes_gf_mul(uint8_t a, uint8_t b) {
+    uint8_t product = 0;
+    while (b) {
+        if (b & 1) {
+            product ^= a;
+        }
+        a = aes_xtime(a);
+        b >>= 1;
+    }
+    return product;
+}
+
+static inline uint32_t aes_rotl8(uint32_t x) {
+    return (x << 8) | (x >> 24);
+}
+
+/**
+ * Generate the S-boxes and round tables, and determine whether AES-NI can be
+ * used. This is done once, by `aes_set_key()`.
+ */
+void aes_init_tables() {
+    // Walk the multiplicative group of GF(2^8) with generator 3, so that `p`
+    // and `q` are always inverses; then apply the affine transformation.
+    uint8_t p = 1, q = 1;
+    do {
+        p = p ^ aes_xtime(p);   // p *= 3
+        q ^= q << 1;            // q /= 3
+        q ^= q << 2;
+        q ^= q << 4;
+        if (q & 0x80) {
+            q ^= 0x09;
+        }
+        uint8_t s = q ^ (q << 1 | q >> 7) ^ (q << 2 | q >> 6) ^ (q << 3 | q >> 5) ^ (q << 4 | q >> 4) ^ 0x63;
+        aes_sbox[p] = s;
+    } while (p != 1);
+    aes_sbox[0] = 0x63;
+
+    for (int i = 0; i < 256; i++) {
+        aes_inv_sbox[aes_sbox[i]] = i;
+    }
+
+    for (int i = 0; i < 256; i++) {
+        uint8_t s = aes_sbox[i];
+        uint32_t enc = (uint32_t)aes_gf_mul(s, 2)
+            | (uint32_t)s << 8
+            | (uint32_t)s << 16
+            | (uint32_t)aes_gf_mul(s, 3) << 24;
+
+        uint8_t t = aes_inv_sbox[i];
+        uint32_t dec = (uint32_t)aes_gf_mul(t, 14)
+            | (uint32_t)aes_gf_mul(t, 9) << 8
+            | (uint32_t)aes_gf_mul(t, 13) << 16
+            | (uint32_t)aes_gf_mul(t, 11) << 24;
+
+        for (int j = 0; j < 4; j++) {
+            aes_enc_table[j][i] = enc;
+            aes_dec_table[j][i] = dec;
+            enc = aes_rotl8(enc);
+            dec = aes_rotl8(dec);
+        }
+    }
+
+#ifdef APFS_AES_NI
+    aes_use_aes_ni = __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+static inline uint32_t aes_load32(const uint8_t* bytes) {
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static inline void aes_store32(uint8_t* bytes, uint32_t x) {
+    bytes[0] = x;
+    bytes[1] = x >> 8;
+    bytes[2] = x >> 16;
+    bytes[3] = x >> 24;
+}
+
+static inline uint32_t aes_sub_word(uint32_t x) {
+    return (uint32_t)aes_sbox[x & 0xff]
+        | (uint32_t)aes_sbox[(x >> 8) & 0xff] << 8
+        | (uint32_t)aes_sbox[(x >> 16) & 0xff] << 16
+        | (uint32_t)aes_sbox[x >> 24] << 24;
+}
+
+/**
+ * Expand an AES key.
+ *
+ * key_len:     The length of `key` in bytes; 16 or 32.
+ *
+ * RETURN VALUE:    `true` on success, or `false` if `key_len` is not a
+ *      supported key length.
+ */
+bool aes_set_key(aes_key_t* aes_key, const uint8_t* key, size_t key_len) {
+    pthread_once(&aes_init_once, aes_init_tables);
+
+    if (key_len != 16 && key_len != 32) {
+        return false;
+    }
+    int key_words = key_len / 4;
+    aes_key->num_rounds = key_words + 6;
+    int num_words = 4 * (aes_key->num_rounds + 1);
+
+    uint32_t* w = aes_key->enc_keys;
+    for (int i = 0; i < key_words; i++) {
+        w[i] = aes_load32(key + 4 * i);
+    }
+    uint8_t rcon = 1;
+    for (int i = key_words; i < num_words; i++) {
+        uint32_t temp = w[i - 1];
+        if (i % key_words == 0) {
+            temp = aes_sub_word((temp >> 8) | (temp << 24)) ^ rcon;
+            rcon = aes_xtime(rcon);
+        } else if (key_words == 8 && i % key_words == 4) {
+            temp = aes_sub_word(temp);
+        }
+        w[i] = w[i - key_words] ^ temp;
+    }
+
+    // Equivalent inverse cipher: reverse the round keys, and apply
+    // InvMixColumns to all but the first and last.
+    uint32_t* d = aes_key->dec_keys;
+    for (int round = 0; round <= aes_key->num_rounds; round++) {
+        uint32_t* src = w + 4 * (aes_key->num_rounds - round);
+        for (int j = 0; j < 4; j++) {
+            uint32_t x = src[j];
+            if (round > 0 && round < aes_key->num_rounds) {
+                x = aes_dec_table[0][aes_sbox[x & 0xff]]
+                    ^ aes_dec_table[1][aes_sbox[(x >> 8) & 0xff]]
+                    ^ aes_dec_table[2][aes_sbox[(x >> 16) & 0xff]]
+                    ^ aes_dec_table[3][aes_sbox[x >> 24]];
+            }
+            d[4 * round + j] = x;
+        }
+    }
+    return true;
+}
+
+/**
+ * Encrypt a single 16-byte block in software. `in` and `out` may be the same.
+ */
+void aes_encrypt_block_soft(const aes_key_t* aes_key, const uint8_t* in, uint8_t* out) {
+    const uint32_t* rk = aes_key->enc_keys;
+    uint32_t s0 = aes_load32(in)      ^ rk[0];
+    uint32_t s1 = aes_load32(in + 4)  ^ rk[1];
+    uint32_t s2 = aes_load32(in + 8)  ^ rk[2];
+    uint32_t s3 = aes_load32(in + 12) ^ rk[3];
+
+    #define AES_ENC_COLUMN(a, b, c, d, k) \
+        (aes_enc_table[0][(a) & 0xff] ^ aes_enc_table[1][((b) >> 8) & 0xff] \
+        ^ aes_enc_table[2][((c) >> 16) & 0xff] ^ aes_enc_table[3][(d) >> 24] ^ (k))
+
+    for (int round = 1; round < aes_key->num_rounds; round++) {
+        rk += 4;
+        uint32_t t0 = AES_ENC_COLUMN(s0, s1, s2, s3, rk[0]);
+        uint32_t t1 = AES_ENC_COLUMN(s1, s2, s3, s0, rk[1]);
+        uint32_t t2 = AES_ENC_COLUMN(s2, s3, s0, s1, rk[2]);
+        uint32_t t3 = AES_ENC_COLUMN(s3, s0, s1, s2, rk[3]);
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+    #undef AES_ENC_COLUMN
+
+    #define AES_ENC_LAST(a, b, c, d, k) \
+        (((uint32_t)aes_sbox[(a) & 0xff] | (uint32_t)aes_sbox[((b) >> 8) & 0xff] << 8 \
+        | (uint32_t)aes_sbox[((c) >> 16) & 0xff] << 16 | (uint32_t)aes_sbox[(d) >> 24] << 24) ^ (k))
+
+    rk += 4;
+    aes_store32(out,      AES_ENC_LAST(s0, s1, s2, s3, rk[0]));
+    aes_store32(out + 4,  AES_ENC_LAST(s1, s2, s3, s0, rk[1]));
+    aes_store32(out + 8,  AES_ENC_LAST(s2, s3, s0, s1, rk[2]));
+    aes_store32(out + 12, AES_ENC_LAST(s3, s0, s1, s2, rk[3]));
+    #undef AES_ENC_LAST
+}
+
+/**
+ * Decrypt a single 16-byte block in software. `in` and `out` may be the same.
+ */
+void aes_decrypt_block_soft(const aes_key_t* aes_key, const uint8_t* in, uint8_t* out) {
+    const uint32_t* rk = aes_key->dec_keys;
+    uint32_t s0 = aes_load32(in)      ^ rk[0];
+    uint32_t s1 = aes_load32(in + 4)  ^ rk[1];
+    uint32_t s2 = aes_load32(in + 8)  ^ rk[2];
+    uint32_t s3 = aes_load32(in + 12) ^ rk[3];
+
+    #define AES_DEC_COLUMN(a, b, c, d, k) \
+        (aes_dec_table[0][(a) & 0xff] ^ aes_dec_table[1][((b) >> 8) & 0xff] \
+        ^ aes_dec_table[2][((c) >> 16) & 0xff] ^ aes_dec_table[3][(d) >> 24] ^ (k))
+
+    for (int round = 1; round < aes_key->num_rounds; round++) {
+        rk += 4;
+        uint32_t t0 = AES_DEC_COLUMN(s0, s3, s2, s1, rk[0]);
+        uint32_t t1 = AES_DEC_COLUMN(s1, s0, s3, s2, rk[1]);
+        uint32_t t2 = AES_DEC_COLUMN(s2, s1, s0, s3, rk[2]);
+        uint32_t t3 = AES_DEC_COLUMN(s3, s2, s1, s0, rk[3]);
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+    #undef AES_DEC_COLUMN
+
+    #define AES_DEC_LAST(a, b, c, d, k) \
+        (((uint32_t)aes_inv_sbox[(a) & 0xff] | (uint32_t)aes_inv_sbox[((b) >> 8) & 0xff] << 8 \
+        | (uint32_t)aes_inv_sbox[((c) >> 16) & 0xff] << 16 | (uint32_t)aes_inv_sbox[(d) >> 24] << 24) ^ (k))
+
+    rk += 4;
+    aes_store32(out,      AES_DEC_LAST(s0, s3, s2, s1, rk[0]));
+    aes_store32(out + 4,  AES_DEC_LAST(s1, s0, s3, s2, rk[1]));
+    aes_store32(out + 8,  AES_DEC_LAST(s2, s1, s0, s3, rk[2]));
+    aes_store32(out + 12, AES_DEC_LAST(s3, s2, s1, s0, rk[3]));
+    #undef AES_DEC_LAST
+}
+
+#ifdef APFS_AES_NI
+
+__attribute__((target("aes,sse4.1")))
+void aes_encrypt_block_ni(const aes_key_t* aes_key, const uint8_t* in, uint8_t* out) {
+    const __m128i* rk = (const __m128i*)aes_key->enc_keys;
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), _mm_loadu_si128(rk));
+    for (int round = 1; round < aes_key->num_rounds; round++) {
+        x = _mm_aesenc_si128(x, _mm_loadu_si128(rk + round));
+    }
+    x = _mm_aesenclast_si128(x, _mm_loadu_si128(rk + aes_key->num_rounds));
+    _mm_storeu_si128((__m128i*)out, x);
+}
+
+__attribute__((target("aes,sse4.1")))
+void aes_decrypt_block_ni(const aes_key_t* aes_key, const uint8_t* in, uint8_t* out) {
+    const __m128i* rk = (const __m128i*)aes_key->dec_keys;
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), _mm_loadu_si128(rk));
+    for (int round = 1; round < aes_key->num_rounds; round++) {
+        x = _mm_aesdec_si128(x, _mm_loadu_si128(rk + round));
+    }
+    x = _mm_aesdeclast_si128(x, _mm_loadu_si128(rk + aes_key->num_rounds));
+    _mm_storeu_si128((__m128i*)out, x);
+}
+
+/**
+ * Multiply an XTS tweak by the primitive element α of GF(2^128).
+ */
+__attribute__((target("aes,sse4.1")))
+static inline __m128i aes_xts_mul_alpha_ni(__m128i tweak) {
+    // Shift each 64-bit half left by one, then carry the top bit of the low
+    // half into the high half, and reduce the top bit of the high half.
+    __m128i carries = _mm_srai_epi32(_mm_shuffle_epi32(tweak, 0x13), 31);
+    carries = _mm_and_si128(carries, _mm_set_epi32(0, 1, 0, 0x87));
+    return _mm_xor_si128(_mm_add_epi64(tweak, tweak), carries);
+}
+
+/**
+ * Decrypt one XTS data unit with AES-NI, eight cipher blocks at a time.
+ */
+__attribute__((target("aes,sse4.1")))
+void aes_xts_decrypt_unit_ni(const aes_xts_key_t* xts_key, uint8_t* data, uint64_t unit_number) {
+    uint8_t tweak_bytes[AES_BLOCK_SIZE] = { 0 };
+    for (int i = 0; i < 8; i++) {
+        tweak_bytes[i] = unit_number >> (8 * i);
+    }
+    aes_encrypt_block_ni(&xts_key->tweak_key, tweak_bytes, tweak_bytes);
+    __m128i tweak = _mm_loadu_si128((const __m128i*)tweak_bytes);
+
+    const __m128i* rk = (const __m128i*)xts_key->data_key.dec_keys;
+    int num_rounds = xts_key->data_key.num_rounds;
+    __m128i* blocks = (__m128i*)data;
+
+    for (int base = 0; base < AES_XTS_UNIT_SIZE / AES_BLOCK_SIZE; base += 8) {
+        __m128i tweaks[8];
+        __m128i x[8];
+        for (int i = 0; i < 8; i++) {
+            tweaks[i] = tweak;
+            tweak = aes_xts_mul_alpha_ni(tweak);
+            x[i] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128(blocks + base + i), tweaks[i]), _mm_loadu_si128(rk));
+        }
+        for (int round = 1; round < num_rounds; round++) {
+            __m128i k = _mm_loadu_si128(rk + round);
+            for (int i = 0; i < 8; i++) {
+                x[i] = _mm_aesdec_si128(x[i], k);
+            }
+        }
+        __m128i k = _mm_loadu_si128(rk + num_rounds);
+        for (int i = 0; i < 8; i++) {
+            x[i] = _mm_aesdeclast_si128(x[i], k);
+            _mm_storeu_si128(blocks + base + i, _mm_xor_si128(x[i], tweaks[i]));
+        }
+    }
+}
+
+#endif // APFS_AES_NI
+
+/**
+ * Encrypt a single 16-byte block. `in` and `out` may be the same.
+ */
+void aes_encrypt_block(const aes_key_t* aes_key, const uint8_t* in, uint8_t* out) {
+#ifdef APFS_AES_NI
+    if (aes_use_aes_ni) {
+        aes_encrypt_block_ni(aes_key, in, out);
+        return;
+    }
+#endif
+    aes_encrypt_block_soft(aes_key, in, out);
+}
+
+/**
+ * Decrypt a single 16-byte block. `in` and `out` may be the same.
+ */
+void aes_decrypt_block(const aes_key_t* aes_key, const uint8_t* in, uint8_t* out) {
+#ifdef APFS_AES_NI
+    if (aes_use_aes_ni) {
+        aes_decrypt_block_ni(aes_key, in, out);
+        return;
+    }
+#endif
+    aes_decrypt_block_soft(aes_key, in, out);
+}
+
+/**
+ * Set up an AES-XTS key.
+ *
+ * key_len:     The length of `key` in bytes; 32 for AES-XTS-128, or 64 for
+ *              AES-XTS-256.
+ *
+ * RETURN VALUE:    `true` on success, or `false` if `key_len` is not a
+ *      supported key length.
+ */
+bool aes_xts_set_key(aes_xts_key_t* xts_key, const uint8_t* key, size_t key_len) {
+    return aes_set_key(&xts_key->data_key, key, key_len / 2)
+        && aes_set_key(&xts_key->tweak_key, key + key_len / 2, key_len / 2);
+}
+
+/**
+ * Decrypt one XTS data unit in software.
+ */
+void aes_xts_decrypt_unit_soft(const aes_xts_key_t* xts_key, uint8_t* data, uint64_t unit_number) {
+    uint8_t tweak[AES_BLOCK_SIZE] = { 0 };
+    for (int i = 0; i < 8; i++) {
+        tweak[i] = unit_number >> (8 * i);
+    }
+    aes_encrypt_block_soft(&xts_key->tweak_key, tweak, tweak);
+
+    for (int offset = 0; offset < AES_XTS_UNIT_SIZE; offset += AES_BLOCK_SIZE) {
+        uint8_t* block = data + offset;
+        for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+            block[i] ^= tweak[i];
+        }
+        aes_decrypt_block_soft(&xts_key->data_key, block, block);
+        for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+            block[i] ^= tweak[i];
+        }
+
+        // Multiply the tweak by α.
+        uint8_t carry = 0;
+        for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+            uint8_t next_carry = tweak[i] >> 7;
+            tweak[i] = tweak[i] << 1 | carry;
+            carry = next_carry;
+        }
+        if (carry) {
+            tweak[0] ^= 0x87;
+        }
+    }
+}
+
+/**
+ * Decrypt data in place with AES-XTS. The data consists of consecutive
+ * 512-byte data units, the first of which has the given unit number; this is
+ * how APFS encrypts blocks, with the unit number derived from the block's
+ * address (for metadata) or from the file extent's crypto ID (for file data).
+ *
+ * num_bytes:   The length of `data` in bytes; a multiple of 512.
+ */
+void aes_xts_decrypt(const aes_xts_key_t* xts_key, void* data, size_t num_bytes, uint64_t unit_number) {
+    uint8_t* bytes = data;
+    for (size_t offset = 0; offset + AES_XTS_UNIT_SIZE <= num_bytes; offset += AES_XTS_UNIT_SIZE) {
+#ifdef APFS_AES_NI
+        if (aes_use_aes_ni) {
+            aes_xts_decrypt_unit_ni(xts_key, bytes + offset, unit_number++);
+            continue;
+        }
+#endif
+        aes_xts_decrypt_unit_soft(xts_key, bytes + offset, unit_number++);
+    }
+}
+
+/**
+ * Unwrap a key with the AES key wrap algorithm (RFC 3394).
+ *
+ * wrapped_len: The length of `wrapped` in bytes; the unwrapped key is 8 bytes
+ *              shorter, and is written to `key`.
+ *
+ * RETURN VALUE:    `true` if the integrity check passed, i.e. `kek` is the key
+ *      that `wrapped` was wrapped with; else `false`.
+ */
+bool aes_unwrap_key(const aes_key_t* kek, const uint8_t* wrapped, size_t wrapped_len, uint8_t* key) {
+    if (wrapped_len < 24 || wrapped_len % 8 != 0) {
+        return false;
+    }
+    size_t n = wrapped_len / 8 - 1;
+
+    uint8_t a[8];
+    memcpy(a, wrapped, 8);
+    memcpy(key, wrapped + 8, 8 * n);
+
+    uint8_t block[AES_BLOCK_SIZE];
+    for (int j = 5; j >= 0; j--) {
+        for (size_t i = n; i >= 1; i--) {
+            uint64_t t = n * j + i;
+            memcpy(block, a, 8);
+            for (int k = 0; k < 8; k++) {
+                block[7 - k] ^= t >> (8 * k);
+            }
+            memcpy(block + 8, key + 8 * (i - 1), 8);
+            aes_decrypt_block(kek, block, block);
+            memcpy(a, block, 8);
+            memcpy(key + 8 * (i - 1), block + 8, 8);
+        }
+    }
+
+    static const uint8_t default_iv[8] = { 0xa6, 0xa6, 0xa6, 0xa6, 0xa6, 0xa6, 0xa6, 0xa6 };
+    return memcmp(a, default_iv, 8) == 0;
+}
+
+#endif // APFS_FUNC_AES_H
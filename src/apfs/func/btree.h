@@ -11,10 +11,36 @@
 #include "../struct/btree.h"
 #include "../struct/j.h"
 #include "../io.h"
+#include "../io/cache.h"
+#include "cksum.h"
+#include "crypto.h"
 
 #include "../string/omap.h"
 #include "../string/j.h"
 
+/**
+ * Read the file-system tree node that a given object map value points to, via
+ * the block cache, decrypting it if the object map marks it as encrypted.
+ *
+ * RETURN VALUE:    The number of blocks read; 1 on success.
+ */
+size_t read_fs_node_cached(btree_node_phys_t* node, omap_val_t* omap_val) {
+    cache_transform_t transform = (omap_val->ov_flags & OMAP_VAL_ENCRYPTED) ? decrypt_metadata_block : NULL;
+    return read_blocks_cached_transformed(node, omap_val->ov_paddr, 1, transform);
+}
+
+/**
+ * Report that a B-tree node couldn't be used in rescue mode, and so the
+ * subtree beneath it is being skipped.
+ */
+void report_skipped_subtree(char* caller, paddr_t addr) {
+    fprintf(stderr, "%s: Skipping the subtree at block %#llx, which is %s; some records may be missing.\n",
+        caller,
+        addr,
+        rescue_is_bad(addr) ? "unreadable" : "corrupt"
+    );
+}
+
 /**
  * Get the latest version of an object, up to a given XID, from an object map
  * B-tree that uses Physical OIDs to refer to its child nodes.
@@ -41,7 +67,7 @@
  *      a NULL pointer is returned.
  *      This pointer must be freed when it is no longer needed.
  */
-omap_val_t* get_btree_phys_omap_val(btree_node_phys_t* root_node, oid_t oid, xid_t max_xid) {
+omap_val_t* get_btree_phys_omap_val_internal(btree_node_phys_t* root_node, oid_t oid, xid_t max_xid) {
     // Create a copy of the root node to use as the current node we're working with
     btree_node_phys_t* node = malloc(nx_block_size);
     if (!node) {
@@ -141,12 +167,24 @@ omap_val_t* get_btree_phys_omap_val(btree_node_phys_t* root_node, oid_t oid, xid
 
         // Else, read the corresponding child node into memory and loop
         paddr_t* child_node_addr = val_end - toc_entry->v;
+        STATS_ADD(tree_descents, 1);
         
-        if (read_blocks(node, *child_node_addr, 1) != 1) {
+        if (read_blocks_cached(node, *child_node_addr, 1) != 1) {
             fprintf(stderr, "\nABORT: get_btree_phys_omap_val: Failed to read block 0x%llx.\n", *child_node_addr);
             exit(-1);
         }
 
+        if (io_rescue && !is_cksum_valid(node)) {
+            fprintf(stderr, "get_btree_phys_omap_val: Node at block %#llx is %s; treating OID %#llx as unmapped.\n",
+                *child_node_addr,
+                rescue_is_bad(*child_node_addr) ? "unreadable" : "corrupt",
+                oid
+            );
+            free(bt_info);
+            free(node);
+            return NULL;
+        }
+
         // if (!is_cksum_valid(node)) {
         //     fprintf(stderr, "\nABORT: get_btree_phys_omap_val: Checksum of node at block 0x%llx did not validate.\n", *child_node_addr);
         //     exit(-1);
@@ -158,6 +196,19 @@ omap_val_t* get_btree_phys_omap_val(btree_node_phys_t* root_node, oid_t oid, xid
     }
 }
 
+/**
+ * Get the latest version of an object, up to a given XID, from an object map
+ * B-tree; see `get_btree_phys_omap_val_internal()`. This wrapper counts and
+ * times the lookups for `--stats`.
+ */
+omap_val_t* get_btree_phys_omap_val(btree_node_phys_t* root_node, oid_t oid, xid_t max_xid) {
+    STATS_ADD(omap_lookups, 1);
+    STATS_TIMER_START(start_ns);
+    omap_val_t* omap_val = get_btree_phys_omap_val_internal(root_node, oid, max_xid);
+    STATS_TIMER_STOP(start_ns, omap_lookup_ns);
+    return omap_val;
+}
+
 /**
  * Custom data structure used to store a full file-system record (i.e. a single
  * key–value pair from a file-system root tree) alongside each other for easier
@@ -203,6 +254,46 @@ void free_j_rec_array(j_rec_t** records_array) {
     free(records_array);
 }
 
+/**
+ * Read the children of a non-leaf file-system B-tree node that a walk for
+ * records with a given OID will visit in turn into the block cache all at
+ * once; see `cache_prefetch()`. These are the children from the `first`th
+ * onward whose first key has an OID no greater than `oid`, as no later child
+ * can hold records with that OID.
+ */
+void prefetch_fs_children(btree_node_phys_t* vol_omap_root_node, btree_node_phys_t* node, uint32_t first, oid_t oid, xid_t max_xid) {
+    char* toc_start = (char*)(node->btn_data) + node->btn_table_space.off;
+    char* key_start = toc_start + node->btn_table_space.len;
+    char* val_end   = (char*)node + nx_block_size;
+    if (node->btn_flags & BTNODE_ROOT) {
+        val_end -= sizeof(btree_info_t);
+    }
+
+    paddr_t* addrs = malloc(node->btn_nkeys * sizeof(paddr_t) + 1);
+    if (!addrs) {
+        fprintf(stderr, "\nABORT: prefetch_fs_children: Could not allocate sufficient memory for `addrs`.\n");
+        exit(-1);
+    }
+
+    size_t num_addrs = 0;
+    kvloc_t* toc_entry = (kvloc_t*)toc_start + first;
+    for (uint32_t i = first; i < node->btn_nkeys; i++, toc_entry++) {
+        j_key_t* key = key_start + toc_entry->k.off;
+        if ((key->obj_id_and_type & OBJ_ID_MASK) > oid) {
+            break;
+        }
+        oid_t* child_node_virt_oid = val_end - toc_entry->v.off;
+        omap_val_t* child_node_omap_val = get_btree_phys_omap_val(vol_omap_root_node, *child_node_virt_oid, max_xid);
+        if (child_node_omap_val) {
+            addrs[num_addrs++] = child_node_omap_val->ov_paddr;
+            free(child_node_omap_val);
+        }
+    }
+
+    cache_prefetch(addrs, num_addrs);
+    free(addrs);
+}
+
 /**
  * Get an array of all the file-system records with a given Virtual OID from a
  * given file-system root tree.
@@ -237,7 +328,7 @@ void free_j_rec_array(j_rec_t** records_array) {
  *      in order to free the memory allocated by this function via internal
  *      calls to `malloc()` and `realloc()`.
  */
-j_rec_t** get_fs_records(btree_node_phys_t* vol_omap_root_node, btree_node_phys_t* vol_fs_root_node, oid_t oid, xid_t max_xid) {
+j_rec_t** get_fs_records_internal(btree_node_phys_t* vol_omap_root_node, btree_node_phys_t* vol_fs_root_node, oid_t oid, xid_t max_xid) {
 
     /**
      * `desc_path` describes the path we have taken to descend down the file-
@@ -251,6 +342,15 @@ j_rec_t** get_fs_records(btree_node_phys_t* vol_omap_root_node, btree_node_phys_
      */
     uint32_t desc_path[vol_fs_root_node->btn_level + 1];
     uint16_t i = 0;     // `i` keeps tracks of how many descents we've made from the root node.
+
+    /**
+     * Whilst walking along the tree below, the children of each non-leaf node
+     * that may hold records with the given OID are read all at once on the
+     * first visit to that node. `prefetched_oids[i]` is the Virtual OID of the
+     * node `i` levels beneath the root level whose children were last read.
+     */
+    oid_t prefetched_oids[vol_fs_root_node->btn_level + 1];
+    memset(prefetched_oids, 0, sizeof(prefetched_oids));
     
     // Initialise the array of records which will be returned to the caller
     size_t num_records = 0;
@@ -385,12 +485,23 @@ j_rec_t** get_fs_records(btree_node_phys_t* vol_omap_root_node, btree_node_phys_
             return NULL;
         }
         
-        if (read_blocks(node, child_node_omap_val->ov_paddr, 1) != 1) {
+        STATS_ADD(tree_descents, 1);
+        if (read_fs_node_cached(node, child_node_omap_val) != 1) {
             fprintf(stderr, "\nABORT: get_fs_records: Failed to read block 0x%llx.\n", child_node_omap_val->ov_paddr);
             exit(-1);
         }
 
         if (!is_cksum_valid(node)) {
+            if (io_rescue) {
+                // Records with the given OID may continue into the next
+                // subtree; have the walk below start there.
+                report_skipped_subtree("get_fs_records", child_node_omap_val->ov_paddr);
+                desc_path[i]++;
+                for (uint16_t j = i + 1; j <= vol_fs_root_node->btn_level; j++) {
+                    desc_path[j] = 0;
+                }
+                break;
+            }
             fprintf(stderr, "\nABORT: get_fs_records: Checksum of node at block 0x%llx did not validate.\n", child_node_omap_val->ov_paddr);
             exit(-1);
         }
@@ -549,7 +660,13 @@ j_rec_t** get_fs_records(btree_node_phys_t* vol_omap_root_node, btree_node_phys_
                 break;
             }
 
-            // Else, read the corresponding child node into memory and loop
+            // Else, read the children that the walk will visit, if this is
+            // the first visit to this node; then read the corresponding child
+            // node into memory and loop
+            if (prefetched_oids[i] != node->btn_o.o_oid) {
+                prefetch_fs_children(vol_omap_root_node, node, desc_path[i], oid, max_xid);
+                prefetched_oids[i] = node->btn_o.o_oid;
+            }
             oid_t* child_node_virt_oid = val_end - toc_entry->v.off;
             omap_val_t* child_node_omap_val = get_btree_phys_omap_val(vol_omap_root_node, *child_node_virt_oid, max_xid);
             if (!child_node_omap_val) {
@@ -561,12 +678,22 @@ j_rec_t** get_fs_records(btree_node_phys_t* vol_omap_root_node, btree_node_phys_
                 return NULL;
             }
             
-            if (read_blocks(node, child_node_omap_val->ov_paddr, 1) != 1) {
+            STATS_ADD(tree_descents, 1);
+            if (read_fs_node_cached(node, child_node_omap_val) != 1) {
                 fprintf(stderr, "\nABORT: get_fs_records: Failed to read block 0x%llx.\n", child_node_omap_val->ov_paddr);
                 exit(-1);
             }
 
             if (!is_cksum_valid(node)) {
+                if (io_rescue) {
+                    // Carry on with the next subtree.
+                    report_skipped_subtree("get_fs_records", child_node_omap_val->ov_paddr);
+                    desc_path[i]++;
+                    for (uint16_t j = i + 1; j <= vol_fs_root_node->btn_level; j++) {
+                        desc_path[j] = 0;
+                    }
+                    break;
+                }
                 fprintf(stderr, "\nABORT: get_fs_records: Checksum of node at block 0x%llx did not validate.\n", child_node_omap_val->ov_paddr);
                 exit(-1);
             }
@@ -578,4 +705,17 @@ j_rec_t** get_fs_records(btree_node_phys_t* vol_omap_root_node, btree_node_phys_
     }
 }
 
+/**
+ * Get an array of all the file-system records with a given Virtual OID; see
+ * `get_fs_records_internal()`. This wrapper counts and times the lookups for
+ * `--stats`; their time includes that of the object map lookups they make.
+ */
+j_rec_t** get_fs_records(btree_node_phys_t* vol_omap_root_node, btree_node_phys_t* vol_fs_root_node, oid_t oid, xid_t max_xid) {
+    STATS_ADD(fs_lookups, 1);
+    STATS_TIMER_START(start_ns);
+    j_rec_t** records = get_fs_records_internal(vol_omap_root_node, vol_fs_root_node, oid, max_xid);
+    STATS_TIMER_STOP(start_ns, fs_lookup_ns);
+    return records;
+}
+
 #endif // APFS_FUNC_BTREE_H
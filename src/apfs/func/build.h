@@ -0,0 +1,426 @@
+/**
+ * Building B-tree nodes and whole B-trees from records given in key order,
+ * for tools that create or repair trees rather than assembling nodes by hand.
+ *
+ * A `node_builder_t` gathers the entries of one node and packs them into a
+ * node: the table of contents, keys, values, free space, and, for a root,
+ * the `btree_info_t`. A `tree_builder_t` bulk-loads a whole tree bottom-up
+ * from a stream of records, filling each node as far as it will go, and
+ * hands every finished node to a callback that gives it an address and OID
+ * and writes or stages it. `build_omap_tree()` does all of this for an
+ * object map, given its mappings in any order.
+ */
+
+#ifndef APFS_FUNC_BUILD_H
+#define APFS_FUNC_BUILD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../io.h"
+#include "cksum.h"
+
+#include "../struct/object.h"
+#include "../struct/omap.h"
+#include "../struct/btree.h"
+
+#define BUILD_MAX_TREE_LEVELS   16
+
+/**
+ * Set the header of an object and compute its checksum.
+ */
+void finish_object(void* block, oid_t oid, xid_t xid, uint32_t type, uint32_t subtype) {
+    obj_phys_t* obj = block;
+    obj->o_oid = oid;
+    obj->o_xid = xid;
+    obj->o_type = type;
+    obj->o_subtype = subtype;
+    *(uint64_t*)obj->o_cksum = compute_block_cksum(block);
+}
+
+static inline uint32_t build_align8(uint32_t value) {
+    return (value + 7) & ~7u;
+}
+
+/** Nodes **/
+
+/**
+ * The entries of a node that is being built. Keys are gathered from the
+ * start of `keys` and values from the end of `vals`, as they are laid out in
+ * a node, and the TOC is kept as `kvloc_t` even for nodes with fixed-size
+ * keys and values, so that the node can only be laid out once the number of
+ * entries, and thus the size of the TOC, is known.
+ */
+typedef struct {
+    bool        fixed;          // Keys and values have fixed sizes; the TOC is `kvoff_t`
+    uint32_t    max_entries;    // Maximum number of entries per node; 0 for no limit
+    char*       keys;
+    char*       vals;
+    kvloc_t*    toc;
+    uint32_t    nkeys;
+    uint32_t    keys_len;
+    uint32_t    vals_len;
+} node_builder_t;
+
+void node_builder_init(node_builder_t* nb, bool fixed, uint32_t max_entries) {
+    memset(nb, 0, sizeof(node_builder_t));
+    nb->fixed = fixed;
+    nb->max_entries = max_entries;
+    nb->keys = malloc(nx_block_size);
+    nb->vals = malloc(nx_block_size);
+    nb->toc  = malloc(nx_block_size);
+    if (!nb->keys || !nb->vals || !nb->toc) {
+        fprintf(stderr, "\nABORT: node_builder_init: Could not allocate sufficient memory for a node builder.\n");
+        exit(-1);
+    }
+}
+
+void node_builder_free(node_builder_t* nb) {
+    free(nb->keys);
+    free(nb->vals);
+    free(nb->toc);
+    memset(nb, 0, sizeof(node_builder_t));
+}
+
+void node_builder_reset(node_builder_t* nb) {
+    nb->nkeys = 0;
+    nb->keys_len = 0;
+    nb->vals_len = 0;
+}
+
+/**
+ * Determine whether a node has room for another entry, given whether it is
+ * to be a root node, which must also have room for a `btree_info_t`.
+ */
+bool node_builder_fits(node_builder_t* nb, uint16_t key_len, uint16_t val_len, bool is_root) {
+    if (nb->max_entries && nb->nkeys >= nb->max_entries) {
+        return false;
+    }
+    size_t used = sizeof(btree_node_phys_t) + (is_root ? sizeof(btree_info_t) : 0);
+    if (nb->fixed) {
+        used += (nb->nkeys + 1) * (sizeof(kvoff_t) + key_len + val_len);
+    } else {
+        used += (nb->nkeys + 1) * sizeof(kvloc_t)
+            + build_align8(nb->keys_len) + key_len
+            + build_align8(nb->vals_len + val_len);
+    }
+    return used <= nx_block_size;
+}
+
+/**
+ * Determine whether a node's current entries would fit in a root node.
+ */
+bool node_builder_fits_root(node_builder_t* nb) {
+    size_t used = sizeof(btree_node_phys_t) + sizeof(btree_info_t) + nb->vals_len
+        + (nb->fixed ? nb->nkeys * sizeof(kvoff_t) + nb->keys_len : nb->nkeys * sizeof(kvloc_t) + build_align8(nb->keys_len));
+    return used <= nx_block_size;
+}
+
+/**
+ * Add an entry to a node, after the ones already added. The caller should
+ * check that it fits with `node_builder_fits()`.
+ */
+void node_builder_add(node_builder_t* nb, void* key, uint16_t key_len, void* val, uint16_t val_len) {
+    kvloc_t* entry = nb->toc + nb->nkeys++;
+    if (nb->fixed) {
+        entry->k.off = nb->keys_len;
+        entry->v.off = nb->vals_len + val_len;
+    } else {
+        entry->k.off = build_align8(nb->keys_len);
+        entry->v.off = build_align8(nb->vals_len + val_len);
+    }
+    entry->k.len = key_len;
+    entry->v.len = val_len;
+    memcpy(nb->keys + entry->k.off, key, key_len);
+    memcpy(nb->vals + nx_block_size - entry->v.off, val, val_len);
+    nb->keys_len = entry->k.off + key_len;
+    nb->vals_len = entry->v.off;
+}
+
+/**
+ * Lay out a node's entries in a block, and set the node's B-tree fields.
+ * `BTNODE_FIXED_KV_SIZE` is added to `flags` if the node has fixed-size keys
+ * and values. If `info` is not NULL, the node is a root node, and `info` is
+ * copied to the end of the block. The object header is left for the caller
+ * to set, e.g. with `finish_object()`.
+ */
+void node_builder_pack(node_builder_t* nb, btree_node_phys_t* node, uint16_t flags, uint16_t level, btree_info_t* info) {
+    memset(node, 0, nx_block_size);
+
+    size_t toc_len = nb->nkeys * (nb->fixed ? sizeof(kvoff_t) : sizeof(kvloc_t));
+    char* toc_start = (char*)node->btn_data;
+    char* key_start = toc_start + toc_len;
+    char* val_end   = (char*)node + nx_block_size - (info ? sizeof(btree_info_t) : 0);
+
+    if (nb->fixed) {
+        kvoff_t* toc = toc_start;
+        for (uint32_t i = 0; i < nb->nkeys; i++) {
+            toc[i].k = nb->toc[i].k.off;
+            toc[i].v = nb->toc[i].v.off;
+        }
+    } else {
+        memcpy(toc_start, nb->toc, toc_len);
+    }
+    memcpy(key_start, nb->keys, nb->keys_len);
+    memcpy(val_end - nb->vals_len, nb->vals + nx_block_size - nb->vals_len, nb->vals_len);
+
+    node->btn_flags = flags | (nb->fixed ? BTNODE_FIXED_KV_SIZE : 0);
+    node->btn_level = level;
+    node->btn_nkeys = nb->nkeys;
+    node->btn_table_space.off = 0;
+    node->btn_table_space.len = toc_len;
+    node->btn_free_space.off = nb->keys_len;
+    node->btn_free_space.len = (val_end - nb->vals_len) - (key_start + nb->keys_len);
+    node->btn_key_free_list.off = 0xffff;
+    node->btn_val_free_list.off = 0xffff;
+
+    if (info) {
+        memcpy(val_end, info, sizeof(btree_info_t));
+    }
+}
+
+/** Trees **/
+
+typedef struct tree_builder tree_builder_t;
+
+/**
+ * A function that stores a finished node of a tree that is being built. The
+ * node's `o_type`, `o_subtype`, and `o_xid` are already set; the function
+ * chooses the node's address and OID, sets `o_oid` and the checksum (e.g.
+ * with `finish_object()`), and writes or stages the node.
+ *
+ * RETURN VALUE:    The OID of the node, by which its parent refers to it.
+ */
+typedef oid_t (*tree_builder_store_t)(tree_builder_t* tree, btree_node_phys_t* node);
+
+/**
+ * A B-tree that is being built bottom-up from records given in key order.
+ * Each level holds the node that is currently being filled; when the next
+ * entry doesn't fit, the node is stored, and an index entry for it is added
+ * to the level above. Nodes are packed full, with room for a `btree_info_t`
+ * only in the root, which is only known once all records have been added.
+ */
+struct tree_builder {
+    // Configuration
+    uint32_t    subtype;        // The tree type, e.g. `OBJECT_TYPE_OMAP`
+    uint32_t    storage;        // `OBJ_PHYSICAL`, `OBJ_VIRTUAL`, or `OBJ_EPHEMERAL`
+    uint16_t    key_size;       // Non-zero for trees with fixed-size keys and values
+    uint16_t    val_size;
+    uint32_t    bt_flags;
+    xid_t       xid;
+    uint32_t    max_entries;    // Maximum number of entries per node; 0 packs nodes full
+    tree_builder_store_t store;
+    void*       context;        // For use by `store`
+
+    // State
+    node_builder_t  levels[BUILD_MAX_TREE_LEVELS];
+    uint64_t        level_num_nodes[BUILD_MAX_TREE_LEVELS];    // Nodes already stored at each level
+    uint32_t        num_levels;
+    btree_node_phys_t* node;
+
+    // Results
+    oid_t       root_oid;
+    uint64_t    key_count;
+    uint64_t    node_count;
+    uint32_t    longest_key;
+    uint32_t    longest_val;
+};
+
+void tree_builder_init(tree_builder_t* tree, uint32_t subtype, uint32_t storage, uint16_t key_size, uint16_t val_size, xid_t xid, tree_builder_store_t store, void* context) {
+    memset(tree, 0, sizeof(tree_builder_t));
+    tree->subtype   = subtype;
+    tree->storage   = storage;
+    tree->key_size  = key_size;
+    tree->val_size  = val_size;
+    tree->bt_flags  = storage == OBJ_PHYSICAL ? BTREE_PHYSICAL : 0;
+    tree->xid       = xid;
+    tree->store     = store;
+    tree->context   = context;
+    tree->node      = calloc(1, nx_block_size);
+    if (!tree->node) {
+        fprintf(stderr, "\nABORT: tree_builder_init: Could not allocate sufficient memory for a node.\n");
+        exit(-1);
+    }
+}
+
+void tree_builder_add_at_level(tree_builder_t* tree, uint32_t level_index, void* key, uint16_t key_len, void* val, uint16_t val_len);
+
+/**
+ * Store the node that a level is filling, and add an index entry for it to
+ * the level above, unless it is the root.
+ */
+void tree_builder_store_level(tree_builder_t* tree, uint32_t level_index, bool is_root) {
+    node_builder_t* level = tree->levels + level_index;
+    btree_node_phys_t* node = tree->node;
+    tree->node_count++;
+
+    btree_info_t info;
+    if (is_root) {
+        memset(&info, 0, sizeof(info));
+        info.bt_fixed.bt_flags      = tree->bt_flags;
+        info.bt_fixed.bt_node_size  = nx_block_size;
+        info.bt_fixed.bt_key_size   = tree->key_size;
+        info.bt_fixed.bt_val_size   = tree->val_size;
+        info.bt_longest_key         = tree->longest_key;
+        info.bt_longest_val         = tree->longest_val;
+        info.bt_key_count           = tree->key_count;
+        info.bt_node_count          = tree->node_count;
+    }
+    uint16_t flags = (is_root ? BTNODE_ROOT : 0) | (level_index == 0 ? BTNODE_LEAF : 0);
+    node_builder_pack(level, node, flags, level_index, is_root ? &info : NULL);
+    node->btn_o.o_xid       = tree->xid;
+    node->btn_o.o_type      = tree->storage | (is_root ? OBJECT_TYPE_BTREE : OBJECT_TYPE_BTREE_NODE);
+    node->btn_o.o_subtype   = tree->subtype;
+
+    oid_t oid = tree->store(tree, node);
+    if (is_root) {
+        tree->root_oid = oid;
+    }
+
+    // The index entry for this node is its first key.
+    char first_key[nx_block_size];
+    uint16_t first_key_len = level->nkeys ? level->toc[0].k.len : 0;
+    memcpy(first_key, level->keys, first_key_len);
+    node_builder_reset(level);
+    tree->level_num_nodes[level_index]++;
+
+    if (!is_root) {
+        tree_builder_add_at_level(tree, level_index + 1, first_key, first_key_len, &oid, sizeof(oid_t));
+    }
+}
+
+void tree_builder_add_at_level(tree_builder_t* tree, uint32_t level_index, void* key, uint16_t key_len, void* val, uint16_t val_len) {
+    if (level_index >= BUILD_MAX_TREE_LEVELS) {
+        fprintf(stderr, "\nABORT: tree_builder_add_at_level: The tree would have more than %u levels.\n", BUILD_MAX_TREE_LEVELS);
+        exit(-1);
+    }
+    node_builder_t* level = tree->levels + level_index;
+    if (level_index >= tree->num_levels) {
+        tree->num_levels = level_index + 1;
+        node_builder_init(level, tree->key_size != 0, tree->max_entries);
+    }
+
+    if (!node_builder_fits(level, key_len, val_len, false)) {
+        if (level->nkeys == 0) {
+            fprintf(stderr, "\nABORT: tree_builder_add_at_level: A record with a %u-byte key and %u-byte value doesn't fit in a node.\n", key_len, val_len);
+            exit(-1);
+        }
+        tree_builder_store_level(tree, level_index, false);
+    }
+    node_builder_add(level, key, key_len, val, val_len);
+}
+
+/**
+ * Add a record to a tree. Records must be added in key order.
+ */
+void tree_builder_add(tree_builder_t* tree, void* key, uint16_t key_len, void* val, uint16_t val_len) {
+    tree->key_count++;
+    if (key_len > tree->longest_key) {
+        tree->longest_key = key_len;
+    }
+    if (val_len > tree->longest_val) {
+        tree->longest_val = val_len;
+    }
+    tree_builder_add_at_level(tree, 0, key, key_len, val, val_len);
+}
+
+/**
+ * Store a level's node as two nodes, each with half of its entries. This is
+ * used when the node would be the root, but has no room for a `btree_info_t`.
+ */
+void tree_builder_split_level(tree_builder_t* tree, uint32_t level_index) {
+    node_builder_t* level = tree->levels + level_index;
+    node_builder_t entries = *level;
+    node_builder_init(level, entries.fixed, entries.max_entries);
+
+    uint32_t half = (entries.nkeys + 1) / 2;
+    for (uint32_t i = 0; i < entries.nkeys; i++) {
+        kvloc_t* entry = entries.toc + i;
+        node_builder_add(level, entries.keys + entry->k.off, entry->k.len, entries.vals + nx_block_size - entry->v.off, entry->v.len);
+        if (i == half - 1 || i == entries.nkeys - 1) {
+            tree_builder_store_level(tree, level_index, false);
+        }
+    }
+    node_builder_free(&entries);
+}
+
+/**
+ * Store the remaining nodes of a tree, and free its buffers.
+ *
+ * RETURN VALUE:    The OID of the root node.
+ */
+oid_t tree_builder_finish(tree_builder_t* tree) {
+    if (tree->num_levels == 0) {
+        // An empty tree is a single, empty root leaf.
+        tree->num_levels = 1;
+        node_builder_init(tree->levels, tree->key_size != 0, tree->max_entries);
+    }
+
+    // Store each level's last node. Each of these adds an entry to the level
+    // above, so the topmost level only ever has one node left, which is the
+    // root, unless that level has already stored a node, in which case it
+    // grows another level above it. A would-be root that has no room for the
+    // B-tree info is split in two, which also grows another level.
+    for (uint32_t i = 0; i < tree->num_levels; i++) {
+        bool is_top = i == tree->num_levels - 1;
+        if (is_top && tree->level_num_nodes[i] == 0) {
+            if (node_builder_fits_root(tree->levels + i)) {
+                tree_builder_store_level(tree, i, true);
+                break;
+            }
+            tree_builder_split_level(tree, i);
+            continue;
+        }
+        tree_builder_store_level(tree, i, false);
+    }
+
+    for (uint32_t i = 0; i < tree->num_levels; i++) {
+        node_builder_free(tree->levels + i);
+    }
+    free(tree->node);
+    tree->node = NULL;
+    return tree->root_oid;
+}
+
+/** Object maps **/
+
+typedef struct {
+    omap_key_t  key;
+    omap_val_t  val;
+} omap_mapping_t;
+
+int compare_omap_mappings(const void* a, const void* b) {
+    const omap_key_t* x = &((const omap_mapping_t*)a)->key;
+    const omap_key_t* y = &((const omap_mapping_t*)b)->key;
+    if (x->ok_oid != y->ok_oid) {
+        return x->ok_oid < y->ok_oid ? -1 : 1;
+    }
+    return x->ok_xid < y->ok_xid ? -1 : x->ok_xid > y->ok_xid;
+}
+
+/**
+ * Build an object map tree from a given array of mappings, in one pass. The
+ * array is sorted in place by (OID, XID); of mappings with the same key, only
+ * one is kept. Nodes are given to `store` as in `tree_builder_init()`,
+ * and are physical, as object map trees always are.
+ *
+ * RETURN VALUE:    The physical OID of the tree's root node.
+ */
+oid_t build_omap_tree(omap_mapping_t* mappings, size_t num_mappings, xid_t xid, tree_builder_store_t store, void* context) {
+    qsort(mappings, num_mappings, sizeof(omap_mapping_t), compare_omap_mappings);
+
+    tree_builder_t tree;
+    tree_builder_init(&tree, OBJECT_TYPE_OMAP, OBJ_PHYSICAL, sizeof(omap_key_t), sizeof(omap_val_t), xid, store, context);
+    for (size_t i = 0; i < num_mappings; i++) {
+        if (i > 0 && compare_omap_mappings(mappings + i - 1, mappings + i) == 0) {
+            continue;
+        }
+        tree_builder_add(&tree, &mappings[i].key, sizeof(omap_key_t), &mappings[i].val, sizeof(omap_val_t));
+    }
+    return tree_builder_finish(&tree);
+}
+
+#endif // APFS_FUNC_BUILD_H
@@ -6,43 +6,34 @@
 #define APFS_FUNC_CKSUM_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "../io.h"
 
 /**
- * Compute or validate the checksum of a given APFS block. This is a helper
- * function for `compute_block_cksum()` and `is_cksum_valid()`.
- * 
- * block:   A pointer to the raw APFS block data. This pointer should point
- *          to at least `nx_block_size` bytes (typically 4096 bytes) of data.
- * 
- * compute: If true, then compute the checksum of the block, treating the
- *          first 64 bits of the block (where the checksum is stored) as zero.
- *          If false, then validate checksum against the checksum stored in the
- *          block header.
- * 
- * RETURN VALUE:
- *          If `compute` is true, return the computed checksum.
- *          If `compute` is false, return zero if the checksum validates
- *          successfully, and non-zero if it fails to do so.
+ * Compute the Fletcher-64 checksum of an array of 32-bit words. This is the
+ * kernel of `fletcher_cksum()`, which calls it with `num_words` constant for
+ * the common block sizes, so that the compiler can unroll the loop for each.
+ *
+ * RETURN VALUE:    See `fletcher_cksum()`.
  */
-uint64_t fletcher_cksum(uint32_t* block, bool compute) {
-    int num_words = nx_block_size / 4;  // Using 32-bit words.
+static inline uint64_t fletcher_cksum_words(uint32_t* words, size_t num_words) {
     uint32_t modulus = ~0;  // all ones; = 2^32 - 1
 
-    // These are 32-bit values, but we need at least 33 bits of memory for each
-    // of these in order to compute them, as values can overflow during
-    // summation before the modulus is taken.
-    // We use the next best thing: 64 bits.
+    // These are 32-bit values, but they are accumulated in 64 bits, and the
+    // modulus is only taken at the end rather than after every word. Each word
+    // is less than 2^32, so after `n` words, `simple_sum` is less than
+    // `n * 2^32` and `second_sum` is less than `n^2 * 2^31`, which fits in 64
+    // bits for up to 2^16 words (256 KiB), well beyond the maximum block size
+    // of 64 KiB. Since taking the modulus commutes with addition, the result
+    // is the same as reducing as we go.
     uint64_t simple_sum = 0;
     uint64_t second_sum = 0;
-
-    // NOTE: When computing the checksum, `i = 2` is used here since we treat
-    // the first 64 bits of the block as zero. When validating the checksum, we
-    // compute the traditional Fletcher-64 checksum of the entire block.
-    for (int i = (compute ? 2 : 0); i < num_words; i++) {
-        simple_sum = (simple_sum + block[i])    % modulus;
-        second_sum = (second_sum + simple_sum)  % modulus;
+    for (size_t i = 0; i < num_words; i++) {
+        simple_sum += words[i];
+        second_sum += simple_sum;
     }
+    simple_sum %= modulus;
+    second_sum %= modulus;
 
     /**
      * APFS uses a variant of the traditional Flecther-64 checksum.
@@ -67,13 +58,64 @@ uint64_t fletcher_cksum(uint32_t* block, bool compute) {
      * against the stored checksum, we compute `c1` and just store it in the
      * variable `simple_sum`.
      */
-    // if (compute) {
-        simple_sum = modulus - ((simple_sum + second_sum) % modulus);
-    // }
+    simple_sum = modulus - ((simple_sum + second_sum) % modulus);
 
     return (second_sum << 32) | simple_sum;
 }
 
+/**
+ * Compute or validate the checksum of an APFS object of a given size. This is
+ * a helper function for `fletcher_cksum()`, and for code that needs to check
+ * objects before the container's block size is known.
+ * 
+ * block:   A pointer to the raw APFS object data, `size` bytes long.
+ * 
+ * size:    The size of the object in bytes; a multiple of 4.
+ * 
+ * compute: If true, then compute the checksum of the block, treating the
+ *          first 64 bits of the block (where the checksum is stored) as zero.
+ *          If false, then validate checksum against the checksum stored in the
+ *          block header.
+ * 
+ * RETURN VALUE:
+ *          If `compute` is true, return the computed checksum.
+ *          If `compute` is false, return zero if the checksum validates
+ *          successfully, and non-zero if it fails to do so.
+ */
+uint64_t fletcher_cksum_sized(uint32_t* block, size_t size, bool compute) {
+    // NOTE: When computing the checksum, the first two words are skipped since
+    // we treat the first 64 bits of the block as zero. When validating the
+    // checksum, we compute the traditional Fletcher-64 checksum of the entire
+    // block.
+    uint32_t* words = compute ? block + 2 : block;
+    size_t num_skipped = compute ? 2 : 0;
+    STATS_ADD(cksum_calls, 1);
+
+    switch (size) {
+        case 4096:
+            return fletcher_cksum_words(words, 4096 / 4 - num_skipped);
+        case 16384:
+            return fletcher_cksum_words(words, 16384 / 4 - num_skipped);
+        case 65536:
+            return fletcher_cksum_words(words, 65536 / 4 - num_skipped);
+        default:
+            return fletcher_cksum_words(words, size / 4 - num_skipped);
+    }
+}
+
+/**
+ * Compute or validate the checksum of a given APFS block. This is a helper
+ * function for `compute_block_cksum()` and `is_cksum_valid()`.
+ * 
+ * block:   A pointer to the raw APFS block data. This pointer should point
+ *          to at least `nx_block_size` bytes (typically 4096 bytes) of data.
+ * 
+ * compute, RETURN VALUE:   See `fletcher_cksum_sized()`.
+ */
+uint64_t fletcher_cksum(uint32_t* block, bool compute) {
+    return fletcher_cksum_sized(block, nx_block_size, compute);
+}
+
 /**
  * Get/compute the checksum of a given APFS block, treating the first 64 bits
  * of the block (the location where the checksum is usually stored) as zero.
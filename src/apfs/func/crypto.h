@@ -0,0 +1,388 @@
+/**
+ * Functions used to unlock and read encrypted (FileVault) volumes.
+ *
+ * An encrypted volume's data and file-system tree nodes are encrypted with
+ * AES-XTS under the volume encryption key (VEK). The VEK is kept in the
+ * container keybag, wrapped with a key encryption key (KEK); the KEK in turn
+ * is kept in the volume keybag, wrapped with a key derived from the user's
+ * password (or the personal recovery key) with PBKDF2. The keybags themselves
+ * are encrypted with AES-XTS under the UUID of the container or volume, so
+ * that they can be read without a password.
+ *
+ * Once `unlock_volume()` has succeeded, `decrypt_metadata_blocks()` and
+ * `decrypt_file_data()` decrypt blocks that were read from the volume. Only
+ * volumes with a single VEK are supported, as made by FileVault on macOS;
+ * volumes with per-file keys, as on iOS, are not.
+ */
+
+#ifndef APFS_FUNC_CRYPTO_H
+#define APFS_FUNC_CRYPTO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../io.h"
+#include "../struct/general.h"
+#include "../struct/object.h"
+#include "../struct/nx.h"
+#include "../struct/fs.h"
+#include "../struct/crypto.h"
+#include "cksum.h"
+#include "aes.h"
+#include "sha256.h"
+
+/** Configuration; set by the `--password` and `--recovery-key` options **/
+
+char*   crypto_password = NULL;
+
+/** State **/
+
+bool            crypto_unlocked = false;
+aes_xts_key_t   crypto_vek;
+
+/** Statistics **/
+
+uint64_t    crypto_num_blocks_decrypted = 0;
+
+/**
+ * Decrypt blocks of file-system metadata in place. Each block is encrypted
+ * with the VEK, with its 512-byte units numbered from its physical address.
+ */
+void decrypt_metadata_blocks(void* blocks, paddr_t start_block, size_t num_blocks) {
+    aes_xts_decrypt(&crypto_vek, blocks, num_blocks * nx_block_size, (uint64_t)start_block * (nx_block_size / AES_XTS_UNIT_SIZE));
+    __atomic_add_fetch(&crypto_num_blocks_decrypted, num_blocks, __ATOMIC_RELAXED);
+}
+
+/**
+ * Decrypt a single block of file-system metadata in place; this has the form
+ * that the block cache expects of a transform.
+ */
+void decrypt_metadata_block(void* block, paddr_t addr) {
+    decrypt_metadata_blocks(block, addr, 1);
+}
+
+/**
+ * Decrypt file data in place.
+ *
+ * unit_number: The number of the first 512-byte unit of `data`; this is the
+ *              crypto ID of the file extent that the data belongs to, plus the
+ *              offset of the data within the extent in 512-byte units.
+ */
+void decrypt_file_data(void* data, size_t num_bytes, uint64_t unit_number) {
+    aes_xts_decrypt(&crypto_vek, data, num_bytes, unit_number);
+    __atomic_add_fetch(&crypto_num_blocks_decrypted, num_bytes / nx_block_size, __ATOMIC_RELAXED);
+}
+
+/**
+ * Find an item with a given tag amongst the DER-encoded items in a buffer,
+ * looking only at the top level (i.e. not inside constructed items).
+ *
+ * RETURN VALUE:    A pointer to the item's contents, whose length is stored in
+ *      `value_len`; or NULL if there is no such item or the encoding is
+ *      malformed.
+ */
+uint8_t* der_find(uint8_t* data, size_t len, uint8_t tag, size_t* value_len) {
+    size_t pos = 0;
+    while (pos + 2 <= len) {
+        uint8_t item_tag = data[pos++];
+        size_t item_len = data[pos++];
+        if (item_len & 0x80) {
+            size_t num_len_bytes = item_len & 0x7f;
+            if (num_len_bytes == 0 || num_len_bytes > 4 || pos + num_len_bytes > len) {
+                return NULL;
+            }
+            item_len = 0;
+            for (size_t i = 0; i < num_len_bytes; i++) {
+                item_len = (item_len << 8) | data[pos++];
+            }
+        }
+        if (item_len > len - pos) {
+            return NULL;
+        }
+        if (item_tag == tag) {
+            *value_len = item_len;
+            return data + pos;
+        }
+        pos += item_len;
+    }
+    return NULL;
+}
+
+/**
+ * The fields of a KEK or VEK blob that are needed to unwrap its key. Both
+ * kinds of blob are DER-encoded as:
+ *
+ *      SEQUENCE {
+ *          [0] version, [1] HMAC, [2] HMAC salt,
+ *          [3] {
+ *              [0] version, [1] UUID, [2] flags, [3] wrapped key,
+ *              [4] PBKDF2 iteration count,     -- KEK blobs only
+ *              [5] PBKDF2 salt,                -- KEK blobs only
+ *          }
+ *      }
+ */
+typedef struct {
+    uint8_t*    uuid;
+    uint32_t    flags;
+    uint8_t*    wrapped_key;
+    size_t      wrapped_key_len;
+    uint64_t    num_iterations;
+    uint8_t*    salt;
+    size_t      salt_len;
+} key_blob_t;
+
+// The wrapped key is 128 bits rather than 256, as in volumes converted from
+// CoreStorage.
+#define KEY_BLOB_FLAG_AES_128   0x02
+
+/**
+ * Parse a KEK or VEK blob.
+ *
+ * RETURN VALUE:    `true` on success, or `false` if the blob is malformed.
+ */
+bool parse_key_blob(uint8_t* blob, size_t blob_len, key_blob_t* key_blob) {
+    memset(key_blob, 0, sizeof(key_blob_t));
+
+    size_t seq_len, inner_len, len;
+    uint8_t* seq = der_find(blob, blob_len, 0x30, &seq_len);
+    uint8_t* inner = seq ? der_find(seq, seq_len, 0xa3, &inner_len) : NULL;
+    if (!inner) {
+        return false;
+    }
+
+    key_blob->uuid = der_find(inner, inner_len, 0x81, &len);
+    if (!key_blob->uuid || len != sizeof(uuid_t)) {
+        return false;
+    }
+
+    uint8_t* flags = der_find(inner, inner_len, 0x82, &len);
+    if (!flags || len < 4) {
+        return false;
+    }
+    key_blob->flags = (uint32_t)flags[0] | (uint32_t)flags[1] << 8 | (uint32_t)flags[2] << 16 | (uint32_t)flags[3] << 24;
+
+    key_blob->wrapped_key = der_find(inner, inner_len, 0x83, &key_blob->wrapped_key_len);
+    if (!key_blob->wrapped_key || (key_blob->wrapped_key_len != 24 && key_blob->wrapped_key_len != 40)) {
+        return false;
+    }
+
+    uint8_t* iterations = der_find(inner, inner_len, 0x84, &len);
+    if (iterations && len <= 8) {
+        for (size_t i = 0; i < len; i++) {
+            key_blob->num_iterations = (key_blob->num_iterations << 8) | iterations[i];
+        }
+    }
+    key_blob->salt = der_find(inner, inner_len, 0x85, &key_blob->salt_len);
+    return true;
+}
+
+/**
+ * Read and decrypt a keybag. Keybags are encrypted with AES-XTS-128, using a
+ * UUID as both halves of the key.
+ *
+ * RETURN VALUE:    A pointer to the keybag, which the caller must free; or
+ *      NULL if the keybag could not be read or is not valid, in which case an
+ *      error has been reported.
+ */
+media_keybag_t* read_keybag(prange_t* location, uuid_t uuid, uint32_t type) {
+    if (location->pr_start_paddr == 0 || location->pr_block_count == 0) {
+        fprintf(stderr, "read_keybag: The keybag location is not set.\n");
+        return NULL;
+    }
+
+    media_keybag_t* keybag = malloc(location->pr_block_count * nx_block_size);
+    if (!keybag) {
+        fprintf(stderr, "\nABORT: read_keybag: Could not allocate sufficient memory for the keybag.\n");
+        exit(-1);
+    }
+    if (read_blocks(keybag, location->pr_start_paddr, location->pr_block_count) != location->pr_block_count) {
+        fprintf(stderr, "read_keybag: Failed to read the keybag at block 0x%llx.\n", location->pr_start_paddr);
+        free(keybag);
+        return NULL;
+    }
+
+    uint8_t key[32];
+    memcpy(key, uuid, 16);
+    memcpy(key + 16, uuid, 16);
+    aes_xts_key_t xts_key;
+    aes_xts_set_key(&xts_key, key, sizeof(key));
+    aes_xts_decrypt(&xts_key, keybag, location->pr_block_count * nx_block_size,
+        (uint64_t)location->pr_start_paddr * (nx_block_size / AES_XTS_UNIT_SIZE)
+    );
+
+    if (!is_cksum_valid(keybag)
+        || keybag->mk_obj.o_type != type
+        || keybag->mk_locker.kl_version != APFS_KEYBAG_VERSION
+    ) {
+        fprintf(stderr, "read_keybag: The keybag at block 0x%llx is not valid.\n", location->pr_start_paddr);
+        free(keybag);
+        return NULL;
+    }
+    return keybag;
+}
+
+/**
+ * Find an entry in a keybag with a given UUID and tag.
+ *
+ * RETURN VALUE:    A pointer to the entry, or NULL if there is no such entry.
+ */
+keybag_entry_t* keybag_find_entry(media_keybag_t* keybag, size_t keybag_size, uuid_t uuid, uint16_t tag) {
+    char* cursor = (char*)keybag->mk_locker.kl_entries;
+    char* end = (char*)keybag + keybag_size;
+    for (uint16_t i = 0; i < keybag->mk_locker.kl_nkeys; i++) {
+        keybag_entry_t* entry = (keybag_entry_t*)cursor;
+        if (cursor + sizeof(keybag_entry_t) > end || (char*)entry->ke_keydata + entry->ke_keylen > end) {
+            break;
+        }
+        if (entry->ke_tag == tag && (!uuid || memcmp(entry->ke_uuid, uuid, sizeof(uuid_t)) == 0)) {
+            return entry;
+        }
+        // Entries are padded to a multiple of 16 bytes.
+        cursor += (sizeof(keybag_entry_t) + entry->ke_keylen + 15) & ~(size_t)15;
+    }
+    return NULL;
+}
+
+/**
+ * Try to unwrap the VEK using a given KEK blob and the configured password.
+ *
+ * RETURN VALUE:    `true` if the password unlocks this KEK, in which case
+ *      `crypto_vek` has been set up; else `false`.
+ */
+bool try_unlock_with_kek(key_blob_t* kek_blob, key_blob_t* vek_blob) {
+    if (!kek_blob->salt || kek_blob->num_iterations == 0) {
+        return false;
+    }
+
+    uint8_t derived_key[32];
+    pbkdf2_hmac_sha256(crypto_password, strlen(crypto_password), kek_blob->salt, kek_blob->salt_len,
+        kek_blob->num_iterations, derived_key, sizeof(derived_key)
+    );
+
+    aes_key_t wrapping_key;
+    uint8_t kek[32];
+    aes_set_key(&wrapping_key, derived_key, (kek_blob->flags & KEY_BLOB_FLAG_AES_128) ? 16 : 32);
+    if (!aes_unwrap_key(&wrapping_key, kek_blob->wrapped_key, kek_blob->wrapped_key_len, kek)) {
+        return false;
+    }
+
+    uint8_t vek[32];
+    aes_set_key(&wrapping_key, kek, (vek_blob->flags & KEY_BLOB_FLAG_AES_128) ? 16 : 32);
+    if (!aes_unwrap_key(&wrapping_key, vek_blob->wrapped_key, vek_blob->wrapped_key_len, vek)) {
+        return false;
+    }
+
+    if (vek_blob->wrapped_key_len == 24) {
+        // A 128-bit VEK from CoreStorage; the tweak key is derived from it.
+        uint8_t hash_input[16 + sizeof(uuid_t)];
+        uint8_t hash[SHA256_DIGEST_SIZE];
+        memcpy(hash_input, vek, 16);
+        memcpy(hash_input + 16, vek_blob->uuid, sizeof(uuid_t));
+        sha256(hash_input, sizeof(hash_input), hash);
+        memcpy(vek + 16, hash, 16);
+    }
+
+    aes_xts_set_key(&crypto_vek, vek, sizeof(vek));
+    return true;
+}
+
+/**
+ * Find where a volume's keybag is stored, according to the container keybag.
+ *
+ * RETURN VALUE:    `true` on success, in which case the location is stored in
+ *      `location`; else `false`.
+ */
+bool get_volume_keybag_location(nx_superblock_t* nxsb, uuid_t vol_uuid, prange_t* location) {
+    media_keybag_t* container_keybag = read_keybag(&nxsb->nx_keylocker, nxsb->nx_uuid, OBJECT_TYPE_CONTAINER_KEYBAG);
+    if (!container_keybag) {
+        return false;
+    }
+    keybag_entry_t* entry = keybag_find_entry(container_keybag, nxsb->nx_keylocker.pr_block_count * nx_block_size, vol_uuid, KB_TAG_VOLUME_UNLOCK_RECORDS);
+    bool found = entry && entry->ke_keylen >= sizeof(prange_t);
+    if (found) {
+        memcpy(location, entry->ke_keydata, sizeof(prange_t));
+    }
+    free(container_keybag);
+    return found;
+}
+
+/**
+ * Unlock an encrypted volume with the configured password, so that its blocks
+ * can be decrypted. Unencrypted volumes need no unlocking. Only one volume is
+ * unlocked at a time; unlocking another replaces the key in `crypto_vek`.
+ *
+ * nxsb:    The container superblock.
+ * apsb:    The volume superblock.
+ *
+ * RETURN VALUE:    `true` if the volume is unencrypted or was unlocked, else
+ *      `false`, in which case the reason has been reported.
+ */
+bool unlock_volume(nx_superblock_t* nxsb, apfs_superblock_t* apsb) {
+    if (apsb->apfs_fs_flags & APFS_FS_UNENCRYPTED) {
+        return true;
+    }
+    crypto_unlocked = false;
+    if (!crypto_password) {
+        fprintf(stderr, "The volume `%s` is encrypted; give its password with `--password` or `--recovery-key`.\n", apsb->apfs_volname);
+        return false;
+    }
+
+    media_keybag_t* container_keybag = read_keybag(&nxsb->nx_keylocker, nxsb->nx_uuid, OBJECT_TYPE_CONTAINER_KEYBAG);
+    if (!container_keybag) {
+        return false;
+    }
+
+    size_t container_keybag_size = nxsb->nx_keylocker.pr_block_count * nx_block_size;
+    keybag_entry_t* vek_entry = keybag_find_entry(container_keybag, container_keybag_size, apsb->apfs_vol_uuid, KB_TAG_VOLUME_KEY);
+    keybag_entry_t* location_entry = keybag_find_entry(container_keybag, container_keybag_size, apsb->apfs_vol_uuid, KB_TAG_VOLUME_UNLOCK_RECORDS);
+    key_blob_t vek_blob;
+    if (!vek_entry || !location_entry || location_entry->ke_keylen < sizeof(prange_t)
+        || !parse_key_blob(vek_entry->ke_keydata, vek_entry->ke_keylen, &vek_blob)
+    ) {
+        fprintf(stderr, "The container keybag has no usable key for the volume `%s`.\n", apsb->apfs_volname);
+        free(container_keybag);
+        return false;
+    }
+
+    prange_t volume_keybag_location;
+    memcpy(&volume_keybag_location, location_entry->ke_keydata, sizeof(prange_t));
+    size_t volume_keybag_size = volume_keybag_location.pr_block_count * nx_block_size;
+    media_keybag_t* volume_keybag = read_keybag(&volume_keybag_location, apsb->apfs_vol_uuid, OBJECT_TYPE_VOLUME_KEYBAG);
+    if (!volume_keybag) {
+        free(container_keybag);
+        return false;
+    }
+
+    // Each user who can unlock the volume, and the recovery key, has an unlock
+    // record; try the password against each of them.
+    char* cursor = (char*)volume_keybag->mk_locker.kl_entries;
+    char* end = (char*)volume_keybag + volume_keybag_size;
+    for (uint16_t i = 0; i < volume_keybag->mk_locker.kl_nkeys && !crypto_unlocked; i++) {
+        keybag_entry_t* entry = (keybag_entry_t*)cursor;
+        if (cursor + sizeof(keybag_entry_t) > end || (char*)entry->ke_keydata + entry->ke_keylen > end) {
+            break;
+        }
+        key_blob_t kek_blob;
+        if (entry->ke_tag == KB_TAG_VOLUME_UNLOCK_RECORDS
+            && parse_key_blob(entry->ke_keydata, entry->ke_keylen, &kek_blob)
+            && try_unlock_with_kek(&kek_blob, &vek_blob)
+        ) {
+            crypto_unlocked = true;
+        }
+        cursor += (sizeof(keybag_entry_t) + entry->ke_keylen + 15) & ~(size_t)15;
+    }
+
+    free(volume_keybag);
+    free(container_keybag);
+
+    if (!crypto_unlocked) {
+        fprintf(stderr, "The password does not unlock the volume `%s`.\n", apsb->apfs_volname);
+        return false;
+    }
+    return true;
+}
+
+#endif // APFS_FUNC_CRYPTO_H
@@ -0,0 +1,893 @@
+/**
+ * Generation of synthetic APFS containers, for benchmarking and regression
+ * testing without real disks or client images.
+ *
+ * The shape of the container is described by `gen_params`: the number of
+ * volumes; in each volume, a directory tree of a given depth with a given
+ * number of subdirectories, files, and clones in each directory; the number
+ * of blocks and extents of each file; the maximum number of entries per
+ * B-tree node; and the number of checkpoints and snapshots. The container is
+ * written to an image file by `generate_container()`.
+ *
+ * Every object gets a valid checksum (see `compute_block_cksum()`), and the
+ * B-trees are bulk-loaded bottom-up, so the whole container is written in a
+ * single pass with a bump allocator: file-system tree leaves are interleaved
+ * with the file data they describe, much as on a real disk. File data is
+ * left as holes in a sparse image unless `fill_data` is set, so images of a
+ * terabyte or more can be generated quickly.
+ *
+ * Generated volumes are unencrypted, case-insensitive, and have hashed
+ * directory entries. Each checkpoint has its own copy of every volume
+ * superblock, mapped in the container object map at that checkpoint's XID.
+ * Snapshots have their own volume superblocks, metadata records, and object
+ * map snapshot records, but share the current file-system tree. Clones share
+ * the extents of the first file in their directory, and both are flagged
+ * `INODE_WAS_CLONED`. There is no space manager bitmap, reaper, or
+ * extent-reference tree.
+ */
+
+#ifndef APFS_FUNC_GENERATE_H
+#define APFS_FUNC_GENERATE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/errno.h>
+
+#include "../io.h"
+#include "cksum.h"
+#include "build.h"
+
+#include "../struct/object.h"
+#include "../struct/nx.h"
+#include "../struct/omap.h"
+#include "../struct/btree.h"
+#include "../struct/fs.h"
+#include "../struct/j.h"
+#include "../struct/dstream.h"
+#include "../struct/snap.h"
+#include "../struct/xf.h"
+#include "../struct/const.h"
+
+/** Configuration **/
+
+typedef struct {
+    uint32_t    num_volumes;
+    uint32_t    depth;              // Levels of subdirectories beneath each volume's root
+    uint32_t    subdirs_per_dir;
+    uint32_t    files_per_dir;
+    uint32_t    clones_per_dir;     // Clones of the first file in each directory
+    uint32_t    file_blocks;        // Blocks of data in each file
+    uint32_t    extents_per_file;   // Each file's data is split into this many discontiguous extents
+    uint32_t    fanout;             // Maximum entries per B-tree node; 0 packs nodes full
+    uint32_t    num_checkpoints;
+    uint32_t    num_snapshots;
+    uint64_t    block_count;        // Size of the container; 0 makes it as small as possible
+    uint64_t    seed;               // Seeds UUIDs and file data
+    bool        fill_data;          // Write file data, rather than leaving holes
+} gen_params_t;
+
+gen_params_t gen_params = {
+    .num_volumes        = 1,
+    .depth              = 2,
+    .subdirs_per_dir    = 4,
+    .files_per_dir      = 16,
+    .clones_per_dir     = 0,
+    .file_blocks        = 4,
+    .extents_per_file   = 1,
+    .fanout             = 0,
+    .num_checkpoints    = 1,
+    .num_snapshots      = 0,
+    .block_count        = 0,
+    .seed               = 0,
+    .fill_data          = false,
+};
+
+// The XID of the oldest snapshot, or of the first checkpoint if there are no
+// snapshots. All file-system objects are written in this transaction.
+#define GEN_FIRST_XID           2
+
+// Virtual and ephemeral OIDs; virtual OIDs are allocated from
+// `GEN_FIRST_VIRTUAL_OID` upward.
+#define GEN_SPACEMAN_OID        0x400
+#define GEN_FIRST_VIRTUAL_OID   0x402
+
+// Timestamp given to every inode, directory entry, and snapshot:
+// 2020-01-01T00:00:00Z, in nanoseconds since the Unix epoch.
+#define GEN_TIMESTAMP           1577836800000000000ULL
+
+// Number of blocks that are gathered into a single write.
+#define GEN_WRITE_RUN_BLOCKS    256
+
+/** State **/
+
+int         gen_fd = -1;
+paddr_t     gen_next_paddr = 0;
+oid_t       gen_next_oid = GEN_FIRST_VIRTUAL_OID;
+
+char*       gen_run = NULL;         // Blocks gathered for the next write
+paddr_t     gen_run_start = 0;
+uint32_t    gen_run_len = 0;
+
+/** Statistics **/
+
+uint64_t    gen_num_nodes = 0;
+uint64_t    gen_num_records = 0;
+uint64_t    gen_num_data_blocks = 0;
+
+/**
+ * Get the next value from a SplitMix64 generator with a given state.
+ */
+uint64_t gen_splitmix64(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void gen_make_uuid(uuid_t uuid, uint64_t index) {
+    uint64_t state = gen_params.seed * 0x100000001b3ULL + index;
+    uint64_t words[2] = { gen_splitmix64(&state), gen_splitmix64(&state) };
+    memcpy(uuid, words, sizeof(uuid_t));
+    uuid[6] = (uuid[6] & 0x0f) | 0x40;  // Version 4
+    uuid[8] = (uuid[8] & 0x3f) | 0x80;  // RFC 4122 variant
+}
+
+/** Output **/
+
+void gen_write_or_abort(void* buffer, size_t num_bytes, off_t offset) {
+    size_t num_written = 0;
+    while (num_written < num_bytes) {
+        ssize_t ret = pwrite(gen_fd, (char*)buffer + num_written, num_bytes - num_written, offset + num_written);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            fprintf(stderr, "\nABORT: gen_write_or_abort: Failed to write to the image (%s).\n", strerror(errno));
+            exit(-1);
+        }
+        num_written += ret;
+    }
+}
+
+void gen_flush_run() {
+    if (gen_run_len > 0) {
+        gen_write_or_abort(gen_run, gen_run_len * nx_block_size, (off_t)gen_run_start * nx_block_size);
+        gen_run_len = 0;
+    }
+}
+
+/**
+ * Write a block to the image. Consecutive blocks are gathered into a single
+ * write.
+ */
+void gen_write_block(paddr_t addr, void* block) {
+    if (gen_run_len > 0 && (addr != gen_run_start + gen_run_len || gen_run_len == GEN_WRITE_RUN_BLOCKS)) {
+        gen_flush_run();
+    }
+    if (gen_run_len == 0) {
+        gen_run_start = addr;
+    }
+    memcpy(gen_run + gen_run_len * nx_block_size, block, nx_block_size);
+    gen_run_len++;
+}
+
+/**
+ * Set the header of an object, compute its checksum, and write it.
+ */
+void gen_write_object(paddr_t addr, void* block, oid_t oid, xid_t xid, uint32_t type, uint32_t subtype) {
+    finish_object(block, oid, xid, type, subtype);
+    gen_write_block(addr, block);
+}
+
+/**
+ * Allocate a given number of contiguous blocks.
+ */
+paddr_t gen_alloc(uint64_t num_blocks) {
+    paddr_t addr = gen_next_paddr;
+    gen_next_paddr += num_blocks;
+    return addr;
+}
+
+void* gen_alloc_block_buffer() {
+    void* block = calloc(1, nx_block_size);
+    if (!block) {
+        fprintf(stderr, "\nABORT: gen_alloc_block_buffer: Could not allocate sufficient memory for a block.\n");
+        exit(-1);
+    }
+    return block;
+}
+
+/** Object maps **/
+
+typedef struct {
+    oid_t       oid;
+    xid_t       xid;
+    paddr_t     paddr;
+} gen_omap_entry_t;
+
+typedef struct {
+    gen_omap_entry_t*   entries;
+    size_t              count;
+    size_t              capacity;
+} gen_omap_entries_t;
+
+void gen_omap_entries_add(gen_omap_entries_t* list, oid_t oid, xid_t xid, paddr_t paddr) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 64;
+        list->entries = realloc(list->entries, list->capacity * sizeof(gen_omap_entry_t));
+        if (!list->entries) {
+            fprintf(stderr, "\nABORT: gen_omap_entries_add: Could not allocate sufficient memory for the object map entries.\n");
+            exit(-1);
+        }
+    }
+    list->entries[list->count++] = (gen_omap_entry_t){ oid, xid, paddr };
+}
+
+/** B-tree bulk loading **/
+
+/**
+ * Store a finished node of a generated tree: allocate its block, and if the
+ * tree is virtual, give it the next Virtual OID and map it in the object map
+ * list that is the tree's context.
+ */
+oid_t gen_store_node(tree_builder_t* tree, btree_node_phys_t* node) {
+    paddr_t addr = gen_alloc(1);
+    oid_t oid = addr;
+    if (tree->storage == OBJ_VIRTUAL) {
+        oid = gen_next_oid++;
+        gen_omap_entries_add(tree->context, oid, tree->xid, addr);
+    }
+    gen_num_nodes++;
+    gen_write_object(addr, node, oid, node->btn_o.o_xid, node->btn_o.o_type, node->btn_o.o_subtype);
+    return oid;
+}
+
+/**
+ * Start building a tree, whose nodes are packed with at most
+ * `gen_params.fanout` entries. Virtual trees are mapped in `omap`.
+ */
+void gen_tree_init(tree_builder_t* tree, uint32_t subtype, bool physical, uint16_t key_size, uint16_t val_size, xid_t xid, gen_omap_entries_t* omap) {
+    tree_builder_init(tree, subtype, physical ? OBJ_PHYSICAL : OBJ_VIRTUAL, key_size, val_size, xid, gen_store_node, omap);
+    tree->max_entries = gen_params.fanout;
+}
+
+/**
+ * Add a record to a tree. Records must be added in key order.
+ */
+void gen_tree_add(tree_builder_t* tree, void* key, uint16_t key_len, void* val, uint16_t val_len) {
+    gen_num_records++;
+    tree_builder_add(tree, key, key_len, val, val_len);
+}
+
+/**
+ * Write an object map and its tree, given its entries in (OID, XID) order.
+ *
+ * RETURN VALUE:    The physical address of the object map.
+ */
+paddr_t gen_write_omap(gen_omap_entries_t* list, xid_t xid, uint32_t flags, uint32_t snap_count, xid_t most_recent_snap, paddr_t snapshot_tree_addr) {
+    tree_builder_t tree;
+    gen_tree_init(&tree, OBJECT_TYPE_OMAP, true, sizeof(omap_key_t), sizeof(omap_val_t), xid, NULL);
+    for (size_t i = 0; i < list->count; i++) {
+        omap_key_t key = { list->entries[i].oid, list->entries[i].xid };
+        omap_val_t val = { 0, nx_block_size, list->entries[i].paddr };
+        gen_tree_add(&tree, &key, sizeof(key), &val, sizeof(val));
+    }
+    oid_t tree_oid = tree_builder_finish(&tree);
+
+    omap_phys_t* omap = gen_alloc_block_buffer();
+    omap->om_flags              = flags;
+    omap->om_snap_count         = snap_count;
+    omap->om_tree_type          = OBJ_PHYSICAL | OBJECT_TYPE_BTREE;
+    omap->om_snapshot_tree_type = OBJ_PHYSICAL | OBJECT_TYPE_BTREE;
+    omap->om_tree_oid           = tree_oid;
+    omap->om_snapshot_tree_oid  = snapshot_tree_addr;
+    omap->om_most_recent_snap   = most_recent_snap;
+
+    paddr_t addr = gen_alloc(1);
+    gen_write_object(addr, omap, addr, xid, OBJ_PHYSICAL | OBJECT_TYPE_OMAP, 0);
+    free(omap);
+    return addr;
+}
+
+/** File-system trees **/
+
+enum {
+    GEN_DIR,
+    GEN_FILE,
+    GEN_CLONE,
+};
+
+/**
+ * A file-system object in a generated volume. Objects are numbered in
+ * breadth-first order, so the children of each directory have consecutive
+ * OIDs, and the records of the whole tree can be generated in key order by
+ * visiting the objects in order.
+ */
+typedef struct {
+    oid_t       parent;
+    oid_t       first_child;
+    uint32_t    num_subdirs;
+    uint32_t    num_files;
+    uint32_t    num_clones;
+    uint32_t    name_index;
+    uint16_t    level;
+    uint8_t     kind;
+    paddr_t     data_start;     // Files: the address of the first extent
+} gen_object_t;
+
+gen_object_t*   gen_objects = NULL;
+uint64_t        gen_num_objects = 0;
+
+static inline uint64_t gen_object_index(oid_t oid) {
+    return oid == ROOT_DIR_INO_NUM ? 0 : oid - MIN_USER_INO_NUM + 1;
+}
+
+static inline oid_t gen_object_oid(uint64_t index) {
+    return index == 0 ? ROOT_DIR_INO_NUM : MIN_USER_INO_NUM + index - 1;
+}
+
+/**
+ * Lay out the directory tree that every generated volume has.
+ */
+void gen_build_objects() {
+    uint64_t capacity = 1024;
+    gen_objects = malloc(capacity * sizeof(gen_object_t));
+    if (!gen_objects) {
+        fprintf(stderr, "\nABORT: gen_build_objects: Could not allocate sufficient memory for `gen_objects`.\n");
+        exit(-1);
+    }
+    gen_objects[0] = (gen_object_t){ .parent = ROOT_DIR_PARENT, .kind = GEN_DIR };
+    gen_num_objects = 1;
+
+    for (uint64_t i = 0; i < gen_num_objects; i++) {
+        if (gen_objects[i].kind != GEN_DIR) {
+            continue;
+        }
+
+        gen_object_t* dir = gen_objects + i;
+        uint16_t level = dir->level;
+        dir->first_child = gen_object_oid(gen_num_objects);
+        dir->num_subdirs = level < gen_params.depth ? gen_params.subdirs_per_dir : 0;
+        dir->num_files   = gen_params.files_per_dir;
+        dir->num_clones  = gen_params.files_per_dir ? gen_params.clones_per_dir : 0;
+        uint64_t num_children = (uint64_t)dir->num_subdirs + dir->num_files + dir->num_clones;
+
+        while (gen_num_objects + num_children > capacity) {
+            capacity *= 2;
+            gen_objects = realloc(gen_objects, capacity * sizeof(gen_object_t));
+            if (!gen_objects) {
+                fprintf(stderr, "\nABORT: gen_build_objects: Could not allocate sufficient memory for `gen_objects`.\n");
+                exit(-1);
+            }
+            dir = gen_objects + i;
+        }
+
+        oid_t oid = gen_object_oid(i);
+        for (uint64_t j = 0; j < num_children; j++) {
+            gen_object_t* child = gen_objects + gen_num_objects++;
+            memset(child, 0, sizeof(gen_object_t));
+            child->parent = oid;
+            child->level = level + 1;
+            if (j < dir->num_subdirs) {
+                child->kind = GEN_DIR;
+                child->name_index = j;
+            } else if (j < dir->num_subdirs + dir->num_files) {
+                child->kind = GEN_FILE;
+                child->name_index = j - dir->num_subdirs;
+            } else {
+                child->kind = GEN_CLONE;
+                child->name_index = j - dir->num_subdirs - dir->num_files;
+            }
+        }
+    }
+}
+
+int gen_object_name(gen_object_t* obj, char* name, size_t size) {
+    static const char* prefixes[] = { "dir", "file", "clone" };
+    return snprintf(name, size, "%s%u", prefixes[obj->kind], obj->name_index);
+}
+
+/**
+ * Compute the CRC-32C of a given buffer, continuing from a given CRC.
+ */
+uint32_t gen_crc32c(uint32_t crc, const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        }
+    }
+    return crc;
+}
+
+/**
+ * Compute the hash of a directory entry's name, as stored in
+ * `j_drec_hashed_key_t`. The hash is of the name's UTF-32 code points after
+ * case folding and normalisation, which for the ASCII names used here means
+ * the lowercase characters.
+ */
+uint32_t gen_drec_name_hash(const char* name) {
+    uint32_t crc = ~0u;
+    for (const char* c = name; *c; c++) {
+        uint32_t code_point = (*c >= 'A' && *c <= 'Z') ? *c - 'A' + 'a' : (uint8_t)*c;
+        uint8_t bytes[4] = { code_point, code_point >> 8, code_point >> 16, code_point >> 24 };
+        crc = gen_crc32c(crc, bytes, 4);
+    }
+    return (~crc) & 0x3fffff;
+}
+
+/**
+ * Get the length of a given extent of a file, and its offset from the start
+ * of the file's data, in blocks. Consecutive extents are separated by a hole
+ * of one block, so that each file has the requested number of fragments.
+ */
+void gen_extent_layout(uint32_t extent_index, uint64_t* length, uint64_t* offset) {
+    uint32_t num_extents = gen_params.extents_per_file;
+    uint64_t base = gen_params.file_blocks / num_extents;
+    uint64_t extra = gen_params.file_blocks % num_extents;
+    *length = base + (extent_index < extra ? 1 : 0);
+    *offset = extent_index * base + (extent_index < extra ? extent_index : extra) + extent_index;
+}
+
+uint64_t gen_file_span_blocks() {
+    return gen_params.file_blocks + gen_params.extents_per_file - 1;
+}
+
+/**
+ * Allocate, and if asked for, write, the data of a file.
+ */
+paddr_t gen_write_file_data() {
+    paddr_t start = gen_alloc(gen_file_span_blocks());
+    gen_num_data_blocks += gen_params.file_blocks;
+    if (!gen_params.fill_data) {
+        return start;
+    }
+
+    uint64_t* block = gen_alloc_block_buffer();
+    for (uint32_t i = 0; i < gen_params.extents_per_file; i++) {
+        uint64_t length, offset;
+        gen_extent_layout(i, &length, &offset);
+        for (uint64_t j = 0; j < length; j++) {
+            paddr_t addr = start + offset + j;
+            uint64_t state = gen_params.seed ^ (addr * 0x9e3779b97f4a7c15ULL);
+            for (size_t k = 0; k < nx_block_size / sizeof(uint64_t); k++) {
+                block[k] = gen_splitmix64(&state);
+            }
+            gen_write_block(addr, block);
+        }
+    }
+    free(block);
+    return start;
+}
+
+typedef struct {
+    uint32_t    hash;
+    uint32_t    child;
+} gen_drec_order_t;
+
+int gen_compare_drec_order(const void* a, const void* b) {
+    const gen_drec_order_t* x = a;
+    const gen_drec_order_t* y = b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->child < y->child ? -1 : x->child > y->child;
+}
+
+/**
+ * Write the records of one object to a file-system tree, in key order:
+ * its inode, then its data stream ID and extents if it is a file, or the
+ * directory entries of its children if it is a directory.
+ */
+void gen_add_object_records(tree_builder_t* tree, uint64_t index, char* key_buffer, char* val_buffer) {
+    gen_object_t* obj = gen_objects + index;
+    oid_t oid = gen_object_oid(index);
+    bool is_file = obj->kind != GEN_DIR;
+
+    // Inode, with a data stream extended field for files
+    j_inode_key_t inode_key = { { ((uint64_t)APFS_TYPE_INODE << OBJ_TYPE_SHIFT) | oid } };
+    j_inode_val_t* inode = val_buffer;
+    memset(inode, 0, sizeof(j_inode_val_t));
+    inode->parent_id    = obj->parent;
+    inode->private_id   = oid;
+    inode->create_time  = GEN_TIMESTAMP;
+    inode->mod_time     = GEN_TIMESTAMP;
+    inode->change_time  = GEN_TIMESTAMP;
+    inode->access_time  = GEN_TIMESTAMP;
+    inode->owner        = 501;
+    inode->group        = 20;
+    size_t inode_len = sizeof(j_inode_val_t);
+    if (is_file) {
+        inode->nlink = 1;
+        inode->mode = S_IFREG | 0644;
+        if (obj->kind == GEN_CLONE || (obj->name_index == 0 && gen_params.clones_per_dir)) {
+            inode->internal_flags |= INODE_WAS_CLONED;
+        }
+
+        xf_blob_t* blob = (xf_blob_t*)inode->xfields;
+        x_field_t* field = (x_field_t*)blob->xf_data;
+        j_dstream_t* dstream = (j_dstream_t*)(field + 1);
+        blob->xf_num_exts = 1;
+        blob->xf_used_data = sizeof(x_field_t) + sizeof(j_dstream_t);
+        field->x_type = INO_EXT_TYPE_DSTREAM;
+        field->x_flags = XF_SYSTEM_FIELD;
+        field->x_size = sizeof(j_dstream_t);
+        memset(dstream, 0, sizeof(j_dstream_t));
+        dstream->size = (uint64_t)gen_params.file_blocks * nx_block_size;
+        dstream->alloced_size = dstream->size;
+        inode_len += sizeof(xf_blob_t) + blob->xf_used_data;
+    } else {
+        inode->nchildren = obj->num_subdirs + obj->num_files + obj->num_clones;
+        inode->mode = S_IFDIR | 0755;
+    }
+    gen_tree_add(tree, &inode_key, sizeof(inode_key), inode, inode_len);
+
+    if (is_file) {
+        // Clones share the data of the first file in their directory, which
+        // precedes them in OID order, and so already has its data.
+        if (obj->kind == GEN_CLONE) {
+            gen_object_t* parent = gen_objects + gen_object_index(obj->parent);
+            obj->data_start = gen_objects[gen_object_index(parent->first_child) + parent->num_subdirs].data_start;
+        } else {
+            obj->data_start = gen_write_file_data();
+        }
+
+        j_dstream_id_key_t dstream_key = { { ((uint64_t)APFS_TYPE_DSTREAM_ID << OBJ_TYPE_SHIFT) | oid } };
+        j_dstream_id_val_t dstream_val = { 1 };
+        gen_tree_add(tree, &dstream_key, sizeof(dstream_key), &dstream_val, sizeof(dstream_val));
+
+        for (uint32_t i = 0; i < gen_params.extents_per_file; i++) {
+            uint64_t length, offset;
+            gen_extent_layout(i, &length, &offset);
+            if (length == 0) {
+                continue;
+            }
+            j_file_extent_key_t extent_key = {
+                { ((uint64_t)APFS_TYPE_FILE_EXTENT << OBJ_TYPE_SHIFT) | oid },
+                (offset - i) * nx_block_size,
+            };
+            j_file_extent_val_t extent_val = {
+                (length * nx_block_size) & J_FILE_EXTENT_LEN_MASK,
+                obj->data_start + offset,
+                0,
+            };
+            gen_tree_add(tree, &extent_key, sizeof(extent_key), &extent_val, sizeof(extent_val));
+        }
+        return;
+    }
+
+    // Directory entries, in hash order
+    uint32_t num_children = obj->num_subdirs + obj->num_files + obj->num_clones;
+    gen_drec_order_t* order = malloc(num_children * sizeof(gen_drec_order_t) + 1);
+    if (!order) {
+        fprintf(stderr, "\nABORT: gen_add_object_records: Could not allocate sufficient memory for `order`.\n");
+        exit(-1);
+    }
+    uint64_t first_child_index = gen_object_index(obj->first_child);
+    char name[64];
+    for (uint32_t i = 0; i < num_children; i++) {
+        gen_object_name(gen_objects + first_child_index + i, name, sizeof(name));
+        order[i].hash = gen_drec_name_hash(name);
+        order[i].child = i;
+    }
+    qsort(order, num_children, sizeof(gen_drec_order_t), gen_compare_drec_order);
+
+    for (uint32_t i = 0; i < num_children; i++) {
+        gen_object_t* child = gen_objects + first_child_index + order[i].child;
+        int name_len = gen_object_name(child, name, sizeof(name)) + 1;
+
+        j_drec_hashed_key_t* drec_key = key_buffer;
+        drec_key->hdr.obj_id_and_type = ((uint64_t)APFS_TYPE_DIR_REC << OBJ_TYPE_SHIFT) | oid;
+        drec_key->name_len_and_hash = (name_len & J_DREC_LEN_MASK) | (order[i].hash << J_DREC_HASH_SHIFT);
+        memcpy(drec_key->name, name, name_len);
+
+        j_drec_val_t drec_val = {
+            obj->first_child + order[i].child,
+            GEN_TIMESTAMP,
+            child->kind == GEN_DIR ? DT_DIR : DT_REG,
+        };
+        gen_tree_add(tree, drec_key, sizeof(j_drec_hashed_key_t) + name_len, &drec_val, sizeof(drec_val));
+    }
+    free(order);
+}
+
+/** Snapshots **/
+
+/**
+ * Write the snapshot metadata tree of a volume, given the addresses of the
+ * snapshots' volume superblocks.
+ *
+ * RETURN VALUE:    The physical address of the tree's root node.
+ */
+paddr_t gen_write_snap_meta_tree(paddr_t* snap_sblock_addrs, xid_t first_snap_xid) {
+    tree_builder_t tree;
+    gen_tree_init(&tree, OBJECT_TYPE_SNAPMETATREE, true, 0, 0, first_snap_xid + gen_params.num_snapshots - 1, NULL);
+
+    char* key_buffer = gen_alloc_block_buffer();
+    char* val_buffer = gen_alloc_block_buffer();
+    char name[32];
+
+    for (uint32_t i = 0; i < gen_params.num_snapshots; i++) {
+        xid_t snap_xid = first_snap_xid + i;
+        int name_len = snprintf(name, sizeof(name), "snapshot-%04u", i) + 1;
+
+        j_snap_metadata_key_t key = { { ((uint64_t)APFS_TYPE_SNAP_METADATA << OBJ_TYPE_SHIFT) | snap_xid } };
+        j_snap_metadata_val_t* val = val_buffer;
+        memset(val, 0, sizeof(j_snap_metadata_val_t));
+        val->sblock_oid = snap_sblock_addrs[i];
+        val->create_time = GEN_TIMESTAMP + i * 1000000000ULL;
+        val->change_time = val->create_time;
+        val->extentref_tree_type = OBJ_PHYSICAL | OBJECT_TYPE_BTREE;
+        val->name_len = name_len;
+        memcpy(val->name, name, name_len);
+        gen_tree_add(&tree, &key, sizeof(key), val, sizeof(j_snap_metadata_val_t) + name_len);
+    }
+
+    // Name records all have the same OID, and are ordered by name, which the
+    // zero-padded index makes the same as snapshot order.
+    for (uint32_t i = 0; i < gen_params.num_snapshots; i++) {
+        int name_len = snprintf(name, sizeof(name), "snapshot-%04u", i) + 1;
+        j_snap_name_key_t* key = key_buffer;
+        key->hdr.obj_id_and_type = ((uint64_t)APFS_TYPE_SNAP_NAME << OBJ_TYPE_SHIFT) | OBJ_ID_MASK;
+        key->name_len = name_len;
+        memcpy(key->name, name, name_len);
+        j_snap_name_val_t val = { first_snap_xid + i };
+        gen_tree_add(&tree, key, sizeof(j_snap_name_key_t) + name_len, &val, sizeof(val));
+    }
+
+    free(key_buffer);
+    free(val_buffer);
+    return tree_builder_finish(&tree);
+}
+
+/**
+ * Write the object map snapshot tree of a volume.
+ *
+ * RETURN VALUE:    The physical address of the tree's root node.
+ */
+paddr_t gen_write_omap_snapshot_tree(xid_t first_snap_xid) {
+    tree_builder_t tree;
+    gen_tree_init(&tree, OBJECT_TYPE_OMAP_SNAPSHOT, true, sizeof(xid_t), sizeof(omap_snapshot_t), first_snap_xid, NULL);
+    for (uint32_t i = 0; i < gen_params.num_snapshots; i++) {
+        xid_t snap_xid = first_snap_xid + i;
+        omap_snapshot_t val = { 0, 0, 0 };
+        gen_tree_add(&tree, &snap_xid, sizeof(snap_xid), &val, sizeof(val));
+    }
+    return tree_builder_finish(&tree);
+}
+
+/** Volumes and the container **/
+
+/**
+ * Write a volume superblock at a given address.
+ */
+void gen_write_apsb(paddr_t addr, apfs_superblock_t* apsb, oid_t oid, xid_t xid) {
+    char* block = gen_alloc_block_buffer();
+    memcpy(block, apsb, sizeof(apfs_superblock_t));
+    gen_write_object(addr, block, oid, xid, OBJ_VIRTUAL | OBJECT_TYPE_FS, 0);
+    free(block);
+}
+
+/**
+ * Generate one volume: its file-system tree, snapshots, object map, and one
+ * volume superblock per checkpoint, whose addresses are added to the
+ * container object map.
+ *
+ * RETURN VALUE:    The Virtual OID of the volume superblock.
+ */
+oid_t gen_write_volume(uint32_t fs_index, gen_omap_entries_t* nx_omap_entries, xid_t first_checkpoint_xid) {
+    xid_t first_xid = GEN_FIRST_XID;
+    gen_omap_entries_t fs_omap_entries = { NULL, 0, 0 };
+
+    // File-system tree
+    tree_builder_t fs_tree;
+    gen_tree_init(&fs_tree, OBJECT_TYPE_FSTREE, false, 0, 0, first_xid, &fs_omap_entries);
+    char* key_buffer = gen_alloc_block_buffer();
+    char* val_buffer = gen_alloc_block_buffer();
+    uint64_t first_data_block_count = gen_num_data_blocks;
+    uint64_t num_files = 0;
+    uint64_t num_dirs = 0;
+    for (uint64_t i = 0; i < gen_num_objects; i++) {
+        gen_add_object_records(&fs_tree, i, key_buffer, val_buffer);
+        if (gen_objects[i].kind == GEN_DIR) {
+            num_dirs++;
+        } else {
+            num_files++;
+        }
+    }
+    free(key_buffer);
+    free(val_buffer);
+    oid_t root_tree_oid = tree_builder_finish(&fs_tree);
+
+    // Volume superblock, of which the snapshots and checkpoints get copies
+    oid_t apsb_oid = gen_next_oid++;
+    apfs_superblock_t apsb;
+    memset(&apsb, 0, sizeof(apsb));
+    apsb.apfs_magic                 = APFS_MAGIC;
+    apsb.apfs_fs_index              = fs_index;
+    apsb.apfs_incompatible_features = APFS_INCOMPAT_CASE_INSENSITIVE;
+    apsb.apfs_unmount_time          = GEN_TIMESTAMP;
+    apsb.apfs_root_tree_type        = OBJ_VIRTUAL | OBJECT_TYPE_BTREE;
+    apsb.apfs_extentref_tree_type   = OBJ_PHYSICAL | OBJECT_TYPE_BTREE;
+    apsb.apfs_snap_meta_tree_type   = OBJ_PHYSICAL | OBJECT_TYPE_BTREE;
+    apsb.apfs_root_tree_oid         = root_tree_oid;
+    apsb.apfs_next_obj_id           = gen_object_oid(gen_num_objects);
+    apsb.apfs_num_files             = num_files;
+    apsb.apfs_num_directories       = num_dirs - 1;     // Not counting the root
+    apsb.apfs_num_snapshots         = gen_params.num_snapshots;
+    apsb.apfs_last_mod_time         = GEN_TIMESTAMP;
+    apsb.apfs_fs_flags              = APFS_FS_UNENCRYPTED;
+    apsb.apfs_fs_alloc_count        = gen_num_data_blocks - first_data_block_count;
+    gen_make_uuid(apsb.apfs_vol_uuid, 1 + fs_index);
+    snprintf((char*)apsb.apfs_formatted_by.id, APFS_MODIFIED_NAMELEN, "apfs-generate");
+    apsb.apfs_formatted_by.timestamp = GEN_TIMESTAMP;
+    apsb.apfs_formatted_by.last_xid = first_xid;
+    snprintf((char*)apsb.apfs_volname, APFS_VOLNAME_LEN, "Volume %u", fs_index + 1);
+
+    // Snapshots
+    paddr_t snapshot_tree_addr = 0;
+    xid_t most_recent_snap = 0;
+    if (gen_params.num_snapshots > 0) {
+        paddr_t* snap_sblock_addrs = malloc(gen_params.num_snapshots * sizeof(paddr_t));
+        if (!snap_sblock_addrs) {
+            fprintf(stderr, "\nABORT: gen_write_volume: Could not allocate sufficient memory for `snap_sblock_addrs`.\n");
+            exit(-1);
+        }
+        for (uint32_t i = 0; i < gen_params.num_snapshots; i++) {
+            snap_sblock_addrs[i] = gen_alloc(1);
+            gen_write_apsb(snap_sblock_addrs[i], &apsb, apsb_oid, first_xid + i);
+        }
+        apsb.apfs_snap_meta_tree_oid = gen_write_snap_meta_tree(snap_sblock_addrs, first_xid);
+        snapshot_tree_addr = gen_write_omap_snapshot_tree(first_xid);
+        most_recent_snap = first_xid + gen_params.num_snapshots - 1;
+        free(snap_sblock_addrs);
+    }
+
+    apsb.apfs_omap_oid = gen_write_omap(&fs_omap_entries, first_xid, 0, gen_params.num_snapshots, most_recent_snap, snapshot_tree_addr);
+    free(fs_omap_entries.entries);
+
+    for (uint32_t i = 0; i < gen_params.num_checkpoints; i++) {
+        paddr_t addr = gen_alloc(1);
+        gen_write_apsb(addr, &apsb, apsb_oid, first_checkpoint_xid + i);
+        gen_omap_entries_add(nx_omap_entries, apsb_oid, first_checkpoint_xid + i, addr);
+    }
+    return apsb_oid;
+}
+
+/**
+ * Generate a container according to `gen_params`, and write it to a given
+ * image file, which is created or truncated. The block size is
+ * `nx_block_size`.
+ *
+ * RETURN VALUE:    The number of blocks in the container.
+ */
+uint64_t generate_container(char* image_path) {
+    if (gen_params.num_volumes < 1 || gen_params.num_volumes > NX_MAX_FILE_SYSTEMS) {
+        fprintf(stderr, "\nABORT: generate_container: The number of volumes must be from 1 to %u.\n", NX_MAX_FILE_SYSTEMS);
+        exit(-1);
+    }
+    if (gen_params.num_checkpoints < 1 || gen_params.extents_per_file < 1) {
+        fprintf(stderr, "\nABORT: generate_container: There must be at least one checkpoint and one extent per file.\n");
+        exit(-1);
+    }
+    if (gen_params.fanout == 1) {
+        fprintf(stderr, "\nABORT: generate_container: The fanout must be at least 2.\n");
+        exit(-1);
+    }
+
+    gen_fd = open(image_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (gen_fd == -1) {
+        fprintf(stderr, "\nABORT: generate_container: Could not open `%s` for writing (%s).\n", image_path, strerror(errno));
+        exit(-1);
+    }
+    gen_run = malloc(GEN_WRITE_RUN_BLOCKS * nx_block_size);
+    if (!gen_run) {
+        fprintf(stderr, "\nABORT: generate_container: Could not allocate sufficient memory for `gen_run`.\n");
+        exit(-1);
+    }
+
+    // Block 0, then the checkpoint descriptor and data areas; each checkpoint
+    // uses two descriptor blocks (a checkpoint map and a container
+    // superblock), and one data block (the space manager).
+    uint32_t num_checkpoints = gen_params.num_checkpoints;
+    uint32_t xp_desc_blocks = 2 * num_checkpoints < 8 ? 8 : 2 * num_checkpoints;
+    uint32_t xp_data_blocks = num_checkpoints < 8 ? 8 : num_checkpoints;
+    paddr_t xp_desc_base = 1;
+    paddr_t xp_data_base = xp_desc_base + xp_desc_blocks;
+    gen_next_paddr = xp_data_base + xp_data_blocks;
+    gen_next_oid = GEN_FIRST_VIRTUAL_OID;
+
+    xid_t first_checkpoint_xid = GEN_FIRST_XID + gen_params.num_snapshots;
+    xid_t last_xid = first_checkpoint_xid + num_checkpoints - 1;
+
+    gen_build_objects();
+
+    gen_omap_entries_t nx_omap_entries = { NULL, 0, 0 };
+    oid_t fs_oids[NX_MAX_FILE_SYSTEMS] = { 0 };
+    for (uint32_t i = 0; i < gen_params.num_volumes; i++) {
+        fs_oids[i] = gen_write_volume(i, &nx_omap_entries, first_checkpoint_xid);
+    }
+    paddr_t nx_omap_addr = gen_write_omap(&nx_omap_entries, first_checkpoint_xid, OMAP_MANUALLY_MANAGED, 0, 0, 0);
+    free(nx_omap_entries.entries);
+
+    uint64_t block_count = gen_next_paddr;
+    if (gen_params.block_count) {
+        if (gen_params.block_count < block_count) {
+            fprintf(stderr, "\nABORT: generate_container: The container needs at least %llu blocks, but only %llu were asked for.\n", block_count, gen_params.block_count);
+            exit(-1);
+        }
+        block_count = gen_params.block_count;
+    }
+
+    // Checkpoints, oldest first; block 0 is a copy of the latest superblock.
+    char* block = gen_alloc_block_buffer();
+    for (uint32_t i = 0; i < num_checkpoints; i++) {
+        xid_t xid = first_checkpoint_xid + i;
+
+        memset(block, 0, nx_block_size);
+        paddr_t spaceman_addr = xp_data_base + i;
+        gen_write_object(spaceman_addr, block, GEN_SPACEMAN_OID, xid, OBJ_EPHEMERAL | OBJECT_TYPE_SPACEMAN, 0);
+
+        checkpoint_map_phys_t* cpm = (checkpoint_map_phys_t*)block;
+        memset(block, 0, nx_block_size);
+        cpm->cpm_flags = CHECKPOINT_MAP_LAST;
+        cpm->cpm_count = 1;
+        cpm->cpm_map[0].cpm_type    = OBJ_EPHEMERAL | OBJECT_TYPE_SPACEMAN;
+        cpm->cpm_map[0].cpm_size    = nx_block_size;
+        cpm->cpm_map[0].cpm_oid     = GEN_SPACEMAN_OID;
+        cpm->cpm_map[0].cpm_paddr   = spaceman_addr;
+        paddr_t cpm_addr = xp_desc_base + 2 * i;
+        gen_write_object(cpm_addr, block, cpm_addr, xid, OBJ_PHYSICAL | OBJECT_TYPE_CHECKPOINT_MAP, 0);
+
+        nx_superblock_t* nxsb = (nx_superblock_t*)block;
+        memset(block, 0, nx_block_size);
+        nxsb->nx_magic                  = NX_MAGIC;
+        nxsb->nx_block_size             = nx_block_size;
+        nxsb->nx_block_count            = block_count;
+        nxsb->nx_incompatible_features  = NX_INCOMPAT_VERSION2;
+        gen_make_uuid(nxsb->nx_uuid, 0);
+        nxsb->nx_next_oid               = gen_next_oid;
+        nxsb->nx_next_xid               = xid + 1;
+        nxsb->nx_xp_desc_blocks         = xp_desc_blocks;
+        nxsb->nx_xp_data_blocks         = xp_data_blocks;
+        nxsb->nx_xp_desc_base           = xp_desc_base;
+        nxsb->nx_xp_data_base           = xp_data_base;
+        nxsb->nx_xp_desc_index          = 2 * i;
+        nxsb->nx_xp_desc_len            = 2;
+        nxsb->nx_xp_desc_next           = (2 * i + 2) % xp_desc_blocks;
+        nxsb->nx_xp_data_index          = i;
+        nxsb->nx_xp_data_len            = 1;
+        nxsb->nx_xp_data_next           = (i + 1) % xp_data_blocks;
+        nxsb->nx_spaceman_oid           = GEN_SPACEMAN_OID;
+        nxsb->nx_omap_oid               = nx_omap_addr;
+        nxsb->nx_max_file_systems       = NX_MAX_FILE_SYSTEMS;
+        memcpy(nxsb->nx_fs_oid, fs_oids, sizeof(fs_oids));
+        gen_write_object(xp_desc_base + 2 * i + 1, block, OID_NX_SUPERBLOCK, xid, OBJ_EPHEMERAL | OBJECT_TYPE_NX_SUPERBLOCK, 0);
+
+        if (xid == last_xid) {
+            gen_write_block(0, block);
+        }
+    }
+    free(block);
+    gen_flush_run();
+
+    if (ftruncate(gen_fd, (off_t)block_count * nx_block_size) != 0) {
+        fprintf(stderr, "\nABORT: generate_container: Could not set the size of `%s` (%s).\n", image_path, strerror(errno));
+        exit(-1);
+    }
+    close(gen_fd);
+    gen_fd = -1;
+
+    free(gen_run);
+    gen_run = NULL;
+    free(gen_objects);
+    gen_objects = NULL;
+    return block_count;
+}
+
+#endif // APFS_FUNC_GENERATE_H
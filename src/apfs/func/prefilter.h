@@ -0,0 +1,111 @@
+/**
+ * A cheap test of whether a block could be an APFS object, which the carving
+ * tools apply to each chunk of a scan before computing any checksums.
+ *
+ * Most blocks of a container hold file data, and computing the Fletcher-64
+ * checksum of each of them just to reject it is most of the work of a scan.
+ * The test here looks only at the object header and, for B-tree nodes, the
+ * node header, which together lie in the first 56 bytes of the block:
+ *
+ * - the object type is a known one, and the type flags are defined ones;
+ * - the subtype is zero or a known object type;
+ * - for B-tree nodes, the flags are defined ones, the root flag agrees with
+ *   the object type, the leaf flag agrees with the level, the level is
+ *   bounded, and the table of contents and free space lie within the node,
+ *   with the former large enough for its keys.
+ *
+ * Every valid, unencrypted object passes, so only blocks that pass need be
+ * checksummed and handed to the matchers. The test is written without
+ * branches, so that a whole chunk is filtered in one tight loop with no
+ * mispredictions; see `prefilter_objects()`.
+ */
+
+#ifndef APFS_FUNC_PREFILTER_H
+#define APFS_FUNC_PREFILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "../io.h"
+#include "../struct/object.h"
+#include "../struct/btree.h"
+
+// The highest object type that APFS defines, excluding `OBJECT_TYPE_TEST` and
+// the keybag types; keybags are always encrypted, so cannot be carved anyway.
+#define PREFILTER_MAX_OBJECT_TYPE   0x20
+
+// The B-tree node flags that APFS defines.
+#define PREFILTER_BTNODE_FLAGS      (0x001f | BTNODE_CHECK_KOFF_INVAL)
+
+// The deepest B-tree that is plausible.
+#define PREFILTER_MAX_BTREE_LEVEL   16
+
+// The parameters of the test, which decide which blocks a scan's matchers see;
+// tools record them with their search configuration, as in `shard_add_config()`.
+const uint32_t prefilter_params[] = {
+    PREFILTER_MAX_OBJECT_TYPE,
+    PREFILTER_BTNODE_FLAGS,
+    PREFILTER_MAX_BTREE_LEVEL,
+};
+
+/**
+ * Determine whether a block of the container's block size could be an APFS
+ * object, judging only by its headers; see above.
+ */
+static inline bool is_plausible_object(obj_phys_t* obj) {
+    uint32_t type       = obj->o_type & OBJECT_TYPE_MASK;
+    uint32_t flags      = obj->o_type & OBJECT_TYPE_FLAGS_MASK;
+    uint32_t subtype    = obj->o_subtype;
+
+    // Bitwise rather than logical operators throughout, so that the compiler
+    // evaluates every condition rather than branching on each.
+    bool ok = ((type - 1) < PREFILTER_MAX_OBJECT_TYPE) | (type == OBJECT_TYPE_TEST);
+    ok &= (flags & ~OBJECT_TYPE_FLAGS_DEFINED_MASK) == 0;
+    ok &= (flags & OBJ_STORAGETYPE_MASK) != OBJ_STORAGETYPE_MASK;
+    ok &= (subtype <= PREFILTER_MAX_OBJECT_TYPE) | (subtype == OBJECT_TYPE_TEST);
+
+    btree_node_phys_t* node = (btree_node_phys_t*)obj;
+    bool is_root    = (node->btn_flags & BTNODE_ROOT) != 0;
+    bool is_leaf    = (node->btn_flags & BTNODE_LEAF) != 0;
+    size_t toc_entry_size = (node->btn_flags & BTNODE_FIXED_KV_SIZE) ? sizeof(kvoff_t) : sizeof(kvloc_t);
+    uint32_t space  = nx_block_size - sizeof(btree_node_phys_t) - (is_root ? sizeof(btree_info_t) : 0);
+
+    bool node_ok = (node->btn_flags & ~PREFILTER_BTNODE_FLAGS) == 0;
+    node_ok &= is_root == (type == OBJECT_TYPE_BTREE);
+    node_ok &= is_leaf == (node->btn_level == 0);
+    node_ok &= node->btn_level < PREFILTER_MAX_BTREE_LEVEL;
+    node_ok &= (uint32_t)node->btn_table_space.off + node->btn_table_space.len <= space;
+    node_ok &= (uint32_t)node->btn_free_space.off + node->btn_free_space.len <= space;
+    node_ok &= (uint64_t)node->btn_nkeys * toc_entry_size <= node->btn_table_space.len;
+
+    bool is_node = (type == OBJECT_TYPE_BTREE) | (type == OBJECT_TYPE_BTREE_NODE);
+    return ok & (node_ok | !is_node);
+}
+
+/**
+ * Filter a chunk of consecutive blocks, keeping only those that could be APFS
+ * objects.
+ *
+ * data:        The blocks, each `nx_block_size` bytes long.
+ *
+ * num_blocks:  The number of blocks in `data`.
+ *
+ * survivors:   On return, the indices within `data` of the blocks that could
+ *      be APFS objects, in ascending order; room for `num_blocks` entries.
+ *
+ * RETURN VALUE:    The number of such blocks.
+ */
+size_t prefilter_objects(char* data, size_t num_blocks, uint32_t* survivors) {
+    size_t num_survivors = 0;
+    for (size_t i = 0; i < num_blocks; i++) {
+        // Write the index unconditionally, and only keep it if the block
+        // passes, rather than branching on the result.
+        survivors[num_survivors] = i;
+        num_survivors += is_plausible_object((obj_phys_t*)(data + i * nx_block_size));
+    }
+    STATS_ADD(prefilter_rejected, num_blocks - num_survivors);
+    return num_survivors;
+}
+
+#endif // APFS_FUNC_PREFILTER_H
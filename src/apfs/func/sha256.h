@@ -0,0 +1,223 @@
+/**
+ * SHA-256 (FIPS 180-4), HMAC-SHA256 (RFC 2104), and PBKDF2-HMAC-SHA256
+ * (RFC 8018), as needed to derive key-encryption keys from passwords when
+ * unlocking encrypted volumes.
+ */
+
+#ifndef APFS_FUNC_SHA256_H
+#define APFS_FUNC_SHA256_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define SHA256_BLOCK_SIZE   64
+#define SHA256_DIGEST_SIZE  32
+
+typedef struct {
+    uint32_t    state[8];
+    uint64_t    num_bytes;
+    uint8_t     buffer[SHA256_BLOCK_SIZE];
+    size_t      buffer_len;
+} sha256_ctx_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t sha256_rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+/**
+ * Process one 64-byte block of input.
+ */
+void sha256_transform(sha256_ctx_t* ctx, const uint8_t* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4*i] << 24 | (uint32_t)block[4*i + 1] << 16 | (uint32_t)block[4*i + 2] << 8 | block[4*i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = sha256_rotr(w[i-15], 7) ^ sha256_rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = sha256_rotr(w[i-2], 17) ^ sha256_rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(sha256_ctx_t* ctx) {
+    static const uint32_t initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, initial_state, sizeof(initial_state));
+    ctx->num_bytes = 0;
+    ctx->buffer_len = 0;
+}
+
+void sha256_update(sha256_ctx_t* ctx, const void* data, size_t len) {
+    const uint8_t* bytes = data;
+    ctx->num_bytes += len;
+
+    if (ctx->buffer_len > 0) {
+        size_t n = SHA256_BLOCK_SIZE - ctx->buffer_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(ctx->buffer + ctx->buffer_len, bytes, n);
+        ctx->buffer_len += n;
+        bytes += n;
+        len -= n;
+        if (ctx->buffer_len < SHA256_BLOCK_SIZE) {
+            return;
+        }
+        sha256_transform(ctx, ctx->buffer);
+        ctx->buffer_len = 0;
+    }
+
+    while (len >= SHA256_BLOCK_SIZE) {
+        sha256_transform(ctx, bytes);
+        bytes += SHA256_BLOCK_SIZE;
+        len -= SHA256_BLOCK_SIZE;
+    }
+
+    memcpy(ctx->buffer, bytes, len);
+    ctx->buffer_len = len;
+}
+
+void sha256_final(sha256_ctx_t* ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint64_t num_bits = ctx->num_bytes * 8;
+
+    uint8_t padding[SHA256_BLOCK_SIZE + 8] = { 0x80 };
+    size_t padding_len = (ctx->buffer_len < 56 ? 56 : 120) - ctx->buffer_len;
+    sha256_update(ctx, padding, padding_len);
+
+    uint8_t length[8];
+    for (int i = 0; i < 8; i++) {
+        length[i] = num_bits >> (56 - 8*i);
+    }
+    sha256_update(ctx, length, 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4*i]     = ctx->state[i] >> 24;
+        digest[4*i + 1] = ctx->state[i] >> 16;
+        digest[4*i + 2] = ctx->state[i] >> 8;
+        digest[4*i + 3] = ctx->state[i];
+    }
+}
+
+void sha256(const void* data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
+
+/**
+ * State of an HMAC-SHA256 computation with a given key. The inner and outer
+ * hash states after absorbing the padded key are kept, so that PBKDF2, which
+ * computes many HMACs with the same key, only has to hash the key once.
+ */
+typedef struct {
+    sha256_ctx_t    inner;
+    sha256_ctx_t    outer;
+} hmac_sha256_key_t;
+
+void hmac_sha256_init_key(hmac_sha256_key_t* hmac_key, const void* key, size_t key_len) {
+    uint8_t block[SHA256_BLOCK_SIZE] = { 0 };
+    if (key_len > SHA256_BLOCK_SIZE) {
+        sha256(key, key_len, block);
+    } else {
+        memcpy(block, key, key_len);
+    }
+
+    uint8_t pad[SHA256_BLOCK_SIZE];
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        pad[i] = block[i] ^ 0x36;
+    }
+    sha256_init(&hmac_key->inner);
+    sha256_update(&hmac_key->inner, pad, SHA256_BLOCK_SIZE);
+
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    sha256_init(&hmac_key->outer);
+    sha256_update(&hmac_key->outer, pad, SHA256_BLOCK_SIZE);
+}
+
+void hmac_sha256(const hmac_sha256_key_t* hmac_key, const void* data, size_t len, uint8_t mac[SHA256_DIGEST_SIZE]) {
+    sha256_ctx_t ctx = hmac_key->inner;
+    uint8_t inner_digest[SHA256_DIGEST_SIZE];
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, inner_digest);
+
+    ctx = hmac_key->outer;
+    sha256_update(&ctx, inner_digest, SHA256_DIGEST_SIZE);
+    sha256_final(&ctx, mac);
+}
+
+/**
+ * Derive a key from a password with PBKDF2-HMAC-SHA256.
+ *
+ * key_len:     The number of bytes of key to derive.
+ */
+void pbkdf2_hmac_sha256(
+    const void* password, size_t password_len,
+    const uint8_t* salt, size_t salt_len,
+    uint32_t num_iterations,
+    uint8_t* key, size_t key_len
+) {
+    hmac_sha256_key_t hmac_key;
+    hmac_sha256_init_key(&hmac_key, password, password_len);
+
+    uint8_t block_input[256 + 4];
+    if (salt_len > 256) {
+        salt_len = 256;
+    }
+    memcpy(block_input, salt, salt_len);
+
+    for (uint32_t block_index = 1; key_len > 0; block_index++) {
+        block_input[salt_len]     = block_index >> 24;
+        block_input[salt_len + 1] = block_index >> 16;
+        block_input[salt_len + 2] = block_index >> 8;
+        block_input[salt_len + 3] = block_index;
+
+        uint8_t u[SHA256_DIGEST_SIZE];
+        uint8_t t[SHA256_DIGEST_SIZE];
+        hmac_sha256(&hmac_key, block_input, salt_len + 4, u);
+        memcpy(t, u, SHA256_DIGEST_SIZE);
+        for (uint32_t i = 1; i < num_iterations; i++) {
+            hmac_sha256(&hmac_key, u, SHA256_DIGEST_SIZE, u);
+            for (int j = 0; j < SHA256_DIGEST_SIZE; j++) {
+                t[j] ^= u[j];
+            }
+        }
+
+        size_t n = key_len < SHA256_DIGEST_SIZE ? key_len : SHA256_DIGEST_SIZE;
+        memcpy(key, t, n);
+        key += n;
+        key_len -= n;
+    }
+}
+
+#endif // APFS_FUNC_SHA256_H
@@ -0,0 +1,547 @@
+/**
+ * Partitioned scans, and the partial result files that they produce.
+ *
+ * A scan of a very large container can be split across several processes or
+ * hosts with no coordination between them. Each is given the same ranges of
+ * blocks to scan (those given with `--ranges`, or else the whole container)
+ * and its own shard `I/N` with `--shard`, and scans the `I`th of `N`
+ * contiguous parts of equal size of those ranges. With
+ * `--shard-output=FILE`, the contents of the tool's result sink (see
+ * `sink.h`) are written to `FILE`, and `apfs-merge-shards` combines the files
+ * of all of the shards into one sorted result.
+ *
+ * A shard file consists of a `shard_header_t`, then the ranges that the shard
+ * scanned, then the ranges that the whole search was partitioned from, both as
+ * `scan_range_t`s, then a `shard_criterion_t` for each criterion, then a
+ * `shard_version_t` for each version that the sink kept, in the order of
+ * `compare_sink_entries()`. The header identifies the tool, the container, the
+ * shard, and the search configuration (a digest of whatever the tool passed to
+ * `shard_add_config()`), so that files from different scans can't be mixed up.
+ * The file is written under a temporary name and renamed once it is complete,
+ * so a shard whose process died never leaves a truncated file behind.
+ */
+
+#ifndef APFS_FUNC_SHARD_H
+#define APFS_FUNC_SHARD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "../struct/general.h"
+#include "../struct/nx.h"
+#include "../io/scan.h"
+#include "../options.h"
+#include "sink.h"
+#include "sha256.h"
+
+#define SHARD_MAGIC         "APFSSHRD"
+#define SHARD_VERSION       2
+#define SHARD_NAME_LEN      32
+
+typedef struct {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    block_size;
+    char        tool[SHARD_NAME_LEN];   // The tool that wrote the file
+    uuid_t      nx_uuid;                // The container that was scanned
+    uint64_t    nx_block_count;
+    uint32_t    shard_index;
+    uint32_t    num_shards;
+    uint64_t    num_ranges;
+    uint64_t    num_search_ranges;      // The ranges of the whole search
+    uint8_t     config_digest[SHA256_DIGEST_SIZE];  // The search configuration
+    uint32_t    num_criteria;
+    uint32_t    padding;
+    uint64_t    num_versions;
+    uint64_t    num_dropped;            // Versions that the sink didn't keep
+} shard_header_t;
+
+typedef struct {
+    char        name[SHARD_NAME_LEN];
+    uint64_t    num_matches;
+    paddr_t     first_addr;
+    paddr_t     last_addr;
+} shard_criterion_t;
+
+typedef struct {
+    uint32_t    criterion;
+    uint32_t    padding;
+    oid_t       oid;
+    xid_t       xid;
+    paddr_t     addr;
+    uint64_t    num_copies;
+} shard_version_t;
+
+/**
+ * A shard file, as loaded into memory by `shard_read()`.
+ */
+typedef struct {
+    char*               path;
+    shard_header_t      header;
+    scan_range_t*       ranges;
+    scan_range_t*       search_ranges;
+    shard_criterion_t*  criteria;
+    shard_version_t*    versions;
+} shard_file_t;
+
+/** Configuration **/
+
+// Set by `--shard=I/N`; this process scans the `shard_index`th of
+// `shard_count` parts, counting from 0.
+bool            shard_given = false;
+uint32_t        shard_index = 0;
+uint32_t        shard_count = 1;
+
+// Set by `--ranges`; the ranges to scan instead of the tool's own, if any.
+scan_range_t*   shard_given_ranges = NULL;
+size_t          shard_num_given_ranges = 0;
+
+// Set by `--shard-output=FILE`.
+char*           shard_output_path = NULL;
+
+// Set by `shard_ranges()`; the ranges that the whole search is partitioned
+// from.
+scan_range_t    shard_default_range;
+scan_range_t*   shard_search_ranges = NULL;
+size_t          shard_num_search_ranges = 0;
+
+// A digest of the search configuration, built up by `shard_add_config()`.
+sha256_ctx_t    shard_config;
+bool            shard_config_begun = false;
+
+/**
+ * Print a description of the options that partition a scan to a given stream;
+ * tools that support them call this from their usage info.
+ */
+void print_shard_options_usage(FILE* stream) {
+    fprintf(stream,
+        "Partitioning options:\n"
+        "  --ranges=START:END[,START:END...]\n"
+        "                      Scan the given ranges of blocks, each up to but not including END, rather\n"
+        "                      than the usual range.\n"
+        "  --shard=I/N         Scan only the Ith of N equal parts of the ranges, or of the whole\n"
+        "                      container if none are given, counting from 0.\n"
+        "  --shard-output=FILE Write the results to FILE, for `apfs-merge-shards` to combine with those\n"
+        "                      of the other shards.\n"
+        "\n"
+    );
+}
+
+/**
+ * Order ranges by their first block.
+ */
+int compare_scan_ranges(const void* a, const void* b) {
+    const scan_range_t* x = a;
+    const scan_range_t* y = b;
+    if (x->start_block != y->start_block) {
+        return x->start_block < y->start_block ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Parse a comma-separated list of block ranges, as in `0x1000:0x2000,0x8000:0x9000`.
+ * The ranges are sorted, and must not be empty or overlap.
+ *
+ * RETURN VALUE:    `true` if the list is valid, in which case `*ranges` is set
+ *      to an array of `*num_ranges` ranges, which the caller must free.
+ */
+bool parse_scan_ranges(char* string, scan_range_t** ranges, size_t* num_ranges) {
+    size_t capacity = 1;
+    for (char* c = string; *c; c++) {
+        capacity += *c == ',';
+    }
+    *ranges = malloc(capacity * sizeof(scan_range_t));
+    if (!*ranges) {
+        fprintf(stderr, "\nABORT: parse_scan_ranges: Could not allocate sufficient memory for `ranges`.\n");
+        exit(-1);
+    }
+
+    size_t n = 0;
+    char* cursor = string;
+    while (true) {
+        char* end;
+        if (!*cursor || *cursor == '-') {
+            break;
+        }
+        uint64_t start_block = strtoull(cursor, &end, 0);
+        if (*end != ':' || !end[1] || end[1] == '-') {
+            break;
+        }
+        cursor = end + 1;
+        uint64_t end_block = strtoull(cursor, &end, 0);
+        if ((*end != ',' && *end != '\0') || start_block >= end_block || end_block > INT64_MAX) {
+            break;
+        }
+        (*ranges)[n].start_block    = start_block;
+        (*ranges)[n].end_block      = end_block;
+        n++;
+        if (*end == '\0') {
+            qsort(*ranges, n, sizeof(scan_range_t), compare_scan_ranges);
+            for (size_t i = 1; i < n; i++) {
+                if ((*ranges)[i].start_block < (*ranges)[i - 1].end_block) {
+                    free(*ranges);
+                    return false;
+                }
+            }
+            *num_ranges = n;
+            return true;
+        }
+        cursor = end + 1;
+    }
+
+    free(*ranges);
+    return false;
+}
+
+/**
+ * Parse and remove the options that partition a scan from the argument list;
+ * see `parse_common_options()`, which should be called afterwards.
+ */
+bool parse_shard_options(int* argc, char** argv) {
+    int num_kept = 1;
+    for (int i = 1; i < *argc; i++) {
+        char* arg = argv[i];
+        if (strcmp(arg, "--") == 0) {
+            // Leave the rest for `parse_common_options()`
+            while (i < *argc) {
+                argv[num_kept++] = argv[i++];
+            }
+            break;
+        }
+
+        if (strncmp(arg, "--ranges=", 9) == 0) {
+            if (!parse_scan_ranges(arg + 9, &shard_given_ranges, &shard_num_given_ranges)) {
+                fprintf(stderr, "Option `--ranges` requires a list of non-overlapping block ranges, as in `--ranges=0x1000:0x2000,0x8000:0x9000`.\n");
+                return false;
+            }
+        } else if (strncmp(arg, "--shard=", 8) == 0) {
+            char* slash = strchr(arg + 8, '/');
+            bool ok = slash != NULL;
+            if (ok) {
+                *slash = '\0';
+                ok = parse_option_uint32_or_zero(arg + 8, &shard_index)
+                    && parse_option_uint32(slash + 1, &shard_count)
+                    && shard_index < shard_count;
+                *slash = '/';
+            }
+            shard_given = ok;
+            if (!ok) {
+                fprintf(stderr, "Option `--shard` requires a shard index and count, as in `--shard=0/4`, with the index less than the count.\n");
+                return false;
+            }
+        } else if (strncmp(arg, "--shard-output=", 15) == 0) {
+            if (!arg[15]) {
+                fprintf(stderr, "Option `--shard-output` requires a file path.\n");
+                return false;
+            }
+            shard_output_path = arg + 15;
+        } else {
+            argv[num_kept++] = arg;
+        }
+    }
+
+    argv[num_kept] = NULL;
+    *argc = num_kept;
+    return true;
+}
+
+/**
+ * Count the blocks in a list of ranges.
+ */
+uint64_t count_range_blocks(scan_range_t* ranges, size_t num_ranges) {
+    uint64_t num_blocks = 0;
+    for (size_t i = 0; i < num_ranges; i++) {
+        num_blocks += ranges[i].end_block - ranges[i].start_block;
+    }
+    return num_blocks;
+}
+
+/**
+ * Get one shard's part of a list of ranges.
+ *
+ * all:     The ranges that the whole search is partitioned from.
+ *
+ * index, count:    The shard's index, and the number of shards.
+ *
+ * ranges:  On return, the shard's part; room for `num_all` ranges.
+ *
+ * RETURN VALUE:    The number of ranges in `ranges`.
+ */
+size_t shard_partition(scan_range_t* all, size_t num_all, uint32_t index, uint32_t count, scan_range_t* ranges) {
+    // This shard's part, as offsets into the concatenation of the ranges;
+    // written so as not to overflow.
+    uint64_t total = count_range_blocks(all, num_all);
+    uint64_t part_lo = (total / count) * index + (total % count) * index / count;
+    uint64_t part_hi = (total / count) * (index + 1) + (total % count) * (index + 1) / count;
+
+    size_t n = 0;
+    uint64_t offset = 0;
+    for (size_t i = 0; i < num_all; i++) {
+        uint64_t len = all[i].end_block - all[i].start_block;
+        uint64_t lo = part_lo > offset ? part_lo - offset : 0;
+        uint64_t hi = part_hi - offset < len ? part_hi - offset : len;
+        if (part_hi > offset && lo < hi) {
+            ranges[n].start_block   = all[i].start_block + lo;
+            ranges[n].end_block     = all[i].start_block + hi;
+            n++;
+        }
+        offset += len;
+    }
+    return n;
+}
+
+/**
+ * Get the ranges of blocks that this shard should scan: its part of the ranges
+ * given with `--ranges`, or else of the whole container. If the scan isn't
+ * partitioned and no ranges are given, this is the tool's own range.
+ *
+ * start_block, end_block:  The range that the tool scans by default.
+ *
+ * nx_block_count:  The number of blocks in the container.
+ *
+ * ranges:  On return, set to an array of ranges, which the caller must free.
+ *
+ * RETURN VALUE:    The number of ranges in `*ranges`.
+ */
+size_t shard_ranges(paddr_t start_block, paddr_t end_block, uint64_t nx_block_count, scan_range_t** ranges) {
+    shard_default_range.start_block = start_block;
+    shard_default_range.end_block   = end_block;
+    if (shard_given) {
+        shard_default_range.start_block = 0;
+        shard_default_range.end_block   = nx_block_count;
+    }
+    shard_search_ranges     = shard_given_ranges ? shard_given_ranges     : &shard_default_range;
+    shard_num_search_ranges = shard_given_ranges ? shard_num_given_ranges : 1;
+
+    *ranges = malloc(shard_num_search_ranges * sizeof(scan_range_t) + 1);
+    if (!*ranges) {
+        fprintf(stderr, "\nABORT: shard_ranges: Could not allocate sufficient memory for `ranges`.\n");
+        exit(-1);
+    }
+    return shard_partition(shard_search_ranges, shard_num_search_ranges, shard_index, shard_count, *ranges);
+}
+
+/**
+ * Add to the search configuration that a shard file records: anything besides
+ * the ranges and the names of the criteria that decides what a search finds,
+ * such as the values that each criterion matches. `apfs-merge-shards` refuses
+ * to merge shards whose configurations differ.
+ */
+void shard_add_config(const void* data, size_t len) {
+    if (!shard_config_begun) {
+        sha256_init(&shard_config);
+        shard_config_begun = true;
+    }
+    sha256_update(&shard_config, data, len);
+}
+
+/**
+ * Describe a list of ranges on stdout, as in `0x1000:0x2000, 0x8000:0x9000`.
+ */
+void print_scan_ranges(scan_range_t* ranges, size_t num_ranges) {
+    for (size_t i = 0; i < num_ranges; i++) {
+        printf("%s%#llx:%#llx", i ? ", " : "", ranges[i].start_block, ranges[i].end_block);
+    }
+    if (num_ranges == 0) {
+        printf("(none)");
+    }
+}
+
+/**
+ * Describe the ranges that a scan will cover on stdout, if they were chosen
+ * with `--shard` or `--ranges`.
+ */
+void print_shard_ranges(scan_range_t* ranges, size_t num_ranges) {
+    if (shard_given) {
+        printf("Scanning shard %u of %u: ", shard_index, shard_count);
+    } else if (shard_given_ranges) {
+        printf("Scanning blocks ");
+    } else {
+        return;
+    }
+    print_scan_ranges(ranges, num_ranges);
+    printf(" (%llu blocks).\n\n", count_range_blocks(ranges, num_ranges));
+}
+
+/**
+ * Write the contents of a result sink to a shard file; see above.
+ *
+ * tool:    The name of the tool.
+ *
+ * nxsb:    The container superblock, which identifies the container.
+ *
+ * ranges:  The ranges that were scanned, as given by `shard_ranges()`.
+ *
+ * RETURN VALUE:    `true` on success. On failure, an error is printed, and no
+ *      file is left behind.
+ */
+bool shard_write(char* path, char* tool, nx_superblock_t* nxsb, result_sink_t* sink, scan_range_t* ranges, size_t num_ranges) {
+    size_t num_versions;
+    sink_entry_t* versions = sink_results(sink, 0, &num_versions);
+
+    size_t tmp_path_len = strlen(path) + 5;
+    char* tmp_path = malloc(tmp_path_len);
+    if (!tmp_path) {
+        fprintf(stderr, "\nABORT: shard_write: Could not allocate sufficient memory for `tmp_path`.\n");
+        exit(-1);
+    }
+    snprintf(tmp_path, tmp_path_len, "%s.tmp", path);
+
+    FILE* file = fopen(tmp_path, "wb");
+    if (!file) {
+        printf("FAILED: shard_write: Could not create `%s`: %s.\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        free(versions);
+        return false;
+    }
+
+    shard_header_t header = {
+        .magic          = SHARD_MAGIC,
+        .version        = SHARD_VERSION,
+        .block_size     = nx_block_size,
+        .nx_block_count = nxsb->nx_block_count,
+        .shard_index    = shard_index,
+        .num_shards     = shard_count,
+        .num_ranges     = num_ranges,
+        .num_search_ranges = shard_num_search_ranges,
+        .num_criteria   = sink->num_criteria,
+        .num_versions   = num_versions,
+        .num_dropped    = sink->num_dropped,
+    };
+    strncpy(header.tool, tool, SHARD_NAME_LEN - 1);
+    memcpy(header.nx_uuid, nxsb->nx_uuid, sizeof(uuid_t));
+    sha256_ctx_t config = shard_config;
+    if (!shard_config_begun) {
+        sha256_init(&config);
+    }
+    sha256_final(&config, header.config_digest);
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(ranges, sizeof(scan_range_t), num_ranges, file) == num_ranges
+        && fwrite(shard_search_ranges, sizeof(scan_range_t), shard_num_search_ranges, file) == shard_num_search_ranges;
+    for (uint32_t i = 0; ok && i < sink->num_criteria; i++) {
+        shard_criterion_t criterion = {
+            .num_matches    = sink->criteria[i].num_matches,
+            .first_addr     = sink->criteria[i].first_addr,
+            .last_addr      = sink->criteria[i].last_addr,
+        };
+        strncpy(criterion.name, sink->criteria[i].name, SHARD_NAME_LEN - 1);
+        ok = fwrite(&criterion, sizeof(criterion), 1, file) == 1;
+    }
+    for (size_t i = 0; ok && i < num_versions; i++) {
+        shard_version_t version = {
+            .criterion  = versions[i].criterion,
+            .oid        = versions[i].oid,
+            .xid        = versions[i].xid,
+            .addr       = versions[i].addr,
+            .num_copies = versions[i].num_copies,
+        };
+        ok = fwrite(&version, sizeof(version), 1, file) == 1;
+    }
+    free(versions);
+
+    if (fclose(file) != 0 || !ok || rename(tmp_path, path) != 0) {
+        printf("FAILED: shard_write: Could not write `%s`: %s.\n", path, strerror(errno));
+        unlink(tmp_path);
+        free(tmp_path);
+        return false;
+    }
+    free(tmp_path);
+    return true;
+}
+
+/**
+ * Load a shard file into memory.
+ *
+ * RETURN VALUE:    `true` on success. On failure, an error is printed.
+ */
+bool shard_read(char* path, shard_file_t* shard) {
+    memset(shard, 0, sizeof(shard_file_t));
+    shard->path = path;
+
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("FAILED: shard_read: Could not open `%s`: %s.\n", path, strerror(errno));
+        return false;
+    }
+
+    shard_header_t* header = &shard->header;
+    if (fread(header, sizeof(shard_header_t), 1, file) != 1
+        || memcmp(header->magic, SHARD_MAGIC, sizeof(header->magic)) != 0
+    ) {
+        printf("FAILED: shard_read: `%s` is not a shard file.\n", path);
+        fclose(file);
+        return false;
+    }
+    if (header->version != SHARD_VERSION) {
+        printf("FAILED: shard_read: `%s` is a shard file of an unsupported version (%u).\n", path, header->version);
+        fclose(file);
+        return false;
+    }
+    header->tool[SHARD_NAME_LEN - 1] = '\0';
+
+    if (header->shard_index >= header->num_shards) {
+        printf("FAILED: shard_read: `%s` is corrupt; it is of shard %u of %u.\n", path, header->shard_index, header->num_shards);
+        fclose(file);
+        return false;
+    }
+
+    shard->ranges           = malloc(header->num_ranges * sizeof(scan_range_t) + 1);
+    shard->search_ranges    = malloc(header->num_search_ranges * sizeof(scan_range_t) + 1);
+    shard->criteria         = malloc(header->num_criteria * sizeof(shard_criterion_t) + 1);
+    shard->versions         = malloc(header->num_versions * sizeof(shard_version_t) + 1);
+    if (!shard->ranges || !shard->search_ranges || !shard->criteria || !shard->versions) {
+        fprintf(stderr, "\nABORT: shard_read: Could not allocate sufficient memory for the contents of `%s`.\n", path);
+        exit(-1);
+    }
+    bool ok = fread(shard->ranges, sizeof(scan_range_t), header->num_ranges, file) == header->num_ranges
+        && fread(shard->search_ranges, sizeof(scan_range_t), header->num_search_ranges, file) == header->num_search_ranges
+        && fread(shard->criteria, sizeof(shard_criterion_t), header->num_criteria, file) == header->num_criteria
+        && fread(shard->versions, sizeof(shard_version_t), header->num_versions, file) == header->num_versions;
+    fclose(file);
+    if (!ok) {
+        printf("FAILED: shard_read: `%s` is truncated.\n", path);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header->num_criteria; i++) {
+        shard->criteria[i].name[SHARD_NAME_LEN - 1] = '\0';
+    }
+    for (uint64_t i = 0; i < header->num_versions; i++) {
+        if (shard->versions[i].criterion >= header->num_criteria) {
+            printf("FAILED: shard_read: `%s` is corrupt; a version has criterion %u of %u.\n", path, shard->versions[i].criterion, header->num_criteria);
+            return false;
+        }
+    }
+
+    // The shard must have scanned exactly its part of the search's ranges.
+    scan_range_t* expected = malloc(header->num_search_ranges * sizeof(scan_range_t) + 1);
+    if (!expected) {
+        fprintf(stderr, "\nABORT: shard_read: Could not allocate sufficient memory for `expected`.\n");
+        exit(-1);
+    }
+    size_t num_expected = shard_partition(shard->search_ranges, header->num_search_ranges, header->shard_index, header->num_shards, expected);
+    ok = num_expected == header->num_ranges
+        && memcmp(expected, shard->ranges, num_expected * sizeof(scan_range_t)) == 0;
+    free(expected);
+    if (!ok) {
+        printf("FAILED: shard_read: `%s` is corrupt; its ranges are not its part of the ranges of the search.\n", path);
+        return false;
+    }
+    return true;
+}
+
+void shard_free(shard_file_t* shard) {
+    free(shard->ranges);
+    free(shard->search_ranges);
+    free(shard->criteria);
+    free(shard->versions);
+}
+
+#endif // APFS_FUNC_SHARD_H
@@ -0,0 +1,437 @@
+/**
+ * Aggregation of the matches that a scan finds.
+ *
+ * A scan over a whole container finds the same logical object many times
+ * over: each stale copy of a B-tree node that hasn't yet been overwritten
+ * matches just as the current one does. The sink records each match under its
+ * criterion and the (OID, XID) of the object that matched, keeping only the
+ * lowest address of each such version and the number of copies found. It also
+ * counts the matches of each criterion and tracks the first and last address
+ * at which they occur.
+ *
+ * The versions are kept in an open-addressing hash table whose slots are
+ * claimed with atomic compare-and-swap operations, so several threads may add
+ * matches at once without taking a lock. The table has a fixed size; once it
+ * holds `sink_max_versions` versions, further new versions are counted but not
+ * kept.
+ *
+ * Typical usage:
+ *
+ *      result_sink_t sink;
+ *      sink_init(&sink, NUM_CRITERIA, criterion_names);
+ *      // ... for each match ...
+ *          if (sink_add(&sink, criterion, oid, xid, addr)) {
+ *              // ... report the match ...
+ *          }
+ *      sink_report(&sink);
+ *      sink_free(&sink);
+ */
+
+#ifndef APFS_FUNC_SINK_H
+#define APFS_FUNC_SINK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../struct/general.h"
+#include "../options.h"
+#include "../string/record.h"
+
+/** Configuration **/
+
+// Set by `--dedupe`; if true, matches are only reported for the first copy
+// found of each version of an object.
+bool        sink_dedupe = false;
+
+// Set by `--top-k=N`; if nonzero, matches aren't reported as they are found;
+// instead, the newest `sink_top_k` versions of each object are listed at the
+// end.
+uint32_t    sink_top_k = 0;
+
+// Set by `--max-versions=N`; the maximum number of distinct versions kept.
+uint32_t    sink_max_versions = 1 << 20;
+
+#define SINK_SLOT_EMPTY     0
+#define SINK_SLOT_CLAIMED   1   // Being filled in by the thread that claimed it
+#define SINK_SLOT_READY     2
+
+typedef struct {
+    uint32_t    state;
+    uint32_t    criterion;
+    oid_t       oid;
+    xid_t       xid;
+    paddr_t     addr;           // The lowest address of any copy
+    uint64_t    num_copies;
+} sink_entry_t;
+
+typedef struct {
+    const char* name;
+    uint64_t    num_matches;
+    uint64_t    num_versions;
+    paddr_t     first_addr;
+    paddr_t     last_addr;
+} sink_criterion_t;
+
+typedef struct {
+    sink_entry_t*       entries;
+    uint64_t            capacity;       // A power of two
+    uint64_t            num_entries;
+    uint64_t            num_dropped;    // New versions that didn't fit
+    sink_criterion_t*   criteria;
+    uint32_t            num_criteria;
+} result_sink_t;
+
+/**
+ * Print a description of the options that configure the sink to a given
+ * stream; tools that use a sink call this from their usage info.
+ */
+void print_sink_options_usage(FILE* stream) {
+    fprintf(stream,
+        "Result options:\n"
+        "  --dedupe            Report only the first copy found of each version (OID and XID) of an\n"
+        "                      object, rather than every match.\n"
+        "  --top-k=N           Rather than reporting matches as they are found, list the N newest\n"
+        "                      versions of each object at the end, each at the lowest address found.\n"
+        "  --max-versions=N    Keep track of up to N distinct versions (default: %u).\n"
+        "\n",
+        sink_max_versions
+    );
+}
+
+/**
+ * Parse and remove the options that configure the sink from the argument
+ * list; see `parse_common_options()`, which should be called afterwards.
+ */
+bool parse_sink_options(int* argc, char** argv) {
+    int num_kept = 1;
+    for (int i = 1; i < *argc; i++) {
+        char* arg = argv[i];
+        if (strcmp(arg, "--") == 0) {
+            // Leave the rest for `parse_common_options()`
+            while (i < *argc) {
+                argv[num_kept++] = argv[i++];
+            }
+            break;
+        }
+
+        if (strcmp(arg, "--dedupe") == 0) {
+            sink_dedupe = true;
+        } else if (strncmp(arg, "--top-k=", 8) == 0) {
+            if (!parse_option_uint32(arg + 8, &sink_top_k)) {
+                fprintf(stderr, "Option `--top-k` requires a positive integer value.\n");
+                return false;
+            }
+        } else if (strncmp(arg, "--max-versions=", 15) == 0) {
+            if (!parse_option_uint32(arg + 15, &sink_max_versions)) {
+                fprintf(stderr, "Option `--max-versions` requires a positive integer value.\n");
+                return false;
+            }
+        } else {
+            argv[num_kept++] = arg;
+        }
+    }
+
+    argv[num_kept] = NULL;
+    *argc = num_kept;
+    return true;
+}
+
+/**
+ * Initialise a sink for a given number of criteria.
+ *
+ * names:   The name of each criterion, which is used in the report.
+ */
+void sink_init(result_sink_t* sink, uint32_t num_criteria, const char** names) {
+    // Keep the table at most half full, so that probe sequences stay short.
+    sink->capacity = 1;
+    while (sink->capacity < 2 * (uint64_t)sink_max_versions) {
+        sink->capacity *= 2;
+    }
+    sink->entries       = calloc(sink->capacity, sizeof(sink_entry_t));
+    sink->num_entries   = 0;
+    sink->num_dropped   = 0;
+    sink->criteria      = calloc(num_criteria, sizeof(sink_criterion_t));
+    sink->num_criteria  = num_criteria;
+    if (!sink->entries || !sink->criteria) {
+        fprintf(stderr, "\nABORT: sink_init: Could not allocate sufficient memory for %llu versions.\n", sink->capacity);
+        exit(-1);
+    }
+    for (uint32_t i = 0; i < num_criteria; i++) {
+        sink->criteria[i].name          = names[i];
+        sink->criteria[i].first_addr    = INT64_MAX;
+        sink->criteria[i].last_addr     = -1;
+    }
+}
+
+void sink_free(result_sink_t* sink) {
+    free(sink->entries);
+    free(sink->criteria);
+}
+
+/**
+ * Get the total number of matches recorded across all criteria. The sink must
+ * not be added to meanwhile.
+ */
+uint64_t sink_num_matches(result_sink_t* sink) {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < sink->num_criteria; i++) {
+        total += sink->criteria[i].num_matches;
+    }
+    return total;
+}
+
+/**
+ * Hash the key of a version; this is the finaliser of SplitMix64.
+ */
+uint64_t sink_hash(uint32_t criterion, oid_t oid, xid_t xid) {
+    uint64_t hash = oid ^ (xid * 0x9e3779b97f4a7c15) ^ ((uint64_t)criterion << 56);
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+    return hash ^ (hash >> 31);
+}
+
+/**
+ * Atomically lower a value to a given value, if it is greater.
+ */
+void sink_atomic_min(paddr_t* target, paddr_t value) {
+    paddr_t current = __atomic_load_n(target, __ATOMIC_RELAXED);
+    while (value < current
+        && !__atomic_compare_exchange_n(target, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+    );
+}
+
+/**
+ * Atomically raise a value to a given value, if it is less.
+ */
+void sink_atomic_max(paddr_t* target, paddr_t value) {
+    paddr_t current = __atomic_load_n(target, __ATOMIC_RELAXED);
+    while (value > current
+        && !__atomic_compare_exchange_n(target, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+    );
+}
+
+/**
+ * Add copies of a version to the sink, without counting them as matches of
+ * its criterion. This may be called from several threads at once.
+ *
+ * addr:        The lowest address of the copies.
+ *
+ * RETURN VALUE:    1 if the version is new, 0 if it was in the sink already,
+ *      or -1 if it is new but the sink is full, in which case it is counted in
+ *      `num_dropped`.
+ */
+int sink_insert(result_sink_t* sink, uint32_t criterion, oid_t oid, xid_t xid, paddr_t addr, uint64_t num_copies) {
+    uint64_t mask = sink->capacity - 1;
+    uint64_t i = sink_hash(criterion, oid, xid) & mask;
+    while (true) {
+        sink_entry_t* entry = sink->entries + i;
+        uint32_t state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+
+        if (state == SINK_SLOT_EMPTY) {
+            // Reserve room for a new version before claiming the slot, so
+            // that the table never fills up, and a probe always ends.
+            if (__atomic_add_fetch(&sink->num_entries, 1, __ATOMIC_RELAXED) > sink_max_versions) {
+                __atomic_sub_fetch(&sink->num_entries, 1, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&sink->num_dropped, 1, __ATOMIC_RELAXED);
+                return -1;
+            }
+            if (__atomic_compare_exchange_n(&entry->state, &state, SINK_SLOT_CLAIMED, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                entry->criterion    = criterion;
+                entry->oid          = oid;
+                entry->xid          = xid;
+                entry->addr         = addr;
+                entry->num_copies   = num_copies;
+                __atomic_store_n(&entry->state, SINK_SLOT_READY, __ATOMIC_RELEASE);
+                __atomic_add_fetch(&sink->criteria[criterion].num_versions, 1, __ATOMIC_RELAXED);
+                return 1;
+            }
+            // Another thread claimed the slot first; `state` now holds its
+            // state. Give back the room, and look at what it put there.
+            __atomic_sub_fetch(&sink->num_entries, 1, __ATOMIC_RELAXED);
+        }
+
+        // The key is written only once, just after the slot is claimed.
+        while (state == SINK_SLOT_CLAIMED) {
+            state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+        }
+        if (entry->criterion == criterion && entry->oid == oid && entry->xid == xid) {
+            sink_atomic_min(&entry->addr, addr);
+            __atomic_add_fetch(&entry->num_copies, num_copies, __ATOMIC_RELAXED);
+            return 0;
+        }
+
+        i = (i + 1) & mask;
+    }
+}
+
+/**
+ * Record a match. This may be called from several threads at once.
+ *
+ * criterion:   The index of the criterion that matched.
+ *
+ * oid, xid:    The OID and XID of the object that matched.
+ *
+ * addr:        The address of the block in which the match was found.
+ *
+ * RETURN VALUE:    Whether the caller should report the match now: `false` if
+ *      `--top-k` was given, or if `--dedupe` was given and this version has
+ *      been seen before, and `true` otherwise.
+ */
+bool sink_add(result_sink_t* sink, uint32_t criterion, oid_t oid, xid_t xid, paddr_t addr) {
+    sink_criterion_t* c = sink->criteria + criterion;
+    __atomic_add_fetch(&c->num_matches, 1, __ATOMIC_RELAXED);
+    sink_atomic_min(&c->first_addr, addr);
+    sink_atomic_max(&c->last_addr, addr);
+
+    int inserted = sink_insert(sink, criterion, oid, xid, addr, 1);
+    return !sink_top_k && (inserted != 0 || !sink_dedupe);
+}
+
+/**
+ * Order versions by criterion, then by OID, then by XID, newest first.
+ */
+int compare_sink_entries(const void* a, const void* b) {
+    const sink_entry_t* x = a;
+    const sink_entry_t* y = b;
+    if (x->criterion != y->criterion) {
+        return x->criterion < y->criterion ? -1 : 1;
+    }
+    if (x->oid != y->oid) {
+        return x->oid < y->oid ? -1 : 1;
+    }
+    if (x->xid != y->xid) {
+        return x->xid > y->xid ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Get the newest `top_k` versions of each object for each criterion, or every
+ * version if `top_k` is 0. The sink must not be added to meanwhile.
+ *
+ * num_results:     On return, set to the number of versions returned.
+ *
+ * RETURN VALUE:    An array of the versions, ordered as by
+ *      `compare_sink_entries()`, which the caller must free.
+ */
+sink_entry_t* sink_results(result_sink_t* sink, uint32_t top_k, size_t* num_results) {
+    sink_entry_t* results = malloc(sink->num_entries * sizeof(sink_entry_t) + 1);
+    if (!results) {
+        fprintf(stderr, "\nABORT: sink_results: Could not allocate sufficient memory for `results`.\n");
+        exit(-1);
+    }
+    size_t n = 0;
+    for (uint64_t i = 0; i < sink->capacity; i++) {
+        if (sink->entries[i].state == SINK_SLOT_READY) {
+            results[n++] = sink->entries[i];
+        }
+    }
+    qsort(results, n, sizeof(sink_entry_t), compare_sink_entries);
+
+    if (top_k) {
+        size_t num_kept = 0;
+        uint32_t num_kept_of_object = 0;
+        for (size_t i = 0; i < n; i++) {
+            bool same_object = i > 0
+                && results[i].criterion == results[i - 1].criterion
+                && results[i].oid == results[i - 1].oid;
+            num_kept_of_object = same_object ? num_kept_of_object + 1 : 1;
+            if (num_kept_of_object <= top_k) {
+                results[num_kept++] = results[i];
+            }
+        }
+        n = num_kept;
+    }
+
+    *num_results = n;
+    return results;
+}
+
+/**
+ * Report the matches of each criterion. The sink must not be added to
+ * meanwhile.
+ */
+void sink_report_criteria(result_sink_t* sink) {
+    bool structured = is_structured_output();
+    FILE* stream = structured ? stderr : stdout;
+
+    fprintf(stream, "\nMatches by criterion:\n");
+    for (uint32_t i = 0; i < sink->num_criteria; i++) {
+        sink_criterion_t* c = sink->criteria + i;
+        if (c->num_matches == 0) {
+            fprintf(stream, "- %s: no matches.\n", c->name);
+        } else {
+            fprintf(stream, "- %s: %llu matches of %llu versions; first at %#llx, last at %#llx.\n",
+                c->name, c->num_matches, c->num_versions, c->first_addr, c->last_addr
+            );
+        }
+        if (structured) {
+            record_begin("criterion");
+            record_string("query",          c->name);
+            record_uint("matches",          c->num_matches);
+            record_uint("versions",         c->num_versions);
+            if (c->num_matches > 0) {
+                record_uint("first_addr",   c->first_addr);
+                record_uint("last_addr",    c->last_addr);
+            }
+            record_end();
+        }
+    }
+    if (sink->num_dropped > 0) {
+        fprintf(stream, "!! %llu versions were not kept, as the limit was reached; use `--max-versions` to keep more.\n",
+            sink->num_dropped
+        );
+    }
+}
+
+/**
+ * List the newest `top_k` versions of each object, or every version if
+ * `top_k` is 0, in the order of `compare_sink_entries()`. The sink must not be
+ * added to meanwhile.
+ */
+void sink_report_versions(result_sink_t* sink, uint32_t top_k) {
+    bool structured = is_structured_output();
+    FILE* stream = structured ? stderr : stdout;
+
+    size_t num_results;
+    sink_entry_t* results = sink_results(sink, top_k, &num_results);
+    if (top_k) {
+        fprintf(stream, "\nNewest %u versions of each object:\n", top_k);
+    } else {
+        fprintf(stream, "\nVersions of each object, newest first:\n");
+    }
+    for (size_t i = 0; i < num_results; i++) {
+        sink_entry_t* entry = results + i;
+        if (structured) {
+            record_begin("version");
+            record_string("query",  sink->criteria[entry->criterion].name);
+            record_uint("oid",      entry->oid);
+            record_uint("xid",      entry->xid);
+            record_uint("addr",     entry->addr);
+            record_uint("copies",   entry->num_copies);
+            record_end();
+        } else {
+            printf("%-14s || OID %#9llx || XID %#9llx || at %#8llx || copies: %llu\n",
+                sink->criteria[entry->criterion].name,
+                entry->oid, entry->xid, entry->addr, entry->num_copies
+            );
+        }
+    }
+    free(results);
+}
+
+/**
+ * Report the matches of each criterion and, if `--top-k` was given, the
+ * newest versions of each object. The sink must not be added to meanwhile.
+ */
+void sink_report(result_sink_t* sink) {
+    sink_report_criteria(sink);
+    if (sink_top_k) {
+        sink_report_versions(sink, sink_top_k);
+    }
+}
+
+#endif // APFS_FUNC_SINK_H
@@ -9,8 +9,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
 #include <sys/errno.h>
 
+#include "struct/general.h"     // for `paddr_t`
+#include "stats.h"
+
 char*   nx_path;
 FILE*   nx;
 size_t  nx_block_size = 4096;
@@ -71,6 +77,163 @@ void report_fopen_error() {
     }
 }
 
+/**
+ * Read given number of blocks from a single device or image file, without any
+ * error handling beyond retrying interrupted reads; see `pread_blocks()`.
+ */
+ssize_t pread_device_blocks(int fd, void* buffer, paddr_t start_block, size_t num_blocks) {
+    size_t num_bytes = num_blocks * nx_block_size;
+    off_t offset = (off_t)start_block * nx_block_size;
+    size_t num_bytes_read = 0;
+
+    while (num_bytes_read < num_bytes) {
+        ssize_t ret = pread(fd, (char*)buffer + num_bytes_read, num_bytes - num_bytes_read, offset + num_bytes_read);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0) {
+            // Reached end-of-file
+            break;
+        }
+        num_bytes_read += ret;
+    }
+
+    return num_bytes_read / nx_block_size;
+}
+
+// Block-size detection, which packed images and overlays use when they are
+// probed; this must come before them.
+#include "io/blocksize.h"
+
+// Packed images, overlays, and Fusion containers; these must come after
+// `pread_device_blocks()` and before `pread_blocks_raw()`.
+#include "io/packed.h"
+#include "io/overlay.h"
+#include "io/fusion.h"
+
+/**
+ * Read given number of blocks from the APFS container via a given file
+ * descriptor, without any error handling beyond retrying interrupted reads;
+ * see `pread_blocks()`. If the container is an overlay of several images (see
+ * `io/overlay.h`) or a packed image (see `io/packed.h`), it is read through
+ * the overlay's segment table or the packed image's index instead. Blocks on
+ * the second tier of a Fusion container are read from that device (see
+ * `io/fusion.h`).
+ */
+ssize_t pread_blocks_raw(int fd, void* buffer, paddr_t start_block, size_t num_blocks) {
+    if (nx_is_overlay()) {
+        return overlay_pread_blocks(buffer, start_block, num_blocks);
+    }
+    if (nx_is_packed()) {
+        return packed_pread_blocks(buffer, start_block, num_blocks);
+    }
+    if (is_tier2_addr(start_block)) {
+        return fusion_pread_blocks(fd, buffer, start_block, num_blocks);
+    }
+    return pread_device_blocks(fd, buffer, start_block, num_blocks);
+}
+
+// Container superblock discovery (see `io/discover.h`), which scans the
+// container and so is included at the end of this file.
+bool    nx_find_superblock = false;     // Set by `--find-superblock`
+char*   nx_found_superblock = NULL;     // The chosen superblock, if any
+bool    find_nx_superblock();
+void    discover_mask_blocks(char* buffer, paddr_t start_block, size_t num_blocks);
+
+/**
+ * Determine the block size of the container, and set `nx_block_size`
+ * accordingly (see `io/blocksize.h`), unless it was given with `--block-size`.
+ * Packed images record their block size, and overlays take it from their
+ * images. Tools call this once `nx` is open, before allocating any buffers
+ * that are sized in blocks. With `--find-superblock`, the container is first
+ * scanned for the best container superblock, which is then read in place of
+ * block 0, and whose block size is used.
+ */
+void detect_block_size() {
+    if (nx_find_superblock && find_nx_superblock()) {
+        return;
+    }
+    if (nx_is_overlay() || nx_is_packed() || nx_block_size_forced) {
+        return;
+    }
+
+    bool probed;
+    size_t size = probe_block_size_fd(fileno(nx), &probed);
+    if (size == 0) {
+        fprintf(stderr, "Could not determine the block size of `%s`; assuming %lu bytes. Use `--block-size` to override this.\n", nx_path, nx_block_size);
+        return;
+    }
+    if (probed) {
+        fprintf(stderr, "Block 0 of `%s` is not a valid container superblock; found %lu-byte blocks by probing.\n", nx_path, size);
+    }
+    nx_block_size = size;
+}
+
+// Error-tolerant reads; this must come after `pread_blocks_raw()`.
+#include "io/rescue.h"
+
+/**
+ * Read given number of blocks from the APFS container via a given file
+ * descriptor, as the device holds them, even if a container superblock was
+ * chosen with `--find-superblock`. Tools that copy the device use this, so
+ * that the copy is faithful; see `pread_blocks_fd()`.
+ */
+ssize_t pread_blocks_fd_unmasked(int fd, void* buffer, paddr_t start_block, size_t num_blocks) {
+    STATS_TIMER_START(start_ns);
+    ssize_t num_blocks_read = io_rescue
+        ? rescue_pread_blocks(fd, buffer, start_block, num_blocks)
+        : pread_blocks_raw(fd, buffer, start_block, num_blocks);
+    if (STATS_ENABLED()) {
+        stats_note_read(start_ns, num_blocks_read, nx_block_size);
+    }
+    return num_blocks_read;
+}
+
+/**
+ * Read given number of blocks from the APFS container via a given file
+ * descriptor; see `pread_blocks()`. If a container superblock was chosen with
+ * `--find-superblock`, it is returned in place of block 0, which then needn't
+ * be readable at all; see `io/discover.h`.
+ */
+ssize_t pread_blocks_fd(int fd, void* buffer, paddr_t start_block, size_t num_blocks) {
+    if (nx_found_superblock && start_block == 0 && num_blocks > 0) {
+        ssize_t num_rest_read = num_blocks > 1
+            ? pread_blocks_fd(fd, (char*)buffer + nx_block_size, 1, num_blocks - 1)
+            : 0;
+        memcpy(buffer, nx_found_superblock, nx_block_size);
+        return num_rest_read == -1 ? 1 : num_rest_read + 1;
+    }
+
+    ssize_t num_blocks_read = pread_blocks_fd_unmasked(fd, buffer, start_block, num_blocks);
+    if (nx_found_superblock && num_blocks_read > 0) {
+        discover_mask_blocks(buffer, start_block, num_blocks_read);
+    }
+    return num_blocks_read;
+}
+
+/**
+ * Read given number of blocks from the APFS container using `pread()`, without
+ * reporting errors. Unlike `read_blocks()`, this function does not touch the
+ * file position of `nx`, and so it is safe to call from several threads at
+ * once; it is what the asynchronous I/O engine in `io/async.h` uses.
+ * 
+ * - buffer:        The location where data that is read will be stored.
+ * - start_block:   APFS physical block address to start reading from.
+ * - num_blocks:    The number of APFS physical blocks to read into `buffer`.
+ * 
+ * RETURN VALUE:    On success or partial success, the number of whole blocks
+ *              read (a non-negative value); fewer than `num_blocks` blocks are
+ *              read only if end-of-file is reached. On failure, -1, in which
+ *              case `errno` describes the error. In rescue mode (see
+ *              `io/rescue.h`), unreadable blocks are zero-filled instead.
+ */
+ssize_t pread_blocks(void* buffer, paddr_t start_block, size_t num_blocks) {
+    return pread_blocks_fd(fileno(nx), buffer, start_block, num_blocks);
+}
+
 /**
  * Read given number of blocks from the APFS container.
  * 
@@ -84,12 +247,17 @@ void report_fopen_error() {
  *              (a non-negative value). On failure, a negative value.
  */
 size_t read_blocks(void* buffer, long start_block, size_t num_blocks) {
-    if (fseek(nx, start_block * nx_block_size, SEEK_SET) == -1) {
-        // An error occurred.
+    if (start_block < 0) {
+        printf("FAILED: read_blocks: The specified starting block address, 0x%lx, is invalid, as it lies outside of the file `%s`.\n", start_block, nx_path);
+        return -1;
+    }
+
+    ssize_t num_blocks_read = pread_blocks(buffer, start_block, num_blocks);
+    if (num_blocks_read == -1) {
         printf("FAILED: read_blocks: ");
         switch (errno) {
             case EBADF:
-                printf("The file `%s` cannot be seeked through.\n", nx_path);
+                printf("The file `%s` cannot be read from.\n", nx_path);
                 break;
             case EINVAL:
                 printf("The specified starting block address, 0x%lx, is invalid, as it lies outside of the file `%s`.\n", start_block, nx_path);
@@ -100,29 +268,17 @@ size_t read_blocks(void* buffer, long start_block, size_t num_blocks) {
             case ESPIPE:
                 printf("The data stream associated with the file `%s` is a pipe or FIFO, and thus cannot be seeked through.\n", nx_path);
                 break;
+            case EIO:
+                printf("A low-level I/O error occurred whilst reading from the file `%s`.\n", nx_path);
+                break;
             default:
-                printf("Unknown error.\n");
+                printf("An unknown error occurred whilst reading from the stream.\n");
                 break;
         }
         return -1;
     }
 
-    size_t num_blocks_read = fread(buffer, nx_block_size, num_blocks, nx);
-    if (num_blocks_read != num_blocks) {
-        // An error occured or we reached end-of-file.
-        
-        // NOTE: This is intended to act as an `assert` statement with a message
-        if (!ferror(nx) && !feof(nx)) {
-            fprintf(stderr, "ABORT: read_blocks: Unexpected beaviour --- `fread` read fewer blocks than expected, but `feof` did not report EOF and `ferror` did not detect an error.\n\n");
-            exit(-1);
-        }
-        
-        if (ferror(nx)) {
-            printf("FAILED: read_blocks: An unknown error occurred whilst reading from the stream.\n");
-            return -1;
-        }
-
-        assert(feof(nx));
+    if ((size_t)num_blocks_read != num_blocks) {
         printf("read_blocks: Reached end-of-file after reading %lu blocks.\n", num_blocks_read);
     }
     return num_blocks_read;
@@ -144,35 +300,33 @@ size_t read_blocks(void* buffer, long start_block, size_t num_blocks) {
  *                  written before an error occurred.
  */
 size_t write_blocks(void* buffer, long start_block, size_t num_blocks) {
-    if (fseek(nx, start_block * nx_block_size, SEEK_SET) == -1) {
-        // An error occurred.
-        printf("FAILED: read_blocks: ");
-        switch (errno) {
-            case EBADF:
-                printf("The file `%s` cannot be seeked through.\n", nx_path);
-                break;
-            case EINVAL:
-                printf("The specified starting block address, 0x%lx, is invalid, as it lies outside of the file `%s`.\n", start_block, nx_path);
-                break;
-            case EOVERFLOW:
-                printf("The specified starting block address, 0x%lx, exceeds %lu bits in length, which would result in an overflow.\n", start_block, 8 * sizeof(long));
-                break;
-            case ESPIPE:
-                printf("The data stream associated with the file `%s` is a pipe or FIFO, and thus cannot be seeked through.\n", nx_path);
-                break;
-            default:
-                printf("Unknown error.\n");
-                break;
-        }
-        return -1;
+    if (start_block < 0) {
+        printf("FAILED: write_blocks: The specified starting block address, 0x%lx, is invalid, as it lies outside of the file `%s`.\n", start_block, nx_path);
+        return 0;
     }
 
-    size_t num_blocks_written = fwrite(buffer, nx_block_size, num_blocks, nx);
-    if (num_blocks_written != num_blocks) {
-        // A write error occured
-        printf("write_blocks: An error occurred after writing %lu blocks.\n", num_blocks_written);
+    int fd = fileno(nx);
+    size_t num_bytes = num_blocks * nx_block_size;
+    off_t offset = (off_t)start_block * nx_block_size;
+    size_t num_bytes_written = 0;
+
+    while (num_bytes_written < num_bytes) {
+        ssize_t ret = pwrite(fd, (char*)buffer + num_bytes_written, num_bytes - num_bytes_written, offset + num_bytes_written);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            // A write error occured
+            printf("write_blocks: An error occurred after writing %lu blocks.\n", num_bytes_written / nx_block_size);
+            break;
+        }
+        num_bytes_written += ret;
     }
-    return num_blocks_written;
+    return num_bytes_written / nx_block_size;
 }
 
+// Container superblock discovery; this must come last, as it scans the
+// container.
+#include "io/discover.h"
+
 #endif // APFS_IO_H
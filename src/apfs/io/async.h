@@ -0,0 +1,593 @@
+/**
+ * An asynchronous block-read engine, used to keep several reads of the APFS
+ * container in flight at once, which deep-queue devices (NVMe drives, RAID
+ * arrays, network block devices) need in order to reach their throughput.
+ *
+ * Two back ends are provided:
+ *
+ * - io_uring, used on Linux when compiled with `APFS_IO_URING` defined (see
+ *   `make IO_URING=1`). Requests are queued in the submission ring and only
+ *   submitted in batches, and buffers registered via `aio_register_buffers()`
+ *   are read into using fixed-buffer reads.
+ *
+ * - A pool of worker threads issuing `pread_blocks()` calls. This is used on
+ *   every other platform, and whenever io_uring is unavailable at runtime
+ *   (e.g. an old kernel, or a seccomp policy that forbids it). When reading a
+ *   Fusion container, there is a separate queue and set of threads for each
+ *   tier, so that reads from the fast main device aren't held up by reads
+ *   from the slow tier 2 device.
+ *
+ * Both back ends are driven the same way: requests are handed to
+ * `aio_submit()`, pushed to the device with `aio_flush()`, and reaped one at a
+ * time with `aio_wait()`, in whatever order they complete.
+ */
+
+#ifndef APFS_IO_ASYNC_H
+#define APFS_IO_ASYNC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#ifdef APFS_IO_URING
+#include <liburing.h>
+#endif
+
+#include "../io.h"
+#include "direct.h"
+
+/**
+ * A single asynchronous read request.
+ *
+ * buffer:          Where the data that is read will be stored. It must be
+ *      large enough to hold `num_blocks` blocks.
+ *
+ * start_block:     APFS physical block address to start reading from.
+ *
+ * num_blocks:      The number of APFS physical blocks to read.
+ *
+ * result:          Set when the request completes: the number of whole blocks
+ *      read (fewer than `num_blocks` only at end-of-file), or -1 on failure,
+ *      in which case `error` holds the relevant `errno` value.
+ *
+ * user_data:       Not used by the engine; callers may use it to associate
+ *      their own state with the request.
+ *
+ * fixed_index:     The index of the registered buffer that `buffer` lies in,
+ *      or -1 if it does not lie in a registered buffer. Only meaningful to the
+ *      io_uring back end.
+ *
+ * direct:          Whether to read through the direct descriptor opened by
+ *      `direct_open()` rather than through `nx`; `buffer` must then have been
+ *      allocated with `direct_alloc()`.
+ *
+ * unmasked:        Whether to read the blocks as the device holds them, even
+ *      if a container superblock was chosen with `--find-superblock`; see
+ *      `pread_blocks_fd_unmasked()`.
+ *
+ * batch:           Set by `aio_read_batch()` to tell its own requests apart
+ *      from those of other submitters; requests submitted with `aio_submit()`
+ *      should have it set to NULL.
+ */
+typedef struct aio_req {
+    void*       buffer;
+    paddr_t     start_block;
+    size_t      num_blocks;
+    ssize_t     result;
+    int         error;
+    void*       user_data;
+    int         fixed_index;
+    bool        direct;
+    bool        unmasked;
+    void*       batch;
+
+    struct aio_req* next;   // Used internally to link queued requests
+} aio_req_t;
+
+/** Engine configuration; these should be set before calling `aio_init()` **/
+
+// The maximum number of requests that may be in flight at once.
+uint32_t    aio_queue_depth = 32;
+
+// The number of worker threads used by the thread-pool back end.
+uint32_t    aio_num_threads = 8;
+
+// Set to `false` to force use of the thread-pool back end.
+bool        aio_use_io_uring = true;
+
+/** Engine state **/
+
+typedef enum {
+    AIO_ENGINE_NONE = 0,
+    AIO_ENGINE_THREADS,
+    AIO_ENGINE_IO_URING,
+} aio_engine_t;
+
+aio_engine_t    aio_engine = AIO_ENGINE_NONE;
+
+// Number of requests handed to `aio_submit()` that haven't been reaped yet
+uint32_t        aio_num_outstanding = 0;
+
+// Completed requests of other submitters that `aio_read_batch()` reaped whilst
+// waiting for its own; `aio_wait()` returns these first. They still count as
+// outstanding until then.
+aio_req_t*      aio_deferred_head = NULL;
+aio_req_t*      aio_deferred_tail = NULL;
+uint32_t        aio_num_deferred = 0;
+
+#ifdef APFS_IO_URING
+struct io_uring aio_ring;
+uint32_t        aio_num_unsubmitted = 0;
+#endif
+
+// Thread-pool state. Requests move from a pending queue to the completion
+// queue; all are singly linked FIFO lists protected by `aio_lock`. There is
+// one pending queue per tier of a Fusion container, each served by its own
+// `aio_num_threads` threads; otherwise, only the first queue is used.
+#define AIO_MAX_QUEUES  2
+
+pthread_mutex_t aio_lock        = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  aio_pending_cv[AIO_MAX_QUEUES] = { PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+pthread_cond_t  aio_done_cv     = PTHREAD_COND_INITIALIZER;
+aio_req_t*      aio_pending_head[AIO_MAX_QUEUES]    = { NULL };
+aio_req_t*      aio_pending_tail[AIO_MAX_QUEUES]    = { NULL };
+aio_req_t*      aio_done_head       = NULL;
+aio_req_t*      aio_done_tail       = NULL;
+uint32_t        aio_num_queues      = 1;
+pthread_t*      aio_threads         = NULL;
+uint32_t        aio_num_threads_started = 0;
+bool            aio_stopping        = false;
+
+/**
+ * Get a human-readable name for the engine that is currently in use.
+ */
+char* aio_engine_to_string(aio_engine_t engine) {
+    switch (engine) {
+        case AIO_ENGINE_THREADS:
+            return "thread pool (pread)";
+        case AIO_ENGINE_IO_URING:
+            return "io_uring";
+        default:
+            return "(not initialised)";
+    }
+}
+
+/**
+ * Execute a request synchronously, filling in its `result` and `error` fields.
+ */
+void aio_execute(aio_req_t* req) {
+    int fd = req->direct ? nx_direct_fd : fileno(nx);
+    req->result = req->unmasked
+        ? pread_blocks_fd_unmasked(fd, req->buffer, req->start_block, req->num_blocks)
+        : pread_blocks_fd(fd, req->buffer, req->start_block, req->num_blocks);
+    req->error = req->result == -1 ? errno : 0;
+}
+
+/**
+ * Get the index of the pending queue that a request belongs in.
+ */
+uint32_t aio_queue_for(aio_req_t* req) {
+    return (aio_num_queues > 1 && is_tier2_addr(req->start_block)) ? 1 : 0;
+}
+
+/**
+ * Main loop of each worker thread in the thread-pool back end.
+ *
+ * arg:     The index of the pending queue that the thread serves.
+ */
+void* aio_worker_main(void* arg) {
+    uint32_t queue = (uintptr_t)arg;
+
+    pthread_mutex_lock(&aio_lock);
+    while (true) {
+        while (!aio_pending_head[queue] && !aio_stopping) {
+            pthread_cond_wait(aio_pending_cv + queue, &aio_lock);
+        }
+        if (aio_stopping) {
+            break;
+        }
+
+        aio_req_t* req = aio_pending_head[queue];
+        aio_pending_head[queue] = req->next;
+        if (!aio_pending_head[queue]) {
+            aio_pending_tail[queue] = NULL;
+        }
+
+        pthread_mutex_unlock(&aio_lock);
+        aio_execute(req);
+        pthread_mutex_lock(&aio_lock);
+
+        req->next = NULL;
+        if (aio_done_tail) {
+            aio_done_tail->next = req;
+        } else {
+            aio_done_head = req;
+        }
+        aio_done_tail = req;
+        pthread_cond_signal(&aio_done_cv);
+    }
+    pthread_mutex_unlock(&aio_lock);
+    return NULL;
+}
+
+/**
+ * Start the thread-pool back end.
+ *
+ * RETURN VALUE:    `true` on success, `false` if no threads could be started.
+ */
+bool aio_init_threads() {
+    if (aio_num_threads == 0) {
+        aio_num_threads = 1;
+    }
+    if (aio_num_threads > aio_queue_depth) {
+        aio_num_threads = aio_queue_depth;
+    }
+
+    aio_num_queues = fusion_tier2_path ? 2 : 1;
+    aio_threads = malloc(aio_num_queues * aio_num_threads * sizeof(pthread_t));
+    if (!aio_threads) {
+        fprintf(stderr, "\nABORT: aio_init_threads: Could not allocate sufficient memory for `aio_threads`.\n");
+        exit(-1);
+    }
+
+    aio_stopping = false;
+    aio_num_threads_started = 0;
+    for (uint32_t queue = 0; queue < aio_num_queues; queue++) {
+        uint32_t num_started = 0;
+        for (uint32_t i = 0; i < aio_num_threads; i++) {
+            if (pthread_create(aio_threads + aio_num_threads_started, NULL, aio_worker_main, (void*)(uintptr_t)queue) != 0) {
+                break;
+            }
+            aio_num_threads_started++;
+            num_started++;
+        }
+        if (num_started == 0) {
+            // A queue without threads would never be served.
+            pthread_mutex_lock(&aio_lock);
+            aio_stopping = true;
+            for (uint32_t j = 0; j < aio_num_queues; j++) {
+                pthread_cond_broadcast(aio_pending_cv + j);
+            }
+            pthread_mutex_unlock(&aio_lock);
+            for (uint32_t j = 0; j < aio_num_threads_started; j++) {
+                pthread_join(aio_threads[j], NULL);
+            }
+            free(aio_threads);
+            aio_threads = NULL;
+            aio_num_threads_started = 0;
+            return false;
+        }
+        // Otherwise, make do with the threads we managed to start.
+    }
+
+    aio_engine = AIO_ENGINE_THREADS;
+    return true;
+}
+
+/**
+ * Initialise the asynchronous I/O engine, preferring io_uring if it is both
+ * compiled in and usable. Calling this function when the engine is already
+ * initialised has no effect.
+ *
+ * RETURN VALUE:    `true` on success, `false` if neither back end could be
+ *      started, in which case callers should fall back to `read_blocks()`.
+ */
+bool aio_init() {
+    if (aio_engine != AIO_ENGINE_NONE) {
+        return true;
+    }
+    if (aio_queue_depth == 0) {
+        aio_queue_depth = 1;
+    }
+
+#ifdef APFS_IO_URING
+    // io_uring reads bypass `pread_blocks()`, so they can't be used in rescue
+    // mode, which must see every read, nor on overlays, packed images, or
+    // Fusion containers, whose addresses must be translated, nor with
+    // `--find-superblock`, whose chosen superblock stands in for block 0.
+    // The last is decided by the option rather than by whether a superblock
+    // was found, as the discovery scan itself starts the engine.
+    if (aio_use_io_uring && !io_rescue && !fusion_tier2_path && !nx_find_superblock && !nx_is_overlay() && !nx_is_packed()) {
+        if (io_uring_queue_init(aio_queue_depth, &aio_ring, 0) == 0) {
+            aio_engine = AIO_ENGINE_IO_URING;
+            aio_num_unsubmitted = 0;
+            return true;
+        }
+        // io_uring isn't available here; fall through to the thread pool.
+    }
+#endif
+
+    return aio_init_threads();
+}
+
+/**
+ * Shut down the asynchronous I/O engine. All outstanding requests must have
+ * been reaped by the caller beforehand.
+ */
+void aio_shutdown() {
+    switch (aio_engine) {
+        case AIO_ENGINE_THREADS:
+            pthread_mutex_lock(&aio_lock);
+            aio_stopping = true;
+            for (uint32_t queue = 0; queue < aio_num_queues; queue++) {
+                pthread_cond_broadcast(aio_pending_cv + queue);
+            }
+            pthread_mutex_unlock(&aio_lock);
+
+            for (uint32_t i = 0; i < aio_num_threads_started; i++) {
+                pthread_join(aio_threads[i], NULL);
+            }
+            free(aio_threads);
+            aio_threads = NULL;
+            aio_num_threads_started = 0;
+            break;
+#ifdef APFS_IO_URING
+        case AIO_ENGINE_IO_URING:
+            io_uring_queue_exit(&aio_ring);
+            break;
+#endif
+        default:
+            break;
+    }
+
+    aio_engine = AIO_ENGINE_NONE;
+    aio_num_outstanding = 0;
+}
+
+/**
+ * Register buffers with the engine so that reads into them avoid per-request
+ * page pinning. Only the io_uring back end makes use of this; for the thread
+ * pool, this function does nothing. Requests whose `buffer` lies in the
+ * registered buffer at index `i` of `iovecs` should set `fixed_index = i`.
+ *
+ * RETURN VALUE:    `true` if the buffers were registered, else `false`, in
+ *      which case callers should leave `fixed_index` set to -1.
+ */
+bool aio_register_buffers(struct iovec* iovecs, uint32_t num_iovecs) {
+#ifdef APFS_IO_URING
+    if (aio_engine == AIO_ENGINE_IO_URING) {
+        return io_uring_register_buffers(&aio_ring, iovecs, num_iovecs) == 0;
+    }
+#endif
+    return false;
+}
+
+/**
+ * Unregister any buffers registered with `aio_register_buffers()`.
+ */
+void aio_unregister_buffers() {
+#ifdef APFS_IO_URING
+    if (aio_engine == AIO_ENGINE_IO_URING) {
+        io_uring_unregister_buffers(&aio_ring);
+    }
+#endif
+}
+
+#ifdef APFS_IO_URING
+/**
+ * Queue a request in the io_uring submission ring, submitting what is already
+ * queued if the ring is full.
+ */
+void aio_uring_queue(aio_req_t* req) {
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&aio_ring);
+    while (!sqe) {
+        io_uring_submit(&aio_ring);
+        aio_num_unsubmitted = 0;
+        sqe = io_uring_get_sqe(&aio_ring);
+    }
+
+    unsigned num_bytes = req->num_blocks * nx_block_size;
+    off_t offset = (off_t)req->start_block * nx_block_size;
+    int fd = req->direct ? nx_direct_fd : fileno(nx);
+    if (req->fixed_index >= 0) {
+        io_uring_prep_read_fixed(sqe, fd, req->buffer, num_bytes, offset, req->fixed_index);
+    } else {
+        io_uring_prep_read(sqe, fd, req->buffer, num_bytes, offset);
+    }
+    io_uring_sqe_set_data(sqe, req);
+    aio_num_unsubmitted++;
+}
+#endif
+
+/**
+ * Hand a request to the engine. With io_uring, the request is only queued;
+ * it is not guaranteed to be sent to the device until `aio_flush()` or
+ * `aio_wait()` is called, which allows requests to be submitted in batches.
+ * The engine must already have been initialised with `aio_init()`.
+ */
+void aio_submit(aio_req_t* req) {
+    req->result = 0;
+    req->error = 0;
+    req->next = NULL;
+    aio_num_outstanding++;
+
+    switch (aio_engine) {
+#ifdef APFS_IO_URING
+        case AIO_ENGINE_IO_URING:
+            aio_uring_queue(req);
+            break;
+#endif
+        case AIO_ENGINE_THREADS: {
+            uint32_t queue = aio_queue_for(req);
+            pthread_mutex_lock(&aio_lock);
+            if (aio_pending_tail[queue]) {
+                aio_pending_tail[queue]->next = req;
+            } else {
+                aio_pending_head[queue] = req;
+            }
+            aio_pending_tail[queue] = req;
+            pthread_cond_signal(aio_pending_cv + queue);
+            pthread_mutex_unlock(&aio_lock);
+        } break;
+        default:
+            fprintf(stderr, "\nABORT: aio_submit: The asynchronous I/O engine has not been initialised.\n");
+            exit(-1);
+    }
+}
+
+/**
+ * Send all queued requests to the device.
+ */
+void aio_flush() {
+#ifdef APFS_IO_URING
+    if (aio_engine == AIO_ENGINE_IO_URING && aio_num_unsubmitted > 0) {
+        io_uring_submit(&aio_ring);
+        aio_num_unsubmitted = 0;
+    }
+#endif
+}
+
+/**
+ * Wait for the engine to complete any request that is in flight; this is a
+ * helper function for `aio_wait()` and `aio_read_batch()`.
+ *
+ * RETURN VALUE:    As for `aio_wait()`.
+ */
+aio_req_t* aio_reap() {
+    if (aio_num_outstanding == aio_num_deferred) {
+        return NULL;
+    }
+    aio_req_t* req = NULL;
+
+    switch (aio_engine) {
+#ifdef APFS_IO_URING
+        case AIO_ENGINE_IO_URING: {
+            struct io_uring_cqe* cqe;
+            int ret = aio_num_unsubmitted > 0
+                ? io_uring_submit_and_wait(&aio_ring, 1)
+                : 0;
+            aio_num_unsubmitted = 0;
+            if (ret >= 0) {
+                ret = io_uring_wait_cqe(&aio_ring, &cqe);
+            }
+            if (ret < 0) {
+                fprintf(stderr, "\nABORT: aio_wait: io_uring failed to deliver a completion (error %d).\n", -ret);
+                exit(-1);
+            }
+
+            req = io_uring_cqe_get_data(cqe);
+            int res = cqe->res;
+            io_uring_cqe_seen(&aio_ring, cqe);
+
+            if (res < 0) {
+                req->result = -1;
+                req->error = -res;
+            } else if ((size_t)res < req->num_blocks * nx_block_size) {
+                // Short read; this is either end-of-file, or the kernel
+                // split the request. Finish the remainder synchronously so
+                // that callers only ever see short reads at end-of-file.
+                size_t num_whole_blocks = res / nx_block_size;
+                STATS_ADD(read_calls, 1);
+                STATS_ADD(blocks_read, num_whole_blocks);
+                STATS_ADD(bytes_read, num_whole_blocks * nx_block_size);
+                aio_req_t rest = *req;
+                rest.buffer = (char*)req->buffer + num_whole_blocks * nx_block_size;
+                rest.start_block += num_whole_blocks;
+                rest.num_blocks -= num_whole_blocks;
+                aio_execute(&rest);
+                if (rest.result == -1) {
+                    req->result = -1;
+                    req->error = rest.error;
+                } else {
+                    req->result = num_whole_blocks + rest.result;
+                }
+            } else {
+                // Reads made with io_uring are counted, but not timed.
+                STATS_ADD(read_calls, 1);
+                STATS_ADD(blocks_read, req->num_blocks);
+                STATS_ADD(bytes_read, req->num_blocks * nx_block_size);
+                req->result = req->num_blocks;
+            }
+        } break;
+#endif
+        case AIO_ENGINE_THREADS:
+            pthread_mutex_lock(&aio_lock);
+            while (!aio_done_head) {
+                pthread_cond_wait(&aio_done_cv, &aio_lock);
+            }
+            req = aio_done_head;
+            aio_done_head = req->next;
+            if (!aio_done_head) {
+                aio_done_tail = NULL;
+            }
+            pthread_mutex_unlock(&aio_lock);
+            break;
+        default:
+            return NULL;
+    }
+
+    aio_num_outstanding--;
+    return req;
+}
+
+/**
+ * Wait for any outstanding request to complete.
+ *
+ * RETURN VALUE:    A pointer to the completed request, whose `result` and
+ *      `error` fields have been filled in; or NULL if there are no
+ *      outstanding requests.
+ */
+aio_req_t* aio_wait() {
+    if (!aio_deferred_head) {
+        return aio_reap();
+    }
+    aio_req_t* req = aio_deferred_head;
+    aio_deferred_head = req->next;
+    if (!aio_deferred_head) {
+        aio_deferred_tail = NULL;
+    }
+    req->next = NULL;
+    aio_num_deferred--;
+    aio_num_outstanding--;
+    return req;
+}
+
+/**
+ * Read a batch of independent requests, keeping up to `aio_queue_depth` of
+ * them in flight, and return once all of them have completed. If the engine
+ * cannot be initialised, the requests are executed synchronously instead.
+ *
+ * Other submitters, such as a scan, may have requests in flight at the same
+ * time; their completions are set aside for their own calls to `aio_wait()`.
+ *
+ * Callers must check the `result` of each request.
+ */
+void aio_read_batch(aio_req_t* reqs, size_t num_reqs) {
+    if (!aio_init()) {
+        for (size_t i = 0; i < num_reqs; i++) {
+            aio_execute(reqs + i);
+        }
+        return;
+    }
+
+    size_t num_submitted = 0;
+    size_t num_completed = 0;
+    while (num_completed < num_reqs) {
+        while (num_submitted < num_reqs && aio_num_outstanding - aio_num_deferred < aio_queue_depth) {
+            reqs[num_submitted].fixed_index = -1;
+            reqs[num_submitted].batch = reqs;
+            aio_submit(reqs + num_submitted);
+            num_submitted++;
+        }
+        aio_flush();
+
+        aio_req_t* req = aio_reap();
+        if (req->batch == reqs) {
+            num_completed++;
+            continue;
+        }
+        req->next = NULL;
+        if (aio_deferred_tail) {
+            aio_deferred_tail->next = req;
+        } else {
+            aio_deferred_head = req;
+        }
+        aio_deferred_tail = req;
+        aio_num_deferred++;
+        aio_num_outstanding++;
+    }
+}
+
+#endif // APFS_IO_ASYNC_H
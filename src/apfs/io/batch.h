@@ -0,0 +1,458 @@
+/**
+ * Write batches: reversible, multi-block writes to the APFS container.
+ *
+ * Rather than writing each modified block as soon as it is ready, a tool
+ * stages it with `batch_get_block()` or `batch_put_block()`, and then writes
+ * every staged block at once with `batch_commit()`, which:
+ *
+ * - recomputes the checksums of the staged objects, so that callers needn't;
+ * - reads the blocks' current contents and saves them to an undo log, which is
+ *   flushed to stable storage before anything is written to the container;
+ * - writes the blocks in address order, each run of adjacent blocks with a
+ *   single `pwritev()`, and drops any cached copies of them (see `cache.h`),
+ *   so that later reads see what was written;
+ * - flushes the container to stable storage.
+ *
+ * `batch_rollback()` restores the blocks saved in an undo log, itself as a
+ * batch. An undo log consists of an `undo_log_header_t`, followed by an
+ * `undo_log_entry_t` and the original contents of each block in turn.
+ */
+
+#ifndef APFS_IO_BATCH_H
+#define APFS_IO_BATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "../io.h"
+#include "../func/cksum.h"
+#include "cache.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX     1024
+#endif
+
+#define UNDO_LOG_MAGIC      "APFSUNDO"
+#define UNDO_LOG_VERSION    1
+
+typedef struct {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    block_size;
+    uint64_t    num_blocks;
+} undo_log_header_t;
+
+/**
+ * Each block in an undo log is preceded by its address, the Fletcher-64
+ * checksum of its original contents (as saved in the log), and the same for
+ * the contents that the batch wrote, so that rolling back can tell whether a
+ * block was changed again afterwards. These are plain checksums of the whole
+ * block, not the checksum stored in an object's header.
+ */
+typedef struct {
+    uint64_t    addr;
+    uint64_t    orig_cksum;
+    uint64_t    new_cksum;
+} undo_log_entry_t;
+
+typedef struct {
+    paddr_t     addr;
+    char*       data;
+    bool        is_object;  // Whether to recompute its checksum
+} batch_block_t;
+
+/** State **/
+
+batch_block_t*  batch_blocks = NULL;
+size_t          batch_num_blocks = 0;
+size_t          batch_capacity = 0;
+
+// Open-addressed index of `batch_blocks` by address; each slot holds an index
+// into `batch_blocks` plus 1, or 0 if empty.
+size_t*         batch_index = NULL;
+size_t          batch_index_size = 0;
+
+size_t* batch_index_slot(paddr_t addr) {
+    size_t mask = batch_index_size - 1;
+    size_t slot = ((uint64_t)addr * 0x9e3779b97f4a7c15ULL) >> 32 & mask;
+    while (batch_index[slot] && batch_blocks[batch_index[slot] - 1].addr != addr) {
+        slot = (slot + 1) & mask;
+    }
+    return batch_index + slot;
+}
+
+/**
+ * Find the staged block with a given address.
+ *
+ * RETURN VALUE:    A pointer to the staged block, or NULL if there is none.
+ */
+batch_block_t* batch_find_block(paddr_t addr) {
+    if (!batch_index) {
+        return NULL;
+    }
+    size_t* slot = batch_index_slot(addr);
+    return *slot ? batch_blocks + *slot - 1 : NULL;
+}
+
+batch_block_t* batch_add_block(paddr_t addr, bool is_object) {
+    if (batch_num_blocks == batch_capacity) {
+        batch_capacity = batch_capacity ? 2 * batch_capacity : 64;
+        batch_blocks = realloc(batch_blocks, batch_capacity * sizeof(batch_block_t));
+        if (!batch_blocks) {
+            fprintf(stderr, "\nABORT: batch_add_block: Could not allocate sufficient memory for `batch_blocks`.\n");
+            exit(-1);
+        }
+    }
+
+    // Keep the index at most half full
+    if (2 * (batch_num_blocks + 1) > batch_index_size) {
+        free(batch_index);
+        batch_index_size = batch_index_size ? 2 * batch_index_size : 128;
+        batch_index = calloc(batch_index_size, sizeof(size_t));
+        if (!batch_index) {
+            fprintf(stderr, "\nABORT: batch_add_block: Could not allocate sufficient memory for `batch_index`.\n");
+            exit(-1);
+        }
+        for (size_t i = 0; i < batch_num_blocks; i++) {
+            *batch_index_slot(batch_blocks[i].addr) = i + 1;
+        }
+    }
+
+    batch_block_t* block = batch_blocks + batch_num_blocks;
+    block->addr = addr;
+    block->is_object = is_object;
+    block->data = malloc(nx_block_size);
+    if (!block->data) {
+        fprintf(stderr, "\nABORT: batch_add_block: Could not allocate sufficient memory for a block.\n");
+        exit(-1);
+    }
+    *batch_index_slot(addr) = ++batch_num_blocks;
+    return block;
+}
+
+/**
+ * Stage a block for modification, reading its current contents if it isn't
+ * already staged. The caller modifies the block in place.
+ *
+ * is_object:   Whether the block is an object, whose checksum is to be
+ *      recomputed when the batch is committed.
+ *
+ * RETURN VALUE:    A pointer to the staged contents of the block, which
+ *      remains valid until the batch is committed or discarded, or NULL if it
+ *      could not be read.
+ */
+void* batch_get_block(paddr_t addr, bool is_object) {
+    batch_block_t* block = batch_find_block(addr);
+    if (block) {
+        block->is_object |= is_object;
+        return block->data;
+    }
+
+    block = batch_add_block(addr, is_object);
+    if (read_blocks(block->data, addr, 1) != 1) {
+        // This was the last block added, so no other block's probe sequence
+        // passes through its slot, which can simply be emptied.
+        free(block->data);
+        *batch_index_slot(addr) = 0;
+        batch_num_blocks--;
+        return NULL;
+    }
+    return block->data;
+}
+
+/**
+ * Stage a block to be overwritten with given contents, which are copied.
+ *
+ * is_object:   See `batch_get_block()`.
+ */
+void batch_put_block(void* buffer, paddr_t addr, bool is_object) {
+    batch_block_t* block = batch_find_block(addr);
+    if (!block) {
+        block = batch_add_block(addr, is_object);
+    }
+    block->is_object = is_object;
+    memcpy(block->data, buffer, nx_block_size);
+}
+
+/**
+ * Discard all staged blocks without writing them.
+ */
+void batch_discard() {
+    for (size_t i = 0; i < batch_num_blocks; i++) {
+        free(batch_blocks[i].data);
+    }
+    free(batch_blocks);
+    free(batch_index);
+    batch_blocks = NULL;
+    batch_num_blocks = 0;
+    batch_capacity = 0;
+    batch_index = NULL;
+    batch_index_size = 0;
+}
+
+int compare_batch_blocks(const void* a, const void* b) {
+    paddr_t addr_a = ((batch_block_t*)a)->addr;
+    paddr_t addr_b = ((batch_block_t*)b)->addr;
+    return addr_a < addr_b ? -1 : (addr_a > addr_b ? 1 : 0);
+}
+
+bool write_all(int fd, void* buffer, size_t num_bytes) {
+    size_t num_bytes_written = 0;
+    while (num_bytes_written < num_bytes) {
+        ssize_t ret = write(fd, (char*)buffer + num_bytes_written, num_bytes - num_bytes_written);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        num_bytes_written += ret;
+    }
+    return true;
+}
+
+/**
+ * Write a run of staged blocks with consecutive addresses, starting at a given
+ * index of `batch_blocks`, using as few calls to `pwritev()` as possible.
+ *
+ * RETURN VALUE:    The number of blocks written; fewer than `num_blocks` only
+ *      if an error occurred.
+ */
+size_t batch_write_run(size_t start, size_t num_blocks) {
+    int fd = fileno(nx);
+    struct iovec iov[IOV_MAX];
+    size_t num_written = 0;
+
+    while (num_written < num_blocks) {
+        size_t num_iov = num_blocks - num_written;
+        if (num_iov > IOV_MAX) {
+            num_iov = IOV_MAX;
+        }
+        for (size_t i = 0; i < num_iov; i++) {
+            iov[i].iov_base = batch_blocks[start + num_written + i].data;
+            iov[i].iov_len  = nx_block_size;
+        }
+
+        off_t offset = (off_t)batch_blocks[start + num_written].addr * nx_block_size;
+        ssize_t ret = pwritev(fd, iov, num_iov, offset);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return num_written;
+        }
+
+        // After a short write, write the rest of a partially written block
+        // separately, then carry on with the following blocks.
+        size_t num_whole = ret / nx_block_size;
+        size_t partial = ret % nx_block_size;
+        num_written += num_whole;
+        if (partial) {
+            batch_block_t* block = batch_blocks + start + num_written;
+            size_t done = partial;
+            while (done < nx_block_size) {
+                ret = pwrite(fd, block->data + done, nx_block_size - done, (off_t)block->addr * nx_block_size + done);
+                if (ret == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (ret <= 0) {
+                    return num_written;
+                }
+                done += ret;
+            }
+            num_written++;
+        }
+    }
+    return num_written;
+}
+
+/**
+ * Write all staged blocks to the container, and empty the batch.
+ *
+ * undo_path:   The path of the undo log to save the blocks' current contents
+ *      to; it must not already exist. If NULL, no undo log is saved.
+ *
+ * RETURN VALUE:    The number of blocks written; fewer than were staged only
+ *      if an error occurred, which is reported. In that case, the blocks that
+ *      were written can be restored from the undo log.
+ */
+size_t batch_commit(char* undo_path) {
+    size_t num_blocks = batch_num_blocks;
+    if (num_blocks == 0) {
+        return 0;
+    }
+    if (nx_is_overlay() || nx_is_packed()) {
+        printf("FAILED: batch_commit: Overlays and packed images can't be written to.\n");
+        batch_discard();
+        return 0;
+    }
+
+    // The index is invalidated by sorting; it isn't needed any more.
+    qsort(batch_blocks, num_blocks, sizeof(batch_block_t), compare_batch_blocks);
+    for (size_t i = 0; i < num_blocks; i++) {
+        if (is_tier2_addr(batch_blocks[i].addr)) {
+            printf("FAILED: batch_commit: Block %#llx is on the second tier of a Fusion container, which can't be written to.\n", batch_blocks[i].addr);
+            batch_discard();
+            return 0;
+        }
+        if (batch_blocks[i].is_object) {
+            *(uint64_t*)batch_blocks[i].data = compute_block_cksum(batch_blocks[i].data);
+        }
+    }
+
+    if (undo_path) {
+        int undo_fd = open(undo_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (undo_fd == -1) {
+            printf("FAILED: batch_commit: Could not create the undo log `%s`: %s.\n", undo_path, strerror(errno));
+            batch_discard();
+            return 0;
+        }
+
+        char* orig = malloc(nx_block_size);
+        if (!orig) {
+            fprintf(stderr, "\nABORT: batch_commit: Could not allocate sufficient memory for `orig`.\n");
+            exit(-1);
+        }
+
+        undo_log_header_t header = {
+            .magic      = UNDO_LOG_MAGIC,
+            .version    = UNDO_LOG_VERSION,
+            .block_size = nx_block_size,
+            .num_blocks = num_blocks,
+        };
+        bool ok = write_all(undo_fd, &header, sizeof(header));
+        for (size_t i = 0; ok && i < num_blocks; i++) {
+            batch_block_t* block = batch_blocks + i;
+            if (pread_blocks(orig, block->addr, 1) != 1) {
+                printf("FAILED: batch_commit: Could not read the current contents of block %#llx.\n", block->addr);
+                ok = false;
+                break;
+            }
+            undo_log_entry_t entry = {
+                .addr       = block->addr,
+                .orig_cksum = fletcher_cksum(orig, false),
+                .new_cksum  = fletcher_cksum(block->data, false),
+            };
+            ok = write_all(undo_fd, &entry, sizeof(entry)) && write_all(undo_fd, orig, nx_block_size);
+        }
+        free(orig);
+
+        if (!ok || fsync(undo_fd) != 0 || close(undo_fd) != 0) {
+            printf("FAILED: batch_commit: Could not save the undo log `%s`; nothing was written to the container.\n", undo_path);
+            unlink(undo_path);
+            batch_discard();
+            return 0;
+        }
+    }
+
+    size_t num_written = 0;
+    for (size_t start = 0; start < num_blocks; ) {
+        size_t run_len = 1;
+        while (start + run_len < num_blocks && batch_blocks[start + run_len].addr == batch_blocks[start].addr + (paddr_t)run_len) {
+            run_len++;
+        }
+
+        // Drop the whole run from the cache, even if only some of it was
+        // written, since part of a block may have been written.
+        size_t num_run_written = batch_write_run(start, run_len);
+        cache_invalidate(batch_blocks[start].addr, run_len);
+        num_written += num_run_written;
+        if (num_run_written != run_len) {
+            printf("FAILED: batch_commit: An error occurred whilst writing block %#llx: %s.\n", batch_blocks[start + num_run_written].addr, strerror(errno));
+            break;
+        }
+        start += run_len;
+    }
+
+    if (num_written == num_blocks && fsync(fileno(nx)) != 0 && errno != EINVAL) {
+        // `fsync()` fails with `EINVAL` on special files that can't be synced.
+        printf("FAILED: batch_commit: Could not flush the writes to `%s`: %s.\n", nx_path, strerror(errno));
+        num_written = 0;
+    }
+
+    batch_discard();
+    return num_written;
+}
+
+/**
+ * Restore the blocks saved in an undo log by `batch_commit()`. Any blocks that
+ * have been changed since the batch was committed are reported, but restored
+ * all the same.
+ *
+ * RETURN VALUE:    The number of blocks restored, or -1 if the undo log is
+ *      unreadable or doesn't match the container, in which case nothing is
+ *      written.
+ */
+ssize_t batch_rollback(char* undo_path) {
+    FILE* undo = fopen(undo_path, "rb");
+    if (!undo) {
+        printf("FAILED: batch_rollback: Could not open the undo log `%s`: %s.\n", undo_path, strerror(errno));
+        return -1;
+    }
+
+    undo_log_header_t header;
+    if (fread(&header, sizeof(header), 1, undo) != 1
+        || memcmp(header.magic, UNDO_LOG_MAGIC, sizeof(header.magic)) != 0
+        || header.version != UNDO_LOG_VERSION
+    ) {
+        printf("FAILED: batch_rollback: `%s` is not an undo log.\n", undo_path);
+        fclose(undo);
+        return -1;
+    }
+    if (header.block_size != nx_block_size) {
+        printf("FAILED: batch_rollback: The undo log `%s` is of %u-byte blocks, but the container has %zu-byte blocks.\n", undo_path, header.block_size, nx_block_size);
+        fclose(undo);
+        return -1;
+    }
+
+    char* orig = malloc(nx_block_size);
+    char* current = malloc(nx_block_size);
+    if (!orig || !current) {
+        fprintf(stderr, "\nABORT: batch_rollback: Could not allocate sufficient memory for the blocks.\n");
+        exit(-1);
+    }
+
+    batch_discard();
+    for (uint64_t i = 0; i < header.num_blocks; i++) {
+        undo_log_entry_t entry;
+        if (fread(&entry, sizeof(entry), 1, undo) != 1 || fread(orig, nx_block_size, 1, undo) != 1) {
+            printf("FAILED: batch_rollback: The undo log `%s` is truncated.\n", undo_path);
+            batch_discard();
+            free(current);
+            free(orig);
+            fclose(undo);
+            return -1;
+        }
+        if (fletcher_cksum(orig, false) != entry.orig_cksum) {
+            printf("FAILED: batch_rollback: The copy of block %#llx in the undo log `%s` is corrupt.\n", entry.addr, undo_path);
+            batch_discard();
+            free(current);
+            free(orig);
+            fclose(undo);
+            return -1;
+        }
+        if (pread_blocks(current, entry.addr, 1) != 1 || fletcher_cksum(current, false) != entry.new_cksum) {
+            printf("- Block %#llx has been changed since the batch was committed; restoring it anyway.\n", entry.addr);
+        }
+        batch_put_block(orig, entry.addr, false);
+    }
+    free(current);
+    free(orig);
+    fclose(undo);
+
+    size_t num_staged = batch_num_blocks;
+    size_t num_restored = batch_commit(NULL);
+    if (num_restored != num_staged) {
+        printf("FAILED: batch_rollback: Only %zu of %zu blocks were restored.\n", num_restored, num_staged);
+    }
+    return num_restored;
+}
+
+#endif // APFS_IO_BATCH_H
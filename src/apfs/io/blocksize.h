@@ -0,0 +1,134 @@
+/**
+ * Detection of the container's block size.
+ *
+ * APFS containers use blocks of 4 KiB by default, but any power of two from
+ * 4 KiB to 64 KiB is allowed, and the block size is recorded in the container
+ * superblock. The superblock in block 0 is read first; its `nx_block_size`
+ * field is used if the block's checksum is valid at that size. If block 0 is
+ * damaged, each allowed size is tried in turn, looking for a valid container
+ * superblock or checkpoint map at that size in the checkpoint descriptor area,
+ * which usually starts at block 1.
+ *
+ * This header is included by `io.h`, which it depends on; include that
+ * instead. Tools call `detect_block_size()` (see `io.h`) once the container is
+ * open, before allocating any block buffers.
+ */
+
+#ifndef APFS_IO_BLOCKSIZE_H
+#define APFS_IO_BLOCKSIZE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../struct/object.h"
+#include "../struct/nx.h"
+#include "../func/cksum.h"
+
+/** Configuration **/
+
+// Set by `--block-size`; if true, `nx_block_size` is used as given.
+bool    nx_block_size_forced = false;
+
+// Number of blocks after block 0 to look at when probing.
+#define BLOCK_SIZE_PROBE_BLOCKS     8
+
+/**
+ * Determine whether a value is an allowed APFS block size.
+ */
+bool is_valid_block_size(uint64_t size) {
+    return size >= NX_MINIMUM_BLOCK_SIZE
+        && size <= NX_MAXIMUM_BLOCK_SIZE
+        && (size & (size - 1)) == 0;
+}
+
+/**
+ * Determine whether a buffer of a given size holds a valid container
+ * superblock or checkpoint map of that size.
+ */
+bool is_valid_nx_object(void* block, size_t size) {
+    obj_phys_t* obj = block;
+    if (fletcher_cksum_sized(block, size, true) != *(uint64_t*)obj->o_cksum) {
+        return false;
+    }
+    uint32_t type = obj->o_type & OBJECT_TYPE_MASK;
+    if (type == OBJECT_TYPE_NX_SUPERBLOCK) {
+        nx_superblock_t* nxsb = block;
+        return nxsb->nx_magic == NX_MAGIC && nxsb->nx_block_size == size;
+    }
+    return type == OBJECT_TYPE_CHECKPOINT_MAP;
+}
+
+/**
+ * Read a given number of bytes at a given offset, retrying interrupted reads.
+ *
+ * RETURN VALUE:    `true` if all of the bytes were read, else `false`.
+ */
+bool probe_pread(int fd, void* buffer, size_t num_bytes, off_t offset) {
+    size_t num_bytes_read = 0;
+    while (num_bytes_read < num_bytes) {
+        ssize_t ret = pread(fd, (char*)buffer + num_bytes_read, num_bytes - num_bytes_read, offset + num_bytes_read);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        num_bytes_read += ret;
+    }
+    return true;
+}
+
+/**
+ * Determine the block size of the container on a given device or image file.
+ *
+ * probed:  Set to true if block 0 was not a valid container superblock, and
+ *          the block size had to be found by probing.
+ *
+ * RETURN VALUE:    The block size in bytes, or 0 if it could not be found.
+ */
+size_t probe_block_size_fd(int fd, bool* probed) {
+    char* block = malloc(NX_MAXIMUM_BLOCK_SIZE);
+    if (!block) {
+        fprintf(stderr, "\nABORT: probe_block_size_fd: Could not allocate sufficient memory for `block`.\n");
+        exit(-1);
+    }
+    nx_superblock_t* nxsb = (nx_superblock_t*)block;
+    *probed = false;
+
+    // The `nx_block_size` field lies within the first 4 KiB, whatever the
+    // block size.
+    size_t size = 0;
+    if (probe_pread(fd, block, NX_MINIMUM_BLOCK_SIZE, 0)
+        && nxsb->nx_magic == NX_MAGIC
+        && is_valid_block_size(nxsb->nx_block_size)
+    ) {
+        size = nxsb->nx_block_size;
+        if (probe_pread(fd, block, size, 0) && is_valid_nx_object(block, size)) {
+            free(block);
+            return size;
+        }
+    }
+
+    *probed = true;
+    for (size_t candidate = NX_MINIMUM_BLOCK_SIZE; candidate <= NX_MAXIMUM_BLOCK_SIZE; candidate *= 2) {
+        for (off_t i = 1; i <= BLOCK_SIZE_PROBE_BLOCKS; i++) {
+            if (!probe_pread(fd, block, candidate, i * candidate)) {
+                break;
+            }
+            if (is_valid_nx_object(block, candidate)) {
+                free(block);
+                return candidate;
+            }
+        }
+    }
+
+    // Fall back to the size that block 0 claims, if any, even though the
+    // block's checksum is wrong.
+    free(block);
+    return size;
+}
+
+#endif // APFS_IO_BLOCKSIZE_H
@@ -0,0 +1,556 @@
+/**
+ * A block cache for the reads made whilst walking B-trees, with an adaptive
+ * readahead policy.
+ *
+ * Every hop in a tree walk (`get_btree_phys_omap_val()`, `get_fs_records()`)
+ * reads a single node, but APFS tends to allocate sibling nodes of the same
+ * tree close together on disk, and devices with a high per-request cost
+ * (spinning disks, network block devices) reward reading a larger range in one
+ * go. On a cache miss, the prefetcher therefore looks at where recent misses
+ * occurred: if the missed block lies close to one of them, the surrounding
+ * range is read into the cache along with it, and the range grows on each
+ * further clustered miss. The prefetcher keeps track of how many speculatively
+ * read blocks are subsequently used, and shrinks the range and backs off for a
+ * while if too few of them are. Where a walk knows which nodes it will visit
+ * next, such as the children of a node that `get_fs_records()` walks along, it
+ * reads them into the cache all at once with `cache_prefetch()` instead.
+ *
+ * Blocks can be cached in transformed form, e.g. decrypted. Blocks are read
+ * into the cache as they are on disk, and a reader asking for a transform
+ * applies it to the cached copy the first time the block is requested, so that
+ * a block is only transformed once however often it is read, and blocks read
+ * speculatively are not transformed unless they are used.
+ *
+ * The cache is not thread-safe; it is only meant to be used from the main
+ * thread. Bulk data reads should use `scan.h` instead, so as not to flush the
+ * cache.
+ */
+
+#ifndef APFS_IO_CACHE_H
+#define APFS_IO_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "../io.h"
+#include "async.h"
+
+/** Configuration; these should be set before the first call to `read_blocks_cached()` **/
+
+// Capacity of the cache, in blocks; 0 disables the cache (and readahead).
+uint32_t    cache_num_blocks = 8192;
+
+// Maximum number of blocks to read speculatively on a miss; 0 disables readahead.
+uint32_t    readahead_max_blocks = 256;
+
+// Size of the readahead range when a clustered miss is first seen.
+uint32_t    readahead_min_blocks = 8;
+
+// Two misses are considered clustered if they are at most this many blocks
+// apart (or the current readahead range, if that is larger).
+uint32_t    readahead_cluster_distance = 64;
+
+/** Statistics **/
+
+uint64_t    cache_num_hits = 0;
+uint64_t    cache_num_misses = 0;
+uint64_t    readahead_num_issued = 0;   // Blocks read speculatively
+uint64_t    readahead_num_used = 0;     // Blocks read speculatively that were later requested
+
+/** Cache state **/
+
+#define CACHE_NONE  UINT32_MAX
+
+/**
+ * A transform applied in place to a block at a given address after it is read,
+ * such as decryption.
+ */
+typedef void (*cache_transform_t)(void* block, paddr_t addr);
+
+typedef struct {
+    paddr_t     addr;
+    cache_transform_t   transform;  // The transform applied to the cached data, if any
+    uint32_t    next;           // Next entry in the same hash bucket
+    uint32_t    batch_seq;      // Sequence number of the readahead batch, if `prefetched`
+    bool        valid;
+    bool        referenced;     // Used by the clock eviction policy
+    bool        prefetched;     // Read speculatively and not yet requested
+} cache_entry_t;
+
+bool            cache_initialised = false;
+cache_entry_t*  cache_entries = NULL;
+char*           cache_data = NULL;
+uint32_t*       cache_buckets = NULL;
+uint32_t        cache_bucket_mask = 0;
+uint32_t        cache_clock_hand = 0;
+
+/** Readahead state **/
+
+#define READAHEAD_HISTORY_LEN   16
+#define READAHEAD_BATCHES_LEN   16
+
+paddr_t     readahead_history[READAHEAD_HISTORY_LEN];
+uint32_t    readahead_history_len = 0;
+uint32_t    readahead_history_index = 0;
+
+// Current readahead range, in blocks; 0 means only the requested blocks are read.
+uint32_t    readahead_blocks = 0;
+
+// Number of misses for which the range must not grow, after backing off.
+uint32_t    readahead_backoff = 0;
+
+// The most recent readahead batches, used to measure how many of the blocks
+// they read were later used. A batch is judged when its slot is reused.
+typedef struct {
+    uint32_t    seq;
+    uint32_t    num_issued;
+    uint32_t    num_used;
+} readahead_batch_t;
+
+readahead_batch_t   readahead_batches[READAHEAD_BATCHES_LEN];
+uint32_t            readahead_batch_seq = 0;
+uint64_t            readahead_window_issued = 0;
+uint64_t            readahead_window_used = 0;
+
+char*       readahead_buffer = NULL;
+size_t      readahead_buffer_blocks = 0;
+
+/**
+ * Allocate the cache. If this fails, the cache is disabled.
+ */
+void cache_init() {
+    cache_initialised = true;
+    if (cache_num_blocks == 0) {
+        return;
+    }
+
+    uint32_t num_buckets = 1;
+    while (num_buckets < cache_num_blocks) {
+        num_buckets <<= 1;
+    }
+
+    cache_entries   = calloc(cache_num_blocks, sizeof(cache_entry_t));
+    cache_data      = malloc((size_t)cache_num_blocks * nx_block_size);
+    cache_buckets   = malloc(num_buckets * sizeof(uint32_t));
+    if (!cache_entries || !cache_data || !cache_buckets) {
+        fprintf(stderr, "cache_init: Could not allocate %u blocks for the block cache; continuing without it.\n", cache_num_blocks);
+        free(cache_entries);
+        free(cache_data);
+        free(cache_buckets);
+        cache_entries = NULL;
+        cache_data = NULL;
+        cache_buckets = NULL;
+        cache_num_blocks = 0;
+        return;
+    }
+
+    memset(cache_buckets, 0xff, num_buckets * sizeof(uint32_t));   // All `CACHE_NONE`
+    cache_bucket_mask = num_buckets - 1;
+    cache_clock_hand = 0;
+}
+
+uint32_t cache_bucket(paddr_t addr) {
+    return (uint32_t)(((uint64_t)addr * 0x9e3779b97f4a7c15ULL) >> 32) & cache_bucket_mask;
+}
+
+/**
+ * Find the cache entry for a given block.
+ *
+ * RETURN VALUE:    The index of the entry, or `CACHE_NONE` if the block is not
+ *      cached.
+ */
+uint32_t cache_lookup(paddr_t addr) {
+    for (uint32_t i = cache_buckets[cache_bucket(addr)]; i != CACHE_NONE; i = cache_entries[i].next) {
+        if (cache_entries[i].addr == addr) {
+            return i;
+        }
+    }
+    return CACHE_NONE;
+}
+
+/**
+ * Remove an entry from its hash bucket and mark it as free.
+ */
+void cache_remove(uint32_t index) {
+    cache_entry_t* entry = cache_entries + index;
+    uint32_t* link = cache_buckets + cache_bucket(entry->addr);
+    while (*link != index) {
+        link = &cache_entries[*link].next;
+    }
+    *link = entry->next;
+    entry->valid = false;
+}
+
+/**
+ * Choose an entry to hold a new block, evicting a block if necessary, using
+ * the clock (second chance) policy.
+ */
+uint32_t cache_evict() {
+    while (true) {
+        uint32_t index = cache_clock_hand;
+        cache_entry_t* entry = cache_entries + index;
+        cache_clock_hand = (cache_clock_hand + 1) % cache_num_blocks;
+
+        if (!entry->valid) {
+            return index;
+        }
+        if (entry->referenced) {
+            entry->referenced = false;
+            continue;
+        }
+        cache_remove(index);
+        return index;
+    }
+}
+
+/**
+ * Insert a block into the cache, unless it is already present. Blocks that
+ * are `prefetched` are counted towards the current readahead batch.
+ */
+void cache_insert(paddr_t addr, char* data, bool prefetched) {
+    if (cache_lookup(addr) != CACHE_NONE) {
+        return;
+    }
+    if (prefetched) {
+        readahead_batches[readahead_batch_seq % READAHEAD_BATCHES_LEN].num_issued++;
+        readahead_num_issued++;
+    }
+
+    uint32_t index = cache_evict();
+    cache_entry_t* entry = cache_entries + index;
+    entry->addr         = addr;
+    entry->transform    = NULL;
+    entry->valid        = true;
+    entry->referenced   = !prefetched;
+    entry->prefetched   = prefetched;
+    entry->batch_seq    = readahead_batch_seq;
+
+    uint32_t bucket = cache_bucket(addr);
+    entry->next = cache_buckets[bucket];
+    cache_buckets[bucket] = index;
+
+    memcpy(cache_data + (size_t)index * nx_block_size, data, nx_block_size);
+}
+
+/**
+ * Drop any cached copies of a range of blocks, e.g. after they are written to.
+ */
+void cache_invalidate(paddr_t start_block, size_t num_blocks) {
+    if (!cache_entries) {
+        return;
+    }
+    for (size_t i = 0; i < num_blocks; i++) {
+        uint32_t index = cache_lookup(start_block + i);
+        if (index != CACHE_NONE) {
+            cache_remove(index);
+        }
+    }
+}
+
+/**
+ * Drop every cached block and forget the readahead history, e.g. when `nx` is
+ * replaced by a different container.
+ */
+void cache_clear() {
+    if (!cache_entries) {
+        return;
+    }
+    memset(cache_entries, 0, cache_num_blocks * sizeof(cache_entry_t));
+    memset(cache_buckets, 0xff, (cache_bucket_mask + 1) * sizeof(uint32_t));   // All `CACHE_NONE`
+    cache_clock_hand = 0;
+    readahead_history_len = 0;
+    readahead_history_index = 0;
+    readahead_blocks = 0;
+    readahead_backoff = 0;
+}
+
+/**
+ * Record that a block that was read speculatively has been requested.
+ */
+void readahead_note_used(cache_entry_t* entry) {
+    entry->prefetched = false;
+    readahead_num_used++;
+
+    readahead_batch_t* batch = readahead_batches + (entry->batch_seq % READAHEAD_BATCHES_LEN);
+    if (batch->seq == entry->batch_seq) {
+        batch->num_used++;
+    }
+}
+
+/**
+ * Start a new readahead batch, first judging the batch whose slot it reuses.
+ * If too few of the blocks read speculatively across recent batches have been
+ * used, shrink the readahead range and stop it growing for a while.
+ */
+void readahead_begin_batch() {
+    readahead_batch_seq++;
+    readahead_batch_t* batch = readahead_batches + (readahead_batch_seq % READAHEAD_BATCHES_LEN);
+
+    if (batch->num_issued > 0) {
+        readahead_window_issued += batch->num_issued;
+        readahead_window_used   += batch->num_used;
+
+        if (readahead_window_issued >= 4 * readahead_max_blocks) {
+            if (4 * readahead_window_used < readahead_window_issued) {
+                // Fewer than a quarter of speculatively read blocks were used.
+                readahead_blocks /= 4;
+                readahead_backoff = 2 * READAHEAD_HISTORY_LEN;
+            }
+            readahead_window_issued = 0;
+            readahead_window_used   = 0;
+        }
+    }
+
+    batch->seq          = readahead_batch_seq;
+    batch->num_issued   = 0;
+    batch->num_used     = 0;
+}
+
+/**
+ * Update the readahead range in response to a miss at a given block.
+ */
+void readahead_on_miss(paddr_t addr) {
+    uint64_t distance_limit = readahead_cluster_distance > readahead_blocks
+        ? readahead_cluster_distance
+        : readahead_blocks;
+
+    bool clustered = false;
+    for (uint32_t i = 0; i < readahead_history_len; i++) {
+        paddr_t other = readahead_history[i];
+        uint64_t distance = other > addr ? other - addr : addr - other;
+        if (distance <= distance_limit) {
+            clustered = true;
+            break;
+        }
+    }
+
+    readahead_history[readahead_history_index] = addr;
+    readahead_history_index = (readahead_history_index + 1) % READAHEAD_HISTORY_LEN;
+    if (readahead_history_len < READAHEAD_HISTORY_LEN) {
+        readahead_history_len++;
+    }
+
+    if (readahead_backoff > 0) {
+        readahead_backoff--;
+        return;
+    }
+
+    if (clustered) {
+        readahead_blocks = readahead_blocks == 0 ? readahead_min_blocks : 2 * readahead_blocks;
+        if (readahead_blocks > readahead_max_blocks) {
+            readahead_blocks = readahead_max_blocks;
+        }
+    } else {
+        readahead_blocks /= 2;
+    }
+}
+
+/**
+ * Handle a cache miss at block `addr`, where the caller needs `num_needed`
+ * consecutive blocks starting there, by reading those blocks into the cache,
+ * along with any surrounding blocks that the prefetcher decides to read.
+ *
+ * RETURN VALUE:    `true` if at least the block at `addr` is now cached, else
+ *      `false`, in which case an error has been reported.
+ */
+bool cache_fill(paddr_t addr, size_t num_needed) {
+    cache_num_misses++;
+    STATS_ADD(cache_misses, 1);
+    if (readahead_max_blocks > 0) {
+        readahead_on_miss(addr);
+    }
+
+    // Read a range of `readahead_blocks` blocks containing the needed ones;
+    // walks more often move forwards on disk than backwards, so start only a
+    // quarter of the range before `addr`.
+    size_t num_before = readahead_blocks / 4;
+    if ((size_t)addr < num_before) {
+        num_before = addr;
+    }
+    paddr_t first = addr - num_before;
+    size_t count = num_before + num_needed;
+    if (count < readahead_blocks) {
+        count = readahead_blocks;
+    }
+    if (count > cache_num_blocks / 2) {
+        // Don't let one read flush most of the cache.
+        num_before = 0;
+        first = addr;
+        count = num_needed;
+    }
+
+    if (count > readahead_buffer_blocks) {
+        char* new_buffer = realloc(readahead_buffer, count * nx_block_size);
+        if (!new_buffer) {
+            fprintf(stderr, "\nABORT: cache_fill: Could not allocate sufficient memory for `readahead_buffer`.\n");
+            exit(-1);
+        }
+        readahead_buffer = new_buffer;
+        readahead_buffer_blocks = count;
+    }
+
+    ssize_t num_read = pread_blocks(readahead_buffer, first, count);
+    if (num_read < (ssize_t)(num_before + 1)) {
+        // The speculative read failed or fell short; retry just the block
+        // we need, so that any error is reported in the usual way.
+        if (read_blocks(readahead_buffer, addr, 1) != 1) {
+            return false;
+        }
+        cache_insert(addr, readahead_buffer, false);
+        return true;
+    }
+
+    if ((size_t)num_read > num_needed) {
+        readahead_begin_batch();
+    }
+
+    for (size_t i = 0; i < (size_t)num_read; i++) {
+        bool needed = i >= num_before && i < num_before + num_needed;
+        cache_insert(first + i, readahead_buffer + i * nx_block_size, !needed);
+    }
+    return true;
+}
+
+/**
+ * Order block addresses numerically.
+ */
+int compare_paddrs(const void* a, const void* b) {
+    paddr_t addr_a = *(paddr_t*)a;
+    paddr_t addr_b = *(paddr_t*)b;
+    return addr_a < addr_b ? -1 : (addr_a > addr_b ? 1 : 0);
+}
+
+/**
+ * Read a set of blocks that are about to be needed, such as the children of a
+ * B-tree node that a walk will visit in turn, into the cache all at once,
+ * keeping several reads in flight with the asynchronous I/O engine. Blocks that
+ * are cached already are skipped, runs of consecutive blocks are read in one
+ * request, and blocks that can't be read are left for `read_blocks_cached()`
+ * to report when they are needed.
+ *
+ * addrs:   The addresses of the blocks, in any order; they are sorted in place.
+ */
+void cache_prefetch(paddr_t* addrs, size_t num_addrs) {
+    if (!cache_initialised) {
+        cache_init();
+    }
+    if (!cache_entries || num_addrs < 2 || num_addrs > cache_num_blocks / 2) {
+        return;
+    }
+    qsort(addrs, num_addrs, sizeof(paddr_t), compare_paddrs);
+
+    aio_req_t* reqs = calloc(num_addrs, sizeof(aio_req_t));
+    char* buffers = malloc(num_addrs * nx_block_size);
+    if (!reqs || !buffers) {
+        fprintf(stderr, "\nABORT: cache_prefetch: Could not allocate sufficient memory for %lu blocks.\n", num_addrs);
+        exit(-1);
+    }
+
+    size_t num_reqs = 0;
+    size_t num_blocks = 0;
+    for (size_t i = 0; i < num_addrs; i++) {
+        if (addrs[i] < 0 || cache_lookup(addrs[i]) != CACHE_NONE || (i > 0 && addrs[i] == addrs[i - 1])) {
+            continue;
+        }
+        aio_req_t* last = num_reqs > 0 ? reqs + num_reqs - 1 : NULL;
+        if (last && addrs[i] == last->start_block + (paddr_t)last->num_blocks) {
+            last->num_blocks++;
+        } else {
+            reqs[num_reqs].buffer       = buffers + num_blocks * nx_block_size;
+            reqs[num_reqs].start_block  = addrs[i];
+            reqs[num_reqs].num_blocks   = 1;
+            num_reqs++;
+        }
+        num_blocks++;
+    }
+    if (num_blocks > 1) {
+        aio_read_batch(reqs, num_reqs);
+        for (size_t i = 0; i < num_reqs; i++) {
+            for (ssize_t j = 0; j < reqs[i].result; j++) {
+                cache_insert(reqs[i].start_block + j, (char*)reqs[i].buffer + j * nx_block_size, false);
+            }
+        }
+    }
+
+    free(reqs);
+    free(buffers);
+}
+
+/**
+ * Read given number of blocks from the APFS container without using the cache,
+ * applying a given transform (if any) to each block that is read.
+ */
+size_t read_blocks_transformed(void* buffer, paddr_t start_block, size_t num_blocks, cache_transform_t transform) {
+    size_t num_read = read_blocks(buffer, start_block, num_blocks);
+    if (transform) {
+        for (size_t i = 0; i < num_read; i++) {
+            transform((char*)buffer + i * nx_block_size, start_block + i);
+        }
+    }
+    return num_read;
+}
+
+/**
+ * Read given number of blocks from the APFS container, via the block cache,
+ * applying a given transform to each block. The arguments and return value
+ * are otherwise the same as for `read_blocks()`.
+ *
+ * transform:   The transform to apply, or NULL to read the blocks as they are
+ *              on disk.
+ */
+size_t read_blocks_cached_transformed(void* buffer, paddr_t start_block, size_t num_blocks, cache_transform_t transform) {
+    if (!cache_initialised) {
+        cache_init();
+    }
+    if (!cache_entries || start_block < 0 || num_blocks > cache_num_blocks / 2) {
+        return read_blocks_transformed(buffer, start_block, num_blocks, transform);
+    }
+
+    for (size_t i = 0; i < num_blocks; i++) {
+        paddr_t addr = start_block + i;
+        uint32_t index = cache_lookup(addr);
+        if (index != CACHE_NONE && cache_entries[index].transform && cache_entries[index].transform != transform) {
+            // Cached with a different transform; read it afresh.
+            cache_remove(index);
+            index = CACHE_NONE;
+        }
+        if (index == CACHE_NONE) {
+            if (!cache_fill(addr, num_blocks - i)) {
+                return i;
+            }
+            index = cache_lookup(addr);
+            if (index == CACHE_NONE) {
+                // Only possible if the cache is tiny; bypass it.
+                return i + read_blocks_transformed((char*)buffer + i * nx_block_size, addr, num_blocks - i, transform);
+            }
+        } else {
+            cache_num_hits++;
+            STATS_ADD(cache_hits, 1);
+        }
+
+        cache_entry_t* entry = cache_entries + index;
+        entry->referenced = true;
+        if (entry->prefetched) {
+            readahead_note_used(entry);
+        }
+        char* data = cache_data + (size_t)index * nx_block_size;
+        if (entry->transform != transform) {
+            transform(data, addr);
+            entry->transform = transform;
+        }
+        memcpy((char*)buffer + i * nx_block_size, data, nx_block_size);
+    }
+    return num_blocks;
+}
+
+/**
+ * Read given number of blocks from the APFS container, via the block cache.
+ * The arguments and return value are the same as for `read_blocks()`.
+ */
+size_t read_blocks_cached(void* buffer, paddr_t start_block, size_t num_blocks) {
+    return read_blocks_cached_transformed(buffer, start_block, num_blocks, NULL);
+}
+
+#endif // APFS_IO_CACHE_H
@@ -0,0 +1,245 @@
+/**
+ * Direct (uncached) I/O for large sequential scans of the APFS container.
+ *
+ * A full pass over a multi-terabyte device with ordinary buffered reads fills
+ * the host's page cache with blocks that will never be read again, evicting
+ * everything else that is cached. When `io_direct` is set (`--direct`), the
+ * scanner in `scan.h` instead reads through a second file descriptor that
+ * bypasses the page cache, into buffers aligned to the device's sector size:
+ *
+ * - On Linux, the descriptor is opened with `O_DIRECT`.
+ * - On macOS, caching is disabled on the descriptor with `F_NOCACHE`.
+ * - Where neither is available (or the file system refuses `O_DIRECT`, as
+ *   tmpfs does), ordinary reads are used, and each chunk is dropped from the
+ *   page cache with `posix_fadvise(POSIX_FADV_DONTNEED)` once it is consumed.
+ *
+ * All other reads, in particular those made whilst walking B-trees, continue
+ * to go through `nx` and so remain buffered.
+ */
+
+#ifndef APFS_IO_DIRECT_H
+#define APFS_IO_DIRECT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#if defined(__APPLE__)
+#include <sys/disk.h>       // for `DKIOCGETBLOCKSIZE`, `DKIOCGETPHYSICALBLOCKSIZE`
+#elif defined(__linux__)
+#include <linux/fs.h>       // for `BLKSSZGET`, `BLKPBSZGET`
+#endif
+
+#include "../io.h"
+
+/** Configuration **/
+
+// Set to `true` (`--direct`) to make scans bypass the page cache.
+bool    io_direct = false;
+
+/** State **/
+
+typedef enum {
+    DIRECT_MODE_NONE = 0,   // Not opened yet, or not possible
+    DIRECT_MODE_O_DIRECT,
+    DIRECT_MODE_NOCACHE,
+    DIRECT_MODE_DONTNEED,
+} direct_mode_t;
+
+direct_mode_t   direct_mode = DIRECT_MODE_NONE;
+int             nx_direct_fd = -1;
+
+// Logical and physical sector sizes of the device, in bytes, or 0 if unknown
+size_t  direct_logical_sector_size = 0;
+size_t  direct_physical_sector_size = 0;
+
+// Alignment used for buffers, offsets, and lengths of direct reads
+size_t  direct_alignment = 4096;
+
+/**
+ * Get a human-readable description of a direct I/O mode.
+ */
+char* direct_mode_to_string(direct_mode_t mode) {
+    switch (mode) {
+        case DIRECT_MODE_O_DIRECT:
+            return "O_DIRECT";
+        case DIRECT_MODE_NOCACHE:
+            return "F_NOCACHE";
+        case DIRECT_MODE_DONTNEED:
+            return "buffered reads with POSIX_FADV_DONTNEED";
+        default:
+            return "buffered reads";
+    }
+}
+
+/**
+ * Determine the logical and physical sector sizes of the device that a given
+ * file descriptor refers to, storing them in `direct_logical_sector_size` and
+ * `direct_physical_sector_size`. Either is left as 0 if it cannot be
+ * determined, e.g. because `fd` refers to a regular file (an image).
+ */
+void get_sector_sizes(int fd) {
+    direct_logical_sector_size = 0;
+    direct_physical_sector_size = 0;
+
+#if defined(DKIOCGETBLOCKSIZE)
+    uint32_t logical_size;
+    if (ioctl(fd, DKIOCGETBLOCKSIZE, &logical_size) == 0) {
+        direct_logical_sector_size = logical_size;
+    }
+#elif defined(BLKSSZGET)
+    int logical_size;
+    if (ioctl(fd, BLKSSZGET, &logical_size) == 0 && logical_size > 0) {
+        direct_logical_sector_size = logical_size;
+    }
+#endif
+
+#if defined(DKIOCGETPHYSICALBLOCKSIZE)
+    uint32_t physical_size;
+    if (ioctl(fd, DKIOCGETPHYSICALBLOCKSIZE, &physical_size) == 0) {
+        direct_physical_sector_size = physical_size;
+    }
+#elif defined(BLKPBSZGET)
+    unsigned int physical_size;
+    if (ioctl(fd, BLKPBSZGET, &physical_size) == 0 && physical_size > 0) {
+        direct_physical_sector_size = physical_size;
+    }
+#endif
+}
+
+/**
+ * Open `nx_path` a second time for direct reads, if `io_direct` is set and
+ * this has not been done already. Information about the mode that is used is
+ * printed to stderr, since stdout may be carrying recovered file data.
+ *
+ * RETURN VALUE:    `true` if scans should read through `nx_direct_fd`, else
+ *      `false`, in which case they should read through `nx` as usual.
+ */
+bool direct_open() {
+    if (!io_direct) {
+        return false;
+    }
+    if (nx_direct_fd != -1) {
+        return true;
+    }
+
+    get_sector_sizes(fileno(nx));
+
+    // Buffers must be aligned to the logical sector size for `O_DIRECT`; we
+    // use at least the page size, which also suits `F_NOCACHE` and io_uring.
+    long page_size = sysconf(_SC_PAGESIZE);
+    direct_alignment = page_size > 0 ? (size_t)page_size : 4096;
+    if (direct_logical_sector_size > direct_alignment) {
+        direct_alignment = direct_logical_sector_size;
+    }
+    if (direct_physical_sector_size > direct_alignment) {
+        direct_alignment = direct_physical_sector_size;
+    }
+
+    // Every read starts on a block boundary and spans whole blocks, so this
+    // is the only condition that offsets and lengths need to satisfy.
+    bool aligned = nx_block_size % (direct_logical_sector_size ? direct_logical_sector_size : 512) == 0;
+
+#if defined(O_DIRECT)
+    if (aligned) {
+        nx_direct_fd = open(nx_path, O_RDONLY | O_DIRECT);
+        if (nx_direct_fd != -1) {
+            direct_mode = DIRECT_MODE_O_DIRECT;
+        }
+    }
+#elif defined(F_NOCACHE)
+    if (aligned) {
+        nx_direct_fd = open(nx_path, O_RDONLY);
+        if (nx_direct_fd != -1) {
+            if (fcntl(nx_direct_fd, F_NOCACHE, 1) == 0) {
+                direct_mode = DIRECT_MODE_NOCACHE;
+            } else {
+                close(nx_direct_fd);
+                nx_direct_fd = -1;
+            }
+        }
+    }
+#endif
+
+    if (nx_direct_fd == -1) {
+        // Fall back to buffered reads that are evicted as we go.
+        nx_direct_fd = open(nx_path, O_RDONLY);
+        if (nx_direct_fd == -1) {
+            fprintf(stderr, "Could not open `%s` for direct I/O; using buffered reads.\n", nx_path);
+            io_direct = false;
+            direct_mode = DIRECT_MODE_NONE;
+            return false;
+        }
+#if defined(POSIX_FADV_DONTNEED)
+        direct_mode = DIRECT_MODE_DONTNEED;
+#else
+        direct_mode = DIRECT_MODE_NONE;
+#endif
+    }
+
+    fprintf(stderr, "Direct I/O for scans: %s", direct_mode_to_string(direct_mode));
+    if (direct_logical_sector_size) {
+        fprintf(stderr, "; sector size %lu bytes logical, %lu bytes physical",
+            direct_logical_sector_size,
+            direct_physical_sector_size ? direct_physical_sector_size : direct_logical_sector_size
+        );
+    }
+    fprintf(stderr, "; buffers aligned to %lu bytes.\n", direct_alignment);
+    return true;
+}
+
+/**
+ * Close the descriptor opened by `direct_open()`, if any.
+ */
+void direct_close() {
+    if (nx_direct_fd != -1) {
+        close(nx_direct_fd);
+        nx_direct_fd = -1;
+    }
+    direct_mode = DIRECT_MODE_NONE;
+}
+
+/**
+ * Allocate memory suitable for direct reads. It must be released with `free()`.
+ *
+ * RETURN VALUE:    A pointer to the memory, or NULL on failure.
+ */
+void* direct_alloc(size_t size) {
+    void* buffer = NULL;
+    if (posix_memalign(&buffer, direct_alignment, size) != 0) {
+        return NULL;
+    }
+    return buffer;
+}
+
+/**
+ * Read given number of blocks through the direct descriptor; otherwise
+ * identical to `pread_blocks()`.
+ */
+ssize_t pread_blocks_direct(void* buffer, paddr_t start_block, size_t num_blocks) {
+    return pread_blocks_fd(nx_direct_fd, buffer, start_block, num_blocks);
+}
+
+/**
+ * Tell the kernel that a range of blocks that was just read through the direct
+ * descriptor will not be needed again. This only has an effect when the
+ * kernel's cache could not be bypassed in the first place.
+ */
+void direct_release(paddr_t start_block, size_t num_blocks) {
+#if defined(POSIX_FADV_DONTNEED)
+    if (direct_mode == DIRECT_MODE_DONTNEED) {
+        posix_fadvise(
+            nx_direct_fd,
+            (off_t)start_block * nx_block_size,
+            (off_t)num_blocks * nx_block_size,
+            POSIX_FADV_DONTNEED
+        );
+    }
+#endif
+}
+
+#endif // APFS_IO_DIRECT_H
@@ -0,0 +1,390 @@
+/**
+ * Discovery of the container superblock, for containers whose block 0 cannot
+ * be trusted.
+ *
+ * Each tool mounts the container by reading the superblock in block 0 and
+ * following its `nx_xp_desc_base` to the checkpoint descriptor area, where it
+ * picks the latest valid superblock. If block 0 is damaged, that leads
+ * nowhere. With `--find-superblock`, `detect_block_size()` instead scans the
+ * device for container superblocks, validates their checksums, and ranks them
+ * by how consistent they are, and then by XID. From then on, reads of block 0
+ * via `pread_blocks_fd()` return the best candidate, and any newer superblocks
+ * in its checkpoint descriptor area are read as zeroes, so every tool mounts
+ * from that candidate without any changes of its own. This includes reads via
+ * the asynchronous I/O engine, unless the request is marked `unmasked`; the
+ * tools that copy the device, `apfs-image` and `apfs-pack`, read the blocks
+ * that they copy that way, so that the copy holds what the device does.
+ *
+ * The device is read in large chunks (see `scan.h`), and only the 4-byte magic
+ * number of each 4 KiB block is looked at; every block boundary is also a
+ * 4 KiB boundary, so superblocks of any block size are found, and the
+ * checksum is only computed for blocks whose magic number matches.
+ *
+ * This header is included at the end of `io.h`, which it depends on; include
+ * that instead.
+ */
+
+#ifndef APFS_IO_DISCOVER_H
+#define APFS_IO_DISCOVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include "../io.h"
+#include "../struct/object.h"
+#include "../struct/nx.h"
+#include "../struct/omap.h"
+#include "../func/cksum.h"
+#include "../string/progress.h"
+#include "blocksize.h"
+#include "scan.h"
+
+/** Configuration **/
+
+// Set by `--find-superblock=MIB`; the number of mebibytes at the start of the
+// device to scan, or 0 to scan the whole device.
+uint64_t    discover_limit_mib = 0;
+
+// The number of top-ranked candidates to report.
+#define DISCOVER_REPORT_CANDIDATES  8
+
+// The number of consistency checks that a candidate can pass; see
+// `score_nx_candidate()`.
+#define DISCOVER_NUM_CHECKS         7
+
+typedef struct {
+    paddr_t     addr;           // In units of the candidate's own block size
+    size_t      block_size;
+    xid_t       xid;
+    uint32_t    score;          // The number of consistency checks passed
+    char*       block;
+} nx_candidate_t;
+
+/** State **/
+
+// Addresses of superblocks that are newer than the chosen one and lie in its
+// checkpoint descriptor area; reads of these blocks return zeroes.
+paddr_t*    discover_masked_addrs = NULL;
+size_t      discover_num_masked = 0;
+
+/**
+ * Zero any masked superblocks within a range of blocks that has just been
+ * read; `pread_blocks_fd()` calls this once a superblock has been chosen.
+ */
+void discover_mask_blocks(char* buffer, paddr_t start_block, size_t num_blocks) {
+    for (size_t i = 0; i < discover_num_masked; i++) {
+        paddr_t addr = discover_masked_addrs[i];
+        if (addr >= start_block && addr < start_block + (paddr_t)num_blocks) {
+            memset(buffer + (addr - start_block) * nx_block_size, 0, nx_block_size);
+        }
+    }
+}
+
+/**
+ * Read and validate one object of a given block size. `nx_block_size` is set
+ * to that size for the duration of the read.
+ *
+ * RETURN VALUE:    `true` if the object was read and its checksum is valid.
+ */
+bool discover_read_object(char* buffer, paddr_t addr, size_t block_size) {
+    size_t saved_block_size = nx_block_size;
+    nx_block_size = block_size;
+    bool ok = pread_blocks(buffer, addr, 1) == 1
+        && fletcher_cksum_sized(buffer, block_size, true) == *(uint64_t*)((obj_phys_t*)buffer)->o_cksum;
+    nx_block_size = saved_block_size;
+    return ok;
+}
+
+/**
+ * Count the consistency checks that a candidate superblock passes, namely
+ * whether:
+ *
+ * - it lies within the container that it describes, which fits on the device;
+ * - its checkpoint descriptor area is contiguous and lies within the
+ *   container, and its own checkpoint lies within that area;
+ * - its checkpoint data area is likewise well-formed;
+ * - it lies in block 0 or at the end of its own checkpoint;
+ * - its checkpoint starts with a valid checkpoint map of the same XID;
+ * - its object map is a valid object map that is no newer than it; and
+ * - its next XID, space manager, and volume count are plausible.
+ *
+ * device_blocks:   The size of the device in blocks of the candidate's size,
+ *      or 0 if unknown.
+ *
+ * scratch:         A buffer of at least `NX_MAXIMUM_BLOCK_SIZE` bytes.
+ */
+uint32_t score_nx_candidate(nx_candidate_t* candidate, uint64_t device_blocks, char* scratch) {
+    nx_superblock_t* nxsb = (nx_superblock_t*)candidate->block;
+    uint64_t num_blocks = nxsb->nx_block_count;
+    uint32_t score = 0;
+
+    if ((uint64_t)candidate->addr < num_blocks && (device_blocks == 0 || num_blocks <= device_blocks)) {
+        score++;
+    }
+
+    uint32_t desc_blocks = nxsb->nx_xp_desc_blocks;
+    uint32_t data_blocks = nxsb->nx_xp_data_blocks;
+    bool desc_ok = !(desc_blocks >> 31)
+        && desc_blocks > 0
+        && (uint64_t)nxsb->nx_xp_desc_base < num_blocks
+        && desc_blocks <= num_blocks - nxsb->nx_xp_desc_base
+        && nxsb->nx_xp_desc_index < desc_blocks
+        && nxsb->nx_xp_desc_len > 0
+        && nxsb->nx_xp_desc_len <= desc_blocks;
+    if (desc_ok) {
+        score++;
+    }
+    if (
+        !(data_blocks >> 31)
+        && data_blocks > 0
+        && (uint64_t)nxsb->nx_xp_data_base < num_blocks
+        && data_blocks <= num_blocks - nxsb->nx_xp_data_base
+        && nxsb->nx_xp_data_index < data_blocks
+        && nxsb->nx_xp_data_len <= data_blocks
+    ) {
+        score++;
+    }
+
+    if (desc_ok) {
+        paddr_t last = nxsb->nx_xp_desc_base + (nxsb->nx_xp_desc_index + nxsb->nx_xp_desc_len - 1) % desc_blocks;
+        if (candidate->addr == 0 || candidate->addr == last) {
+            score++;
+        }
+
+        checkpoint_map_phys_t* cpm = (checkpoint_map_phys_t*)scratch;
+        paddr_t first = nxsb->nx_xp_desc_base + nxsb->nx_xp_desc_index;
+        if (
+            discover_read_object(scratch, first, candidate->block_size)
+            && (cpm->cpm_o.o_type & OBJECT_TYPE_MASK) == OBJECT_TYPE_CHECKPOINT_MAP
+            && cpm->cpm_o.o_xid == candidate->xid
+        ) {
+            score++;
+        }
+    }
+
+    omap_phys_t* omap = (omap_phys_t*)scratch;
+    if (
+        nxsb->nx_omap_oid > 0
+        && nxsb->nx_omap_oid < num_blocks
+        && discover_read_object(scratch, nxsb->nx_omap_oid, candidate->block_size)
+        && (omap->om_o.o_type & OBJECT_TYPE_MASK) == OBJECT_TYPE_OMAP
+        && omap->om_o.o_xid <= candidate->xid
+    ) {
+        score++;
+    }
+
+    if (
+        nxsb->nx_next_xid > candidate->xid
+        && nxsb->nx_spaceman_oid != 0
+        && nxsb->nx_max_file_systems > 0
+        && nxsb->nx_max_file_systems <= NX_MAX_FILE_SYSTEMS
+    ) {
+        score++;
+    }
+
+    return score;
+}
+
+/**
+ * Order candidates best first: by the number of consistency checks passed,
+ * then by XID, newest first, then by address.
+ */
+int compare_nx_candidates(const void* a, const void* b) {
+    const nx_candidate_t* x = a;
+    const nx_candidate_t* y = b;
+    if (x->score != y->score) {
+        return x->score > y->score ? -1 : 1;
+    }
+    if (x->xid != y->xid) {
+        return x->xid > y->xid ? -1 : 1;
+    }
+    if (x->addr != y->addr) {
+        return x->addr < y->addr ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Scan the container for container superblocks, choose the best one, and
+ * arrange for reads of block 0 to return it. Unless the block size is fixed
+ * (see `detect_block_size()`), `nx_block_size` is set to the chosen
+ * superblock's block size. The candidates are reported on stderr.
+ *
+ * RETURN VALUE:    `true` if a superblock was chosen; else `false`, in which
+ *      case nothing has changed.
+ */
+bool find_nx_superblock() {
+    bool size_fixed = nx_is_overlay() || nx_is_packed() || nx_block_size_forced;
+    size_t saved_block_size = nx_block_size;
+
+    // The size of the device, which bounds the scan and is one of the
+    // consistency checks, isn't known for overlays and packed images.
+    uint64_t device_bytes = 0;
+    if (!nx_is_overlay() && !nx_is_packed()) {
+        off_t size = lseek(fileno(nx), 0, SEEK_END);
+        if (size > 0) {
+            device_bytes = size;
+        }
+    }
+    uint64_t scan_bytes = device_bytes;
+    if (discover_limit_mib > 0 && (scan_bytes == 0 || discover_limit_mib * 1024 * 1024 < scan_bytes)) {
+        scan_bytes = discover_limit_mib * 1024 * 1024;
+    }
+
+    char* scratch = malloc(NX_MAXIMUM_BLOCK_SIZE);
+    if (!scratch) {
+        fprintf(stderr, "\nABORT: find_nx_superblock: Could not allocate sufficient memory for `scratch`.\n");
+        exit(-1);
+    }
+
+    nx_candidate_t* candidates = NULL;
+    size_t num_candidates = 0;
+    size_t candidates_size = 0;
+    uint64_t num_rejected = 0;
+
+    // Scan in units of the smallest block size, unless the block size is fixed.
+    size_t unit = size_fixed ? nx_block_size : NX_MINIMUM_BLOCK_SIZE;
+    nx_block_size = unit;
+    paddr_t end_addr = scan_bytes > 0 ? (paddr_t)(scan_bytes / unit) : INT64_MAX;
+
+    fprintf(stderr, "Scanning `%s` for container superblocks ...\n", nx_path);
+    progress_t progress;
+    progress_init(&progress, scan_bytes / unit);
+
+    scan_t scan;
+    scan_init(&scan, 0, end_addr);
+    paddr_t chunk_start;
+    char* data;
+    size_t chunk_blocks;
+    while ( (chunk_blocks = scan_next_chunk(&scan, &chunk_start, &data)) ) {
+        // The magic number is all that is looked at in most blocks.
+        const char* magic = data + offsetof(nx_superblock_t, nx_magic);
+        for (size_t i = 0; i < chunk_blocks; i++, magic += unit) {
+            uint32_t value;
+            memcpy(&value, magic, sizeof(value));
+            if (value != NX_MAGIC) {
+                continue;
+            }
+
+            nx_superblock_t* nxsb = (nx_superblock_t*)(data + i * unit);
+            size_t block_size = nxsb->nx_block_size;
+            uint64_t offset = (uint64_t)(chunk_start + i) * unit;
+            if (
+                !is_valid_block_size(block_size)
+                || (size_fixed && block_size != unit)
+                || offset % block_size != 0
+                || !discover_read_object(scratch, offset / block_size, block_size)
+                || !is_valid_nx_object(scratch, block_size)
+            ) {
+                num_rejected++;
+                continue;
+            }
+
+            if (num_candidates == candidates_size) {
+                candidates_size = candidates_size ? 2 * candidates_size : 16;
+                candidates = realloc(candidates, candidates_size * sizeof(nx_candidate_t));
+                if (!candidates) {
+                    fprintf(stderr, "\nABORT: find_nx_superblock: Could not allocate sufficient memory for %lu candidates.\n", candidates_size);
+                    exit(-1);
+                }
+            }
+            nx_candidate_t* candidate = candidates + num_candidates++;
+            candidate->addr         = offset / block_size;
+            candidate->block_size   = block_size;
+            candidate->xid          = ((obj_phys_t*)scratch)->o_xid;
+            candidate->block        = malloc(block_size);
+            if (!candidate->block) {
+                fprintf(stderr, "\nABORT: find_nx_superblock: Could not allocate sufficient memory for a candidate.\n");
+                exit(-1);
+            }
+            memcpy(candidate->block, scratch, block_size);
+            progress_add_matches(&progress, 1);
+        }
+        progress_add_blocks(&progress, chunk_blocks);
+        progress_update(&progress);
+    }
+    scan_end(&scan);
+    progress_clear(&progress);
+    nx_block_size = saved_block_size;
+
+    if (num_candidates == 0) {
+        fprintf(stderr, "- Found no valid container superblocks");
+        if (num_rejected > 0) {
+            fprintf(stderr, "; %llu blocks had the magic number but failed validation", num_rejected);
+        }
+        fprintf(stderr, ".\n");
+        free(scratch);
+        return false;
+    }
+
+    for (size_t i = 0; i < num_candidates; i++) {
+        nx_candidate_t* candidate = candidates + i;
+        candidate->score = score_nx_candidate(candidate, device_bytes / candidate->block_size, scratch);
+    }
+    qsort(candidates, num_candidates, sizeof(nx_candidate_t), compare_nx_candidates);
+
+    fprintf(stderr, "- Found %lu valid container superblocks", num_candidates);
+    if (num_rejected > 0) {
+        fprintf(stderr, " (and %llu blocks that had the magic number but failed validation)", num_rejected);
+    }
+    fprintf(stderr, "; the best are:\n");
+    for (size_t i = 0; i < num_candidates && i < DISCOVER_REPORT_CANDIDATES; i++) {
+        nx_candidate_t* candidate = candidates + i;
+        fprintf(stderr, "  %c block 0x%llx: XID %#llx, %lu-byte blocks, %u/%u consistency checks passed\n",
+            i == 0 ? '*' : ' ',
+            candidate->addr, candidate->xid, candidate->block_size,
+            candidate->score, DISCOVER_NUM_CHECKS
+        );
+    }
+
+    nx_candidate_t* best = candidates;
+    if (!size_fixed) {
+        nx_block_size = best->block_size;
+    }
+
+    // Mask the newer superblocks in the chosen superblock's checkpoint
+    // descriptor area, as tools pick the newest one that they find there.
+    nx_superblock_t* best_nxsb = (nx_superblock_t*)best->block;
+    uint32_t desc_blocks = best_nxsb->nx_xp_desc_blocks;
+    discover_masked_addrs = malloc(num_candidates * sizeof(paddr_t));
+    if (!discover_masked_addrs) {
+        fprintf(stderr, "\nABORT: find_nx_superblock: Could not allocate sufficient memory for `discover_masked_addrs`.\n");
+        exit(-1);
+    }
+    for (size_t i = 0; i < num_candidates; i++) {
+        nx_candidate_t* candidate = candidates + i;
+        if (
+            !(desc_blocks >> 31)
+            && candidate->block_size == best->block_size
+            && candidate->xid > best->xid
+            && candidate->addr >= best_nxsb->nx_xp_desc_base
+            && candidate->addr < best_nxsb->nx_xp_desc_base + desc_blocks
+        ) {
+            discover_masked_addrs[discover_num_masked++] = candidate->addr;
+        }
+    }
+
+    fprintf(stderr, "- Mounting from the container superblock in block 0x%llx, with XID %#llx", best->addr, best->xid);
+    if (discover_num_masked > 0) {
+        fprintf(stderr, "; ignoring %lu newer superblocks in its checkpoint descriptor area", discover_num_masked);
+    }
+    fprintf(stderr, ".\n");
+    if (best->score < DISCOVER_NUM_CHECKS) {
+        fprintf(stderr, "!! APFS ERROR !! The chosen container superblock failed %u consistency checks. Proceeding as if it didn't.\n", DISCOVER_NUM_CHECKS - best->score);
+    }
+
+    nx_found_superblock = best->block;
+    for (size_t i = 1; i < num_candidates; i++) {
+        free(candidates[i].block);
+    }
+    free(candidates);
+    free(scratch);
+    return true;
+}
+
+#endif // APFS_IO_DISCOVER_H
@@ -0,0 +1,339 @@
+/**
+ * Reading of Fusion containers, which span two devices: a fast main device
+ * (tier 1, an SSD) and a slow secondary device (tier 2, a hard drive).
+ *
+ * Physical addresses of blocks on the tier 2 device have the bit given by
+ * `FUSION_TIER2_DEVICE_BLOCK_ADDR()` set. When the tier 2 device is given with
+ * `--tier2`, reads of such addresses are directed to it, with that bit
+ * cleared. Otherwise, they fail with `ENXIO`.
+ *
+ * Some ranges of tier 2 blocks are cached on the main device, and when they
+ * are dirty, the copy on the main device is the only up-to-date one. The
+ * Fusion middle tree (`nx_fusion_mt_oid`) records which ranges are cached and
+ * where; it is loaded in full on the first read from tier 2, and reads of
+ * cached ranges are directed to the main device.
+ *
+ * The asynchronous I/O engine keeps a separate queue and set of worker
+ * threads for each tier (see `aio_queue_for()`), so that reads from the main
+ * device never wait behind reads from the much slower tier 2 device.
+ *
+ * This header is included by `io.h`, which it depends on; include that
+ * instead.
+ */
+
+#ifndef APFS_IO_FUSION_H
+#define APFS_IO_FUSION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../struct/object.h"
+#include "../struct/nx.h"
+#include "../struct/btree.h"
+#include "../struct/fusion.h"
+#include "../func/cksum.h"
+
+/** Configuration **/
+
+// Path of the tier 2 device (`--tier2`), or NULL.
+char*   fusion_tier2_path = NULL;
+
+/** Statistics **/
+
+uint64_t    fusion_num_tier2_blocks = 0;    // Blocks read from the tier 2 device
+uint64_t    fusion_num_cached_blocks = 0;   // Tier 2 blocks read from their cached copy on the main device
+
+/** State **/
+
+// A range of tier 2 blocks that is cached on the main device, as recorded in
+// the Fusion middle tree. Addresses are without the tier 2 bit.
+typedef struct {
+    paddr_t     tier2_start;
+    paddr_t     tier1_start;
+    uint64_t    count;
+    uint32_t    flags;
+} fusion_mapping_t;
+
+pthread_once_t      fusion_init_once = PTHREAD_ONCE_INIT;
+int                 fusion_tier2_fd = -1;
+fusion_mapping_t*   fusion_mappings = NULL;
+uint64_t            fusion_num_mappings = 0;
+bool                fusion_warned_no_tier2 = false;
+
+/**
+ * Determine whether a physical block address lies on the tier 2 device.
+ */
+bool is_tier2_addr(paddr_t addr) {
+    return ((uint64_t)addr & FUSION_TIER2_DEVICE_BLOCK_ADDR(nx_block_size)) != 0;
+}
+
+/**
+ * Get the address of a block on the tier 2 device itself, i.e. without the
+ * tier 2 bit.
+ */
+paddr_t tier2_device_addr(paddr_t addr) {
+    return (uint64_t)addr & ~FUSION_TIER2_DEVICE_BLOCK_ADDR(nx_block_size);
+}
+
+/**
+ * Read blocks from either device of a Fusion container, as given by the
+ * tier 2 bit of `start_block`, without consulting the middle tree. Reads from
+ * the main device use the file descriptor `fd`.
+ */
+ssize_t fusion_pread_device(int fd, void* buffer, paddr_t start_block, size_t num_blocks) {
+    if (is_tier2_addr(start_block)) {
+        return pread_device_blocks(fusion_tier2_fd, buffer, tier2_device_addr(start_block), num_blocks);
+    }
+    return pread_device_blocks(fd, buffer, start_block, num_blocks);
+}
+
+int compare_fusion_mappings(const void* a, const void* b) {
+    paddr_t start_a = ((fusion_mapping_t*)a)->tier2_start;
+    paddr_t start_b = ((fusion_mapping_t*)b)->tier2_start;
+    return start_a < start_b ? -1 : (start_a > start_b ? 1 : 0);
+}
+
+/**
+ * Find the most recent valid container superblock on the main device, by
+ * looking through the checkpoint descriptor area that block 0 describes.
+ *
+ * RETURN VALUE:    `true` on success, else `false`.
+ */
+bool fusion_read_nxsb(nx_superblock_t* nxsb) {
+    int fd = fileno(nx);
+    if (pread_device_blocks(fd, nxsb, 0, 1) != 1 || !is_cksum_valid(nxsb) || nxsb->nx_magic != NX_MAGIC) {
+        return false;
+    }
+    if (nxsb->nx_xp_desc_blocks >> 31) {
+        // Non-contiguous checkpoint descriptor area; make do with block 0.
+        return true;
+    }
+
+    char* block = malloc(nx_block_size);
+    if (!block) {
+        fprintf(stderr, "\nABORT: fusion_read_nxsb: Could not allocate sufficient memory for `block`.\n");
+        exit(-1);
+    }
+    paddr_t xp_desc_base = nxsb->nx_xp_desc_base;
+    uint32_t xp_desc_blocks = nxsb->nx_xp_desc_blocks;
+    for (uint32_t i = 0; i < xp_desc_blocks; i++) {
+        nx_superblock_t* candidate = (nx_superblock_t*)block;
+        if (pread_device_blocks(fd, block, xp_desc_base + i, 1) == 1
+            && is_cksum_valid(candidate)
+            && candidate->nx_magic == NX_MAGIC
+            && (candidate->nx_o.o_type & OBJECT_TYPE_MASK) == OBJECT_TYPE_NX_SUPERBLOCK
+            && candidate->nx_o.o_xid > nxsb->nx_o.o_xid
+        ) {
+            memcpy(nxsb, candidate, sizeof(nx_superblock_t));
+        }
+    }
+    free(block);
+    return true;
+}
+
+/**
+ * Load the Fusion middle tree, whose root node is at a given address, into
+ * `fusion_mappings`. Unreadable nodes are reported and skipped; the blocks
+ * they describe are then read from the tier 2 device, which may be stale.
+ */
+void fusion_load_middle_tree(paddr_t root_addr) {
+    int fd = fileno(nx);
+    uint64_t mappings_capacity = 0;
+
+    size_t stack_len = 1;
+    size_t stack_capacity = 64;
+    paddr_t* stack = malloc(stack_capacity * sizeof(paddr_t));
+    btree_node_phys_t* node = malloc(nx_block_size);
+    if (!stack || !node) {
+        fprintf(stderr, "\nABORT: fusion_load_middle_tree: Could not allocate sufficient memory.\n");
+        exit(-1);
+    }
+    stack[0] = root_addr;
+
+    while (stack_len > 0) {
+        paddr_t addr = stack[--stack_len];
+        if (fusion_pread_device(fd, node, addr, 1) != 1 || !is_cksum_valid(node)
+            || (node->btn_o.o_type & OBJECT_TYPE_MASK) != (addr == root_addr ? OBJECT_TYPE_BTREE : OBJECT_TYPE_BTREE_NODE)
+            || !(node->btn_flags & BTNODE_FIXED_KV_SIZE)
+        ) {
+            fprintf(stderr, "Fusion middle tree node at block %#llx is unreadable or invalid; skipping it.\n", addr);
+            continue;
+        }
+
+        kvoff_t* toc = (kvoff_t*)((char*)node->btn_data + node->btn_table_space.off);
+        char* key_start = (char*)node->btn_data + node->btn_table_space.off + node->btn_table_space.len;
+        char* val_end = (char*)node + nx_block_size;
+        if (node->btn_flags & BTNODE_ROOT) {
+            val_end -= sizeof(btree_info_t);
+        }
+
+        for (uint32_t i = 0; i < node->btn_nkeys; i++) {
+            fusion_mt_key_t* key = (fusion_mt_key_t*)(key_start + toc[i].k);
+
+            if (!(node->btn_flags & BTNODE_LEAF)) {
+                if (stack_len == stack_capacity) {
+                    stack_capacity *= 2;
+                    stack = realloc(stack, stack_capacity * sizeof(paddr_t));
+                    if (!stack) {
+                        fprintf(stderr, "\nABORT: fusion_load_middle_tree: Could not allocate sufficient memory for `stack`.\n");
+                        exit(-1);
+                    }
+                }
+                stack[stack_len++] = *(oid_t*)(val_end - toc[i].v);
+                continue;
+            }
+
+            fusion_mt_val_t* val = (fusion_mt_val_t*)(val_end - toc[i].v);
+            if (fusion_num_mappings == mappings_capacity) {
+                mappings_capacity = mappings_capacity ? 2 * mappings_capacity : 1024;
+                fusion_mappings = realloc(fusion_mappings, mappings_capacity * sizeof(fusion_mapping_t));
+                if (!fusion_mappings) {
+                    fprintf(stderr, "\nABORT: fusion_load_middle_tree: Could not allocate sufficient memory for %llu mappings.\n", mappings_capacity);
+                    exit(-1);
+                }
+            }
+            fusion_mapping_t* mapping = fusion_mappings + fusion_num_mappings++;
+            mapping->tier2_start    = tier2_device_addr(*key);
+            mapping->tier1_start    = val->fmv_lba;
+            mapping->count          = val->fmv_length;   // In blocks
+            mapping->flags          = val->fmv_flags;
+        }
+    }
+
+    free(node);
+    free(stack);
+    qsort(fusion_mappings, fusion_num_mappings, sizeof(fusion_mapping_t), compare_fusion_mappings);
+}
+
+/**
+ * Open the tier 2 device, check that it belongs with the main device, and
+ * load the middle tree. This is done once, on the first read from tier 2.
+ */
+void fusion_init() {
+    fusion_tier2_fd = open(fusion_tier2_path, O_RDONLY);
+    if (fusion_tier2_fd == -1) {
+        fprintf(stderr, "\nABORT: Could not open the tier 2 device `%s` (%s).\n", fusion_tier2_path, strerror(errno));
+        exit(-1);
+    }
+
+    nx_superblock_t* nxsb = malloc(nx_block_size);
+    nx_superblock_t* tier2_nxsb = malloc(nx_block_size);
+    if (!nxsb || !tier2_nxsb) {
+        fprintf(stderr, "\nABORT: fusion_init: Could not allocate sufficient memory for the container superblocks.\n");
+        exit(-1);
+    }
+    if (!fusion_read_nxsb(nxsb)) {
+        fprintf(stderr, "\nABORT: Block 0x0 of `%s` is not a valid container superblock, so the Fusion middle tree can't be found.\n", nx_path);
+        exit(-1);
+    }
+    if (!(nxsb->nx_incompatible_features & NX_INCOMPAT_FUSION)) {
+        fprintf(stderr, "Warning: `--tier2` was given, but `%s` is not part of a Fusion container.\n", nx_path);
+    }
+
+    // Both devices have a copy of the container superblock, whose Fusion set
+    // UUIDs differ only in their most significant bit.
+    if (pread_device_blocks(fusion_tier2_fd, tier2_nxsb, 0, 1) == 1 && tier2_nxsb->nx_magic == NX_MAGIC) {
+        if ((nxsb->nx_fusion_uuid[0] & 0x7f) != (tier2_nxsb->nx_fusion_uuid[0] & 0x7f)
+            || memcmp(nxsb->nx_fusion_uuid + 1, tier2_nxsb->nx_fusion_uuid + 1, sizeof(uuid_t) - 1) != 0
+        ) {
+            fprintf(stderr, "Warning: The Fusion set UUIDs of `%s` and `%s` don't match; they may not belong together.\n", nx_path, fusion_tier2_path);
+        }
+    } else {
+        fprintf(stderr, "Warning: Block 0x0 of the tier 2 device `%s` is not a container superblock.\n", fusion_tier2_path);
+    }
+
+    if (nxsb->nx_fusion_mt_oid != 0) {
+        fusion_load_middle_tree(nxsb->nx_fusion_mt_oid);
+    }
+    fprintf(stderr, "Fusion: reading tier 2 from `%s`; %llu ranges are cached on the main device.\n", fusion_tier2_path, fusion_num_mappings);
+
+    free(tier2_nxsb);
+    free(nxsb);
+}
+
+/**
+ * Find the first mapping that ends after a given tier 2 block.
+ *
+ * RETURN VALUE:    An index into `fusion_mappings`, which equals
+ *      `fusion_num_mappings` if there is no such mapping.
+ */
+uint64_t fusion_find_mapping(paddr_t block) {
+    uint64_t lo = 0;
+    uint64_t hi = fusion_num_mappings;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if ((uint64_t)fusion_mappings[mid].tier2_start + fusion_mappings[mid].count <= (uint64_t)block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Read given number of blocks from the tier 2 device of a Fusion container;
+ * otherwise identical to `pread_blocks_raw()`. Ranges that are cached on the
+ * main device are read from there, using the file descriptor `fd`.
+ */
+ssize_t fusion_pread_blocks(int fd, void* buffer, paddr_t start_block, size_t num_blocks) {
+    if (!fusion_tier2_path) {
+        if (!fusion_warned_no_tier2) {
+            fusion_warned_no_tier2 = true;
+            fprintf(stderr, "Block %#llx lies on the second tier of a Fusion container; use `--tier2` to give the path of that device.\n", start_block);
+        }
+        errno = ENXIO;
+        return -1;
+    }
+    pthread_once(&fusion_init_once, fusion_init);
+
+    paddr_t first = tier2_device_addr(start_block);
+    uint64_t index = fusion_find_mapping(first);
+    size_t i = 0;
+    while (i < num_blocks) {
+        paddr_t block = first + i;
+        char* dest = (char*)buffer + i * nx_block_size;
+        fusion_mapping_t* mapping = index < fusion_num_mappings ? fusion_mappings + index : NULL;
+
+        size_t count = num_blocks - i;
+        ssize_t num_read;
+        if (mapping && mapping->tier2_start <= block) {
+            // Cached on the main device
+            uint64_t offset = block - mapping->tier2_start;
+            if (count > mapping->count - offset) {
+                count = mapping->count - offset;
+            }
+            num_read = pread_device_blocks(fd, dest, mapping->tier1_start + offset, count);
+            if (num_read > 0) {
+                __atomic_add_fetch(&fusion_num_cached_blocks, num_read, __ATOMIC_RELAXED);
+            }
+            index++;
+        } else {
+            // Read from tier 2, up to the start of the next cached range
+            if (mapping && (uint64_t)mapping->tier2_start - block < count) {
+                count = mapping->tier2_start - block;
+            }
+            num_read = pread_device_blocks(fusion_tier2_fd, dest, block, count);
+            if (num_read > 0) {
+                __atomic_add_fetch(&fusion_num_tier2_blocks, num_read, __ATOMIC_RELAXED);
+            }
+        }
+
+        if (num_read == -1) {
+            return -1;
+        }
+        i += num_read;
+        if ((size_t)num_read < count) {
+            break;  // End-of-file
+        }
+    }
+    return i;
+}
+
+#endif // APFS_IO_FUSION_H
@@ -0,0 +1,357 @@
+/**
+ * Reading of overlays, which combine several partial images of the same
+ * container into a single virtual container.
+ *
+ * When a failing disk is imaged in several passes (forwards, backwards,
+ * retrying bad areas, or with different tools), each pass yields a partial
+ * image, along with a GNU ddrescue mapfile saying which parts of it were read
+ * successfully. Rather than merging these into one image first, an overlay
+ * spec can be given in place of the container. This is a text file like:
+ *
+ *      apfs-overlay
+ *      # Highest priority first; the mapfile is optional.
+ *      retry.img       retry.map
+ *      reverse.img     reverse.map
+ *      forward.img     forward.map
+ *
+ * Each block is read from the first image whose mapfile marks it as finished
+ * (`+`); an image without a mapfile is taken to be complete. Relative paths
+ * are relative to the directory containing the spec. Blocks that no image
+ * covers cannot be read; reading them fails with `EIO`, so that `--rescue`
+ * treats them as bad blocks.
+ *
+ * When the spec is loaded, the sources are resolved into a single sorted table
+ * of segments, each of which maps a run of blocks to one image, so that a read
+ * spanning many blocks turns into one large read per segment.
+ *
+ * This header is included by `io.h`, which it depends on; include that
+ * instead.
+ */
+
+#ifndef APFS_IO_OVERLAY_H
+#define APFS_IO_OVERLAY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define OVERLAY_MAGIC   "apfs-overlay"
+
+typedef struct {
+    char*       path;
+    char*       map_path;           // NULL if the image is complete
+    int         fd;
+    uint64_t    num_blocks_used;    // Number of blocks read from this image in the segment table
+} overlay_source_t;
+
+typedef struct {
+    uint64_t    start_block;
+    uint64_t    count;
+    uint32_t    source;             // Index into `overlay_sources`
+} overlay_segment_t;
+
+/** State **/
+
+bool                io_overlay = false;
+pthread_once_t      overlay_probe_once = PTHREAD_ONCE_INIT;
+
+overlay_source_t*   overlay_sources = NULL;
+uint32_t            overlay_num_sources = 0;
+
+overlay_segment_t*  overlay_segments = NULL;
+uint64_t            overlay_num_segments = 0;
+uint64_t            overlay_segments_capacity = 0;
+
+uint64_t            overlay_block_count = 0;    // Size of the virtual container, in blocks
+
+/**
+ * Get the path of a file named in an overlay spec, resolving relative paths
+ * against the directory containing the spec.
+ *
+ * RETURN VALUE:    A newly allocated string.
+ */
+char* overlay_resolve_path(char* path) {
+    char* last_slash = strrchr(nx_path, '/');
+    size_t dir_len = (path[0] == '/' || !last_slash) ? 0 : (size_t)(last_slash - nx_path + 1);
+    char* resolved = malloc(dir_len + strlen(path) + 1);
+    if (!resolved) {
+        fprintf(stderr, "\nABORT: overlay_resolve_path: Could not allocate sufficient memory for a path.\n");
+        exit(-1);
+    }
+    memcpy(resolved, nx_path, dir_len);
+    strcpy(resolved + dir_len, path);
+    return resolved;
+}
+
+/**
+ * Find the first segment that ends after a given block.
+ *
+ * RETURN VALUE:    An index into `overlay_segments`, which equals
+ *      `overlay_num_segments` if there is no such segment.
+ */
+uint64_t overlay_find_segment(uint64_t block) {
+    uint64_t lo = 0;
+    uint64_t hi = overlay_num_segments;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (overlay_segments[mid].start_block + overlay_segments[mid].count <= block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Insert a segment into the table at a given index.
+ */
+void overlay_insert_segment(uint64_t index, uint64_t start_block, uint64_t count, uint32_t source) {
+    if (overlay_num_segments == overlay_segments_capacity) {
+        overlay_segments_capacity = overlay_segments_capacity ? 2 * overlay_segments_capacity : 256;
+        overlay_segments = realloc(overlay_segments, overlay_segments_capacity * sizeof(overlay_segment_t));
+        if (!overlay_segments) {
+            fprintf(stderr, "\nABORT: overlay_insert_segment: Could not allocate sufficient memory for %llu segments.\n", overlay_segments_capacity);
+            exit(-1);
+        }
+    }
+    memmove(overlay_segments + index + 1, overlay_segments + index, (overlay_num_segments - index) * sizeof(overlay_segment_t));
+    overlay_segments[index].start_block = start_block;
+    overlay_segments[index].count = count;
+    overlay_segments[index].source = source;
+    overlay_num_segments++;
+}
+
+/**
+ * Add a range of blocks provided by a given source to the segment table,
+ * except for those blocks that are already provided by a source of higher
+ * priority. Sources must be added in order of decreasing priority.
+ */
+void overlay_add_range(uint64_t first, uint64_t end, uint32_t source) {
+    uint64_t index = overlay_find_segment(first);
+    while (first < end) {
+        if (index < overlay_num_segments && overlay_segments[index].start_block <= first) {
+            // Already covered; skip to the end of that segment.
+            first = overlay_segments[index].start_block + overlay_segments[index].count;
+            index++;
+            continue;
+        }
+
+        uint64_t piece_end = end;
+        if (index < overlay_num_segments && overlay_segments[index].start_block < piece_end) {
+            piece_end = overlay_segments[index].start_block;
+        }
+
+        // Extend the previous segment if it is adjacent and from the same source.
+        if (index > 0
+            && overlay_segments[index - 1].source == source
+            && overlay_segments[index - 1].start_block + overlay_segments[index - 1].count == first
+        ) {
+            overlay_segments[index - 1].count += piece_end - first;
+        } else {
+            overlay_insert_segment(index, first, piece_end - first, source);
+            index++;
+        }
+        overlay_sources[source].num_blocks_used += piece_end - first;
+        first = piece_end;
+    }
+}
+
+/**
+ * Add the blocks that a ddrescue mapfile marks as finished to the segment
+ * table. Blocks that are only partly finished are not included.
+ */
+void overlay_load_map(uint32_t source) {
+    char* map_path = overlay_sources[source].map_path;
+    FILE* map = fopen(map_path, "r");
+    if (!map) {
+        fprintf(stderr, "\nABORT: Could not open the mapfile `%s` (%s).\n", map_path, strerror(errno));
+        exit(-1);
+    }
+
+    char line[256];
+    bool seen_status_line = false;
+    while (fgets(line, sizeof(line), map)) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        // The first non-comment line gives ddrescue's position and phase.
+        if (!seen_status_line) {
+            seen_status_line = true;
+            continue;
+        }
+
+        unsigned long long pos, size;
+        char status;
+        if (sscanf(line, "%llx %llx %c", &pos, &size, &status) != 3 || status != '+') {
+            continue;
+        }
+
+        uint64_t first = (pos + nx_block_size - 1) / nx_block_size;
+        uint64_t end = (pos + size) / nx_block_size;
+        if (first < end) {
+            overlay_add_range(first, end, source);
+            if (end > overlay_block_count) {
+                overlay_block_count = end;
+            }
+        }
+    }
+    fclose(map);
+}
+
+/**
+ * Determine whether `nx` is an overlay spec, and if so, open its images and
+ * build the segment table. This is done once, when the container is first
+ * read; use `nx_is_overlay()` rather than calling this directly.
+ */
+void overlay_probe() {
+    char magic[sizeof(OVERLAY_MAGIC)];
+    ssize_t ret = pread(fileno(nx), magic, sizeof(magic), 0);
+    if (ret != sizeof(magic) || memcmp(magic, OVERLAY_MAGIC, sizeof(magic) - 1) != 0
+        || (magic[sizeof(magic) - 1] != '\n' && magic[sizeof(magic) - 1] != '\r')
+    ) {
+        return;
+    }
+
+    FILE* spec = fopen(nx_path, "r");
+    if (!spec) {
+        fprintf(stderr, "\nABORT: Could not open the overlay spec `%s` (%s).\n", nx_path, strerror(errno));
+        exit(-1);
+    }
+
+    char line[4096];
+    fgets(line, sizeof(line), spec);    // The magic line
+    uint32_t sources_capacity = 0;
+    while (fgets(line, sizeof(line), spec)) {
+        char image_path[2048];
+        char map_path[2048];
+        int num_fields = sscanf(line, " %2047s %2047s", image_path, map_path);
+        if (num_fields < 1 || image_path[0] == '#') {
+            continue;
+        }
+
+        if (overlay_num_sources == sources_capacity) {
+            sources_capacity = sources_capacity ? 2 * sources_capacity : 8;
+            overlay_sources = realloc(overlay_sources, sources_capacity * sizeof(overlay_source_t));
+            if (!overlay_sources) {
+                fprintf(stderr, "\nABORT: overlay_probe: Could not allocate sufficient memory for `overlay_sources`.\n");
+                exit(-1);
+            }
+        }
+        overlay_source_t* source = overlay_sources + overlay_num_sources;
+        source->path = overlay_resolve_path(image_path);
+        source->map_path = (num_fields == 2 && map_path[0] != '#') ? overlay_resolve_path(map_path) : NULL;
+        source->num_blocks_used = 0;
+        source->fd = open(source->path, O_RDONLY);
+        if (source->fd == -1) {
+            fprintf(stderr, "\nABORT: Could not open the image `%s` named in the overlay spec (%s).\n", source->path, strerror(errno));
+            exit(-1);
+        }
+        overlay_num_sources++;
+    }
+    fclose(spec);
+
+    if (overlay_num_sources == 0) {
+        fprintf(stderr, "\nABORT: The overlay spec `%s` does not name any images.\n", nx_path);
+        exit(-1);
+    }
+
+    // The mapfiles give byte offsets, so the block size must be known before
+    // they are loaded; take it from the first image that has it.
+    for (uint32_t i = 0; i < overlay_num_sources && !nx_block_size_forced; i++) {
+        bool probed;
+        size_t size = probe_block_size_fd(overlay_sources[i].fd, &probed);
+        if (size != 0) {
+            nx_block_size = size;
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < overlay_num_sources; i++) {
+        if (overlay_sources[i].map_path) {
+            overlay_load_map(i);
+        } else {
+            off_t size = lseek(overlay_sources[i].fd, 0, SEEK_END);
+            uint64_t num_blocks = size > 0 ? size / nx_block_size : 0;
+            overlay_add_range(0, num_blocks, i);
+            if (num_blocks > overlay_block_count) {
+                overlay_block_count = num_blocks;
+            }
+        }
+    }
+
+    uint64_t num_covered = 0;
+    for (uint32_t i = 0; i < overlay_num_sources; i++) {
+        num_covered += overlay_sources[i].num_blocks_used;
+    }
+    fprintf(stderr, "Overlay `%s`: %llu of %llu blocks covered by %u images in %llu segments.\n",
+        nx_path, num_covered, overlay_block_count, overlay_num_sources, overlay_num_segments
+    );
+
+    io_overlay = true;
+}
+
+/**
+ * Determine whether the container is being read from an overlay.
+ */
+bool nx_is_overlay() {
+    pthread_once(&overlay_probe_once, overlay_probe);
+    return io_overlay;
+}
+
+/**
+ * Read given number of blocks from an overlay; otherwise identical to
+ * `pread_blocks_raw()`. If any of the blocks is not covered by an image, the
+ * read fails with `errno` set to `EIO`. This function is thread-safe.
+ */
+ssize_t overlay_pread_blocks(void* buffer, paddr_t start_block, size_t num_blocks) {
+    if ((uint64_t)start_block >= overlay_block_count) {
+        return 0;
+    }
+    if (num_blocks > overlay_block_count - start_block) {
+        num_blocks = overlay_block_count - start_block;
+    }
+
+    uint64_t index = overlay_find_segment(start_block);
+    size_t i = 0;
+    while (i < num_blocks) {
+        uint64_t block = start_block + i;
+        if (index == overlay_num_segments || overlay_segments[index].start_block > block) {
+            errno = EIO;
+            return -1;
+        }
+
+        overlay_segment_t* segment = overlay_segments + index;
+        size_t count = segment->start_block + segment->count - block;
+        if (count > num_blocks - i) {
+            count = num_blocks - i;
+        }
+
+        ssize_t num_read = pread_device_blocks(
+            overlay_sources[segment->source].fd,
+            (char*)buffer + i * nx_block_size,
+            block,
+            count
+        );
+        if (num_read == -1) {
+            return -1;
+        }
+        if ((size_t)num_read < count) {
+            // The image is shorter than its mapfile claims.
+            errno = EIO;
+            return -1;
+        }
+
+        i += count;
+        index++;
+    }
+
+    return num_blocks;
+}
+
+#endif // APFS_IO_OVERLAY_H
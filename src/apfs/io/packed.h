@@ -0,0 +1,484 @@
+/**
+ * Reading of packed container images, as produced by `apfs-pack`.
+ *
+ * A raw image of a container is mostly made up of zeroed blocks (free space)
+ * and, in many cases, blocks that are identical to one another. A packed image
+ * stores only the distinct non-zero blocks ("unique blocks"), in the order in
+ * which they first occur in the container, grouped into chunks of
+ * `chunk_blocks` unique blocks that are compressed independently so that any
+ * one of them can be read without reading the others. The layout is:
+ *
+ * - A header (`packed_header_t`), padded to `PACKED_HEADER_SIZE` bytes.
+ * - The chunks, one after another.
+ * - The chunk index, an array of `packed_chunk_t`, giving the location and
+ *   compression method of each chunk.
+ * - The run map, an array of `packed_run_t` sorted by block address, mapping
+ *   runs of container blocks to runs of unique blocks. Blocks that are not
+ *   covered by any run read as zeroes.
+ *
+ * All integers are little-endian. The chunks may be compressed with zstd or LZ4
+ * if support for them was compiled in (`make ZSTD=1`, `make LZ4=1`); chunks
+ * that don't compress well are stored as-is.
+ *
+ * Packed images are detected when the container is first read, and are read
+ * transparently by `pread_blocks_raw()`. Decompressed chunks are kept in a
+ * small cache, so that walking a B-tree whose nodes lie in the same chunk
+ * decompresses that chunk only once.
+ *
+ * This header is included by `io.h`, which it depends on; include that
+ * instead.
+ */
+
+#ifndef APFS_IO_PACKED_H
+#define APFS_IO_PACKED_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef APFS_ZSTD
+#include <zstd.h>
+#endif
+#ifdef APFS_LZ4
+#include <lz4.h>
+#endif
+
+/** On-disk format **/
+
+#define PACKED_MAGIC        "APFSPACK"
+#define PACKED_VERSION      1
+#define PACKED_HEADER_SIZE  4096
+
+#define PACKED_CODEC_NONE   0
+#define PACKED_CODEC_ZSTD   1
+#define PACKED_CODEC_LZ4    2
+
+typedef struct {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    block_size;
+    uint64_t    block_count;        // Size of the container, in blocks
+    uint32_t    chunk_blocks;       // Number of unique blocks per chunk
+    uint32_t    reserved;
+    uint64_t    num_unique_blocks;
+    uint64_t    num_chunks;
+    uint64_t    index_offset;       // Byte offset of the chunk index
+    uint64_t    num_runs;
+    uint64_t    map_offset;         // Byte offset of the run map
+} packed_header_t;
+
+typedef struct {
+    uint64_t    offset;             // Byte offset of the chunk
+    uint32_t    size;               // Size of the chunk as stored, in bytes
+    uint16_t    codec;
+    uint16_t    num_blocks;         // Fewer than `chunk_blocks` only for the last chunk
+} packed_chunk_t;
+
+typedef struct {
+    uint64_t    start_block;        // Address of the first container block in the run
+    uint64_t    unique_start;       // Index of the unique block holding its data
+    uint64_t    count;              // Number of blocks in the run
+} packed_run_t;
+
+/** Configuration **/
+
+// Capacity of the decompressed-chunk cache, in chunks.
+uint32_t    packed_cache_num_chunks = 64;
+
+/** Statistics **/
+
+uint64_t    packed_num_chunk_hits = 0;
+uint64_t    packed_num_chunk_misses = 0;
+
+/** State **/
+
+bool                io_packed = false;
+pthread_once_t      packed_probe_once = PTHREAD_ONCE_INIT;
+int                 packed_fd = -1;
+packed_header_t     packed_header;
+packed_chunk_t*     packed_chunks = NULL;
+packed_run_t*       packed_runs = NULL;
+
+typedef struct {
+    uint64_t    chunk;
+    char*       data;
+    bool        valid;
+    bool        referenced;         // Used by the clock eviction policy
+} packed_cache_entry_t;
+
+pthread_mutex_t         packed_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+packed_cache_entry_t*   packed_cache = NULL;
+uint32_t                packed_cache_clock_hand = 0;
+
+/**
+ * Get a human-readable name for a chunk compression method.
+ */
+char* packed_codec_to_string(uint16_t codec) {
+    switch (codec) {
+        case PACKED_CODEC_NONE:
+            return "none";
+        case PACKED_CODEC_ZSTD:
+            return "zstd";
+        case PACKED_CODEC_LZ4:
+            return "lz4";
+        default:
+            return "unknown";
+    }
+}
+
+/**
+ * Determine whether support for a given compression method was compiled in.
+ */
+bool packed_codec_supported(uint16_t codec) {
+    switch (codec) {
+        case PACKED_CODEC_NONE:
+            return true;
+#ifdef APFS_ZSTD
+        case PACKED_CODEC_ZSTD:
+            return true;
+#endif
+#ifdef APFS_LZ4
+        case PACKED_CODEC_LZ4:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+/**
+ * Compress data with a given method.
+ *
+ * dest_size:       The size of `dest`, in bytes.
+ *
+ * level:           The compression level, or 0 for the method's default.
+ *
+ * RETURN VALUE:    The size of the compressed data, or 0 if it could not be
+ *      compressed into `dest_size` bytes, in which case the caller should
+ *      store the data uncompressed.
+ */
+size_t packed_compress(uint16_t codec, int level, void* dest, size_t dest_size, void* src, size_t src_size) {
+    switch (codec) {
+#ifdef APFS_ZSTD
+        case PACKED_CODEC_ZSTD: {
+            size_t ret = ZSTD_compress(dest, dest_size, src, src_size, level ? level : 3);
+            return ZSTD_isError(ret) ? 0 : ret;
+        }
+#endif
+#ifdef APFS_LZ4
+        case PACKED_CODEC_LZ4: {
+            int ret = LZ4_compress_default(src, dest, src_size, dest_size);
+            return ret > 0 ? (size_t)ret : 0;
+        }
+#endif
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Decompress data that was compressed with a given method.
+ *
+ * RETURN VALUE:    `true` if exactly `dest_size` bytes were produced, else `false`.
+ */
+bool packed_decompress(uint16_t codec, void* dest, size_t dest_size, void* src, size_t src_size) {
+    switch (codec) {
+        case PACKED_CODEC_NONE:
+            if (src_size != dest_size) {
+                return false;
+            }
+            memcpy(dest, src, dest_size);
+            return true;
+#ifdef APFS_ZSTD
+        case PACKED_CODEC_ZSTD:
+            return ZSTD_decompress(dest, dest_size, src, src_size) == dest_size;
+#endif
+#ifdef APFS_LZ4
+        case PACKED_CODEC_LZ4:
+            return LZ4_decompress_safe(src, dest, src_size, dest_size) == (int)dest_size;
+#endif
+        default:
+            return false;
+    }
+}
+
+/**
+ * Read exactly `num_bytes` bytes from the packed image at a given offset.
+ *
+ * RETURN VALUE:    `true` on success, else `false`, in which case `errno`
+ *      describes the error (`EIO` if the image is truncated).
+ */
+bool packed_pread(void* buffer, size_t num_bytes, uint64_t offset) {
+    size_t num_bytes_read = 0;
+    while (num_bytes_read < num_bytes) {
+        ssize_t ret = pread(packed_fd, (char*)buffer + num_bytes_read, num_bytes - num_bytes_read, offset + num_bytes_read);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (ret == 0) {
+            errno = EIO;
+            return false;
+        }
+        num_bytes_read += ret;
+    }
+    return true;
+}
+
+/**
+ * Determine whether `nx` is a packed image, and if so, load its chunk index
+ * and run map. This is done once, when the container is first read; use
+ * `nx_is_packed()` rather than calling this directly.
+ */
+void packed_probe() {
+    packed_fd = fileno(nx);
+
+    char header_block[PACKED_HEADER_SIZE];
+    if (!packed_pread(header_block, PACKED_HEADER_SIZE, 0)
+        || memcmp(header_block, PACKED_MAGIC, sizeof(packed_header.magic)) != 0
+    ) {
+        packed_fd = -1;
+        return;
+    }
+    memcpy(&packed_header, header_block, sizeof(packed_header_t));
+
+    if (packed_header.version != PACKED_VERSION) {
+        fprintf(stderr, "\nABORT: `%s` is a packed image of an unsupported version (%u).\n", nx_path, packed_header.version);
+        exit(-1);
+    }
+    if (!is_valid_block_size(packed_header.block_size)) {
+        fprintf(stderr, "\nABORT: `%s` is a packed image with an invalid block size (%u bytes).\n", nx_path, packed_header.block_size);
+        exit(-1);
+    }
+    if (nx_block_size_forced && packed_header.block_size != nx_block_size) {
+        fprintf(stderr, "\nABORT: `%s` is a packed image with a block size of %u bytes, not %lu bytes as given.\n", nx_path, packed_header.block_size, nx_block_size);
+        exit(-1);
+    }
+    nx_block_size = packed_header.block_size;
+    if (packed_header.chunk_blocks == 0 || packed_header.chunk_blocks > UINT16_MAX) {
+        fprintf(stderr, "\nABORT: `%s` is a packed image with an invalid chunk size.\n", nx_path);
+        exit(-1);
+    }
+
+    packed_chunks = malloc(packed_header.num_chunks * sizeof(packed_chunk_t) + 1);
+    packed_runs = malloc(packed_header.num_runs * sizeof(packed_run_t) + 1);
+    if (!packed_chunks || !packed_runs) {
+        fprintf(stderr, "\nABORT: packed_probe: Could not allocate sufficient memory for the index of `%s`.\n", nx_path);
+        exit(-1);
+    }
+    if (!packed_pread(packed_chunks, packed_header.num_chunks * sizeof(packed_chunk_t), packed_header.index_offset)
+        || !packed_pread(packed_runs, packed_header.num_runs * sizeof(packed_run_t), packed_header.map_offset)
+    ) {
+        fprintf(stderr, "\nABORT: Could not read the index of the packed image `%s` (%s).\n", nx_path, strerror(errno));
+        exit(-1);
+    }
+
+    for (uint64_t i = 0; i < packed_header.num_chunks; i++) {
+        if (!packed_codec_supported(packed_chunks[i].codec)) {
+            fprintf(stderr, "\nABORT: The packed image `%s` uses %s compression, support for which was not compiled in.\n", nx_path, packed_codec_to_string(packed_chunks[i].codec));
+            exit(-1);
+        }
+    }
+
+    if (packed_cache_num_chunks == 0) {
+        packed_cache_num_chunks = 1;
+    }
+    packed_cache = calloc(packed_cache_num_chunks, sizeof(packed_cache_entry_t));
+    if (!packed_cache) {
+        fprintf(stderr, "\nABORT: packed_probe: Could not allocate sufficient memory for `packed_cache`.\n");
+        exit(-1);
+    }
+
+    io_packed = true;
+}
+
+/**
+ * Determine whether the container is being read from a packed image.
+ */
+bool nx_is_packed() {
+    pthread_once(&packed_probe_once, packed_probe);
+    return io_packed;
+}
+
+/**
+ * Find the first run that ends after a given block.
+ *
+ * RETURN VALUE:    An index into `packed_runs`, which equals
+ *      `packed_header.num_runs` if there is no such run.
+ */
+uint64_t packed_find_run(paddr_t block) {
+    uint64_t lo = 0;
+    uint64_t hi = packed_header.num_runs;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (packed_runs[mid].start_block + packed_runs[mid].count <= (uint64_t)block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Read and decompress a chunk into a newly allocated buffer.
+ *
+ * RETURN VALUE:    A pointer to the data, or NULL on failure, in which case
+ *      `errno` describes the error.
+ */
+char* packed_load_chunk(uint64_t chunk) {
+    packed_chunk_t* entry = packed_chunks + chunk;
+    size_t data_size = (size_t)entry->num_blocks * nx_block_size;
+
+    char* data = malloc(packed_header.chunk_blocks * nx_block_size);
+    char* stored = entry->codec == PACKED_CODEC_NONE ? data : malloc(entry->size);
+    if (!data || !stored) {
+        fprintf(stderr, "\nABORT: packed_load_chunk: Could not allocate sufficient memory for a chunk.\n");
+        exit(-1);
+    }
+
+    bool ok = packed_pread(stored, entry->size, entry->offset);
+    if (ok && entry->codec != PACKED_CODEC_NONE) {
+        ok = packed_decompress(entry->codec, data, data_size, stored, entry->size);
+        if (!ok) {
+            errno = EIO;
+        }
+    } else if (ok && entry->size != data_size) {
+        errno = EIO;
+        ok = false;
+    }
+
+    if (stored != data) {
+        free(stored);
+    }
+    if (!ok) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+/**
+ * Copy a run of consecutive unique blocks, all lying in the same chunk, into a
+ * buffer, decompressing the chunk if it isn't cached.
+ *
+ * RETURN VALUE:    `true` on success, else `false`, in which case `errno`
+ *      describes the error.
+ */
+bool packed_copy_unique_blocks(void* buffer, uint64_t unique_start, size_t num_blocks) {
+    uint64_t chunk = unique_start / packed_header.chunk_blocks;
+    size_t offset = (unique_start % packed_header.chunk_blocks) * nx_block_size;
+
+    if (chunk >= packed_header.num_chunks) {
+        errno = EIO;
+        return false;
+    }
+
+    pthread_mutex_lock(&packed_cache_lock);
+    for (uint32_t i = 0; i < packed_cache_num_chunks; i++) {
+        packed_cache_entry_t* entry = packed_cache + i;
+        if (entry->valid && entry->chunk == chunk) {
+            memcpy(buffer, entry->data + offset, num_blocks * nx_block_size);
+            entry->referenced = true;
+            packed_num_chunk_hits++;
+            pthread_mutex_unlock(&packed_cache_lock);
+            return true;
+        }
+    }
+    packed_num_chunk_misses++;
+    pthread_mutex_unlock(&packed_cache_lock);
+
+    // Decompress without holding the lock, so that other threads can use the
+    // cache in the meantime. If two threads miss on the same chunk, both
+    // decompress it, and both copies end up in the cache; this is harmless.
+    char* data = packed_load_chunk(chunk);
+    if (!data) {
+        return false;
+    }
+    memcpy(buffer, data + offset, num_blocks * nx_block_size);
+
+    pthread_mutex_lock(&packed_cache_lock);
+    while (true) {
+        packed_cache_entry_t* entry = packed_cache + packed_cache_clock_hand;
+        packed_cache_clock_hand = (packed_cache_clock_hand + 1) % packed_cache_num_chunks;
+        if (entry->valid && entry->referenced) {
+            entry->referenced = false;
+            continue;
+        }
+        free(entry->data);
+        entry->chunk = chunk;
+        entry->data = data;
+        entry->valid = true;
+        entry->referenced = true;
+        break;
+    }
+    pthread_mutex_unlock(&packed_cache_lock);
+    return true;
+}
+
+/**
+ * Read given number of blocks from a packed image; otherwise identical to
+ * `pread_blocks_raw()`. This function is thread-safe.
+ */
+ssize_t packed_pread_blocks(void* buffer, paddr_t start_block, size_t num_blocks) {
+    if ((uint64_t)start_block >= packed_header.block_count) {
+        return 0;
+    }
+    if (num_blocks > packed_header.block_count - start_block) {
+        num_blocks = packed_header.block_count - start_block;
+    }
+
+    uint64_t run_index = packed_find_run(start_block);
+    size_t i = 0;
+    while (i < num_blocks) {
+        uint64_t block = start_block + i;
+        char* dest = (char*)buffer + i * nx_block_size;
+
+        while (run_index < packed_header.num_runs
+            && packed_runs[run_index].start_block + packed_runs[run_index].count <= block
+        ) {
+            run_index++;
+        }
+
+        if (run_index == packed_header.num_runs || packed_runs[run_index].start_block > block) {
+            // Not covered by any run, so the block is zeroed. Zero up to the
+            // start of the next run in one go.
+            uint64_t end = run_index == packed_header.num_runs
+                ? start_block + num_blocks
+                : packed_runs[run_index].start_block;
+            size_t count = end - block;
+            if (count > num_blocks - i) {
+                count = num_blocks - i;
+            }
+            memset(dest, 0, count * nx_block_size);
+            i += count;
+            continue;
+        }
+
+        packed_run_t* run = packed_runs + run_index;
+        uint64_t unique = run->unique_start + (block - run->start_block);
+        size_t count = run->start_block + run->count - block;
+        if (count > num_blocks - i) {
+            count = num_blocks - i;
+        }
+        size_t chunk_remaining = packed_header.chunk_blocks - unique % packed_header.chunk_blocks;
+        if (count > chunk_remaining) {
+            count = chunk_remaining;
+        }
+
+        if (!packed_copy_unique_blocks(dest, unique, count)) {
+            return -1;
+        }
+        i += count;
+    }
+
+    return num_blocks;
+}
+
+#endif // APFS_IO_PACKED_H
@@ -0,0 +1,506 @@
+/**
+ * Error-tolerant reads for use on failing media, in the style of GNU ddrescue.
+ *
+ * When `io_rescue` is set (`--rescue`), every read of the container goes
+ * through `rescue_pread_blocks()`, which never fails because of bad blocks:
+ *
+ * - A read that fails is retried in successively smaller pieces, so that the
+ *   readable blocks around an error are still read.
+ * - A single block that still fails after `rescue_retries` further attempts is
+ *   recorded as bad, and zero-filled in the caller's buffer.
+ * - Once two consecutive blocks are found to be bad, the next few blocks of
+ *   the same request are skipped (zero-filled without being read), since
+ *   errors tend to come in clusters and each failed read can take seconds.
+ *   The amount skipped doubles each time this happens without an intervening
+ *   successful read, and resets once a read succeeds.
+ * - Bad and skipped areas are kept in a bad-block map, which is saved to the
+ *   file given by `--bad-map` in the ddrescue mapfile format. Areas marked bad
+ *   (`-`) in that file are never read again on later runs; skipped areas
+ *   (`/`) are retried. A mapfile produced by ddrescue itself may be given.
+ *   Like ddrescue, we save the map every `RESCUE_SAVE_SECONDS` seconds or
+ *   every `RESCUE_SAVE_RECORDS` new areas, whichever comes first, and once
+ *   more at exit, rather than after every bad block.
+ * - The first bad block is reported on stderr; the rest are only counted, and
+ *   a summary is printed at exit.
+ *
+ * Callers can tell which blocks were zero-filled using `rescue_is_bad()`.
+ *
+ * This header is included by `io.h`, which it depends on; include that
+ * instead.
+ */
+
+#ifndef APFS_IO_RESCUE_H
+#define APFS_IO_RESCUE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/** Configuration **/
+
+// Set to `true` (`--rescue`, `--bad-map`) to enable error-tolerant reads.
+bool        io_rescue = false;
+
+// The number of further attempts made to read a single block that fails.
+uint32_t    rescue_retries = 2;
+
+// The least and most number of blocks skipped after a cluster of bad blocks.
+uint32_t    rescue_skip_min_blocks = 16;
+uint32_t    rescue_skip_max_blocks = 4096;
+
+// Path of the bad-block map to load and save, or NULL.
+char*       rescue_map_path = NULL;
+
+// How often the bad-block map is saved whilst bad blocks are being found.
+#define RESCUE_SAVE_SECONDS     30
+#define RESCUE_SAVE_RECORDS     1024
+
+/** Statistics **/
+
+uint64_t    rescue_num_errors = 0;          // Failed reads, including retries
+uint64_t    rescue_num_bad_blocks = 0;      // Blocks found to be bad during this run
+uint64_t    rescue_num_skipped_blocks = 0;  // Blocks skipped after clusters of bad blocks
+uint64_t    rescue_num_avoided_blocks = 0;  // Reads of known-bad blocks that were not attempted
+
+/** State **/
+
+#define RESCUE_STATUS_BAD       '-'
+#define RESCUE_STATUS_SKIPPED   '/'
+
+/**
+ * A contiguous area of blocks in the bad-block map.
+ */
+typedef struct {
+    paddr_t     start;
+    uint64_t    count;
+    char        status;     // `RESCUE_STATUS_BAD` or `RESCUE_STATUS_SKIPPED`
+} rescue_area_t;
+
+// Sorted by `start`; areas never overlap.
+rescue_area_t*  rescue_areas = NULL;
+size_t          rescue_num_areas = 0;
+size_t          rescue_areas_capacity = 0;
+
+bool            rescue_initialised = false;
+uint64_t        rescue_num_unsaved = 0;     // Areas recorded since the map was last saved
+time_t          rescue_last_save = 0;
+uint32_t        rescue_skip_blocks = 0;
+uint32_t        rescue_consecutive_bad = 0;
+
+// `rescue_map_lock` protects the map and statistics. `rescue_slow_lock` is
+// held whilst working around an error, so that only one thread at a time
+// hammers a failing area of the disk.
+pthread_mutex_t rescue_map_lock     = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t rescue_slow_lock    = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Find the first area in the map that ends after a given block.
+ *
+ * RETURN VALUE:    The index of that area, or `rescue_num_areas` if there is
+ *      no such area.
+ */
+size_t rescue_find_area(paddr_t addr) {
+    size_t low = 0;
+    size_t high = rescue_num_areas;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if ((uint64_t)rescue_areas[mid].start + rescue_areas[mid].count <= (uint64_t)addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * Add an area to the map. The area must not overlap any area already in the
+ * map. Adjacent areas with the same status are merged.
+ */
+void rescue_add_area(paddr_t start, uint64_t count, char status) {
+    if (count == 0) {
+        return;
+    }
+    size_t index = rescue_find_area(start);
+
+    // Merge with the preceding and/or following area if possible
+    bool merge_prev = index > 0
+        && rescue_areas[index - 1].status == status
+        && rescue_areas[index - 1].start + (paddr_t)rescue_areas[index - 1].count == start;
+    bool merge_next = index < rescue_num_areas
+        && rescue_areas[index].status == status
+        && start + (paddr_t)count == rescue_areas[index].start;
+
+    if (merge_prev && merge_next) {
+        rescue_areas[index - 1].count += count + rescue_areas[index].count;
+        memmove(rescue_areas + index, rescue_areas + index + 1, (rescue_num_areas - index - 1) * sizeof(rescue_area_t));
+        rescue_num_areas--;
+        return;
+    }
+    if (merge_prev) {
+        rescue_areas[index - 1].count += count;
+        return;
+    }
+    if (merge_next) {
+        rescue_areas[index].start = start;
+        rescue_areas[index].count += count;
+        return;
+    }
+
+    if (rescue_num_areas == rescue_areas_capacity) {
+        rescue_areas_capacity = rescue_areas_capacity ? 2 * rescue_areas_capacity : 64;
+        rescue_areas = realloc(rescue_areas, rescue_areas_capacity * sizeof(rescue_area_t));
+        if (!rescue_areas) {
+            fprintf(stderr, "\nABORT: rescue_add_area: Could not allocate sufficient memory for `rescue_areas`.\n");
+            exit(-1);
+        }
+    }
+    memmove(rescue_areas + index + 1, rescue_areas + index, (rescue_num_areas - index) * sizeof(rescue_area_t));
+    rescue_areas[index].start   = start;
+    rescue_areas[index].count   = count;
+    rescue_areas[index].status  = status;
+    rescue_num_areas++;
+}
+
+/**
+ * Load the bad-block map from `rescue_map_path`, if it exists. Only areas
+ * marked as bad are loaded; ddrescue's other statuses describe areas that
+ * are worth trying again.
+ */
+void rescue_load_map() {
+    FILE* map = fopen(rescue_map_path, "r");
+    if (!map) {
+        return;
+    }
+
+    char line[256];
+    bool seen_status_line = false;
+    size_t num_loaded = 0;
+    while (fgets(line, sizeof(line), map)) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        // The first non-comment line gives ddrescue's position and phase.
+        if (!seen_status_line) {
+            seen_status_line = true;
+            continue;
+        }
+
+        unsigned long long pos, size;
+        char status;
+        if (sscanf(line, "%llx %llx %c", &pos, &size, &status) != 3 || status != RESCUE_STATUS_BAD) {
+            continue;
+        }
+
+        // Any block that overlaps a bad area is considered bad.
+        paddr_t first = pos / nx_block_size;
+        paddr_t end = (pos + size + nx_block_size - 1) / nx_block_size;
+        size_t index = rescue_find_area(first);
+        while (first < end) {
+            if (index < rescue_num_areas && rescue_areas[index].start <= first) {
+                first = rescue_areas[index].start + rescue_areas[index].count;
+                index++;
+                continue;
+            }
+            paddr_t area_end = end;
+            if (index < rescue_num_areas && rescue_areas[index].start < area_end) {
+                area_end = rescue_areas[index].start;
+            }
+            rescue_add_area(first, area_end - first, RESCUE_STATUS_BAD);
+            num_loaded += area_end - first;
+            first = area_end;
+            index = rescue_find_area(first);
+        }
+    }
+    fclose(map);
+
+    fprintf(stderr, "Loaded bad-block map `%s`: %lu known-bad blocks will not be read.\n", rescue_map_path, num_loaded);
+}
+
+/**
+ * Save the bad-block map to `rescue_map_path` in the ddrescue mapfile format.
+ * Blocks that aren't in the map are described as non-tried (`?`), since we
+ * don't keep track of which blocks were read successfully. The map is written
+ * to a temporary file which then replaces the old one, so that a crash never
+ * leaves a truncated map behind.
+ */
+void rescue_save_map() {
+    if (!rescue_map_path) {
+        return;
+    }
+
+    size_t tmp_path_len = strlen(rescue_map_path) + 5;
+    char* tmp_path = malloc(tmp_path_len);
+    if (!tmp_path) {
+        fprintf(stderr, "rescue_save_map: Could not allocate sufficient memory for `tmp_path`.\n");
+        return;
+    }
+    snprintf(tmp_path, tmp_path_len, "%s.tmp", rescue_map_path);
+
+    FILE* map = fopen(tmp_path, "w");
+    if (!map) {
+        fprintf(stderr, "rescue_save_map: Could not open `%s` for writing.\n", tmp_path);
+        free(tmp_path);
+        return;
+    }
+
+    fprintf(map, "# Mapfile. Created by apfs-tools\n");
+    fprintf(map, "# current_pos  current_status  current_pass\n");
+    fprintf(map, "0x00000000     ?               1\n");
+    fprintf(map, "#      pos        size  status\n");
+
+    uint64_t pos = 0;
+    for (size_t i = 0; i < rescue_num_areas; i++) {
+        uint64_t start = (uint64_t)rescue_areas[i].start * nx_block_size;
+        if (start > pos) {
+            fprintf(map, "0x%08llx  0x%08llx  ?\n", pos, start - pos);
+        }
+        fprintf(map, "0x%08llx  0x%08llx  %c\n", start, rescue_areas[i].count * nx_block_size, rescue_areas[i].status);
+        pos = start + rescue_areas[i].count * nx_block_size;
+    }
+
+    bool ok = fflush(map) == 0;
+    ok = fclose(map) == 0 && ok;
+    if (!ok || rename(tmp_path, rescue_map_path) != 0) {
+        fprintf(stderr, "rescue_save_map: Could not write the bad-block map to `%s`.\n", rescue_map_path);
+    }
+    free(tmp_path);
+}
+
+/**
+ * Record a range of blocks in the map, and save the map if it is due to be
+ * saved. Must be called with `rescue_map_lock` held.
+ */
+void rescue_record(paddr_t start, uint64_t count, char status) {
+    rescue_add_area(start, count, status);
+    if (status == RESCUE_STATUS_BAD) {
+        if (rescue_num_bad_blocks == 0) {
+            fprintf(stderr, "rescue: Block %#llx is unreadable; substituting zeroes for it and any further bad blocks. A summary will be given at the end.\n", start);
+        }
+        rescue_num_bad_blocks += count;
+    } else {
+        rescue_num_skipped_blocks += count;
+    }
+
+    rescue_num_unsaved++;
+    time_t now = time(NULL);
+    if (rescue_num_unsaved >= RESCUE_SAVE_RECORDS || now - rescue_last_save >= RESCUE_SAVE_SECONDS) {
+        rescue_save_map();
+        rescue_num_unsaved = 0;
+        rescue_last_save = now;
+    }
+}
+
+/**
+ * Save the bad-block map for the last time, and summarise the bad blocks that
+ * were found. Registered with `atexit()` once the first rescue read is made.
+ */
+void rescue_finish() {
+    pthread_mutex_lock(&rescue_map_lock);
+    if (rescue_num_unsaved > 0) {
+        rescue_save_map();
+        rescue_num_unsaved = 0;
+    }
+    if (rescue_num_bad_blocks + rescue_num_skipped_blocks > 0) {
+        fprintf(stderr, "rescue: %llu blocks were unreadable and %llu more were skipped after clusters of bad blocks; zeroes were substituted for all of them (%llu failed reads).\n",
+            rescue_num_bad_blocks, rescue_num_skipped_blocks, rescue_num_errors
+        );
+    }
+    pthread_mutex_unlock(&rescue_map_lock);
+}
+
+/**
+ * Determine whether a given block is bad, or was skipped, and so was (or
+ * would be) zero-filled rather than read.
+ */
+bool rescue_is_bad(paddr_t addr) {
+    pthread_mutex_lock(&rescue_map_lock);
+    size_t index = rescue_find_area(addr);
+    bool bad = index < rescue_num_areas && rescue_areas[index].start <= addr;
+    pthread_mutex_unlock(&rescue_map_lock);
+    return bad;
+}
+
+/**
+ * Count the blocks in a given range that are bad or were skipped.
+ */
+uint64_t rescue_count_bad(paddr_t start_block, size_t num_blocks) {
+    uint64_t count = 0;
+    paddr_t end_block = start_block + num_blocks;
+
+    pthread_mutex_lock(&rescue_map_lock);
+    for (size_t i = rescue_find_area(start_block); i < rescue_num_areas && rescue_areas[i].start < end_block; i++) {
+        paddr_t first = rescue_areas[i].start > start_block ? rescue_areas[i].start : start_block;
+        paddr_t end = rescue_areas[i].start + (paddr_t)rescue_areas[i].count;
+        if (end > end_block) {
+            end = end_block;
+        }
+        count += end - first;
+    }
+    pthread_mutex_unlock(&rescue_map_lock);
+    return count;
+}
+
+/**
+ * Read a range of blocks that contains no known-bad blocks, working around
+ * any errors as described at the top of this file. Must be called with
+ * `rescue_slow_lock` held.
+ *
+ * RETURN VALUE:    The number of blocks placed in `buffer`, which is fewer
+ *      than `num_blocks` only if end-of-file is reached.
+ */
+size_t rescue_read_range(int fd, char* buffer, paddr_t start_block, size_t num_blocks) {
+    size_t pos = 0;
+    size_t try_len = num_blocks;
+
+    while (pos < num_blocks) {
+        size_t len = num_blocks - pos;
+        if (len > try_len) {
+            len = try_len;
+        }
+
+        ssize_t num_read = pread_blocks_raw(fd, buffer + pos * nx_block_size, start_block + pos, len);
+        if (num_read >= 0) {
+            pos += num_read;
+            if ((size_t)num_read < len) {
+                break;  // End-of-file
+            }
+            // Grow the reads again now that we're past the error.
+            try_len = 2 * try_len < num_blocks ? 2 * try_len : num_blocks;
+            rescue_skip_blocks = rescue_skip_min_blocks;
+            rescue_consecutive_bad = 0;
+            continue;
+        }
+
+        pthread_mutex_lock(&rescue_map_lock);
+        rescue_num_errors++;
+        pthread_mutex_unlock(&rescue_map_lock);
+
+        // Home in on the error by halving the read size.
+        if (len > 1) {
+            try_len = (len + 1) / 2;
+            continue;
+        }
+
+        // A single block failed; retry it.
+        for (uint32_t attempt = 0; attempt < rescue_retries && num_read < 0; attempt++) {
+            num_read = pread_blocks_raw(fd, buffer + pos * nx_block_size, start_block + pos, 1);
+            if (num_read < 0) {
+                pthread_mutex_lock(&rescue_map_lock);
+                rescue_num_errors++;
+                pthread_mutex_unlock(&rescue_map_lock);
+            }
+        }
+        if (num_read == 0) {
+            break;  // End-of-file
+        }
+        if (num_read == 1) {
+            pos++;
+            rescue_consecutive_bad = 0;
+            continue;
+        }
+
+        // The block is bad; zero-fill it, and skip ahead if it is part of a
+        // cluster of bad blocks.
+        memset(buffer + pos * nx_block_size, 0, nx_block_size);
+        pthread_mutex_lock(&rescue_map_lock);
+        rescue_record(start_block + pos, 1, RESCUE_STATUS_BAD);
+        pos++;
+        rescue_consecutive_bad++;
+
+        if (rescue_consecutive_bad >= 2) {
+            size_t skip = rescue_skip_blocks;
+            if (skip > num_blocks - pos) {
+                skip = num_blocks - pos;
+            }
+            if (skip > 0) {
+                memset(buffer + pos * nx_block_size, 0, skip * nx_block_size);
+                rescue_record(start_block + pos, skip, RESCUE_STATUS_SKIPPED);
+                pos += skip;
+            }
+            rescue_skip_blocks = 2 * rescue_skip_blocks < rescue_skip_max_blocks ? 2 * rescue_skip_blocks : rescue_skip_max_blocks;
+        }
+        pthread_mutex_unlock(&rescue_map_lock);
+
+        try_len = 1;
+    }
+
+    return pos;
+}
+
+/**
+ * Read given number of blocks via a given file descriptor, tolerating read
+ * errors. The arguments and return value are as for `pread_blocks_raw()`,
+ * except that this function does not fail because of bad blocks; they are
+ * zero-filled instead.
+ */
+ssize_t rescue_pread_blocks(int fd, void* buffer, paddr_t start_block, size_t num_blocks) {
+    pthread_mutex_lock(&rescue_map_lock);
+    if (!rescue_initialised) {
+        rescue_initialised = true;
+        rescue_skip_blocks = rescue_skip_min_blocks;
+        rescue_last_save = time(NULL);
+        if (rescue_map_path) {
+            rescue_load_map();
+        }
+        atexit(rescue_finish);
+    }
+    size_t index = rescue_find_area(start_block);
+    bool overlaps_map = index < rescue_num_areas && rescue_areas[index].start < start_block + (paddr_t)num_blocks;
+    pthread_mutex_unlock(&rescue_map_lock);
+
+    // Fast path: nothing known to be bad, and the read succeeds
+    if (!overlaps_map) {
+        ssize_t num_read = pread_blocks_raw(fd, buffer, start_block, num_blocks);
+        if (num_read >= 0) {
+            return num_read;
+        }
+    }
+
+    // Slow path: read the range piecewise, avoiding known-bad areas
+    pthread_mutex_lock(&rescue_slow_lock);
+    size_t pos = 0;
+    while (pos < num_blocks) {
+        paddr_t addr = start_block + pos;
+
+        pthread_mutex_lock(&rescue_map_lock);
+        index = rescue_find_area(addr);
+        paddr_t area_start = index < rescue_num_areas ? rescue_areas[index].start : start_block + (paddr_t)num_blocks;
+        paddr_t area_end = index < rescue_num_areas ? area_start + (paddr_t)rescue_areas[index].count : area_start;
+        pthread_mutex_unlock(&rescue_map_lock);
+
+        if (area_start <= addr) {
+            // Inside a known bad or skipped area; zero-fill without reading.
+            size_t len = area_end - addr;
+            if (len > num_blocks - pos) {
+                len = num_blocks - pos;
+            }
+            memset((char*)buffer + pos * nx_block_size, 0, len * nx_block_size);
+
+            pthread_mutex_lock(&rescue_map_lock);
+            rescue_num_avoided_blocks += len;
+            pthread_mutex_unlock(&rescue_map_lock);
+
+            pos += len;
+            continue;
+        }
+
+        size_t len = area_start - addr;
+        if (len > num_blocks - pos) {
+            len = num_blocks - pos;
+        }
+        size_t num_read = rescue_read_range(fd, (char*)buffer + pos * nx_block_size, addr, len);
+        pos += num_read;
+        if (num_read < len) {
+            break;  // End-of-file
+        }
+    }
+    pthread_mutex_unlock(&rescue_slow_lock);
+
+    return pos;
+}
+
+#endif // APFS_IO_RESCUE_H
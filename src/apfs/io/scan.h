@@ -0,0 +1,403 @@
+/**
+ * A sequential scanner over a range of blocks in the APFS container. The range
+ * is read in large chunks, several of which are kept in flight at once using
+ * the asynchronous I/O engine in `async.h`, whilst the caller consumes the
+ * chunks in address order. If `io_direct` is set, the chunks are read with
+ * direct I/O (see `direct.h`), so that the scan does not pollute the page
+ * cache.
+ *
+ * Typical usage:
+ *
+ *      scan_t scan;
+ *      scan_init(&scan, start_addr, end_addr);
+ *      paddr_t addr;
+ *      obj_phys_t* block;
+ *      while ( (block = scan_next(&scan, &addr)) ) {
+ *          // ... inspect the block at address `addr` ...
+ *      }
+ *      scan_end(&scan);
+ */
+
+#ifndef APFS_IO_SCAN_H
+#define APFS_IO_SCAN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "../io.h"
+#include "../struct/object.h"
+#include "async.h"
+#include "direct.h"
+
+/** Scanner configuration; these should be set before calling `scan_init()` **/
+
+// The number of chunks to keep in flight at once.
+uint32_t    scan_queue_depth = 8;
+
+// The size of each chunk, in blocks.
+uint32_t    scan_chunk_blocks = 256;
+
+/**
+ * A range of blocks [`start_block`, `end_block`).
+ */
+typedef struct {
+    paddr_t     start_block;
+    paddr_t     end_block;
+} scan_range_t;
+
+/**
+ * State of a scan over the block range [`start_block`, `end_block`), or over
+ * several such ranges in turn; see `scan_init_ranges()`.
+ *
+ * Each of the `num_slots` slots holds one chunk of `chunk_blocks` blocks. Slots
+ * are used as a ring: `head` is the slot holding the lowest-addressed chunk
+ * that has not yet been handed to the caller, and reads are submitted for the
+ * `num_in_flight` slots following it (inclusive).
+ */
+typedef struct {
+    paddr_t     start_block;
+    paddr_t     end_block;
+    paddr_t     next_block;     // Address of the next chunk to be submitted
+
+    // The ranges still to be scanned after the current one, if any
+    scan_range_t*   ranges;
+    size_t          num_ranges;
+    size_t          next_range;
+
+    uint32_t    num_slots;
+    size_t      chunk_blocks;
+    char*       buffers;
+    aio_req_t*  slots;
+    bool*       slot_done;
+    uint32_t    head;
+    uint32_t    num_in_flight;
+    bool        head_consumed;  // Whether the caller has been given the head chunk
+    bool        async;          // Whether the asynchronous engine is in use
+    bool        buffers_registered;
+    bool        direct;         // Whether chunks are read with direct I/O
+    bool        unmasked;       // Whether chunks are read as the device holds them; see `aio_req_t`
+    bool        eof;
+
+    // Whether chunks that cannot be read are skipped (the default) or end the
+    // scan; in the latter case, `error` is set to the corresponding `errno`.
+    bool        skip_errors;
+    int         error;
+
+    // Whether the head chunk, which could not be read whole, is being re-read
+    // one block at a time, and the index within it of the next block to read
+    bool        retrying;
+    size_t      retry_index;
+
+    // The chunk currently being consumed by `scan_next()`
+    char*       cur_data;
+    paddr_t     cur_block;
+    size_t      cur_num_blocks;
+    size_t      cur_index;
+} scan_t;
+
+/**
+ * Begin a scan over the blocks from `start_block` (inclusive) to `end_block`
+ * (exclusive).
+ */
+void scan_init(scan_t* scan, paddr_t start_block, paddr_t end_block) {
+    memset(scan, 0, sizeof(scan_t));
+    scan->start_block   = start_block;
+    scan->end_block     = end_block;
+    scan->next_block    = start_block;
+    scan->chunk_blocks  = scan_chunk_blocks > 0 ? scan_chunk_blocks : 1;
+    scan->skip_errors   = true;
+
+    scan->async = aio_init();
+    scan->num_slots = scan->async ? scan_queue_depth : 1;
+    if (scan->num_slots == 0) {
+        scan->num_slots = 1;
+    }
+    if (scan->async && scan->num_slots > aio_queue_depth) {
+        scan->num_slots = aio_queue_depth;
+    }
+
+    scan->direct = direct_open();
+
+    size_t chunk_size = scan->chunk_blocks * nx_block_size;
+    scan->buffers   = scan->direct
+        ? direct_alloc(scan->num_slots * chunk_size)
+        : malloc(scan->num_slots * chunk_size);
+    scan->slots     = calloc(scan->num_slots, sizeof(aio_req_t));
+    scan->slot_done = calloc(scan->num_slots, sizeof(bool));
+    if (!scan->buffers || !scan->slots || !scan->slot_done) {
+        fprintf(stderr, "\nABORT: scan_init: Could not allocate sufficient memory for %u chunks of %lu blocks.\n", scan->num_slots, scan->chunk_blocks);
+        exit(-1);
+    }
+
+    struct iovec* iovecs = malloc(scan->num_slots * sizeof(struct iovec));
+    if (!iovecs) {
+        fprintf(stderr, "\nABORT: scan_init: Could not allocate sufficient memory for `iovecs`.\n");
+        exit(-1);
+    }
+    for (uint32_t i = 0; i < scan->num_slots; i++) {
+        scan->slots[i].buffer = scan->buffers + i * chunk_size;
+        scan->slots[i].user_data = scan->slot_done + i;
+        scan->slots[i].direct = scan->direct;
+        iovecs[i].iov_base = scan->slots[i].buffer;
+        iovecs[i].iov_len  = chunk_size;
+    }
+    if (scan->async) {
+        scan->buffers_registered = aio_register_buffers(iovecs, scan->num_slots);
+    }
+    for (uint32_t i = 0; i < scan->num_slots; i++) {
+        scan->slots[i].fixed_index = scan->buffers_registered ? (int)i : -1;
+    }
+    free(iovecs);
+}
+
+/**
+ * Begin a scan over several ranges of blocks in turn, which should be in
+ * ascending order and must not overlap. Chunks never span two ranges. The
+ * array of ranges must remain valid until `scan_end()` is called.
+ */
+void scan_init_ranges(scan_t* scan, scan_range_t* ranges, size_t num_ranges) {
+    if (num_ranges == 0) {
+        scan_init(scan, 0, 0);
+        return;
+    }
+    scan_init(scan, ranges[0].start_block, ranges[0].end_block);
+    scan->ranges        = ranges;
+    scan->num_ranges    = num_ranges;
+    scan->next_range    = 1;
+}
+
+/**
+ * Submit reads for as many free slots as possible.
+ */
+void scan_fill(scan_t* scan) {
+    while (scan->num_in_flight < scan->num_slots && !scan->eof) {
+        // Move on to the next range once all of this one has been submitted.
+        while (scan->next_block >= scan->end_block && scan->next_range < scan->num_ranges) {
+            scan_range_t* range = scan->ranges + scan->next_range++;
+            scan->start_block   = range->start_block;
+            scan->end_block     = range->end_block;
+            scan->next_block    = range->start_block;
+        }
+        if (scan->next_block >= scan->end_block) {
+            break;
+        }
+
+        uint32_t i = (scan->head + scan->num_in_flight) % scan->num_slots;
+        aio_req_t* req = scan->slots + i;
+
+        req->start_block = scan->next_block;
+        req->num_blocks  = scan->chunk_blocks;
+        req->unmasked    = scan->unmasked;
+        if (req->num_blocks > (size_t)(scan->end_block - scan->next_block)) {
+            req->num_blocks = scan->end_block - scan->next_block;
+        }
+        scan->next_block += req->num_blocks;
+        scan->slot_done[i] = false;
+        scan->num_in_flight++;
+
+        if (scan->async) {
+            aio_submit(req);
+        } else {
+            aio_execute(req);
+            scan->slot_done[i] = true;
+        }
+    }
+    if (scan->async) {
+        aio_flush();
+    }
+}
+
+/**
+ * Re-read the head chunk of a scan, which could not be read whole, one block at
+ * a time, so that only the blocks that still can't be read are skipped; each
+ * such block is reported on stdout.
+ *
+ * start_block, data:   As for `scan_next_chunk()`.
+ *
+ * RETURN VALUE:    The number of blocks in the next run of consecutive blocks
+ *      of the chunk that could be read, or 0 once the whole chunk has been
+ *      re-read.
+ */
+size_t scan_retry_chunk(scan_t* scan, paddr_t* start_block, char** data) {
+    aio_req_t* req = scan->slots + scan->head;
+    while (scan->retry_index < req->num_blocks) {
+        size_t first = scan->retry_index;
+        size_t i = first;
+        ssize_t result = 1;
+        for (; i < req->num_blocks; i++) {
+            // Read each block into its place in the slot's buffer in the same
+            // way as the chunk was read, e.g. with direct I/O; the block size
+            // is a multiple of the sector size whenever that is used, so every
+            // block of the buffer is suitably aligned.
+            aio_req_t block_req = *req;
+            block_req.buffer      = (char*)req->buffer + i * nx_block_size;
+            block_req.start_block = req->start_block + i;
+            block_req.num_blocks  = 1;
+            aio_execute(&block_req);
+            result = block_req.result;
+            if (result != 1) {
+                errno = block_req.error;
+                break;
+            }
+        }
+
+        // Deal with the block that couldn't be read, if any, before handing
+        // out the run before it, so that it isn't read twice.
+        scan->retry_index = i;
+        if (result == 0) {
+            // Reached end-of-file; don't submit anything beyond this chunk.
+            scan->eof = true;
+            scan->retry_index = req->num_blocks;
+        } else if (result == -1) {
+            printf("- An error occurred whilst reading block %#llx (%s); skipping it.\n",
+                req->start_block + i,
+                strerror(errno)
+            );
+            scan->retry_index++;
+        }
+
+        if (i > first) {
+            *start_block = req->start_block + first;
+            *data = (char*)req->buffer + first * nx_block_size;
+            return i - first;
+        }
+    }
+
+    scan->retrying = false;
+    return 0;
+}
+
+/**
+ * Get the next chunk of the scan, in address order. The data remains valid
+ * until the next call to `scan_next_chunk()`, `scan_next()`, or `scan_end()`.
+ *
+ * Chunks that could not be read are re-read one block at a time, and the
+ * blocks that still can't be read are reported on stdout and skipped, so
+ * consecutive chunks are not necessarily contiguous, unless `skip_errors` has
+ * been cleared, in which case the scan ends at the first such chunk.
+ *
+ * start_block:     On return, set to the address of the first block of the
+ *      chunk.
+ *
+ * data:            On return, set to point to the data of the chunk.
+ *
+ * RETURN VALUE:    The number of blocks in the chunk, or 0 if the scan has
+ *      reached the end of its range or the end of the container.
+ */
+size_t scan_next_chunk(scan_t* scan, paddr_t* start_block, char** data) {
+    while (true) {
+        // Hand out the rest of a chunk that is being re-read, if any.
+        if (scan->retrying) {
+            size_t num_blocks = scan_retry_chunk(scan, start_block, data);
+            if (num_blocks > 0) {
+                return num_blocks;
+            }
+        }
+
+        // Release the chunk that the caller was given last time.
+        if (scan->head_consumed) {
+            if (scan->direct) {
+                direct_release(scan->slots[scan->head].start_block, scan->slots[scan->head].num_blocks);
+            }
+            scan->head = (scan->head + 1) % scan->num_slots;
+            scan->num_in_flight--;
+            scan->head_consumed = false;
+        }
+
+        scan_fill(scan);
+        if (scan->num_in_flight == 0) {
+            return 0;
+        }
+
+        // Wait until the head chunk has arrived; chunks may complete out of
+        // order, so reap completions until that happens.
+        while (!scan->slot_done[scan->head]) {
+            aio_req_t* req = aio_wait();
+            if (!req) {
+                fprintf(stderr, "\nABORT: scan_next_chunk: Lost track of an in-flight read.\n");
+                exit(-1);
+            }
+            *(bool*)req->user_data = true;
+        }
+
+        aio_req_t* req = scan->slots + scan->head;
+        scan->head_consumed = true;
+
+        if (req->result == -1) {
+            if (!scan->skip_errors) {
+                scan->error = req->error;
+                scan->eof = true;
+                return 0;
+            }
+            printf("- An error occurred whilst reading blocks %#llx to %#llx (%s); reading them one at a time.\n",
+                req->start_block,
+                req->start_block + req->num_blocks - 1,
+                strerror(req->error)
+            );
+            scan->retrying = true;
+            scan->retry_index = 0;
+            continue;
+        }
+        if ((size_t)req->result < req->num_blocks) {
+            // Reached end-of-file; don't submit anything beyond this chunk.
+            scan->eof = true;
+            if (req->result == 0) {
+                continue;
+            }
+        }
+
+        *start_block = req->start_block;
+        *data = req->buffer;
+        return req->result;
+    }
+}
+
+/**
+ * Get the next block of the scan, in address order. The data remains valid
+ * until the next call to `scan_next()` or `scan_end()`.
+ *
+ * addr:            On return, set to the address of the block.
+ *
+ * RETURN VALUE:    A pointer to the block data, or NULL if the scan has
+ *      reached the end of its range or the end of the container.
+ */
+obj_phys_t* scan_next(scan_t* scan, paddr_t* addr) {
+    if (scan->cur_index >= scan->cur_num_blocks) {
+        scan->cur_num_blocks = scan_next_chunk(scan, &scan->cur_block, &scan->cur_data);
+        scan->cur_index = 0;
+        if (scan->cur_num_blocks == 0) {
+            return NULL;
+        }
+    }
+
+    *addr = scan->cur_block + scan->cur_index;
+    return (obj_phys_t*)(scan->cur_data + (scan->cur_index++) * nx_block_size);
+}
+
+/**
+ * End a scan, waiting for any reads still in flight and releasing all memory
+ * associated with it. The scan may be ended before it reaches the end of its
+ * range.
+ */
+void scan_end(scan_t* scan) {
+    if (scan->direct && scan->head_consumed) {
+        direct_release(scan->slots[scan->head].start_block, scan->slots[scan->head].num_blocks);
+    }
+    if (scan->async) {
+        while (aio_num_outstanding > 0) {
+            aio_wait();
+        }
+        if (scan->buffers_registered) {
+            aio_unregister_buffers();
+        }
+    }
+
+    free(scan->buffers);
+    free(scan->slots);
+    free(scan->slot_done);
+    memset(scan, 0, sizeof(scan_t));
+}
+
+#endif // APFS_IO_SCAN_H
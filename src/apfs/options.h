@@ -0,0 +1,291 @@
+/**
+ * Parsing of the command-line options that are common to all of the tools,
+ * namely those that configure the I/O layer and the output format. Each tool
+ * calls `parse_common_options()` before looking at its positional arguments;
+ * recognised options are removed from `argv`, so the tools' existing checks of
+ * `argc` work unchanged.
+ */
+
+#ifndef APFS_OPTIONS_H
+#define APFS_OPTIONS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "io.h"
+#include "io/async.h"
+#include "io/scan.h"
+#include "io/direct.h"
+#include "io/cache.h"
+#include "func/crypto.h"
+#include "string/record.h"
+#include "string/progress.h"
+
+/**
+ * Parse an unsigned integer option value, given in decimal or as a hexadecimal
+ * value prefixed with `0x`.
+ *
+ * RETURN VALUE:    `true` if `string` is a valid value, else `false`.
+ */
+bool parse_option_uint64(char* string, uint64_t* value) {
+    char* end;
+    if (!*string || *string == '-') {
+        return false;
+    }
+    *value = strtoull(string, &end, 0);
+    return *end == '\0';
+}
+
+/**
+ * Parse an option value that must be a positive 32-bit integer.
+ */
+bool parse_option_uint32(char* string, uint32_t* value) {
+    uint64_t value_64;
+    if (!parse_option_uint64(string, &value_64) || value_64 == 0 || value_64 > UINT32_MAX) {
+        return false;
+    }
+    *value = value_64;
+    return true;
+}
+
+/**
+ * Parse an option value that must be a non-negative 32-bit integer.
+ */
+bool parse_option_uint32_or_zero(char* string, uint32_t* value) {
+    uint64_t value_64;
+    if (!parse_option_uint64(string, &value_64) || value_64 > UINT32_MAX) {
+        return false;
+    }
+    *value = value_64;
+    return true;
+}
+
+/**
+ * Read a password from the first line of a file, so that it need not be given
+ * on the command line, where other users may be able to see it.
+ *
+ * RETURN VALUE:    A newly allocated string, or NULL if the file could not be
+ *      read, in which case an error has been reported.
+ */
+char* read_password_file(char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Could not open the password file `%s` (%s).\n", path, strerror(errno));
+        return NULL;
+    }
+
+    char* password = malloc(1024);
+    if (!password) {
+        fprintf(stderr, "\nABORT: read_password_file: Could not allocate sufficient memory for the password.\n");
+        exit(-1);
+    }
+    if (!fgets(password, 1024, file)) {
+        password[0] = '\0';
+    }
+    fclose(file);
+    password[strcspn(password, "\r\n")] = '\0';
+    return password;
+}
+
+/**
+ * Print a description of the common options to a given stream.
+ */
+void print_common_options_usage(FILE* stream) {
+    fprintf(stream,
+        "Common options:\n"
+        "  --queue-depth=N     Keep up to N reads in flight at once (default: %u).\n"
+        "  --scan-depth=N      Keep up to N chunks in flight when scanning (default: %u).\n"
+        "  --chunk-blocks=N    Read N blocks per request when scanning or copying (default: %u).\n"
+        "  --threads=N         Use N threads for the thread-pool I/O engine (default: %u).\n"
+        "  --no-io-uring       Use the thread-pool I/O engine even if io_uring is available.\n"
+        "  --direct            Bypass the page cache when scanning or copying large ranges of blocks.\n"
+        "  --cache-blocks=N    Cache up to N blocks read whilst walking B-trees (default: %u; 0 disables).\n"
+        "  --readahead=N       Read up to N nearby blocks along with clustered B-tree reads (default: %u; 0 disables).\n"
+        "  --rescue            Tolerate read errors: retry, skip, and zero-fill bad blocks rather than failing.\n"
+        "  --retries=N         In rescue mode, retry a failing block N more times (default: %u).\n"
+        "  --bad-map=FILE      In rescue mode, load and save the bad-block map in FILE (ddrescue format);\n"
+        "                      implies --rescue.\n"
+        "  --pack-cache=N      When reading a packed image, cache up to N decompressed chunks (default: %u).\n"
+        "  --tier2=DEVICE      Read the second tier (hard drive) of a Fusion container from DEVICE.\n"
+        "  --block-size=N      Use N-byte blocks, rather than the block size that the container records.\n"
+        "  --find-superblock[=MIB]\n"
+        "                      Rather than trusting block 0, scan the device (or its first MIB mebibytes)\n"
+        "                      for container superblocks, and mount from the most consistent, newest one.\n"
+        "  --password=PW       Unlock an encrypted volume with the password PW.\n"
+        "  --password-file=FILE\n"
+        "                      Unlock an encrypted volume with the password on the first line of FILE.\n"
+        "  --recovery-key=KEY  Unlock an encrypted volume with its personal recovery key.\n"
+        "  --stats[=FORMAT]    On exit, print timings and I/O statistics to stderr, as text (`text`, the\n"
+        "                      default) or as a JSON object (`json`).\n"
+        "  --progress-rate=N   When scanning, redraw the progress line on stderr up to N times per second,\n"
+        "                      if stderr is a terminal (default: %u; 0 disables).\n"
+        "\n",
+        aio_queue_depth, scan_queue_depth, scan_chunk_blocks, aio_num_threads,
+        cache_num_blocks, readahead_max_blocks, rescue_retries, packed_cache_num_chunks,
+        progress_rate
+    );
+    if (output_format_supported) {
+        fprintf(stream,
+            "Output options:\n"
+            "  --format=FORMAT     Write one object per block, record, or match to stdout, as JSON Lines\n"
+            "                      (`jsonl`) or a CBOR sequence (`cbor`), and all other output to stderr;\n"
+            "                      or write the usual text (`text`, the default).\n"
+            "\n"
+        );
+    }
+}
+
+/**
+ * Parse and remove the common options from the argument list. Parsing stops at
+ * the first argument that is exactly `--`, which is itself removed, so that
+ * positional arguments beginning with `--` can still be given.
+ *
+ * argc, argv:  Pointers to the arguments of `main()`; on return, they describe
+ *      only the arguments that were not recognised as common options.
+ *
+ * RETURN VALUE:    `true` on success. If an option is malformed or unknown,
+ *      an error is printed to stderr and `false` is returned, in which case
+ *      the caller should print its usage info and exit. If `--format` selects
+ *      structured output, that output has been started; see `string/record.h`.
+ */
+bool parse_common_options(int* argc, char** argv) {
+    int num_kept = 1;
+    bool parsing = true;
+
+    for (int i = 1; i < *argc; i++) {
+        char* arg = argv[i];
+
+        if (!parsing || strncmp(arg, "--", 2) != 0) {
+            argv[num_kept++] = arg;
+            continue;
+        }
+        if (strcmp(arg, "--") == 0) {
+            parsing = false;
+            continue;
+        }
+
+        char* value = strchr(arg, '=');
+        size_t name_len = value ? (size_t)(value - arg) : strlen(arg);
+        if (value) {
+            value++;
+        }
+
+        #define OPTION_IS(name)    (name_len == strlen(name) && strncmp(arg, name, name_len) == 0)
+        #define REQUIRE_UINT32(target) \
+            if (!value || !parse_option_uint32(value, &(target))) { \
+                fprintf(stderr, "Option `%.*s` requires a positive integer value.\n", (int)name_len, arg); \
+                return false; \
+            }
+        #define REQUIRE_UINT32_OR_ZERO(target) \
+            if (!value || !parse_option_uint32_or_zero(value, &(target))) { \
+                fprintf(stderr, "Option `%.*s` requires a non-negative integer value.\n", (int)name_len, arg); \
+                return false; \
+            }
+
+        if (OPTION_IS("--queue-depth")) {
+            REQUIRE_UINT32(aio_queue_depth);
+        } else if (OPTION_IS("--scan-depth")) {
+            REQUIRE_UINT32(scan_queue_depth);
+        } else if (OPTION_IS("--chunk-blocks")) {
+            REQUIRE_UINT32(scan_chunk_blocks);
+        } else if (OPTION_IS("--threads")) {
+            REQUIRE_UINT32(aio_num_threads);
+        } else if (OPTION_IS("--no-io-uring")) {
+            aio_use_io_uring = false;
+        } else if (OPTION_IS("--direct")) {
+            io_direct = true;
+        } else if (OPTION_IS("--cache-blocks")) {
+            REQUIRE_UINT32_OR_ZERO(cache_num_blocks);
+        } else if (OPTION_IS("--readahead")) {
+            REQUIRE_UINT32_OR_ZERO(readahead_max_blocks);
+        } else if (OPTION_IS("--rescue")) {
+            io_rescue = true;
+        } else if (OPTION_IS("--retries")) {
+            REQUIRE_UINT32_OR_ZERO(rescue_retries);
+        } else if (OPTION_IS("--bad-map")) {
+            if (!value || !*value) {
+                fprintf(stderr, "Option `--bad-map` requires a file path.\n");
+                return false;
+            }
+            rescue_map_path = value;
+            io_rescue = true;
+        } else if (OPTION_IS("--pack-cache")) {
+            REQUIRE_UINT32(packed_cache_num_chunks);
+        } else if (OPTION_IS("--tier2")) {
+            if (!value || !*value) {
+                fprintf(stderr, "Option `--tier2` requires a device path.\n");
+                return false;
+            }
+            fusion_tier2_path = value;
+        } else if (OPTION_IS("--block-size")) {
+            uint64_t block_size;
+            if (!value || !parse_option_uint64(value, &block_size) || !is_valid_block_size(block_size)) {
+                fprintf(stderr, "Option `--block-size` requires a power of two from %u to %u.\n", NX_MINIMUM_BLOCK_SIZE, NX_MAXIMUM_BLOCK_SIZE);
+                return false;
+            }
+            nx_block_size = block_size;
+            nx_block_size_forced = true;
+        } else if (OPTION_IS("--find-superblock")) {
+            if (value && !parse_option_uint64(value, &discover_limit_mib)) {
+                fprintf(stderr, "Option `--find-superblock` requires a non-negative integer value, if any.\n");
+                return false;
+            }
+            nx_find_superblock = true;
+        } else if (OPTION_IS("--password") || OPTION_IS("--recovery-key")) {
+            // A recovery key unlocks the volume in the same way as a password.
+            if (!value) {
+                fprintf(stderr, "Option `%.*s` requires a value.\n", (int)name_len, arg);
+                return false;
+            }
+            crypto_password = value;
+        } else if (OPTION_IS("--password-file")) {
+            if (!value || !*value) {
+                fprintf(stderr, "Option `--password-file` requires a file path.\n");
+                return false;
+            }
+            crypto_password = read_password_file(value);
+            if (!crypto_password) {
+                return false;
+            }
+        } else if (OPTION_IS("--stats")) {
+#ifdef APFS_NO_STATS
+            fprintf(stderr, "Option `--stats` is not available; this tool was built with `NO_STATS`.\n");
+            return false;
+#endif
+            if (value && strcmp(value, "json") != 0 && strcmp(value, "text") != 0) {
+                fprintf(stderr, "Option `--stats` requires one of the values `text` or `json`, if any.\n");
+                return false;
+            }
+            stats_start(value && strcmp(value, "json") == 0);
+        } else if (OPTION_IS("--progress-rate")) {
+            REQUIRE_UINT32_OR_ZERO(progress_rate);
+        } else if (OPTION_IS("--format") && output_format_supported) {
+            if (value && strcmp(value, "text") == 0) {
+                output_format = OUTPUT_TEXT;
+            } else if (value && strcmp(value, "jsonl") == 0) {
+                output_format = OUTPUT_JSONL;
+            } else if (value && strcmp(value, "cbor") == 0) {
+                output_format = OUTPUT_CBOR;
+            } else {
+                fprintf(stderr, "Option `--format` requires one of the values `text`, `jsonl`, or `cbor`.\n");
+                return false;
+            }
+        } else {
+            fprintf(stderr, "Unknown option `%s`.\n", arg);
+            return false;
+        }
+
+        #undef REQUIRE_UINT32_OR_ZERO
+        #undef REQUIRE_UINT32
+        #undef OPTION_IS
+    }
+
+    argv[num_kept] = NULL;
+    *argc = num_kept;
+    start_structured_output();
+    return true;
+}
+
+#endif // APFS_OPTIONS_H
@@ -0,0 +1,238 @@
+/**
+ * Instrumentation: phase timers, counters of the work done by the I/O layer
+ * and the B-tree functions, and a histogram of read latencies. With `--stats`,
+ * a summary is printed to stderr when the tool exits; with `--stats=json`, the
+ * same figures are printed as a single JSON object.
+ *
+ * Counters are updated with `STATS_ADD()`, and timed sections are bracketed by
+ * `STATS_TIMER_START()` and `STATS_TIMER_STOP()`. When statistics haven't been
+ * asked for, each of these costs one branch on a global flag that is predicted
+ * not taken; building with `make NO_STATS=1` (which defines `APFS_NO_STATS`)
+ * removes them altogether. Counters are updated atomically, since reads may
+ * be made by the worker threads of the I/O engine.
+ *
+ * A tool divides its run into phases by calling `stats_phase()` with the name
+ * of each phase as it begins it; time spent before the first phase, or after
+ * `stats_phase(NULL)`, isn't attributed to any phase.
+ */
+
+#ifndef APFS_STATS_H
+#define APFS_STATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+/** Configuration **/
+
+// Set by `--stats`.
+bool    stats_enabled = false;
+bool    stats_json = false;
+
+// Read latencies are counted in buckets whose bounds are powers of two
+// microseconds: under 1 us, 1--2 us, 2--4 us, and so on, up to `2^(n-2)` us
+// and over.
+#define STATS_NUM_LATENCY_BUCKETS   24
+
+#define STATS_MAX_PHASES            16
+
+#ifdef APFS_NO_STATS
+#define STATS_ENABLED()     false
+#else
+#define STATS_ENABLED()     __builtin_expect(stats_enabled, 0)
+#endif
+
+#define STATS_ADD(counter, n) do { \
+        if (STATS_ENABLED()) { \
+            __atomic_add_fetch(&stats.counter, (n), __ATOMIC_RELAXED); \
+        } \
+    } while (0)
+
+#define STATS_TIMER_START(timer) \
+    uint64_t timer = STATS_ENABLED() ? stats_now_ns() : 0
+
+#define STATS_TIMER_STOP(timer, counter) \
+    STATS_ADD(counter, stats_now_ns() - (timer))
+
+typedef struct {
+    // I/O
+    uint64_t    read_calls;
+    uint64_t    blocks_read;
+    uint64_t    bytes_read;
+    uint64_t    read_ns;
+    uint64_t    read_latency_hist[STATS_NUM_LATENCY_BUCKETS];
+    uint64_t    cache_hits;
+    uint64_t    cache_misses;
+
+    // Object maps and B-trees
+    uint64_t    cksum_calls;
+    uint64_t    prefilter_rejected;
+    uint64_t    omap_lookups;
+    uint64_t    omap_lookup_ns;
+    uint64_t    fs_lookups;
+    uint64_t    fs_lookup_ns;
+    uint64_t    tree_descents;
+} stats_t;
+
+typedef struct {
+    const char* name;
+    uint64_t    ns;
+} stats_phase_t;
+
+/** State **/
+
+stats_t         stats;
+stats_phase_t   stats_phases[STATS_MAX_PHASES];
+size_t          stats_num_phases = 0;
+stats_phase_t*  stats_current_phase = NULL;
+uint64_t        stats_phase_start_ns = 0;
+uint64_t        stats_start_ns = 0;
+
+/**
+ * Get the time in nanoseconds, from an arbitrary starting point.
+ */
+uint64_t stats_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Record a call to read blocks from the container, given the time at which
+ * the read started and the number of blocks that were read.
+ */
+void stats_note_read(uint64_t start_ns, ssize_t num_blocks_read, size_t block_size) {
+    uint64_t ns = stats_now_ns() - start_ns;
+    uint64_t us = ns / 1000;
+    uint32_t bucket = 0;
+    while (us && bucket < STATS_NUM_LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    STATS_ADD(read_calls, 1);
+    STATS_ADD(read_ns, ns);
+    STATS_ADD(read_latency_hist[bucket], 1);
+    if (num_blocks_read > 0) {
+        STATS_ADD(blocks_read, num_blocks_read);
+        STATS_ADD(bytes_read, num_blocks_read * block_size);
+    }
+}
+
+/**
+ * End the current phase, if any, and begin the phase with a given name, or no
+ * phase if `name` is NULL. Phases with the same name are accumulated.
+ */
+void stats_phase(const char* name) {
+    if (!STATS_ENABLED()) {
+        return;
+    }
+
+    uint64_t now = stats_now_ns();
+    if (stats_current_phase) {
+        stats_current_phase->ns += now - stats_phase_start_ns;
+        stats_current_phase = NULL;
+    }
+    if (!name) {
+        return;
+    }
+
+    for (size_t i = 0; i < stats_num_phases; i++) {
+        if (strcmp(stats_phases[i].name, name) == 0) {
+            stats_current_phase = stats_phases + i;
+            break;
+        }
+    }
+    if (!stats_current_phase && stats_num_phases < STATS_MAX_PHASES) {
+        stats_current_phase = stats_phases + stats_num_phases++;
+        stats_current_phase->name = name;
+        stats_current_phase->ns = 0;
+    }
+    stats_phase_start_ns = now;
+}
+
+/**
+ * Print the statistics to stderr; registered with `atexit()` by `stats_start()`.
+ */
+void stats_report() {
+    stats_phase(NULL);
+    double wall_time = (stats_now_ns() - stats_start_ns) / 1e9;
+    double read_time = stats.read_ns / 1e9;
+
+    if (stats_json) {
+        fprintf(stderr, "{\"wall_time\":%.6f,\"phases\":{", wall_time);
+        for (size_t i = 0; i < stats_num_phases; i++) {
+            fprintf(stderr, "%s\"%s\":%.6f", i ? "," : "", stats_phases[i].name, stats_phases[i].ns / 1e9);
+        }
+        fprintf(stderr, "},\"read_calls\":%llu,\"blocks_read\":%llu,\"bytes_read\":%llu,\"read_time\":%.6f,\"read_latency_us_log2_hist\":[",
+            stats.read_calls, stats.blocks_read, stats.bytes_read, read_time
+        );
+        for (uint32_t i = 0; i < STATS_NUM_LATENCY_BUCKETS; i++) {
+            fprintf(stderr, "%s%llu", i ? "," : "", stats.read_latency_hist[i]);
+        }
+        fprintf(stderr, "],\"cache_hits\":%llu,\"cache_misses\":%llu,\"cksum_calls\":%llu,\"prefilter_rejected\":%llu,"
+            "\"omap_lookups\":%llu,\"omap_lookup_time\":%.6f,\"fs_lookups\":%llu,\"fs_lookup_time\":%.6f,\"tree_descents\":%llu}\n",
+            stats.cache_hits, stats.cache_misses, stats.cksum_calls, stats.prefilter_rejected,
+            stats.omap_lookups, stats.omap_lookup_ns / 1e9,
+            stats.fs_lookups, stats.fs_lookup_ns / 1e9, stats.tree_descents
+        );
+        return;
+    }
+
+    fprintf(stderr, "\nStatistics:\n");
+    fprintf(stderr, "- Wall time:                  %.3f s\n", wall_time);
+    for (size_t i = 0; i < stats_num_phases; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%s:", stats_phases[i].name);
+        fprintf(stderr, "  - %-26s %.3f s\n", name, stats_phases[i].ns / 1e9);
+    }
+    fprintf(stderr, "- Reads:                      %llu calls, %llu blocks, %llu bytes, %.3f s\n",
+        stats.read_calls, stats.blocks_read, stats.bytes_read, read_time
+    );
+    if (read_time > 0) {
+        fprintf(stderr, "- Read throughput:            %.1f MB/s\n", stats.bytes_read / read_time / (1024 * 1024));
+    }
+    if (stats.read_calls) {
+        fprintf(stderr, "- Read latency:\n");
+        for (uint32_t i = 0; i < STATS_NUM_LATENCY_BUCKETS; i++) {
+            if (!stats.read_latency_hist[i]) {
+                continue;
+            }
+            char range[32];
+            if (i == 0) {
+                snprintf(range, sizeof(range), "under 1 us:");
+            } else if (i == STATS_NUM_LATENCY_BUCKETS - 1) {
+                snprintf(range, sizeof(range), "%llu us and over:", 1ULL << (i - 1));
+            } else {
+                snprintf(range, sizeof(range), "%llu--%llu us:", 1ULL << (i - 1), 1ULL << i);
+            }
+            fprintf(stderr, "  - %-26s %llu\n", range, stats.read_latency_hist[i]);
+        }
+    }
+    fprintf(stderr, "- Block cache:                %llu hits, %llu misses\n", stats.cache_hits, stats.cache_misses);
+    fprintf(stderr, "- Checksums computed:         %llu\n", stats.cksum_calls);
+    if (stats.prefilter_rejected) {
+        fprintf(stderr, "- Blocks rejected unchecked:  %llu\n", stats.prefilter_rejected);
+    }
+    fprintf(stderr, "- Object map lookups:         %llu, %.3f s\n", stats.omap_lookups, stats.omap_lookup_ns / 1e9);
+    fprintf(stderr, "- File-system tree lookups:   %llu, %.3f s, %llu nodes descended into\n",
+        stats.fs_lookups, stats.fs_lookup_ns / 1e9, stats.tree_descents
+    );
+    fprintf(stderr, "\n");
+}
+
+/**
+ * Begin collecting statistics, to be reported when the tool exits.
+ */
+void stats_start(bool json) {
+    stats_enabled = true;
+    stats_json = json;
+    stats_start_ns = stats_now_ns();
+    atexit(stats_report);
+}
+
+#endif // APFS_STATS_H
@@ -12,6 +12,33 @@
 #include "../struct/btree.h"
 #include "object.h"
 
+static const flag_desc_t btn_flag_descs[] = {
+    FLAG_DESC(BTNODE_ROOT,              "Root node"),
+    FLAG_DESC(BTNODE_LEAF,              "Leaf node"),
+    FLAG_DESC(BTNODE_FIXED_KV_SIZE,     "Fixed size for keys and values"),
+    FLAG_DESC(BTNODE_CHECK_KOFF_INVAL,  "In transient state --- should never appear on disk"),
+};
+
+static const flag_desc_t bt_info_flag_descs[] = {
+    FLAG_DESC(BTREE_UINT64_KEYS,        "Keys are 64-bit values --- optimisations operations if possible"),
+    FLAG_DESC(BTREE_SEQUENTIAL_INSERT,  "This B-tree is currently undergoing a series of sequential inserts --- optimise operations if possible"),
+    FLAG_DESC(BTREE_ALLOW_GHOSTS,       "Ghosts (keys without values) are allowed"),
+    FLAG_DESC(BTREE_EPHEMERAL,          "Child nodes are referred to using Ephemeral OIDs"),
+    FLAG_DESC(BTREE_PHYSICAL,           "Child nodes are referred to using Physical OIDs"),
+    FLAG_DESC(BTREE_NONPERSISTENT,      "This B-tree does not persist across unmounts"),
+    FLAG_DESC(BTREE_KV_NONALIGNED,      "8-byte alignment of keys and values is not required"),
+};
+
+/**
+ * Append a human-readable, comma-delimited list of the flags that are set on a
+ * given B-tree node to a buffer.
+ * 
+ * btn:     A pointer to the B-tree node in question.
+ */
+void append_btn_flags_string(outbuf_t* buf, btree_node_phys_t* btn) {
+    outbuf_append_flags_inline(buf, btn->btn_flags, btn_flag_descs, NUM_FLAG_DESCS(btn_flag_descs));
+}
+
 /**
  * Get a human-readable, comma-delimited list of the flags that are set on a
  * given B-tree node.
@@ -23,146 +50,59 @@
  *      this pointer when it is no longer needed.
  */
 char* get_btn_flags_string(btree_node_phys_t* btn) {
-    char* default_string = "(none)";
-    size_t default_string_len = strlen(default_string);
-    
-    uint8_t NUM_FLAGS = 4;
-    
-    uint16_t flag_constants[] = {
-        BTNODE_ROOT,
-        BTNODE_LEAF,
-        BTNODE_FIXED_KV_SIZE,
-        BTNODE_CHECK_KOFF_INVAL,
-    };
-
-    char* flag_strings[] = {
-        "Root node",
-        "Leaf node",
-        "Fixed size for keys and values",
-        "In transient state --- should never appear on disk"
-    };
-
-    size_t max_mem_required = 0;
-    for (uint8_t i = 0; i < NUM_FLAGS; i++) {
-        max_mem_required += strlen(flag_strings[i]) + 2;
-        // `+ 2` accounts for appending ", " to each string
-    }
-    if (max_mem_required < default_string_len) {
-        max_mem_required = default_string_len;
-    }
-    max_mem_required++; // Account for terminating NULL byte
-
-    char* result_string = malloc(max_mem_required);
-    if (!result_string) {
-        fprintf(stderr, "\nABORT: get_btn_flags_string: Could not allocate sufficient memory for `result_string`.\n");
-        exit(-1);
-    }
-
-    char* cursor = result_string;
-    for (uint8_t i = 0; i < NUM_FLAGS; i++) {
-        if (btn->btn_flags & flag_constants[i]) {
-            if (cursor != result_string) {
-                *cursor++ = ',';
-                *cursor++ = ' ';
-            }
-            size_t flag_string_len = strlen(flag_strings[i]);
-            memcpy(cursor, flag_strings[i], flag_string_len);
-            cursor += flag_string_len;
-        }
-    }
-
-    // If no flags set, nothing is added to string, so use deafult string
-    if (cursor == result_string) {
-        memcpy(cursor, default_string, default_string_len);
-        cursor += default_string_len;
-    }
-
-    *cursor = '\0';
-
-    // De-allocate excess memory
-    result_string = realloc(result_string, strlen(result_string) + 1);
-    return result_string;
+    outbuf_t buf;
+    outbuf_init(&buf, NULL);
+    append_btn_flags_string(&buf, btn);
+    return outbuf_take_string(&buf);
 }
 
 /**
- * Get a human-readable, bulleted list of the flags that are set on a
+ * Append a human-readable, bulleted list of the flags that are set on a
  * given B-tree info object (an instance of `btree_info_t`; or equivalently for
- * this purpose, an instance of `btree_info_fixed_t`). The list is indented by
- * two spaces.
+ * this purpose, an instance of `btree_info_fixed_t`) to a buffer. The list is
+ * indented by two spaces.
  * 
  * bt_info:     A pointer to the B-tree info object in question.
+ */
+void append_bt_info_flags_string(outbuf_t* buf, btree_info_t* bt_info) {
+    outbuf_append_flags_bulleted(buf, bt_info->bt_fixed.bt_flags, bt_info_flag_descs, NUM_FLAG_DESCS(bt_info_flag_descs), "  - ", "  - No flags are set\n");
+}
+
+/**
+ * Get a human-readable, bulleted list of the flags that are set on a given
+ * B-tree info object; see `append_bt_info_flags_string()`.
  * 
  * RETURN VALUE:
  *      A pointer to the first character of the string. The caller must free
  *      this pointer when it is no longer needed.
  */
 char* get_bt_info_flags_string(btree_info_t* bt_info) {
-    char* default_string = "  - No flags are set\n";
-    size_t default_string_len = strlen(default_string);
-    
-    uint8_t NUM_FLAGS = 7;
-    
-    uint16_t flag_constants[] = {
-        BTREE_UINT64_KEYS,
-        BTREE_SEQUENTIAL_INSERT,
-        BTREE_ALLOW_GHOSTS,
-        BTREE_EPHEMERAL,
-        BTREE_PHYSICAL,
-        BTREE_NONPERSISTENT,
-        BTREE_KV_NONALIGNED,
-    };
-
-    char* flag_strings[] = {
-        "Keys are 64-bit values --- optimisations operations if possible",
-        "This B-tree is currently undergoing a series of sequential inserts --- optimise operations if possible",
-        "Ghosts (keys without values) are allowed",
-        "Child nodes are referred to using Ephemeral OIDs",
-        "Child nodes are referred to using Physical OIDs",
-        "This B-tree does not persist across unmounts",
-        "8-byte alignment of keys and values is not required",
-    };
-
-    size_t max_mem_required = 0;
-    for (uint8_t i = 0; i < NUM_FLAGS; i++) {
-        max_mem_required += strlen(flag_strings[i]) + 5;
-        // `+ 5` accounts for prepending "  - " and appending "\n" to each string
-    }
-    if (max_mem_required < default_string_len) {
-        max_mem_required = default_string_len;
-    }
-    max_mem_required++; // Account for terminating NULL byte
-
-    char* result_string = malloc(max_mem_required);
-    if (!result_string) {
-        fprintf(stderr, "\nABORT: get_bt_info_flags_string: Could not allocate sufficient memory for `result_string`.\n");
-        exit(-1);
-    }
+    outbuf_t buf;
+    outbuf_init(&buf, NULL);
+    append_bt_info_flags_string(&buf, bt_info);
+    return outbuf_take_string(&buf);
+}
 
-    char* cursor = result_string;
-    for (uint8_t i = 0; i < NUM_FLAGS; i++) {
-        if (bt_info->bt_fixed.bt_flags & flag_constants[i]) {
-            memcpy(cursor, "  - ", 4);
-            cursor += 4;
-
-            size_t flag_string_len = strlen(flag_strings[i]);
-            memcpy(cursor, flag_strings[i], flag_string_len);
-            cursor += flag_string_len;
-            
-            *cursor++  = '\n';
-        }
-    }
+/**
+ * Append a nicely formatted description of the data contained in an instance
+ * of `btree_info_t` to a buffer.
+ */
+void append_btree_info(outbuf_t* out, btree_info_t* bt_info) {
+    outbuf_puts(out, "Info relating to the entire B-tree:\n");
+    
+    outbuf_puts(out, "- Flags:\n");
+    append_bt_info_flags_string(out, bt_info);
 
-    // If no flags set, nothing is added to string, so use deafult string
-    if (cursor == result_string) {
-        memcpy(cursor, default_string, default_string_len);
-        cursor += default_string_len;
-    }
+    outbuf_printf(out, "- Node size:                %u bytes\n",    bt_info->bt_fixed.bt_node_size);
+    outbuf_printf(out, "- Key size:                 %u bytes\n",    bt_info->bt_fixed.bt_key_size);
+    outbuf_printf(out, "- Value size:               %u bytes\n",    bt_info->bt_fixed.bt_val_size);
+    outbuf_puts(out, "\n");
 
-    *cursor = '\0';
 
-    // De-allocate excess memory
-    result_string = realloc(result_string, strlen(result_string) + 1);
-    return result_string;
+    outbuf_printf(out, "- Length of longest key:    %u bytes\n",    bt_info->bt_longest_key);
+    outbuf_printf(out, "- Length of longest value:  %u bytes\n",    bt_info->bt_longest_val);
+    outbuf_printf(out, "- Number of keys:           %llu\n",        bt_info->bt_key_count);
+    outbuf_printf(out, "- Number of nodes:          %llu\n",        bt_info->bt_node_count);
 }
 
 /**
@@ -170,51 +110,48 @@ char* get_bt_info_flags_string(btree_info_t* bt_info) {
  * of `btree_info_t`.
  */
 void print_btree_info(btree_info_t* bt_info) {
-    printf("Info relating to the entire B-tree:\n");
-    
-    char* flags_string = get_bt_info_flags_string(bt_info);
-    printf("- Flags:\n%s", flags_string);
-    free(flags_string);
-
-    printf("- Node size:                %u bytes\n",    bt_info->bt_fixed.bt_node_size);
-    printf("- Key size:                 %u bytes\n",    bt_info->bt_fixed.bt_key_size);
-    printf("- Value size:               %u bytes\n",    bt_info->bt_fixed.bt_val_size);
-    printf("\n");
-
-
-    printf("- Length of longest key:    %u bytes\n",    bt_info->bt_longest_key);
-    printf("- Length of longest value:  %u bytes\n",    bt_info->bt_longest_val);
-    printf("- Number of keys:           %llu\n",        bt_info->bt_key_count);
-    printf("- Number of nodes:          %llu\n",        bt_info->bt_node_count);
+    outbuf_t* out = get_print_outbuf();
+    append_btree_info(out, bt_info);
+    outbuf_flush(out);
 }
 
 /**
- * Print a nicely formatted string describing the data contained in a B-tree,
- * including the data in its header. If the given B-tree is a root node, data
- * relating to the entire tree that it is the root node of will also be printed.
+ * Append a nicely formatted description of the data contained in a B-tree node
+ * to a buffer; see `print_btree_node_phys()`.
  */
-void print_btree_node_phys(btree_node_phys_t* btn) {
-    print_obj_phys(btn);    // `btn` equals `&(btn->btn_o)`.
+void append_btree_node_phys(outbuf_t* out, btree_node_phys_t* btn) {
+    append_obj_phys(out, btn);  // `btn` equals `&(btn->btn_o)`.
 
-    char* flags_string = get_btn_flags_string(btn);
-    printf("Flags:                          %s\n",  flags_string);
-    free(flags_string);
+    outbuf_puts(out, "Flags:                          ");
+    append_btn_flags_string(out, btn);
+    outbuf_puts(out, "\n");
 
-    printf("Number of child levels:         %u\n",  btn->btn_level);
-    printf("Number of keys in this node:    %u\n",  btn->btn_nkeys);
+    outbuf_printf(out, "Number of child levels:         %u\n",  btn->btn_level);
+    outbuf_printf(out, "Number of keys in this node:    %u\n",  btn->btn_nkeys);
     
-    printf("Location of table of contents:\n");
-    printf("- Offset from start of node data area:  0x%x = %u\n",   btn->btn_table_space.off,   btn->btn_table_space.off);
-    printf("- Length (bytes):                       0x%x = %u\n",   btn->btn_table_space.len,   btn->btn_table_space.len);
+    outbuf_puts(out, "Location of table of contents:\n");
+    outbuf_printf(out, "- Offset from start of node data area:  0x%x = %u\n",   btn->btn_table_space.off,   btn->btn_table_space.off);
+    outbuf_printf(out, "- Length (bytes):                       0x%x = %u\n",   btn->btn_table_space.len,   btn->btn_table_space.len);
 
-    printf("Location of key–value shared free space:\n");
-    printf("- Offset from start of keys area:       0x%x = %u\n",   btn->btn_free_space.off,    btn->btn_free_space.off);
-    printf("- Length (bytes):                       0x%x = %u\n",   btn->btn_free_space.len,    btn->btn_free_space.len);
+    outbuf_puts(out, "Location of key–value shared free space:\n");
+    outbuf_printf(out, "- Offset from start of keys area:       0x%x = %u\n",   btn->btn_free_space.off,    btn->btn_free_space.off);
+    outbuf_printf(out, "- Length (bytes):                       0x%x = %u\n",   btn->btn_free_space.len,    btn->btn_free_space.len);
 
     if (is_btree_node_phys_root(btn)) {
-        printf("\n");
-        print_btree_info((char*)btn + nx_block_size - sizeof(btree_info_t));
+        outbuf_puts(out, "\n");
+        append_btree_info(out, (char*)btn + nx_block_size - sizeof(btree_info_t));
     }
 }
 
+/**
+ * Print a nicely formatted string describing the data contained in a B-tree,
+ * including the data in its header. If the given B-tree is a root node, data
+ * relating to the entire tree that it is the root node of will also be printed.
+ */
+void print_btree_node_phys(btree_node_phys_t* btn) {
+    outbuf_t* out = get_print_outbuf();
+    append_btree_node_phys(out, btn);
+    outbuf_flush(out);
+}
+
 #endif // APFS_STRING_BTREE_H
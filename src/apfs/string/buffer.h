@@ -0,0 +1,237 @@
+/**
+ * A growable output buffer and flag-table formatting, used by the
+ * pretty-printers in the `string` directory.
+ *
+ * Text is appended to a caller-supplied `outbuf_t`, which grows as needed and
+ * is reused from one call to the next, so that printing a record does not
+ * allocate. If the buffer is bound to a stream, its contents are written to
+ * the stream once they exceed `OUTBUF_FLUSH_SIZE` bytes, and whenever
+ * `outbuf_flush()` is called.
+ *
+ * Flag descriptions are kept in constant tables of `flag_desc_t`, whose string
+ * lengths are computed at compile time by `FLAG_DESC()`.
+ */
+
+#ifndef APFS_STRING_BUFFER_H
+#define APFS_STRING_BUFFER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+// Size at which a buffer bound to a stream is written out.
+#define OUTBUF_FLUSH_SIZE   (64 * 1024)
+
+// Size of the stdio buffer used for standard output when it isn't a terminal.
+#define STDOUT_BUFFER_SIZE  (1024 * 1024)
+
+typedef struct {
+    char*   data;
+    size_t  len;
+    size_t  size;
+    FILE*   stream;     // NULL if the buffer is only used to build a string
+} outbuf_t;
+
+typedef struct {
+    uint64_t    flag;
+    const char* string;
+    size_t      len;
+} flag_desc_t;
+
+#define FLAG_DESC(flag, string)     { (flag), (string), sizeof(string) - 1 }
+#define NUM_FLAG_DESCS(table)       (sizeof(table) / sizeof((table)[0]))
+
+/**
+ * Initialise an empty buffer.
+ *
+ * stream:  The stream that the buffer's contents are written to when it is
+ *          flushed, or NULL if the buffer is only used to build a string.
+ */
+void outbuf_init(outbuf_t* buf, FILE* stream) {
+    buf->data   = NULL;
+    buf->len    = 0;
+    buf->size   = 0;
+    buf->stream = stream;
+}
+
+/**
+ * Write the contents of a buffer to its stream, and empty it. Does nothing if
+ * the buffer is not bound to a stream.
+ */
+void outbuf_flush(outbuf_t* buf) {
+    if (!buf->stream || buf->len == 0) {
+        return;
+    }
+    fwrite(buf->data, 1, buf->len, buf->stream);
+    buf->len = 0;
+}
+
+/**
+ * Ensure that a buffer has room for a given number of further bytes, plus a
+ * terminating NULL byte.
+ */
+void outbuf_reserve(outbuf_t* buf, size_t num_bytes) {
+    if (buf->stream && buf->len + num_bytes > OUTBUF_FLUSH_SIZE) {
+        outbuf_flush(buf);
+    }
+    if (buf->len + num_bytes < buf->size) {
+        return;
+    }
+
+    size_t size = buf->size ? buf->size : 256;
+    while (size <= buf->len + num_bytes) {
+        size *= 2;
+    }
+    char* data = realloc(buf->data, size);
+    if (!data) {
+        fprintf(stderr, "\nABORT: outbuf_reserve: Could not allocate sufficient memory for `buf->data`.\n");
+        exit(-1);
+    }
+    buf->data = data;
+    buf->size = size;
+}
+
+void outbuf_append(outbuf_t* buf, const char* data, size_t len) {
+    outbuf_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+void outbuf_puts(outbuf_t* buf, const char* string) {
+    outbuf_append(buf, string, strlen(string));
+}
+
+void outbuf_printf(outbuf_t* buf, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf->size ? buf->data + buf->len : NULL, buf->size - buf->len, format, args);
+    va_end(args);
+    if (len < 0) {
+        return;
+    }
+
+    // If the output didn't fit, make room and format it again. Reserving room
+    // may flush the buffer, so the output is always formatted at its end.
+    if ((size_t)len >= buf->size - buf->len) {
+        outbuf_reserve(buf, len);
+        va_start(args, format);
+        vsnprintf(buf->data + buf->len, buf->size - buf->len, format, args);
+        va_end(args);
+    }
+    buf->len += len;
+}
+
+/**
+ * Get the contents of a buffer that is not bound to a stream as a string, and
+ * reset the buffer.
+ *
+ * RETURN VALUE:
+ *      A pointer to the first character of the string. The caller must free
+ *      this pointer when it is no longer needed.
+ */
+char* outbuf_take_string(outbuf_t* buf) {
+    outbuf_reserve(buf, 0);
+    buf->data[buf->len] = '\0';
+    char* result_string = buf->data;
+    outbuf_init(buf, buf->stream);
+    return result_string;
+}
+
+/**
+ * Append a comma-delimited list of the descriptions of the flags that are set
+ * in a given value, or "(none)" if none of them are set.
+ */
+void outbuf_append_flags_inline(outbuf_t* buf, uint64_t value, const flag_desc_t* table, size_t num_flags) {
+    bool first = true;
+    for (size_t i = 0; i < num_flags; i++) {
+        if (value & table[i].flag) {
+            if (!first) {
+                outbuf_append(buf, ", ", 2);
+            }
+            outbuf_append(buf, table[i].string, table[i].len);
+            first = false;
+        }
+    }
+    if (first) {
+        outbuf_append(buf, "(none)", 6);
+    }
+}
+
+/**
+ * Append a bulleted list of the descriptions of the flags that are set in a
+ * given value, one per line, each preceded by a given bullet string.
+ *
+ * no_flags_string: The line to append if none of the flags are set,
+ *                  including its bullet and trailing newline.
+ */
+void outbuf_append_flags_bulleted(outbuf_t* buf, uint64_t value, const flag_desc_t* table, size_t num_flags, const char* bullet, const char* no_flags_string) {
+    size_t bullet_len = strlen(bullet);
+    bool none = true;
+    for (size_t i = 0; i < num_flags; i++) {
+        if (value & table[i].flag) {
+            outbuf_reserve(buf, bullet_len + table[i].len + 1);
+            memcpy(buf->data + buf->len, bullet, bullet_len);
+            buf->len += bullet_len;
+            memcpy(buf->data + buf->len, table[i].string, table[i].len);
+            buf->len += table[i].len;
+            buf->data[buf->len++] = '\n';
+            none = false;
+        }
+    }
+    if (none) {
+        outbuf_puts(buf, no_flags_string);
+    }
+}
+
+/**
+ * Look up a value that must equal one of the entries of a table exactly.
+ *
+ * RETURN VALUE:
+ *      A pointer to the matching entry, or NULL if there is none.
+ */
+const flag_desc_t* find_flag_desc(uint64_t value, const flag_desc_t* table, size_t num_flags) {
+    for (size_t i = 0; i < num_flags; i++) {
+        if (value == table[i].flag) {
+            return table + i;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * The buffer that the `print_*()` functions format their output into. Each of
+ * them flushes it before returning, so that their output stays in order with
+ * anything the caller prints directly.
+ */
+outbuf_t print_outbuf = { NULL, 0, 0, NULL };
+
+/**
+ * Get `print_outbuf`, binding it to standard output on first use.
+ */
+outbuf_t* get_print_outbuf() {
+    if (!print_outbuf.stream) {
+        print_outbuf.stream = stdout;
+    }
+    return &print_outbuf;
+}
+
+/**
+ * Set up buffering of standard output for a tool that dumps large amounts of
+ * text. Output to a terminal is left unbuffered, so that progress messages
+ * appear as they are printed; output to a file or pipe is given a large
+ * buffer, so that dumps of whole volumes are written in large chunks. This
+ * must be called before anything is written to standard output.
+ */
+void set_dump_stdout_buffering() {
+    if (isatty(STDOUT_FILENO)) {
+        setbuf(stdout, NULL);
+    } else {
+        setvbuf(stdout, NULL, _IOFBF, STDOUT_BUFFER_SIZE);
+    }
+}
+
+#endif // APFS_STRING_BUFFER_H
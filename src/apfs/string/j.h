@@ -22,6 +22,7 @@
 #include "../struct/j.h"
 #include "../struct/dstream.h"
 #include "../struct/xf.h"
+#include "buffer.h"
 
 char* j_key_type_to_string(uint8_t j_key_type) {
     switch (j_key_type) {
@@ -56,15 +57,27 @@ char* j_key_type_to_string(uint8_t j_key_type) {
     }
 }
 
-void print_j_key(j_key_t* key) {
-    printf("Virtual OID:    0x%llx\n",  key->obj_id_and_type & OBJ_ID_MASK);
-    printf("Object type:    %s\n",      j_key_type_to_string(
+/**
+ * Append a nicely formatted description of the header of a file-system record
+ * key to a buffer.
+ */
+void append_j_key(outbuf_t* out, j_key_t* key) {
+    outbuf_printf(out, "Virtual OID:    0x%llx\n",  key->obj_id_and_type & OBJ_ID_MASK);
+    outbuf_printf(out, "Object type:    %s\n",      j_key_type_to_string(
             (key->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT
     ));
 }
 
+void print_j_key(j_key_t* key) {
+    outbuf_t* out = get_print_outbuf();
+    append_j_key(out, key);
+    outbuf_flush(out);
+}
+
 void print_j_inode_key(j_inode_key_t* key) {
-    print_j_key(key);
+    outbuf_t* out = get_print_outbuf();
+    append_j_key(out, key);
+    outbuf_flush(out);
 }
 
 char* j_inode_mode_to_string(mode_t mode) {
@@ -90,232 +103,134 @@ char* j_inode_mode_to_string(mode_t mode) {
     }
 }
 
-char* get_j_inode_internal_flags_string(uint64_t internal_flags) {
-    // String to use if no flags are set    
-    char* default_string = "- No internal flags are set.\n";
-    size_t default_string_len = strlen(default_string);
-    
-    const int NUM_FLAGS = 17;
-    
-    uint64_t flag_constants[] = {
-        INODE_IS_APFS_PRIVATE,
-        INODE_MAINTAIN_DIR_STATS,
-        INODE_DIR_STATS_ORIGIN,
-        INODE_PROT_CLASS_EXPLICIT,
-        INODE_WAS_CLONED,
-        INODE_FLAG_UNUSED,
-        INODE_HAS_SECURITY_EA,
-        INODE_BEING_TRUNCATED,
-        INODE_HAS_FINDER_INFO,
-        INODE_IS_SPARSE,
-        INODE_WAS_EVER_CLONED,
-        INODE_ACTIVE_FILE_TRIMMED,
-        INODE_PINNED_TO_MAIN,
-        INODE_PINNED_TO_TIER2,
-        INODE_HAS_RSRC_FORK,
-        INODE_NO_RSRC_FORK,
-        INODE_ALLOCATION_SPILLEDOVER,
-    };
-
-    char* flag_strings[] = {
-        "Private flag (0x1) used by an APFS implementation --- this inode is not considered part of the file-system",
-        "MAINTAIN_DIR_STATS: Tracks the size of all its children",
-        "The MAINTAIN_DIR_STATS flag is set explicitly (not due to inheritance)",
-        "Protection class was explicitly set on creation",
-        "Created by cloning another inode",
-        "Reserved/unused (0x20)",
-        "Has an ACL (access control list, i.e. a security-based extended attribute)",
-        "Truncation was in progress, but a crash occurred",
-        "Has a 'Finder info' extended field/attribute",
-        "Is sparse (i.e. has a sparse byte count extended field/attribute)",
-        "Cloned at least once",
-        "Is a trimmed overprovisioning file",
-        "Fusion drive: file content is pinned to main storage device",
-        "Fusion drive: file content is pinned to secondary storage device",
-        "Has a resource fork",
-        "Has no resource fork",
-        "Fusion drive: file content spilled over from preferred storage tier/device",
-    };
-
-    // Allocate sufficient memory for the result string
-    size_t max_mem_required = 0;
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        max_mem_required += strlen(flag_strings[i]) + 3;
-        // `+ 3` accounts for prepending "- " and appending "\n" to each string
-    }
-    if (max_mem_required < default_string_len) {
-        max_mem_required = default_string_len;
-    }
-    max_mem_required++; // Account for terminating NULL byte
-
-    char* result_string = malloc(max_mem_required);
-    if (!result_string) {
-        fprintf(stderr, "\nABORT: get_j_inode_internal_flags_string: Could not allocate sufficient memory for `result_string`.\n");
-        exit(-1);
-    }
+static const flag_desc_t j_inode_internal_flag_descs[] = {
+    FLAG_DESC(INODE_IS_APFS_PRIVATE,        "Private flag (0x1) used by an APFS implementation --- this inode is not considered part of the file-system"),
+    FLAG_DESC(INODE_MAINTAIN_DIR_STATS,     "MAINTAIN_DIR_STATS: Tracks the size of all its children"),
+    FLAG_DESC(INODE_DIR_STATS_ORIGIN,       "The MAINTAIN_DIR_STATS flag is set explicitly (not due to inheritance)"),
+    FLAG_DESC(INODE_PROT_CLASS_EXPLICIT,    "Protection class was explicitly set on creation"),
+    FLAG_DESC(INODE_WAS_CLONED,             "Created by cloning another inode"),
+    FLAG_DESC(INODE_FLAG_UNUSED,            "Reserved/unused (0x20)"),
+    FLAG_DESC(INODE_HAS_SECURITY_EA,        "Has an ACL (access control list, i.e. a security-based extended attribute)"),
+    FLAG_DESC(INODE_BEING_TRUNCATED,        "Truncation was in progress, but a crash occurred"),
+    FLAG_DESC(INODE_HAS_FINDER_INFO,        "Has a 'Finder info' extended field/attribute"),
+    FLAG_DESC(INODE_IS_SPARSE,              "Is sparse (i.e. has a sparse byte count extended field/attribute)"),
+    FLAG_DESC(INODE_WAS_EVER_CLONED,        "Cloned at least once"),
+    FLAG_DESC(INODE_ACTIVE_FILE_TRIMMED,    "Is a trimmed overprovisioning file"),
+    FLAG_DESC(INODE_PINNED_TO_MAIN,         "Fusion drive: file content is pinned to main storage device"),
+    FLAG_DESC(INODE_PINNED_TO_TIER2,        "Fusion drive: file content is pinned to secondary storage device"),
+    FLAG_DESC(INODE_HAS_RSRC_FORK,          "Has a resource fork"),
+    FLAG_DESC(INODE_NO_RSRC_FORK,           "Has no resource fork"),
+    FLAG_DESC(INODE_ALLOCATION_SPILLEDOVER, "Fusion drive: file content spilled over from preferred storage tier/device"),
+};
+
+static const flag_desc_t j_inode_bsd_flag_descs[] = {
+    FLAG_DESC(UF_NODUMP,    "Do not dump the file"),
+    FLAG_DESC(UF_IMMUTABLE, "File may not be changed"),
+    FLAG_DESC(UF_APPEND,    "File may only be appended to"),
+    FLAG_DESC(UF_OPAQUE,    "Directory is opaque when viewd through a union stack"),
+    FLAG_DESC(UF_HIDDEN,    "File/directory is not intended to be displayed to the user"),
+    FLAG_DESC(SF_ARCHIVED,  "File has been archived"),
+    FLAG_DESC(SF_IMMUTABLE, "File may not be changed"),
+    FLAG_DESC(SF_APPEND,    "File may only be appended to"),
+    FLAG_DESC(SF_DATALESS,  "SF_DATALESSFAULT: Dataless placeholder --- see chflags(2) and getiopolicy_np(3)"),
+};
 
-    char* cursor = result_string;
-
-    // Go through possible flags, adding corresponding string to result if
-    // that flag is set.
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        if (internal_flags & flag_constants[i]) {
-            *cursor++ = '-';
-            *cursor++ = ' ';
-            memcpy(cursor, flag_strings[i], strlen(flag_strings[i]));
-            cursor += strlen(flag_strings[i]);
-            *cursor++ = '\n';
-        }
-    }
-
-    if (cursor == result_string) {
-        // No strings were added, so it must be that no flags are set.
-        memcpy(cursor, default_string, default_string_len);
-        cursor += default_string_len;
-    }
+/**
+ * Append a human-readable, bulleted list of the internal flags that are set in
+ * a given `internal_flags` field of an inode to a buffer.
+ */
+void append_j_inode_internal_flags_string(outbuf_t* buf, uint64_t internal_flags) {
+    outbuf_append_flags_bulleted(buf, internal_flags, j_inode_internal_flag_descs, NUM_FLAG_DESCS(j_inode_internal_flag_descs), "- ", "- No internal flags are set.\n");
+}
 
-    *cursor = '\0';
+char* get_j_inode_internal_flags_string(uint64_t internal_flags) {
+    outbuf_t buf;
+    outbuf_init(&buf, NULL);
+    append_j_inode_internal_flags_string(&buf, internal_flags);
+    return outbuf_take_string(&buf);
+}
 
-    // Free up excess allocated memory.
-    result_string = realloc(result_string, strlen(result_string) + 1);
-    return result_string;
+/**
+ * Append a human-readable, bulleted list of the BSD flags that are set in a
+ * given `bsd_flags` field of an inode to a buffer.
+ */
+void append_j_inode_bsd_flags_string(outbuf_t* buf, uint32_t bsd_flags) {
+    outbuf_append_flags_bulleted(buf, bsd_flags, j_inode_bsd_flag_descs, NUM_FLAG_DESCS(j_inode_bsd_flag_descs), "- ", "- No internal flags are set.\n");
 }
 
 char* get_j_inode_bsd_flags_string(uint32_t bsd_flags) {
-    // String to use if no flags are set    
-    char* no_flags_string = "- No internal flags are set.\n";
-    size_t no_flags_string_len = strlen(no_flags_string);
-    
-    const int NUM_FLAGS = 9;
-    
-    uint64_t flag_constants[] = {
-        UF_NODUMP,
-        UF_IMMUTABLE,
-        UF_APPEND,
-        UF_OPAQUE,
-        UF_HIDDEN,
-        SF_ARCHIVED,
-        SF_IMMUTABLE,
-        SF_APPEND,
-        SF_DATALESS,
-    };
-
-    char* flag_strings[] = {
-        "Do not dump the file",
-        "File may not be changed",
-        "File may only be appended to",
-        "Directory is opaque when viewd through a union stack",
-        "File/directory is not intended to be displayed to the user",
-        "File has been archived",
-        "File may not be changed",
-        "File may only be appended to",
-        "SF_DATALESSFAULT: Dataless placeholder --- see chflags(2) and getiopolicy_np(3)"
-    };
-
-    // Allocate sufficient memory for the result string
-    size_t max_mem_required = 0;
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        max_mem_required += strlen(flag_strings[i]) + 3;
-        // `+ 3` accounts for prepending "- " and appending "\n" to each string
-    }
-    if (max_mem_required < no_flags_string_len) {
-        max_mem_required = no_flags_string_len;
-    }
-    max_mem_required++; // Make room for terminating NULL byte
-
-    char* result_string = malloc(max_mem_required);
-    if (!result_string) {
-        fprintf(stderr, "\nABORT: get_j_inode_bsd_flags_string: Could not allocate sufficient memory for `result_string`.\n");
-        exit(-1);
-    }
-
-    char* cursor = result_string;
-
-    // Go through possible flags, adding corresponding string to result if
-    // that flag is set.
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        if (bsd_flags & flag_constants[i]) {
-            *cursor++ = '-';
-            *cursor++ = ' ';
-            memcpy(cursor, flag_strings[i], strlen(flag_strings[i]));
-            cursor += strlen(flag_strings[i]);
-            *cursor++ = '\n';
-        }
-    }
-
-    if (cursor == result_string) {
-        // No strings were added, so it must be that no flags are set.
-        memcpy(cursor, no_flags_string, no_flags_string_len);
-        cursor += no_flags_string_len;
-    }
-
-    *cursor = '\0';
-
-    // Free up excess allocated memory.
-    result_string = realloc(result_string, strlen(result_string) + 1);
-    return result_string;
+    outbuf_t buf;
+    outbuf_init(&buf, NULL);
+    append_j_inode_bsd_flags_string(&buf, bsd_flags);
+    return outbuf_take_string(&buf);
 }
 
 void print_j_inode_val(j_inode_val_t* val, bool has_xfields) {
-    printf("Parent ID:      0x%llx\n",  val->parent_id);
-    printf("Private ID:     0x%llx\n",  val->private_id);
-    printf("\n");
+    outbuf_t* out = get_print_outbuf();
+    outbuf_printf(out, "Parent ID:      0x%llx\n",  val->parent_id);
+    outbuf_printf(out, "Private ID:     0x%llx\n",  val->private_id);
+    outbuf_puts(out, "\n");
 
     time_t timestamp = val->create_time / 1000000000;
-    printf("Creation time:          %s",    ctime(&timestamp));
+    outbuf_printf(out, "Creation time:          %s",    ctime(&timestamp));
     timestamp = val->mod_time / 1000000000;
-    printf("Last modification time: %s",    ctime(&timestamp));
+    outbuf_printf(out, "Last modification time: %s",    ctime(&timestamp));
     timestamp = val->change_time / 1000000000;
-    printf("Last access time:       %s",    ctime(&timestamp));
-    printf("\n");
+    outbuf_printf(out, "Last access time:       %s",    ctime(&timestamp));
+    outbuf_puts(out, "\n");
 
-    printf("Number of children / hard links:    %u\n", val->nchildren);
-    printf("\n");
+    outbuf_printf(out, "Number of children / hard links:    %u\n", val->nchildren);
+    outbuf_puts(out, "\n");
     
-    printf("Owner UID:  %u\n",  val->owner);
-    printf("Group GID:  %u\n",  val->group);
-    printf("\n");
+    outbuf_printf(out, "Owner UID:  %u\n",  val->owner);
+    outbuf_printf(out, "Group GID:  %u\n",  val->group);
+    outbuf_puts(out, "\n");
 
-    printf("Mode:   %s\n",  j_inode_mode_to_string(val->mode));
-    printf("\n");
+    outbuf_printf(out, "Mode:   %s\n",  j_inode_mode_to_string(val->mode));
+    outbuf_puts(out, "\n");
 
-    char* tmp_string = get_j_inode_internal_flags_string(val->internal_flags);
-    printf("Internal flags:\n%s", tmp_string);
-    printf("\n");
-    free(tmp_string);
+    outbuf_puts(out, "Internal flags:\n");
+    append_j_inode_internal_flags_string(out, val->internal_flags);
+    outbuf_puts(out, "\n");
 
-    tmp_string = get_j_inode_bsd_flags_string(val->bsd_flags);
-    printf("BSD flags:\n%s", tmp_string);
-    printf("\n");
-    free(tmp_string);
+    outbuf_puts(out, "BSD flags:\n");
+    append_j_inode_bsd_flags_string(out, val->bsd_flags);
+    outbuf_puts(out, "\n");
 
-    printf("No. extended fields:    ");
+    outbuf_puts(out, "No. extended fields:    ");
     if (!has_xfields) {
-        printf("0\n");
+        outbuf_puts(out, "0\n");
+        outbuf_flush(out);
         return;
     }
-    printf("%u\n", ((xf_blob_t*)(val->xfields))->xf_num_exts);
+    outbuf_printf(out, "%u\n", ((xf_blob_t*)(val->xfields))->xf_num_exts);
     
     // TODO: Print actual details of extended fields/attributes
+    outbuf_flush(out);
 }
 
 void print_j_file_extent_key(j_file_extent_key_t* key) {
-    print_j_key(key);   // `key` equals `&(key->hdr)`
-    printf("\n");
-    printf("Extent offset within file:  %#llx\n", key->logical_addr);
+    outbuf_t* out = get_print_outbuf();
+    append_j_key(out, key);   // `key` equals `&(key->hdr)`
+    outbuf_puts(out, "\n");
+    outbuf_printf(out, "Extent offset within file:  %#llx\n", key->logical_addr);
+    outbuf_flush(out);
 }
 
 void print_j_file_extent_val(j_file_extent_val_t* val) {
+    outbuf_t* out = get_print_outbuf();
     // TODO: Print flags
     // TODO: Print crypto ID
 
-    printf("Length (bytes): %llu\n",    val->len_and_flags & J_FILE_EXTENT_LEN_MASK);
-    printf("Start block:    %#llx\n",   val->phys_block_num);
+    outbuf_printf(out, "Length (bytes): %llu\n",    val->len_and_flags & J_FILE_EXTENT_LEN_MASK);
+    outbuf_printf(out, "Start block:    %#llx\n",   val->phys_block_num);
+    outbuf_flush(out);
 }
 
 void print_j_drec_hashed_key(j_drec_hashed_key_t* key) {
-    print_j_key(key);   // `key` equals `&(key->hdr)`
-    printf("\n");
+    outbuf_t* out = get_print_outbuf();
+    append_j_key(out, key);   // `key` equals `&(key->hdr)`
+    outbuf_puts(out, "\n");
 
     // 10-bit value; next smallest datatype is 16 bits
     uint16_t name_len = key->name_len_and_hash & J_DREC_LEN_MASK;
@@ -323,9 +238,10 @@ void print_j_drec_hashed_key(j_drec_hashed_key_t* key) {
     uint32_t name_hash = (key->name_len_and_hash & J_DREC_HASH_MASK) >> J_DREC_HASH_SHIFT;
     // TODO: validate the hash?
     
-    printf("Dentry name length:     %u UTF-8 bytes (including terminating NULL (U+0000) byte)\n",  name_len);
-    printf("Dentry name hash:       0x%06x\n",          name_hash);
-    printf("Dentry name:            ### %s ####\n",     key->name);
+    outbuf_printf(out, "Dentry name length:     %u UTF-8 bytes (including terminating NULL (U+0000) byte)\n",  name_len);
+    outbuf_printf(out, "Dentry name hash:       0x%06x\n",          name_hash);
+    outbuf_printf(out, "Dentry name:            ### %s ####\n",     key->name);
+    outbuf_flush(out);
 }
 
 char* drec_val_to_type_string(j_drec_val_t* val) {
@@ -379,24 +295,27 @@ char* drec_val_to_short_type_string(j_drec_val_t* val) {
 }
 
 void print_j_drec_val(j_drec_val_t* val, bool has_xfields) {
-    printf("Dentry Virtual OID:     0x%llx\n", val->file_id);
+    outbuf_t* out = get_print_outbuf();
+    outbuf_printf(out, "Dentry Virtual OID:     0x%llx\n", val->file_id);
 
     // timestamp converted from nanoseconds since
     // Unix epoch to seconds since Unix epoch.
     // Newline '\n' is added by result of `ctime()`.
     time_t timestamp = val->date_added / 1000000000;
-    printf("Time added:             %s",    ctime(&timestamp));
+    outbuf_printf(out, "Time added:             %s",    ctime(&timestamp));
 
-    printf("Dentry type:            %s\n",  drec_val_to_type_string(val));
+    outbuf_printf(out, "Dentry type:            %s\n",  drec_val_to_type_string(val));
 
-    printf("No. extended fields:    ");
+    outbuf_puts(out, "No. extended fields:    ");
     if (!has_xfields) {
-        printf("0\n");
+        outbuf_puts(out, "0\n");
+        outbuf_flush(out);
         return;
     }
-    printf("%u\n", ((xf_blob_t*)(val->xfields))->xf_num_exts);
+    outbuf_printf(out, "%u\n", ((xf_blob_t*)(val->xfields))->xf_num_exts);
     
     // TODO: Print actual details of extended fields/attributes
+    outbuf_flush(out);
 }
 
 #endif // APFS_STRING_J_H
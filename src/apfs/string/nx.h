@@ -10,6 +10,37 @@
 #include "../struct/nx.h"
 #include "object.h"
 
+static const flag_desc_t nx_feature_descs[] = {
+    FLAG_DESC(NX_FEATURE_DEFRAG,    "The volumes in this container support defragmentation."),
+    FLAG_DESC(NX_FEATURE_LCFD,      "This container is using low-capacity Fusion Drive mode."),
+};
+
+static const flag_desc_t nx_incompatible_feature_descs[] = {
+    FLAG_DESC(NX_INCOMPAT_VERSION1, "This container uses APFS version 1, as implemented in macOS 10.12."),
+    FLAG_DESC(NX_INCOMPAT_VERSION2, "This container uses APFS version 2, as implemented in macOS 10.13 and iOS 10.3."),
+    FLAG_DESC(NX_INCOMPAT_FUSION,   "This container supports Fusion Drives."),
+};
+
+static const flag_desc_t nx_flag_descs[] = {
+    FLAG_DESC(NX_RESERVED_1,        "Reserved flag 1"),
+    FLAG_DESC(NX_RESERVED_2,        "Reserved flag 2"),
+    FLAG_DESC(NX_CRYPTO_SW,         "This container uses software cryptography."),
+};
+
+static const flag_desc_t cpm_flag_descs[] = {
+    FLAG_DESC(CHECKPOINT_MAP_LAST,  "Last checkpoint-mapping block in the correspondng checkpoint."),
+};
+
+/**
+ * Append a human-readable list of the optional feature flags that are set on a
+ * given container superblock to a buffer.
+ * 
+ * nxsb:    A pointer to the container superblock in question.
+ */
+void append_nx_features_string(outbuf_t* buf, nx_superblock_t* nxsb) {
+    outbuf_append_flags_bulleted(buf, nxsb->nx_features, nx_feature_descs, NUM_FLAG_DESCS(nx_feature_descs), "- ", "- No feature flags are set.\n");
+}
+
 /**
  * Get a human-readable string that lists the optional feature flags that are
  * set on a given container superblock.
@@ -21,68 +52,25 @@
  *      this pointer when it is no longer needed.
  */
 char* get_nx_features_string(nx_superblock_t* nxsb) {
-    // String to use if no flags are set
-    char* no_flags_string = "- No feature flags are set.\n";
-    size_t no_flags_string_len = strlen(no_flags_string);
-    
-    const int NUM_FLAGS = 2;
-    
-    uint64_t flag_constants[] = {
-        NX_FEATURE_DEFRAG,
-        NX_FEATURE_LCFD,
-    };
-
-    char* flag_strings[] = {
-        "The volumes in this container support defragmentation.",
-        "This container is using low-capacity Fusion Drive mode.",
-    };
-
-    // Allocate sufficient memory for the result string
-    size_t max_mem_required = 0;
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        max_mem_required += strlen(flag_strings[i]) + 3;
-        // `+ 3` accounts for prepending "- " and appending "\n" to each string
-    }
-    if (max_mem_required < no_flags_string_len) {
-        max_mem_required = no_flags_string_len;
-    }
-    max_mem_required++; // Make room for terminating NULL byte
-
-    char* result_string = malloc(max_mem_required);
-    if (!result_string) {
-        fprintf(stderr, "\nABORT: get_nx_features_string: Could not allocate sufficient memory for `result_string`.\n");
-        exit(-1);
-    }
-
-    char* cursor = result_string;
-
-    // Go through possible flags, adding corresponding string to result if
-    // that flag is set.
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        if (nxsb->nx_features & flag_constants[i]) {
-            *cursor++ = '-';
-            *cursor++ = ' ';
-            memcpy(cursor, flag_strings[i], strlen(flag_strings[i]));
-            cursor += strlen(flag_strings[i]);
-            *cursor++ = '\n';
-        }
-    }
-
-    if (cursor == result_string) {
-        // No strings were added, so it must be that no flags are set.
-        memcpy(cursor, no_flags_string, no_flags_string_len);
-        cursor += no_flags_string_len;
-    }
-
-    *cursor = '\0';
+    outbuf_t buf;
+    outbuf_init(&buf, NULL);
+    append_nx_features_string(&buf, nxsb);
+    return outbuf_take_string(&buf);
+}
 
-    // Free up excess allocated memory.
-    result_string = realloc(result_string, strlen(result_string) + 1);
-    return result_string;
+/**
+ * Append a human-readable list of the read-only compatible feature flags that
+ * are set on a given container superblock to a buffer. No such flags are
+ * currently defined.
+ * 
+ * nxsb:    A pointer to the container superblock in question.
+ */
+void append_nx_readonly_compatible_features_string(outbuf_t* buf, nx_superblock_t* nxsb) {
+    outbuf_append_flags_bulleted(buf, nxsb->nx_readonly_compatible_features, NULL, 0, "- ", "- No read-only compatible feature flags are set.\n");
 }
 
 /**
- * Get a human-readable string that lists the read-only-compatible feature
+ * Get a human-readable string that lists the read-only compatible feature
  * flags that are set on a given container superblock.
  * 
  * nxsb:    A pointer to the container superblock in question.
@@ -92,60 +80,20 @@ char* get_nx_features_string(nx_superblock_t* nxsb) {
  *      this pointer when it is no longer needed.
  */
 char* get_nx_readonly_compatible_features_string(nx_superblock_t* nxsb) {
-    // String to use if no flags are set
-    char* no_flags_string = "- No read-only compatible feature flags are set.\n";
-    size_t no_flags_string_len = strlen(no_flags_string);
-    
-    const int NUM_FLAGS = 0;
-    uint64_t flag_constants[] = {
-        // empty
-    };
-    char* flag_strings[] = {
-        // empty
-    };
-
-    // Allocate sufficient memory for the result string
-    size_t max_mem_required = 0;
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        max_mem_required += strlen(flag_strings[i]) + 3;
-        // `+ 3` accounts for prepending "- " and appending "\n" to each string
-    }
-    if (max_mem_required < no_flags_string_len) {
-        max_mem_required = no_flags_string_len;
-    }
-    max_mem_required++; // Make room for terminating NULL byte
-
-    char* result_string = malloc(max_mem_required);
-    if (!result_string) {
-        fprintf(stderr, "\nABORT: get_nx_readonly_compatible_features_string: Could not allocate sufficient memory for `result_string`.\n");
-        exit(-1);
-    }
-
-    char* cursor = result_string;
-
-    // Go through possible flags, adding corresponding string to result if
-    // that flag is set.
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        if (nxsb->nx_readonly_compatible_features & flag_constants[i]) {
-            *cursor++ = '-';
-            *cursor++ = ' ';
-            memcpy(cursor, flag_strings[i], strlen(flag_strings[i]));
-            cursor += strlen(flag_strings[i]);
-            *cursor++ = '\n';
-        }
-    }
-
-    if (cursor == result_string) {
-        // No strings were added, so it must be that no flags are set.
-        memcpy(cursor, no_flags_string, no_flags_string_len);
-        cursor += no_flags_string_len;
-    }
-
-    *cursor = '\0';
+    outbuf_t buf;
+    outbuf_init(&buf, NULL);
+    append_nx_readonly_compatible_features_string(&buf, nxsb);
+    return outbuf_take_string(&buf);
+}
 
-    // Free up excess allocated memory.
-    result_string = realloc(result_string, strlen(result_string) + 1);
-    return result_string;
+/**
+ * Append a human-readable list of the backward-incompatible feature flags that
+ * are set on a given container superblock to a buffer.
+ * 
+ * nxsb:    A pointer to the container superblock in question.
+ */
+void append_nx_incompatible_features_string(outbuf_t* buf, nx_superblock_t* nxsb) {
+    outbuf_append_flags_bulleted(buf, nxsb->nx_incompatible_features, nx_incompatible_feature_descs, NUM_FLAG_DESCS(nx_incompatible_feature_descs), "- ", "- No backward-incompatible feature flags are set.\n");
 }
 
 /**
@@ -159,66 +107,20 @@ char* get_nx_readonly_compatible_features_string(nx_superblock_t* nxsb) {
  *      this pointer when it is no longer needed.
  */
 char* get_nx_incompatible_features_string(nx_superblock_t* nxsb) {
-    // String to use if no flags are set    
-    char* no_flags_string = "- No backward-incompatible feature flags are set.\n";
-    size_t no_flags_string_len = strlen(no_flags_string);
-    
-    const int NUM_FLAGS = 3;
-    
-    uint64_t flag_constants[] = {
-        NX_INCOMPAT_VERSION1,
-        NX_INCOMPAT_VERSION2,
-        NX_INCOMPAT_FUSION,
-    };
-
-    char* flag_strings[] = {
-        "This container uses APFS version 1, as implemented in macOS 10.12.",
-        "This container uses APFS version 2, as implemented in macOS 10.13 and iOS 10.3.",
-        "This container supports Fusion Drives.",
-    };
-
-    // Allocate sufficient memory for the result string
-    size_t max_mem_required = 0;
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        max_mem_required += strlen(flag_strings[i]) + 3;
-        // `+ 3` accounts for prepending "- " and appending "\n" to each string
-    }
-    if (max_mem_required < no_flags_string_len) {
-        max_mem_required = no_flags_string_len;
-    }
-    max_mem_required++; // Make room for terminating NULL byte
-
-    char* result_string = malloc(max_mem_required);
-    if (!result_string) {
-        fprintf(stderr, "\nABORT: get_nx_incompatible_features_string: Could not allocate sufficient memory for `result_string`.\n");
-        exit(-1);
-    }
-
-    char* cursor = result_string;
-
-    // Go through possible flags, adding corresponding string to result if
-    // that flag is set.
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        if (nxsb->nx_features & flag_constants[i]) {
-            *cursor++ = '-';
-            *cursor++ = ' ';
-            memcpy(cursor, flag_strings[i], strlen(flag_strings[i]));
-            cursor += strlen(flag_strings[i]);
-            *cursor++ = '\n';
-        }
-    }
-
-    if (cursor == result_string) {
-        // No strings were added, so it must be that no flags are set.
-        memcpy(cursor, no_flags_string, no_flags_string_len);
-        cursor += no_flags_string_len;
-    }
-
-    *cursor = '\0';
+    outbuf_t buf;
+    outbuf_init(&buf, NULL);
+    append_nx_incompatible_features_string(&buf, nxsb);
+    return outbuf_take_string(&buf);
+}
 
-    // Free up excess allocated memory.
-    result_string = realloc(result_string, strlen(result_string) + 1);
-    return result_string;
+/**
+ * Append a human-readable list of the non-feature flags that are set on a
+ * given container superblock to a buffer.
+ * 
+ * nxsb:    A pointer to the container superblock in question.
+ */
+void append_nx_flags_string(outbuf_t* buf, nx_superblock_t* nxsb) {
+    outbuf_append_flags_bulleted(buf, nxsb->nx_flags, nx_flag_descs, NUM_FLAG_DESCS(nx_flag_descs), "- ", "- No other flags are set.\n");
 }
 
 /**
@@ -232,76 +134,20 @@ char* get_nx_incompatible_features_string(nx_superblock_t* nxsb) {
  *      this pointer when it is no longer needed.
  */
 char* get_nx_flags_string(nx_superblock_t* nxsb) {
-    // String to use if no flags are set    
-    char* no_flags_string = "- No other flags are set.\n";
-    size_t no_flags_string_len = strlen(no_flags_string);
-    
-    const int NUM_FLAGS = 3;
-    
-    uint64_t flag_constants[] = {
-        NX_RESERVED_1,
-        NX_RESERVED_2,
-        NX_CRYPTO_SW,
-    };
-
-    char* flag_strings[] = {
-        "Reserved flag 1",
-        "Reserved flag 2",
-        "This container uses software cryptography.",
-    };
-
-    // Allocate sufficient memory for the result string
-    size_t max_mem_required = 0;
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        max_mem_required += strlen(flag_strings[i]) + 3;
-        // `+ 3` accounts for prepending "- " and appending "\n" to each string
-    }
-    if (max_mem_required < no_flags_string_len) {
-        max_mem_required = no_flags_string_len;
-    }
-    max_mem_required++; // Make room for terminating NULL byte
-
-    char* result_string = malloc(max_mem_required);
-    if (!result_string) {
-        fprintf(stderr, "\nABORT: get_nx_flags_string: Could not allocate sufficient memory for `result_string`.\n");
-        exit(-1);
-    }
-
-    char* cursor = result_string;
-
-    // Go through possible flags, adding corresponding string to result if
-    // that flag is set.
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        if (nxsb->nx_features & flag_constants[i]) {
-            *cursor++ = '-';
-            *cursor++ = ' ';
-            memcpy(cursor, flag_strings[i], strlen(flag_strings[i]));
-            cursor += strlen(flag_strings[i]);
-            *cursor++ = '\n';
-        }
-    }
-
-    if (cursor == result_string) {
-        // No strings were added, so it must be that no flags are set.
-        memcpy(cursor, no_flags_string, no_flags_string_len);
-        cursor += no_flags_string_len;
-    }
-
-    *cursor = '\0';
-
-    // Free up excess allocated memory.
-    result_string = realloc(result_string, strlen(result_string) + 1);
-    return result_string;
+    outbuf_t buf;
+    outbuf_init(&buf, NULL);
+    append_nx_flags_string(&buf, nxsb);
+    return outbuf_take_string(&buf);
 }
 
 /**
- * Print a nicely formatted string describing the data contained in a container
- * superblock, including the data in its header.
+ * Append a nicely formatted description of the data contained in a container
+ * superblock, including the data in its header, to a buffer.
  */
-void print_nx_superblock(nx_superblock_t* nxsb) {
-    print_obj_phys(nxsb); // `nxsb` is equivalent to `&(nxsb->nx_o)`.
+void append_nx_superblock(outbuf_t* out, nx_superblock_t* nxsb) {
+    append_obj_phys(out, nxsb);   // `nxsb` is equivalent to `&(nxsb->nx_o)`.
 
-    printf("Keybag location: starts at %#llx, spans %#llx blocks\n", nxsb->nx_keylocker.pr_start_paddr, nxsb->nx_keylocker.pr_block_count);
+    outbuf_printf(out, "Keybag location: starts at %#llx, spans %#llx blocks\n", nxsb->nx_keylocker.pr_start_paddr, nxsb->nx_keylocker.pr_block_count);
 
     char magic_string[] = {
         (char)nxsb->nx_magic,
@@ -310,39 +156,64 @@ void print_nx_superblock(nx_superblock_t* nxsb) {
         (char)(nxsb->nx_magic >> 24),
         '\0'
     };
-    printf("Magic string:       %s\n",          magic_string);
+    outbuf_printf(out, "Magic string:       %s\n",          magic_string);
 
-    printf("Block size:         %u bytes\n",    nxsb->nx_block_size);
-    printf("Block count:        %llu\n",        nxsb->nx_block_count);
+    outbuf_printf(out, "Block size:         %u bytes\n",    nxsb->nx_block_size);
+    outbuf_printf(out, "Block count:        %llu\n",        nxsb->nx_block_count);
     
-    char* features_string = get_nx_features_string(nxsb);
-    printf("Supported features:\n%s", features_string);
-    free(features_string);
+    outbuf_puts(out, "Supported features:\n");
+    append_nx_features_string(out, nxsb);
 
-    char* readonly_compatible_features_string = get_nx_readonly_compatible_features_string(nxsb);
-    printf("Supported read-only compatible features:\n%s", readonly_compatible_features_string);
-    free(readonly_compatible_features_string);
+    outbuf_puts(out, "Supported read-only compatible features:\n");
+    append_nx_readonly_compatible_features_string(out, nxsb);
 
-    char* incompatible_features_string = get_nx_incompatible_features_string(nxsb);
-    printf("Backward-incompatible features:\n%s", incompatible_features_string);
-    free(incompatible_features_string);
+    outbuf_puts(out, "Backward-incompatible features:\n");
+    append_nx_incompatible_features_string(out, nxsb);
     
-    printf("UUID:       0x%016llx%016llx\n",
+    outbuf_printf(out, "UUID:       0x%016llx%016llx\n",
         *((uint64_t*)(nxsb->nx_uuid) + 1),
         * (uint64_t*)(nxsb->nx_uuid)
     );
-    printf("Next OID:                       0x%llx\n",  nxsb->nx_next_oid);
-    printf("Next XID:                       0x%llx\n",  nxsb->nx_next_xid);
+    outbuf_printf(out, "Next OID:                       0x%llx\n",  nxsb->nx_next_oid);
+    outbuf_printf(out, "Next XID:                       0x%llx\n",  nxsb->nx_next_xid);
 
     // TODO: Maybe print `xp_desc` and `xp_data` fields.
 
-    printf("Space manager Ephemeral OID:    0x%llx\n",  nxsb->nx_spaceman_oid);
-    printf("Object map Physical OID:        0x%llx\n",  nxsb->nx_omap_oid);
-    printf("Reaper Ephemeral OID:           0x%llx\n",  nxsb->nx_reaper_oid);
+    outbuf_printf(out, "Space manager Ephemeral OID:    0x%llx\n",  nxsb->nx_spaceman_oid);
+    outbuf_printf(out, "Object map Physical OID:        0x%llx\n",  nxsb->nx_omap_oid);
+    outbuf_printf(out, "Reaper Ephemeral OID:           0x%llx\n",  nxsb->nx_reaper_oid);
 
-    char* flags_string = get_nx_flags_string(nxsb);
-    printf("Other flags:\n%s", flags_string);
-    free(flags_string);
+    outbuf_puts(out, "Other flags:\n");
+    append_nx_flags_string(out, nxsb);
+}
+
+/**
+ * Print a nicely formatted string describing the data contained in a container
+ * superblock, including the data in its header.
+ */
+void print_nx_superblock(nx_superblock_t* nxsb) {
+    outbuf_t* out = get_print_outbuf();
+    append_nx_superblock(out, nxsb);
+    outbuf_flush(out);
+}
+
+/**
+ * Append a nicely formatted description of the data contained in a single
+ * checkpoint-mapping to a buffer; see `print_checkpoint_mapping()`.
+ */
+void append_checkpoint_mapping(outbuf_t* out, checkpoint_mapping_t* cpm) {
+    outbuf_printf(out, "Ephemeral OID:                      0x%llx\n",      cpm->cpm_oid);
+    outbuf_printf(out, "Logical block address on disk:      0x%llx\n",      cpm->cpm_paddr);
+
+    outbuf_puts(out, "Object type:                        ");
+    append_o_type_string(out, cpm->cpm_type);
+
+    outbuf_puts(out, "\nObject subtype:                     ");
+    append_o_subtype_string(out, cpm->cpm_subtype);
+    outbuf_puts(out, "\n");
+    
+    outbuf_printf(out, "Object size:                        %u bytes\n",    cpm->cpm_size);
+    outbuf_printf(out, "Associated volume OID (virtual):    0x%llx\n",      cpm->cpm_fs_oid);
 }
 
 /**
@@ -357,19 +228,19 @@ void print_nx_superblock(nx_superblock_t* nxsb) {
  * cpm:     A pointer to the checkpoint-mapping in question.
  */
 void print_checkpoint_mapping(checkpoint_mapping_t* cpm) {
-    printf("Ephemeral OID:                      0x%llx\n",      cpm->cpm_oid);
-    printf("Logical block address on disk:      0x%llx\n",      cpm->cpm_paddr);
-
-    char* type_string = get_o_type_string(cpm->cpm_type);
-    printf("Object type:                        %s\n",          type_string);
-    free(type_string);
+    outbuf_t* out = get_print_outbuf();
+    append_checkpoint_mapping(out, cpm);
+    outbuf_flush(out);
+}
 
-    char* subtype_string = get_o_subtype_string(cpm->cpm_subtype);
-    printf("Object subtype:                     %s\n",          subtype_string);
-    free(subtype_string);
-    
-    printf("Object size:                        %u bytes\n",    cpm->cpm_size);
-    printf("Associated volume OID (virtual):    0x%llx\n",      cpm->cpm_fs_oid);
+/**
+ * Append a human-readable list of the flags that are set on a given
+ * checkpoint-mapping block to a buffer.
+ * 
+ * cpm:     A pointer to the checkpoint-mapping block in question.
+ */
+void append_cpm_flags_string(outbuf_t* buf, checkpoint_map_phys_t* cpm) {
+    outbuf_append_flags_bulleted(buf, cpm->cpm_flags, cpm_flag_descs, NUM_FLAG_DESCS(cpm_flag_descs), "- ", "- No flags are set.\n");
 }
 
 /**
@@ -383,62 +254,10 @@ void print_checkpoint_mapping(checkpoint_mapping_t* cpm) {
  *      this pointer when it is no longer needed.
  */
 char* get_cpm_flags_string(checkpoint_map_phys_t* cpm) {
-    // String to use if no flags are set    
-    char* no_flags_string = "- No flags are set.\n";
-    size_t no_flags_string_len = strlen(no_flags_string);
-    
-    const int NUM_FLAGS = 1;
-    
-    uint64_t flag_constants[] = {
-        CHECKPOINT_MAP_LAST,
-    };
-
-    char* flag_strings[] = {
-        "Last checkpoint-mapping block in the correspondng checkpoint.",
-    };
-
-    // Allocate sufficient memory for the result string
-    size_t max_mem_required = 0;
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        max_mem_required += strlen(flag_strings[i]) + 3;
-        // `+ 3` accounts for prepending "- " and appending "\n" to each string
-    }
-    if (max_mem_required < no_flags_string_len) {
-        max_mem_required = no_flags_string_len;
-    }
-    max_mem_required++; // Make room for terminating NULL byte
-
-    char* result_string = malloc(max_mem_required);
-    if (!result_string) {
-        fprintf(stderr, "\nABORT: get_cpm_flags_string: Could not allocate sufficient memory for `result_string`.\n");
-        exit(-1);
-    }
-
-    char* cursor = result_string;
-
-    // Go through possible flags, adding corresponding string to result if
-    // that flag is set.
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        if (cpm->cpm_flags & flag_constants[i]) {
-            *cursor++ = '-';
-            *cursor++ = ' ';
-            memcpy(cursor, flag_strings[i], strlen(flag_strings[i]));
-            cursor += strlen(flag_strings[i]);
-            *cursor++ = '\n';
-        }
-    }
-
-    if (cursor == result_string) {
-        // No strings were added, so it must be that no flags are set.
-        memcpy(cursor, no_flags_string, no_flags_string_len);
-        cursor += no_flags_string_len;
-    }
-
-    *cursor = '\0';
-
-    // Free up excess allocated memory.
-    result_string = realloc(result_string, strlen(result_string) + 1);
-    return result_string;
+    outbuf_t buf;
+    outbuf_init(&buf, NULL);
+    append_cpm_flags_string(&buf, cpm);
+    return outbuf_take_string(&buf);
 }
 
 /**
@@ -451,14 +270,14 @@ char* get_cpm_flags_string(checkpoint_map_phys_t* cpm) {
  * cpm:     A pointer to the checkpoint-mapping block in question.
  */
 void print_checkpoint_map_phys(checkpoint_map_phys_t* cpm) {
-    print_obj_phys(cpm);    // `cpm` as the same as `&(cpm->cpm_o)`
+    outbuf_t* out = get_print_outbuf();
+    append_obj_phys(out, cpm);  // `cpm` as the same as `&(cpm->cpm_o)`
     
-    char* flags_string = get_cpm_flags_string(cpm);
-    printf("Flags:\n%s",    flags_string);
-    free(flags_string);
+    outbuf_puts(out, "Flags:\n");
+    append_cpm_flags_string(out, cpm);
 
-    printf("Number of mappings: %u\n",  cpm->cpm_count);
-    
+    outbuf_printf(out, "Number of mappings: %u\n",  cpm->cpm_count);
+    outbuf_flush(out);
 }
 
 /**
@@ -466,14 +285,16 @@ void print_checkpoint_map_phys(checkpoint_map_phys_t* cpm) {
  * that exists in a given checkpoint-mapping block.
  */
 void print_checkpoint_map_phys_mappings(checkpoint_map_phys_t* cpm) {
+    outbuf_t* out = get_print_outbuf();
     checkpoint_mapping_t* cursor = cpm->cpm_map;
     checkpoint_mapping_t* end = cursor + cpm->cpm_count;
 
     while (cursor < end) {
-        print_checkpoint_mapping(cursor);
-        printf("--------------------------------------------------------------------------------\n");
+        append_checkpoint_mapping(out, cursor);
+        outbuf_puts(out, "--------------------------------------------------------------------------------\n");
         cursor++;
     }
+    outbuf_flush(out);
 }
 
 #endif // APFS_STRING_NX_H
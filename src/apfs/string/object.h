@@ -12,6 +12,7 @@
 #include <string.h>
 
 #include "../struct/object.h"   // for `obj_phys_t`
+#include "buffer.h"
 
 /**
  * Get a human-readable string describing the object storage type for a given
@@ -38,81 +39,100 @@ char* o_storage_type_to_string(uint32_t o_type) {
     }
 }
 
+static const flag_desc_t o_type_flag_descs[] = {
+    FLAG_DESC(OBJ_NOHEADER,         "No-header"),
+    FLAG_DESC(OBJ_ENCRYPTED,        "Encrypted"),
+    FLAG_DESC(OBJ_NONPERSISTENT,    "Non-persistent (should never appear on disk --- if it does, file a bug against the APFS implementation that created this object)"),
+};
+
+static const flag_desc_t o_type_descs[] = {
+    FLAG_DESC(OBJECT_TYPE_NX_SUPERBLOCK,        "Container superblock"),
+    FLAG_DESC(OBJECT_TYPE_BTREE,                "B-tree (root node)"),
+    FLAG_DESC(OBJECT_TYPE_BTREE_NODE,           "B-tree (non-root) node"),
+    FLAG_DESC(OBJECT_TYPE_SPACEMAN,             "Space manager"),
+    FLAG_DESC(OBJECT_TYPE_SPACEMAN_CAB,         "Space manager chunk-info address block"),
+    FLAG_DESC(OBJECT_TYPE_SPACEMAN_CIB,         "Space manager chunk-info block"),
+    FLAG_DESC(OBJECT_TYPE_SPACEMAN_BITMAP,      "Space manager free-space bitmap"),
+    FLAG_DESC(OBJECT_TYPE_OMAP,                 "Object map"),
+    FLAG_DESC(OBJECT_TYPE_CHECKPOINT_MAP,       "Checkpoint map"),
+    FLAG_DESC(OBJECT_TYPE_FS,                   "APFS volume"),
+    FLAG_DESC(OBJECT_TYPE_NX_REAPER,            "Container reaper"),
+    FLAG_DESC(OBJECT_TYPE_NX_REAP_LIST,         "Container reaper list"),
+    FLAG_DESC(OBJECT_TYPE_EFI_JUMPSTART,        "EFI jumpstart boot info"),
+    FLAG_DESC(OBJECT_TYPE_NX_FUSION_WBC,        "Fusion device write-back cache state"),
+    FLAG_DESC(OBJECT_TYPE_NX_FUSION_WBC_LIST,   "Fusion device write-back cache list"),
+    FLAG_DESC(OBJECT_TYPE_ER_STATE,             "Encryption-rolling state"),
+    FLAG_DESC(OBJECT_TYPE_GBITMAP,              "General-purpose bitmap"),
+    FLAG_DESC(OBJECT_TYPE_GBITMAP_BLOCK,        "General purpose bitmap block"),
+    FLAG_DESC(OBJECT_TYPE_INVALID,              "(none/invalid)"),
+    FLAG_DESC(OBJECT_TYPE_TEST,                 "A type reserved for testing (should never appear on disk --- if it does, file a bug against the APFS implementation that created this object)"),
+    FLAG_DESC(OBJECT_TYPE_CONTAINER_KEYBAG,     "Container keybag"),
+    FLAG_DESC(OBJECT_TYPE_VOLUME_KEYBAG,        "Volume keybag"),
+};
+
+static const flag_desc_t o_subtype_descs[] = {
+    FLAG_DESC(OBJECT_TYPE_SPACEMAN_FREE_QUEUE,  "Space manager free-space queue"),
+    FLAG_DESC(OBJECT_TYPE_EXTENT_LIST_TREE,     "Extents-list tree"),
+    FLAG_DESC(OBJECT_TYPE_FSTREE,               "File-system records tree"),
+    FLAG_DESC(OBJECT_TYPE_BLOCKREFTREE,         "Extent references tree"),
+    FLAG_DESC(OBJECT_TYPE_SNAPMETATREE,         "Volume snapshot metadata tree"),
+    FLAG_DESC(OBJECT_TYPE_OMAP_SNAPSHOT,        "Object map snapshots tree"),
+    FLAG_DESC(OBJECT_TYPE_FUSION_MIDDLE_TREE,   "Fusion inter-drive block-mapping tree"),
+    FLAG_DESC(OBJECT_TYPE_GBITMAP_TREE,         "B-tree of general-purpose bitmaps"),
+};
+
 /**
- * Get a human-readable string that lists the type flags that are set on a given
- * object. This list does not include storage types; namely, it does not specify
- * whether the object is Physical, Virtual, or Ephemeral.
+ * Append a human-readable list of the type flags that are set on a given
+ * object to a buffer. This list does not include storage types; namely, it
+ * does not specify whether the object is Physical, Virtual, or Ephemeral.
  * 
  * o_type:     A 32-bit bitfield whose lower 16 bits represent an APFS object type.
  *          Examples include the `o_type` field of `obj_phys_t`,
  *          and the `cpm_type` field of `checkpoint_mapping_t`.
+ */
+void append_o_type_flags_string(outbuf_t* buf, uint32_t o_type) {
+    outbuf_append_flags_inline(buf, o_type, o_type_flag_descs, NUM_FLAG_DESCS(o_type_flag_descs));
+}
+
+/**
+ * Get a human-readable string that lists the type flags that are set on a given
+ * object; see `append_o_type_flags_string()`.
  * 
  * RETURN VALUE:
  *      A pointer to the first character of the string. The caller must free
  *      this pointer when it is no longer needed.
  */
 char* get_o_type_flags_string(uint32_t o_type) {
-    uint32_t flag_constants[] = {
-        OBJ_NOHEADER,
-        OBJ_ENCRYPTED,
-        OBJ_NONPERSISTENT,
-    };
-
-    char* flag_strings[] = {
-        "No-header",
-        "Encrypted",
-        "Non-persistent (should never appear on disk --- if it does, file a bug against the APFS implementation that created this object)",
-    };
-
-    // Allocate sufficient memory to store the longest possible string.
-    size_t max_mem_required = 0;
-    for (int i = 0; i < 3; i++) {
-        max_mem_required += strlen(flag_strings[i]) + 2;
-        // `+ 2` accounts for appending ", " to each string
-    }
-    char* result_string = malloc(max_mem_required);
-    if (!result_string) {
-        fprintf(stderr, "\nABORT: get_obj_type_flags_string: Could not allocate sufficient memory for `result_string`.\n");
-    }
-    
-    char* cursor = result_string;
-
-    // Go through possible flags. If a flag is set, append its corresponding
-    // string to `result_string`. The flags are comma-delimited.
-    for (int i = 0; i < 3; i++) {
-        if (o_type & flag_constants[i]) {
-            if (cursor != result_string) {
-                *cursor++ = ',';
-                *cursor++ = ' ';
-            }
-            size_t flag_string_len = strlen(flag_strings[i]);
-            memcpy(cursor, flag_strings[i], flag_string_len);
-            cursor += flag_string_len;
-        }
-    }
-
-    if (cursor == result_string) {
-        // No strings were added, so it must be that no flags are set.
-        char* no_flags_string = "(none)";
-        size_t no_flags_string_len = strlen(no_flags_string);
-        memcpy(cursor, no_flags_string, no_flags_string_len);
-        cursor += no_flags_string_len;
-    }
-
-    *cursor = '\0';
-    
-    // Free up excess allocated memory.
-    result_string = realloc(result_string, strlen(result_string) + 1);
-    return result_string;
+    outbuf_t buf;
+    outbuf_init(&buf, NULL);
+    append_o_type_flags_string(&buf, o_type);
+    return outbuf_take_string(&buf);
 }
 
 /**
- * Get a human-readable string describing a given `o_type` value.
+ * Append a human-readable description of a given `o_type` value to a buffer.
  * 
  * o_type:  A 32-bit bitfield whose lower 16 bits represent an APFS object type.
  *          Examples include the `o_type` field of `obj_phys_t`,
  *          and the `cpm_type` field of `checkpoint_mapping_t`.
  * 
+ * If the specified type is not recognised, the description begins with
+ * "Unknown type".
+ */
+void append_o_type_string(outbuf_t* buf, uint32_t o_type) {
+    uint32_t masked_o_type = o_type & OBJECT_TYPE_MASK;
+    const flag_desc_t* desc = find_flag_desc(masked_o_type, o_type_descs, NUM_FLAG_DESCS(o_type_descs));
+    if (desc) {
+        outbuf_append(buf, desc->string, desc->len);
+        return;
+    }
+    outbuf_printf(buf, "Unknown type (0x%08x) --- perhaps this type was introduced in a later version of APFS than that published on 2019-02-27.", masked_o_type);
+}
+
+/**
+ * Get a human-readable string describing a given `o_type` value; see
+ * `append_o_type_string()`.
+ * 
  * RETURN VALUE:
  *      A pointer to the first character in the string. This pointer must be
  *      freed when it is no longer needed.
@@ -123,107 +143,40 @@ char* get_o_type_flags_string(uint32_t o_type) {
  *      evaluate to `true`.
  */
 char* get_o_type_string(uint32_t o_type) {
-    // This function is implemented this way so that the caller receives a
-    // pointer that is allocated using `malloc()` rather than a stack pointer.
-
-    // This string is a legal `sprintf()` format string.
-    char* default_string = "Unknown type (0x%08x) --- perhaps this type was introduced in a later version of APFS than that published on 2019-02-27.";
-    
-    // Add 8 to account for `%x` being replaced with up to 8 characters.
-    size_t max_mem_required = strlen(default_string) + 8;
-
-    size_t NUM_FLAGS = 22;
-    uint32_t flag_constants[] = {
-        OBJECT_TYPE_NX_SUPERBLOCK,
-        OBJECT_TYPE_BTREE,
-        OBJECT_TYPE_BTREE_NODE,
-        OBJECT_TYPE_SPACEMAN,
-        OBJECT_TYPE_SPACEMAN_CAB,
-        OBJECT_TYPE_SPACEMAN_CIB,
-        OBJECT_TYPE_SPACEMAN_BITMAP,
-        OBJECT_TYPE_OMAP,
-        OBJECT_TYPE_CHECKPOINT_MAP,
-        OBJECT_TYPE_FS,
-        OBJECT_TYPE_NX_REAPER,
-        OBJECT_TYPE_NX_REAP_LIST,
-        OBJECT_TYPE_EFI_JUMPSTART,
-        OBJECT_TYPE_NX_FUSION_WBC,
-        OBJECT_TYPE_NX_FUSION_WBC_LIST,
-        OBJECT_TYPE_ER_STATE,
-        OBJECT_TYPE_GBITMAP,
-        OBJECT_TYPE_GBITMAP_BLOCK,
-        OBJECT_TYPE_INVALID,
-        OBJECT_TYPE_TEST,
-        OBJECT_TYPE_CONTAINER_KEYBAG,
-        OBJECT_TYPE_VOLUME_KEYBAG,
-    };
-    char* flag_strings[] = {
-        "Container superblock",
-        "B-tree (root node)",
-        "B-tree (non-root) node",
-        "Space manager",
-        "Space manager chunk-info address block",
-        "Space manager chunk-info block",
-        "Space manager free-space bitmap",
-        "Object map",
-        "Checkpoint map",
-        "APFS volume",
-        "Container reaper",
-        "Container reaper list",
-        "EFI jumpstart boot info",
-        "Fusion device write-back cache state",
-        "Fusion device write-back cache list",
-        "Encryption-rolling state",
-        "General-purpose bitmap",
-        "General purpose bitmap block",
-        "(none/invalid)",
-        "A type reserved for testing (should never appear on disk --- if it does, file a bug against the APFS implementation that created this object)",
-        "Container keybag",
-        "Volume keybag",
-    };
-
-    // Allocate sufficient memory to store the longest flag string.
-    for (uint32_t i = 0; i < NUM_FLAGS; i++) {
-        size_t flag_string_length = strlen(flag_strings[i]);
-        if (max_mem_required < flag_string_length) {
-            max_mem_required = flag_string_length;
-        }
-    }
-    max_mem_required++; // Account for terminating NULL byte
-
-    char* result_string = malloc(max_mem_required);
-    if (!result_string) {
-        fprintf(stderr, "\nABORT: get_o_type_string: Could not allocate sufficient memory for `result_string`.\n");
-        exit(-1);
-    }
-    
-    // Set the right string
-    memcpy(result_string, default_string, strlen(default_string) + 1);
-    uint32_t masked_o_type = o_type & OBJECT_TYPE_MASK;
-    for (size_t i = 0; i < NUM_FLAGS; i++) {
-        if (masked_o_type == flag_constants[i]) {
-            memcpy(result_string, flag_strings[i], strlen(flag_strings[i]) + 1);
-        }
-    }
-
-    // If no string set (due to no flags present), then report "Unknown type".
-    if (strlen(result_string) == 0) {
-        sprintf(result_string, default_string, masked_o_type);
-    }
-
-    // De-allocate excess memory
-    result_string = realloc(result_string, strlen(result_string) + 1);
-
-    return result_string;
+    outbuf_t buf;
+    outbuf_init(&buf, NULL);
+    append_o_type_string(&buf, o_type);
+    return outbuf_take_string(&buf);
 }
 
 /**
- * Get a human-readable string describing a given `o_subtype` value.
+ * Append a human-readable description of a given `o_subtype` value to a buffer.
  * 
  * o_subtype:   A 32-bit field that represents an APFS object subtype.
  *              Examples include the `o_subtype` field of `obj_phys_t`,
  *              and the `cpm_subtype` field of `checkpoint_mapping_t`.
  * 
+ * If the specified subtype is not recognised, the description begins with
+ * "Unknown subtype".
+ */
+void append_o_subtype_string(outbuf_t* buf, uint32_t o_subtype) {
+    // A subtype may be any of the regular types as well.
+    uint32_t masked_o_subtype = o_subtype & OBJECT_TYPE_MASK;
+    const flag_desc_t* desc = find_flag_desc(masked_o_subtype, o_type_descs, NUM_FLAG_DESCS(o_type_descs));
+    if (!desc) {
+        desc = find_flag_desc(masked_o_subtype, o_subtype_descs, NUM_FLAG_DESCS(o_subtype_descs));
+    }
+    if (desc) {
+        outbuf_append(buf, desc->string, desc->len);
+        return;
+    }
+    outbuf_printf(buf, "Unknown subtype (0x%08x) --- perhaps this subtype was introduced in a later version of APFS than that published on 2019-02-27.", masked_o_subtype);
+}
+
+/**
+ * Get a human-readable string describing a given `o_subtype` value; see
+ * `append_o_subtype_string()`.
+ * 
  * RETURN VALUE:
  *      A pointer to the first character in the string. This pointer must be
  *      freed when it is no longer needed.
@@ -234,81 +187,28 @@ char* get_o_type_string(uint32_t o_type) {
  *      will evaluate to `true`.
  */
 char* get_o_subtype_string(uint32_t o_subtype) {
-    // This function is implemented this way so that the caller receives a
-    // pointer that is allocated using `malloc()` rather than a stack pointer.
-
-    // Check if `o_subtype` is a value representing a regular type.
-    char* result_string = get_o_type_string(o_subtype);
-    if (strstr(result_string, "Unknown type") != result_string) {
-        return result_string;
-    }
-
-    // Set `result_string` to an empty string,
-    // so that `strlen(result_string) == 0`.
-    *result_string = '\0';
-
-    // This string is a legal `sprintf()` format string.
-    char* default_string = "Unknown subtype (0x%08x) --- perhaps this subtype was introduced in a later version of APFS than that published on 2019-02-27.";
-    
-    // Add 8 to account for `%x` being replaced with up to 8 characters.
-    size_t max_mem_required = strlen(default_string) + 8;
-
-    size_t NUM_FLAGS = 8;
-
-    uint32_t flag_constants[] = {
-        OBJECT_TYPE_SPACEMAN_FREE_QUEUE,
-        OBJECT_TYPE_EXTENT_LIST_TREE,
-        OBJECT_TYPE_FSTREE,
-        OBJECT_TYPE_BLOCKREFTREE,
-        OBJECT_TYPE_SNAPMETATREE,
-        OBJECT_TYPE_OMAP_SNAPSHOT,
-        OBJECT_TYPE_FUSION_MIDDLE_TREE,
-        OBJECT_TYPE_GBITMAP_TREE,
-
-    };
-
-    char* flag_strings[] = {
-        "Space manager free-space queue",
-        "Extents-list tree",
-        "File-system records tree",
-        "Extent references tree",
-        "Volume snapshot metadata tree",
-        "Object map snapshots tree",
-        "Fusion inter-drive block-mapping tree",
-        "B-tree of general-purpose bitmaps",
-    };
-
-    // Allocate sufficient memory to store the longest flag string.
-    for (uint32_t i = 0; i < NUM_FLAGS; i++) {
-        size_t flag_string_length = strlen(flag_strings[i]);
-        if (max_mem_required < flag_string_length) {
-            max_mem_required = flag_string_length;
-        }
-    }
-    max_mem_required++; // Account for terminating NULL byte
-    result_string = realloc(result_string, max_mem_required);
-    if (!result_string) {
-        fprintf(stderr, "\nABORT: get_o_subtype_string: Could not allocate sufficient memory for `result_string`.\n");
-        exit(-1);
-    }
-
-    // Set the right string
-    uint32_t masked_o_subtype = o_subtype & OBJECT_TYPE_MASK;
-    for (size_t i = 0; i < NUM_FLAGS; i++) {
-        if (masked_o_subtype == flag_constants[i]) {
-            memcpy(result_string, flag_strings[i], strlen(flag_strings[i]) + 1);
-        }
-    }
-
-    // If no string set (due to no flags present), then report "Unknown type".
-    if (strlen(result_string) == 0) {
-        sprintf(result_string, default_string, masked_o_subtype);
-    }
-
-    // De-allocate excess memory
-    result_string = realloc(result_string, strlen(result_string) + 1);
+    outbuf_t buf;
+    outbuf_init(&buf, NULL);
+    append_o_subtype_string(&buf, o_subtype);
+    return outbuf_take_string(&buf);
+}
 
-    return result_string;
+/**
+ * Append a nicely formatted description of the data contained in the header
+ * of an APFS object to a buffer.
+ */
+void append_obj_phys(outbuf_t* out, obj_phys_t* obj) {
+    outbuf_printf(out, "Stored checksum:    0x%016llx\n",   *(uint64_t*)obj);
+    outbuf_printf(out, "OID:                0x%llx\n",      obj->o_oid);
+    outbuf_printf(out, "XID:                0x%llx\n",      obj->o_xid);
+    outbuf_printf(out, "Storage type:       %s\n",          o_storage_type_to_string(obj->o_type));
+    outbuf_puts(out, "Type flags:         ");
+    append_o_type_flags_string(out, obj->o_type);
+    outbuf_puts(out, "\nType:               ");
+    append_o_type_string(out, obj->o_type);
+    outbuf_puts(out, "\nSubtype:            ");
+    append_o_subtype_string(out, obj->o_subtype);
+    outbuf_puts(out, "\n");
 }
 
 /**
@@ -316,22 +216,9 @@ char* get_o_subtype_string(uint32_t o_subtype) {
  * of an APFS object.
  */
 void print_obj_phys(obj_phys_t* obj) {
-    char* type_flags_string = get_o_type_flags_string(obj->o_type);
-    char* type_string       = get_o_type_string(obj->o_type);
-    char* subtype_string    = get_o_subtype_string(obj->o_subtype);
-
-    // Print the info
-    printf("Stored checksum:    0x%016llx\n",   *(uint64_t*)obj);
-    printf("OID:                0x%llx\n",      obj->o_oid);
-    printf("XID:                0x%llx\n",      obj->o_xid);
-    printf("Storage type:       %s\n",          o_storage_type_to_string(obj->o_type));
-    printf("Type flags:         %s\n",          type_flags_string);
-    printf("Type:               %s\n",          type_string);
-    printf("Subtype:            %s\n",          subtype_string);
-
-    free(type_flags_string);
-    free(type_string);
-    free(subtype_string);
+    outbuf_t* out = get_print_outbuf();
+    append_obj_phys(out, obj);
+    outbuf_flush(out);
 }
 
 #endif // APFS_STRING_OBJECT_H
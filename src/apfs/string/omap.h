@@ -10,6 +10,29 @@
 #include "../struct/omap.h"
 #include "object.h"
 
+static const flag_desc_t om_flag_descs[] = {
+    FLAG_DESC(OMAP_MANUALLY_MANAGED,    "No snapshot support"),
+    FLAG_DESC(OMAP_ENCRYPTING,          "Transitioning to encrypted state"),
+    FLAG_DESC(OMAP_DECRYPTING,          "Transitioning to decrypted state"),
+    FLAG_DESC(OMAP_KEYROLLING,          "Transitioning from on old encryption key to a new encryption key"),
+    /* 
+     * `OMAP_CRYPTO_GENERATION` does not convey any useful info about the
+     * object map itself, but the objects contained within an object map
+     * refer to this field to convey info about their encryption state,
+     * so it is omitted here.
+     */
+};
+
+/**
+ * Append a human-readable list of the flags that are set on a given object map
+ * to a buffer.
+ * 
+ * omap:    A pointer to the object map in question.
+ */
+void append_om_flags_string(outbuf_t* buf, omap_phys_t* omap) {
+    outbuf_append_flags_bulleted(buf, omap->om_flags, om_flag_descs, NUM_FLAG_DESCS(om_flag_descs), "- ", "- No flags are set.\n");
+}
+
 /**
  * Get a human-readable string that lists the flags that are set on a given
  * object map.
@@ -21,75 +44,23 @@
  *      this pointer when it is no longer needed.
  */
 char* get_om_flags_string(omap_phys_t* omap) {
-    // String to use if no flags are set    
-    char* no_flags_string = "- No flags are set.\n";
-    size_t no_flags_string_len = strlen(no_flags_string);
-    
-    const int NUM_FLAGS = 4;
-    
-    uint64_t flag_constants[] = {
-        OMAP_MANUALLY_MANAGED,
-        OMAP_ENCRYPTING,
-        OMAP_DECRYPTING,
-        OMAP_KEYROLLING,
-        /* 
-         * The following constant does not convey any useful info about the
-         * object map itself, but the objects contained within an object map
-         * refer to this field to convey info about their encryption state.
-         * This constant is listed here for completeness.
-         */
-        // OMAP_CRYPTO_GENERATION,
-    };
-
-    char* flag_strings[] = {
-        "No snapshot support",
-        "Transitioning to encrypted state",
-        "Transitioning to decrypted state",
-        "Transitioning from on old encryption key to a new encryption key"
-    };
-
-    // Allocate sufficient memory for the result string
-    size_t max_mem_required = 0;
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        max_mem_required += strlen(flag_strings[i]) + 3;
-        // `+ 3` accounts for prepending "- " and appending "\n" to each string
-    }
-    if (max_mem_required < no_flags_string_len) {
-        max_mem_required = no_flags_string_len;
-    }
-    max_mem_required++; // Make room for terminating NULL byte
-
-    char* result_string = malloc(max_mem_required);
-    if (!result_string) {
-        fprintf(stderr, "\nABORT: get_om_flags_string: Could not allocate sufficient memory for `result_string`.\n");
-        exit(-1);
-    }
-
-    char* cursor = result_string;
-
-    // Go through possible flags, adding corresponding string to result if
-    // that flag is set.
-    for (int i = 0; i < NUM_FLAGS; i++) {
-        if (omap->om_flags & flag_constants[i]) {
-            *cursor++ = '-';
-            *cursor++ = ' ';
-            memcpy(cursor, flag_strings[i], strlen(flag_strings[i]));
-            cursor += strlen(flag_strings[i]);
-            *cursor++ = '\n';
-        }
-    }
-
-    if (cursor == result_string) {
-        // No strings were added, so it must be that no flags are set.
-        memcpy(cursor, no_flags_string, no_flags_string_len);
-        cursor += no_flags_string_len;
-    }
-
-    *cursor = '\0';
+    outbuf_t buf;
+    outbuf_init(&buf, NULL);
+    append_om_flags_string(&buf, omap);
+    return outbuf_take_string(&buf);
+}
 
-    // Free up excess allocated memory.
-    result_string = realloc(result_string, strlen(result_string) + 1);
-    return result_string;
+/**
+ * Append a nicely formatted description of a tree that an object map refers
+ * to, given its type and OID, to a buffer.
+ */
+void append_omap_tree_info(outbuf_t* out, uint32_t tree_type, oid_t tree_oid) {
+    outbuf_printf(out, "- Storage type:         %s\n",          o_storage_type_to_string(tree_type));
+    outbuf_puts(out, "- Type flags:           ");
+    append_o_type_flags_string(out, tree_type);
+    outbuf_puts(out, "\n- Type:                 ");
+    append_o_type_string(out, tree_type);
+    outbuf_printf(out, "\n- Object ID:            0x%llx\n",    tree_oid);
 }
 
 /**
@@ -97,37 +68,24 @@ char* get_om_flags_string(omap_phys_t* omap) {
  * map, including the data in its header.
  */
 void print_omap_phys(omap_phys_t* omap) {
-    print_obj_phys(omap);
+    outbuf_t* out = get_print_outbuf();
+    append_obj_phys(out, omap);
 
-    char* flags_string = get_om_flags_string(omap);
-    printf("Flags:\n%s", flags_string);
-    free(flags_string);
+    outbuf_puts(out, "Flags:\n");
+    append_om_flags_string(out, omap);
 
-    char* type_flags_string = get_o_type_flags_string(omap->om_tree_type);
-    char* type_string       = get_o_type_string(omap->om_tree_type);
-    printf("Object mappings tree:\n");
-    printf("- Storage type:         %s\n",          o_storage_type_to_string(omap->om_tree_type));
-    printf("- Type flags:           %s\n",          type_flags_string);
-    printf("- Type:                 %s\n",          type_string);
-    printf("- Object ID:            0x%llx\n",      omap->om_tree_oid);
-    free(type_flags_string);
-    free(type_string);
+    outbuf_puts(out, "Object mappings tree:\n");
+    append_omap_tree_info(out, omap->om_tree_type, omap->om_tree_oid);
 
-    type_flags_string   = get_o_type_flags_string(omap->om_snapshot_tree_type);
-    type_string         = get_o_type_string(omap->om_snapshot_tree_type);
-    printf("Snapshots tree:\n");
-    printf("- Storage type:         %s\n",          o_storage_type_to_string(omap->om_snapshot_tree_type));
-    printf("- Type flags:           %s\n",          type_flags_string);
-    printf("- Type:                 %s\n",          type_string);
-    printf("- Object ID:            0x%llx\n",      omap->om_snapshot_tree_oid);
-    free(type_flags_string);
-    free(type_string);
+    outbuf_puts(out, "Snapshots tree:\n");
+    append_omap_tree_info(out, omap->om_snapshot_tree_type, omap->om_snapshot_tree_oid);
 
-    printf("- Number of snapshots:  %u snapshots\n",    omap->om_snap_count);
-    printf("- Latest snapshot XID:  0x%llx\n",          omap->om_most_recent_snap);
-    printf("In-progress revert:\n");
-    printf("- Minimum XID:          0x%llx\n",      omap->om_pending_revert_min);
-    printf("- Maximum XID:          0x%llx\n",      omap->om_pending_revert_max);
+    outbuf_printf(out, "- Number of snapshots:  %u snapshots\n",    omap->om_snap_count);
+    outbuf_printf(out, "- Latest snapshot XID:  0x%llx\n",          omap->om_most_recent_snap);
+    outbuf_puts(out, "In-progress revert:\n");
+    outbuf_printf(out, "- Minimum XID:          0x%llx\n",      omap->om_pending_revert_min);
+    outbuf_printf(out, "- Maximum XID:          0x%llx\n",      omap->om_pending_revert_max);
+    outbuf_flush(out);
 }
 
 /**
@@ -135,8 +93,10 @@ void print_omap_phys(omap_phys_t* omap) {
  * map key.
  */
 void print_omap_key(omap_key_t* omap_key) {
-    printf("  - OID:                            0x%llx\n",      omap_key->ok_oid);
-    printf("  - XID:                            0x%llx\n",      omap_key->ok_xid);
+    outbuf_t* out = get_print_outbuf();
+    outbuf_printf(out, "  - OID:                            0x%llx\n",      omap_key->ok_oid);
+    outbuf_printf(out, "  - XID:                            0x%llx\n",      omap_key->ok_xid);
+    outbuf_flush(out);
 }
 
 /**
@@ -145,8 +105,10 @@ void print_omap_key(omap_key_t* omap_key) {
  */
 void print_omap_val(omap_val_t* omap_val) {
     // TODO: Print flags
-    printf("  - Object size:                    %u bytes\n",    omap_val->ov_size);
-    printf("  - Object address in container:    0x%llx\n",      omap_val->ov_paddr);
+    outbuf_t* out = get_print_outbuf();
+    outbuf_printf(out, "  - Object size:                    %u bytes\n",    omap_val->ov_size);
+    outbuf_printf(out, "  - Object address in container:    0x%llx\n",      omap_val->ov_paddr);
+    outbuf_flush(out);
 }
 
 #endif // APFS_STRING_OMAP_H
@@ -0,0 +1,162 @@
+/**
+ * Progress reporting for tools that scan large ranges of blocks.
+ *
+ * A scan counts the blocks it has processed and the matches it has found in a
+ * `progress_t`, and calls `progress_update()` as often as it likes. The clock
+ * is only consulted once every `PROGRESS_CHECK_BLOCKS` blocks, and the
+ * progress line, which shows throughput, an estimate of the time remaining,
+ * and the number of matches, is only redrawn `progress_rate` times per second.
+ * Each redraw is a single write to stderr, and nothing is drawn at all unless
+ * stderr is a terminal, so progress reporting costs next to nothing when the
+ * output is redirected or the tool is run over a slow connection.
+ *
+ * The counters are updated atomically, so worker threads may count blocks and
+ * matches; only one thread should call `progress_update()`.
+ */
+
+#ifndef APFS_STRING_PROGRESS_H
+#define APFS_STRING_PROGRESS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../io.h"
+
+/** Configuration **/
+
+// Set by `--progress-rate`; the maximum number of redraws per second, or 0 to
+// disable progress reporting.
+uint32_t progress_rate = 4;
+
+// Number of blocks between checks of the clock.
+#define PROGRESS_CHECK_BLOCKS   256
+
+typedef struct {
+    bool        enabled;
+    bool        line_drawn;
+    bool        show_matches;   // Cleared by tools that don't look for matches
+    uint64_t    total_blocks;
+    uint64_t    num_blocks;
+    uint64_t    num_matches;
+    uint64_t    next_check_blocks;
+    double      start_time;
+    double      next_draw_time;
+} progress_t;
+
+/**
+ * Get the time in seconds, from an arbitrary starting point.
+ */
+double progress_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Initialise a progress counter for a scan of a given number of blocks. If
+ * the number of blocks isn't known, pass 0, and no ETA will be shown.
+ */
+void progress_init(progress_t* progress, uint64_t total_blocks) {
+    progress->enabled           = progress_rate > 0 && isatty(STDERR_FILENO);
+    progress->line_drawn        = false;
+    progress->show_matches      = true;
+    progress->total_blocks      = total_blocks;
+    progress->num_blocks        = 0;
+    progress->num_matches       = 0;
+    progress->next_check_blocks = PROGRESS_CHECK_BLOCKS;
+    progress->start_time        = progress_now();
+    progress->next_draw_time    = progress->start_time;
+}
+
+void progress_add_blocks(progress_t* progress, uint64_t num_blocks) {
+    __atomic_add_fetch(&progress->num_blocks, num_blocks, __ATOMIC_RELAXED);
+}
+
+void progress_add_matches(progress_t* progress, uint64_t num_matches) {
+    __atomic_add_fetch(&progress->num_matches, num_matches, __ATOMIC_RELAXED);
+}
+
+/**
+ * Format a number of seconds as `h:mm:ss` into a given buffer.
+ */
+void progress_format_duration(char* buffer, size_t size, double seconds) {
+    uint64_t total = seconds;
+    snprintf(buffer, size, "%llu:%02llu:%02llu", total / 3600, (total / 60) % 60, total % 60);
+}
+
+/**
+ * Draw the progress line, replacing any that was drawn before.
+ */
+void progress_draw(progress_t* progress, double now) {
+    uint64_t num_blocks  = __atomic_load_n(&progress->num_blocks,  __ATOMIC_RELAXED);
+    uint64_t num_matches = __atomic_load_n(&progress->num_matches, __ATOMIC_RELAXED);
+
+    double elapsed = now - progress->start_time;
+    double blocks_per_sec = elapsed > 0 ? num_blocks / elapsed : 0;
+    double mb_per_sec = blocks_per_sec * nx_block_size / (1024 * 1024);
+
+    char matches[48] = "";
+    if (progress->show_matches) {
+        snprintf(matches, sizeof(matches), " || %llu matches", num_matches);
+    }
+
+    char line[256];
+    int len;
+    if (progress->total_blocks) {
+        char eta[32] = "?";
+        if (blocks_per_sec > 0 && num_blocks <= progress->total_blocks) {
+            progress_format_duration(eta, sizeof(eta), (progress->total_blocks - num_blocks) / blocks_per_sec);
+        }
+        len = snprintf(line, sizeof(line),
+            "\r\033[2K%6.2f%% || %llu / %llu blocks || %.1f MB/s || %.0f blocks/s || ETA %s%s",
+            (double)num_blocks * 100 / progress->total_blocks,
+            num_blocks, progress->total_blocks,
+            mb_per_sec, blocks_per_sec, eta, matches
+        );
+    } else {
+        len = snprintf(line, sizeof(line),
+            "\r\033[2K%llu blocks || %.1f MB/s || %.0f blocks/s%s",
+            num_blocks, mb_per_sec, blocks_per_sec, matches
+        );
+    }
+    if (len > 0) {
+        fwrite(line, 1, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1, stderr);
+    }
+    progress->line_drawn = true;
+}
+
+/**
+ * Redraw the progress line if it is due to be redrawn. This is cheap enough to
+ * call after every block.
+ */
+void progress_update(progress_t* progress) {
+    if (!progress->enabled
+        || __atomic_load_n(&progress->num_blocks, __ATOMIC_RELAXED) < progress->next_check_blocks
+    ) {
+        return;
+    }
+    progress->next_check_blocks = progress->num_blocks + PROGRESS_CHECK_BLOCKS;
+
+    double now = progress_now();
+    if (now < progress->next_draw_time) {
+        return;
+    }
+    progress->next_draw_time = now + 1.0 / progress_rate;
+    progress_draw(progress, now);
+}
+
+/**
+ * Erase the progress line, if one is shown, so that other output can be
+ * printed in its place. It is redrawn at the next update that is due.
+ */
+void progress_clear(progress_t* progress) {
+    if (progress->line_drawn) {
+        fputs("\r\033[2K", stderr);
+        progress->line_drawn = false;
+    }
+}
+
+#endif // APFS_STRING_PROGRESS_H
@@ -0,0 +1,532 @@
+/**
+ * Machine-readable output: a streaming encoder that writes one object per
+ * block, record, or match, either as JSON Lines (one JSON object per line) or
+ * as a CBOR sequence (RFC 8742; one indefinite-length map per object).
+ *
+ * Tools that support structured output set `output_format_supported` before
+ * calling `parse_common_options()`, which then accepts `--format=jsonl|cbor`.
+ * Once structured output has been started, the objects are written to the
+ * original standard output through a large buffer, and standard output itself
+ * is redirected to stderr, so that the tools' usual prose can still be printed
+ * without corrupting the stream.
+ *
+ * An object is written with `record_begin()`, any number of `record_*()`
+ * field calls, and `record_end()`. Field names must not need escaping. String
+ * values needn't be valid UTF-8, as names from damaged structures often aren't;
+ * bytes that aren't part of a well-formed sequence are replaced with U+FFFD.
+ * Numbers that aren't finite are written as null. Enumerated values are given
+ * by the names of their constants, e.g. `DT_DIR`, rather than by the
+ * descriptions that the text output uses.
+ */
+
+#ifndef APFS_STRING_RECORD_H
+#define APFS_STRING_RECORD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "../struct/object.h"
+#include "../struct/nx.h"
+#include "../struct/omap.h"
+#include "../struct/btree.h"
+#include "../struct/fs.h"
+#include "../struct/j.h"
+#include "../struct/dstream.h"
+#include "buffer.h"
+#include "object.h"
+#include "j.h"
+
+typedef enum {
+    OUTPUT_TEXT,
+    OUTPUT_JSONL,
+    OUTPUT_CBOR,
+} output_format_t;
+
+/** Configuration **/
+
+output_format_t output_format = OUTPUT_TEXT;
+
+// Set by tools that support `--format`; other tools reject the option.
+bool output_format_supported = false;
+
+/** State **/
+
+outbuf_t    record_outbuf;
+FILE*       record_stream = NULL;
+bool        record_first_field = true;
+
+bool is_structured_output() {
+    return output_format != OUTPUT_TEXT;
+}
+
+void end_structured_output() {
+    if (record_stream) {
+        outbuf_flush(&record_outbuf);
+        fflush(record_stream);
+    }
+}
+
+/**
+ * Start writing structured output, if `--format` asked for it. The objects go
+ * to the original standard output; anything subsequently printed to
+ * `stdout` goes to stderr instead. The output is flushed at exit.
+ */
+void start_structured_output() {
+    if (!is_structured_output() || record_stream) {
+        return;
+    }
+
+    int fd = dup(STDOUT_FILENO);
+    if (fd == -1 || !(record_stream = fdopen(fd, "wb"))) {
+        fprintf(stderr, "\nABORT: start_structured_output: Could not duplicate standard output.\n");
+        exit(-1);
+    }
+    // Redirect before flushing, so that any prose still buffered by stdio
+    // goes to stderr along with the rest of it.
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    fflush(stdout);
+
+    outbuf_init(&record_outbuf, record_stream);
+    atexit(end_structured_output);
+}
+
+/** CBOR encoding **/
+
+#define CBOR_MAJOR_UINT     0
+#define CBOR_MAJOR_TEXT     3
+#define CBOR_MAP_INDEFINITE 0xbf
+#define CBOR_BREAK          0xff
+#define CBOR_FALSE          0xf4
+#define CBOR_TRUE           0xf5
+#define CBOR_NULL           0xf6
+
+void cbor_append_head(outbuf_t* buf, uint8_t major, uint64_t value) {
+    uint8_t head[9];
+    size_t len;
+    major <<= 5;
+    if (value < 24) {
+        head[0] = major | value;
+        len = 1;
+    } else if (value <= UINT8_MAX) {
+        head[0] = major | 24;
+        head[1] = value;
+        len = 2;
+    } else if (value <= UINT16_MAX) {
+        head[0] = major | 25;
+        head[1] = value >> 8;
+        head[2] = value;
+        len = 3;
+    } else if (value <= UINT32_MAX) {
+        head[0] = major | 26;
+        for (int i = 0; i < 4; i++) {
+            head[1 + i] = value >> (24 - 8*i);
+        }
+        len = 5;
+    } else {
+        head[0] = major | 27;
+        for (int i = 0; i < 8; i++) {
+            head[1 + i] = value >> (56 - 8*i);
+        }
+        len = 9;
+    }
+    outbuf_append(buf, (char*)head, len);
+}
+
+void cbor_append_text(outbuf_t* buf, const char* string, size_t len) {
+    cbor_append_head(buf, CBOR_MAJOR_TEXT, len);
+    outbuf_append(buf, string, len);
+}
+
+/** JSON encoding **/
+
+void json_append_string(outbuf_t* buf, const char* string, size_t len) {
+    static const char hex_digits[] = "0123456789abcdef";
+
+    outbuf_reserve(buf, len + 2);
+    buf->data[buf->len++] = '"';
+    size_t run_start = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = string[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        outbuf_append(buf, string + run_start, i - run_start);
+        run_start = i + 1;
+        switch (c) {
+            case '"':   outbuf_append(buf, "\\\"", 2);  break;
+            case '\\':  outbuf_append(buf, "\\\\", 2);  break;
+            case '\n':  outbuf_append(buf, "\\n", 2);   break;
+            case '\t':  outbuf_append(buf, "\\t", 2);   break;
+            default: {
+                char escape[6] = { '\\', 'u', '0', '0', hex_digits[c >> 4], hex_digits[c & 0xf] };
+                outbuf_append(buf, escape, 6);
+            } break;
+        }
+    }
+    outbuf_append(buf, string + run_start, len - run_start);
+    outbuf_append(buf, "\"", 1);
+}
+
+void json_append_key(outbuf_t* buf, const char* key) {
+    if (!record_first_field) {
+        outbuf_append(buf, ",", 1);
+    }
+    record_first_field = false;
+    outbuf_append(buf, "\"", 1);
+    outbuf_puts(buf, key);
+    outbuf_append(buf, "\":", 2);
+}
+
+/** UTF-8 validation **/
+
+/**
+ * Get the length of the well-formed UTF-8 sequence at the start of a string,
+ * as defined by table 3-7 of the Unicode standard.
+ *
+ * RETURN VALUE:    1 to 4, or 0 if the bytes at the start of the string aren't
+ *      a well-formed sequence.
+ */
+size_t utf8_sequence_len(const unsigned char* string, size_t len) {
+    unsigned char c = string[0];
+    if (c < 0x80) {
+        return 1;
+    }
+
+    size_t seq_len;
+    unsigned char min = 0x80, max = 0xbf;   // Bounds of the second byte
+    if (c >= 0xc2 && c <= 0xdf) {
+        seq_len = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        seq_len = 3;
+        if (c == 0xe0) {
+            min = 0xa0;
+        } else if (c == 0xed) {
+            max = 0x9f;     // Surrogates
+        }
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        seq_len = 4;
+        if (c == 0xf0) {
+            min = 0x90;
+        } else if (c == 0xf4) {
+            max = 0x8f;     // Beyond U+10FFFF
+        }
+    } else {
+        return 0;
+    }
+
+    if (len < seq_len || string[1] < min || string[1] > max) {
+        return 0;
+    }
+    for (size_t i = 2; i < seq_len; i++) {
+        if (string[i] < 0x80 || string[i] > 0xbf) {
+            return 0;
+        }
+    }
+    return seq_len;
+}
+
+/** Objects and fields **/
+
+void record_field_key(const char* key) {
+    if (output_format == OUTPUT_CBOR) {
+        cbor_append_text(&record_outbuf, key, strlen(key));
+    } else {
+        json_append_key(&record_outbuf, key);
+    }
+}
+
+void record_string_n(const char* key, const char* value, size_t len) {
+    const unsigned char* bytes = (const unsigned char*)value;
+    size_t valid_len = 0;
+    size_t seq_len;
+    while (valid_len < len && (seq_len = utf8_sequence_len(bytes + valid_len, len - valid_len))) {
+        valid_len += seq_len;
+    }
+
+    // Replace each byte that isn't part of a well-formed sequence with U+FFFD,
+    // which takes 3 bytes.
+    char* fixed = NULL;
+    if (valid_len < len) {
+        fixed = malloc(3 * len);
+        if (!fixed) {
+            fprintf(stderr, "\nABORT: record_string_n: Could not allocate sufficient memory for `fixed`.\n");
+            exit(-1);
+        }
+        memcpy(fixed, value, valid_len);
+        size_t fixed_len = valid_len;
+        for (size_t i = valid_len; i < len; ) {
+            seq_len = utf8_sequence_len(bytes + i, len - i);
+            if (seq_len) {
+                memcpy(fixed + fixed_len, value + i, seq_len);
+                fixed_len += seq_len;
+                i += seq_len;
+            } else {
+                memcpy(fixed + fixed_len, "\xef\xbf\xbd", 3);
+                fixed_len += 3;
+                i++;
+            }
+        }
+        value = fixed;
+        len = fixed_len;
+    }
+
+    record_field_key(key);
+    if (output_format == OUTPUT_CBOR) {
+        cbor_append_text(&record_outbuf, value, len);
+    } else {
+        json_append_string(&record_outbuf, value, len);
+    }
+    free(fixed);
+}
+
+void record_string(const char* key, const char* value) {
+    record_string_n(key, value, strlen(value));
+}
+
+void record_uint(const char* key, uint64_t value) {
+    record_field_key(key);
+    if (output_format == OUTPUT_CBOR) {
+        cbor_append_head(&record_outbuf, CBOR_MAJOR_UINT, value);
+    } else {
+        outbuf_printf(&record_outbuf, "%llu", value);
+    }
+}
+
+void record_double(const char* key, double value) {
+    record_field_key(key);
+    if (!isfinite(value)) {
+        // Neither JSON nor most consumers of these records can represent
+        // infinities and NaNs.
+        if (output_format == OUTPUT_CBOR) {
+            char byte = CBOR_NULL;
+            outbuf_append(&record_outbuf, &byte, 1);
+        } else {
+            outbuf_append(&record_outbuf, "null", 4);
+        }
+    } else if (output_format == OUTPUT_CBOR) {
+        // A CBOR float64: the head byte, then the value in big-endian order.
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        uint8_t bytes[9] = { 0xfb };
+        for (int i = 0; i < 8; i++) {
+            bytes[1 + i] = bits >> (56 - 8 * i);
+        }
+        outbuf_append(&record_outbuf, (char*)bytes, sizeof(bytes));
+    } else {
+        outbuf_printf(&record_outbuf, "%.6g", value);
+    }
+}
+
+void record_bool(const char* key, bool value) {
+    record_field_key(key);
+    if (output_format == OUTPUT_CBOR) {
+        char byte = value ? CBOR_TRUE : CBOR_FALSE;
+        outbuf_append(&record_outbuf, &byte, 1);
+    } else if (value) {
+        outbuf_append(&record_outbuf, "true", 4);
+    } else {
+        outbuf_append(&record_outbuf, "false", 5);
+    }
+}
+
+/**
+ * Begin an object, whose `type` field has a given value.
+ */
+void record_begin(const char* type) {
+    if (output_format == OUTPUT_CBOR) {
+        char byte = CBOR_MAP_INDEFINITE;
+        outbuf_append(&record_outbuf, &byte, 1);
+    } else {
+        outbuf_append(&record_outbuf, "{", 1);
+    }
+    record_first_field = true;
+    record_string("type", type);
+}
+
+void record_end() {
+    if (output_format == OUTPUT_CBOR) {
+        char byte = CBOR_BREAK;
+        outbuf_append(&record_outbuf, &byte, 1);
+    } else {
+        outbuf_append(&record_outbuf, "}\n", 2);
+    }
+}
+
+/** Fields describing APFS structures **/
+
+const char* record_storage_type_name(uint32_t o_type) {
+    switch (o_type & OBJ_STORAGETYPE_MASK) {
+        case OBJ_VIRTUAL:       return "OBJ_VIRTUAL";
+        case OBJ_EPHEMERAL:     return "OBJ_EPHEMERAL";
+        case OBJ_PHYSICAL:      return "OBJ_PHYSICAL";
+        default:                return "invalid";
+    }
+}
+
+const char* record_j_key_type_name(uint8_t j_key_type) {
+    switch (j_key_type) {
+        case APFS_TYPE_SNAP_METADATA:   return "APFS_TYPE_SNAP_METADATA";
+        case APFS_TYPE_EXTENT:          return "APFS_TYPE_EXTENT";
+        case APFS_TYPE_INODE:           return "APFS_TYPE_INODE";
+        case APFS_TYPE_XATTR:           return "APFS_TYPE_XATTR";
+        case APFS_TYPE_SIBLING_LINK:    return "APFS_TYPE_SIBLING_LINK";
+        case APFS_TYPE_DSTREAM_ID:      return "APFS_TYPE_DSTREAM_ID";
+        case APFS_TYPE_CRYPTO_STATE:    return "APFS_TYPE_CRYPTO_STATE";
+        case APFS_TYPE_FILE_EXTENT:     return "APFS_TYPE_FILE_EXTENT";
+        case APFS_TYPE_DIR_REC:         return "APFS_TYPE_DIR_REC";
+        case APFS_TYPE_DIR_STATS:       return "APFS_TYPE_DIR_STATS";
+        case APFS_TYPE_SNAP_NAME:       return "APFS_TYPE_SNAP_NAME";
+        case APFS_TYPE_SIBLING_MAP:     return "APFS_TYPE_SIBLING_MAP";
+        case APFS_TYPE_INVALID:         return "APFS_TYPE_INVALID";
+        default:                        return "unknown";
+    }
+}
+
+const char* record_drec_type_name(j_drec_val_t* val) {
+    switch (val->flags & DREC_TYPE_MASK) {
+        case DT_UNKNOWN:    return "DT_UNKNOWN";
+        case DT_FIFO:       return "DT_FIFO";
+        case DT_CHR:        return "DT_CHR";
+        case DT_DIR:        return "DT_DIR";
+        case DT_BLK:        return "DT_BLK";
+        case DT_REG:        return "DT_REG";
+        case DT_LNK:        return "DT_LNK";
+        case DT_SOCK:       return "DT_SOCK";
+        case DT_WHT:        return "DT_WHT";
+        default:            return "unknown";
+    }
+}
+
+/**
+ * Add a field holding the name in a directory entry's key. The name's length
+ * is given by the key, and includes a terminating NUL, which a damaged name
+ * may lack.
+ */
+void record_drec_name(const char* field, j_drec_hashed_key_t* key) {
+    size_t len = key->name_len_and_hash & J_DREC_LEN_MASK;
+    char* end = memchr(key->name, '\0', len);
+    record_string_n(field, (char*)key->name, end ? (size_t)(end - (char*)key->name) : len);
+}
+
+/**
+ * Add fields describing an object header and, for the types of object that
+ * the tools display in detail, the object's most important fields.
+ */
+void record_obj_phys_fields(obj_phys_t* obj) {
+    uint32_t type = obj->o_type & OBJECT_TYPE_MASK;
+    record_uint("oid",      obj->o_oid);
+    record_uint("xid",      obj->o_xid);
+    record_string("storage", record_storage_type_name(obj->o_type));
+    record_uint("o_type",   type);
+    record_uint("o_subtype", obj->o_subtype);
+
+    switch (type) {
+        case OBJECT_TYPE_NX_SUPERBLOCK: {
+            nx_superblock_t* nxsb = obj;
+            record_uint("block_size",   nxsb->nx_block_size);
+            record_uint("block_count",  nxsb->nx_block_count);
+            record_uint("next_xid",     nxsb->nx_next_xid);
+            record_uint("omap_oid",     nxsb->nx_omap_oid);
+        } break;
+        case OBJECT_TYPE_BTREE:
+        case OBJECT_TYPE_BTREE_NODE: {
+            btree_node_phys_t* btn = obj;
+            record_uint("btn_flags",    btn->btn_flags);
+            record_uint("level",        btn->btn_level);
+            record_uint("nkeys",        btn->btn_nkeys);
+        } break;
+        case OBJECT_TYPE_OMAP: {
+            omap_phys_t* omap = obj;
+            record_uint("om_flags",     omap->om_flags);
+            record_uint("tree_oid",     omap->om_tree_oid);
+            record_uint("snap_count",   omap->om_snap_count);
+        } break;
+        case OBJECT_TYPE_CHECKPOINT_MAP: {
+            checkpoint_map_phys_t* cpm = obj;
+            record_uint("cpm_flags",    cpm->cpm_flags);
+            record_uint("count",        cpm->cpm_count);
+        } break;
+        case OBJECT_TYPE_FS: {
+            apfs_superblock_t* apsb = obj;
+            char* name_end = memchr(apsb->apfs_volname, '\0', APFS_VOLNAME_LEN);
+            record_string_n("name",     (char*)apsb->apfs_volname, name_end ? name_end - (char*)apsb->apfs_volname : APFS_VOLNAME_LEN);
+            record_uint("fs_index",     apsb->apfs_fs_index);
+            record_uint("omap_oid",     apsb->apfs_omap_oid);
+            record_uint("root_tree_oid", apsb->apfs_root_tree_oid);
+            record_uint("num_files",    apsb->apfs_num_files);
+        } break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Write an object describing a block that contains an APFS object.
+ *
+ * role:    What the block is to the tool, e.g. "container_superblock"; or NULL.
+ */
+void record_block(const char* role, paddr_t addr, obj_phys_t* obj, bool cksum_valid) {
+    record_begin("block");
+    if (role) {
+        record_string("role", role);
+    }
+    record_uint("addr", addr);
+    record_bool("cksum_valid", cksum_valid);
+    record_obj_phys_fields(obj);
+    record_end();
+}
+
+/**
+ * Write an object describing a file-system record, given its key and value.
+ */
+void record_fs_record(void* key_data, void* val_data, uint16_t val_len) {
+    j_key_t* hdr = key_data;
+    uint8_t type = (hdr->obj_id_and_type & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT;
+
+    record_begin("fs_record");
+    record_uint("oid",          hdr->obj_id_and_type & OBJ_ID_MASK);
+    record_uint("record_type",  type);
+    record_string("kind",       record_j_key_type_name(type));
+
+    switch (type) {
+        case APFS_TYPE_INODE: {
+            j_inode_val_t* val = val_data;
+            record_uint("parent_id",    val->parent_id);
+            record_uint("private_id",   val->private_id);
+            record_uint("mod_time",     val->mod_time);
+            record_uint("mode",         val->mode);
+            record_uint("nchildren",    val->nchildren);
+        } break;
+        case APFS_TYPE_DSTREAM_ID: {
+            j_dstream_id_val_t* val = val_data;
+            record_uint("refcnt",       val->refcnt);
+        } break;
+        case APFS_TYPE_FILE_EXTENT: {
+            j_file_extent_key_t* key = key_data;
+            j_file_extent_val_t* val = val_data;
+            record_uint("logical_addr", key->logical_addr);
+            record_uint("length",       val->len_and_flags & J_FILE_EXTENT_LEN_MASK);
+            record_uint("phys_block",   val->phys_block_num);
+            record_uint("crypto_id",    val->crypto_id);
+        } break;
+        case APFS_TYPE_DIR_REC: {
+            // Spec inorrectly says to use `j_drec_key_t`; see NOTE in `apfs/struct/j.h`
+            j_drec_hashed_key_t* key = key_data;
+            j_drec_val_t* val = val_data;
+            record_drec_name("name",     key);
+            record_uint("target_id",    val->file_id);
+            record_string("dtype",      record_drec_type_name(val));
+            record_uint("date_added",   val->date_added);
+        } break;
+        default:
+            break;
+    }
+    record_end();
+}
+
+#endif // APFS_STRING_RECORD_H